@@ -0,0 +1,424 @@
+/*
+ * libhpcalcs: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+/**
+ * \file alloc.c Files / Calcs: bump-pointer arenas, and routing of the allocations to the allocator of the calculator handle being operated on.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <hpcalcs.h>
+#include "internal.h"
+#include "logging.h"
+#include "error.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+// Alignment of the blocks returned by the arenas, suitable for any type.
+#define ARENA_ALIGNMENT (16)
+// Every allocation is preceded by its size, so that it can be reallocated.
+#define ARENA_HEADER_SIZE (ARENA_ALIGNMENT)
+#define ARENA_ALIGN(x) (((x) + ARENA_ALIGNMENT - 1) & ~((size_t)ARENA_ALIGNMENT - 1))
+
+// The data of arena blocks covers whole granules of this size, each mapped to its arena in arena_map.
+#define ARENA_GRANULE_SHIFT (16)
+#define ARENA_GRANULE_SIZE ((size_t)1 << ARENA_GRANULE_SHIFT)
+#define ARENA_GRANULE_ALIGN(x) (((x) + ARENA_GRANULE_SIZE - 1) & ~(ARENA_GRANULE_SIZE - 1))
+// arena_map has two levels of this many entries, which cover 48-bit addresses.
+#define ARENA_MAP_BITS (16)
+#define ARENA_MAP_SIZE ((uintptr_t)1 << ARENA_MAP_BITS)
+
+typedef struct _arena_block arena_block;
+struct _arena_block {
+    arena_block * next;
+    size_t size;
+    size_t used;
+    uint8_t * data;
+};
+
+struct _hplibs_arena {
+    arena_block * blocks; // Most recent first.
+    size_t block_size;
+    void * last; // Most recent allocation, which can be grown in place.
+};
+
+static HPLIBS_THREAD_LOCAL calc_alloc_scope current_scope;
+
+// Owner of each granule of arena blocks, for finding in O(1) and without locking whether a block being freed comes from an arena.
+// The second level tables are allocated on demand, under the lock, and never freed; the entries are only written by the thread using the arena.
+// Pointer-sized reads and writes are atomic on most ISAs anyway.
+static hplibs_arena ** arena_map[ARENA_MAP_SIZE];
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t arena_map_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK_ARENA_MAP() pthread_mutex_lock(&arena_map_mutex)
+#define UNLOCK_ARENA_MAP() pthread_mutex_unlock(&arena_map_mutex)
+#else
+#define LOCK_ARENA_MAP()
+#define UNLOCK_ARENA_MAP()
+#endif
+
+static hplibs_arena * arena_of(const void * ptr) {
+    hplibs_arena * arena = NULL;
+    uintptr_t granule = (uintptr_t)ptr >> ARENA_GRANULE_SHIFT;
+    if ((granule >> ARENA_MAP_BITS) < ARENA_MAP_SIZE) {
+        hplibs_arena ** table = arena_map[granule >> ARENA_MAP_BITS];
+        if (table != NULL) {
+            arena = table[granule & (ARENA_MAP_SIZE - 1)];
+        }
+    }
+    return arena;
+}
+
+static int arena_map_set(const arena_block * block, hplibs_arena * arena) {
+    uintptr_t granule = (uintptr_t)block->data >> ARENA_GRANULE_SHIFT;
+    uintptr_t end = granule + (block->size >> ARENA_GRANULE_SHIFT);
+    for (; granule < end; granule++) {
+        hplibs_arena ** table;
+        if ((granule >> ARENA_MAP_BITS) >= ARENA_MAP_SIZE) {
+            return 0;
+        }
+        table = arena_map[granule >> ARENA_MAP_BITS];
+        if (table == NULL) {
+            LOCK_ARENA_MAP();
+            table = arena_map[granule >> ARENA_MAP_BITS];
+            if (table == NULL) {
+                table = (hplibs_arena **)calloc(ARENA_MAP_SIZE, sizeof(*table));
+                arena_map[granule >> ARENA_MAP_BITS] = table;
+            }
+            UNLOCK_ARENA_MAP();
+            if (table == NULL) {
+                return 0;
+            }
+        }
+        table[granule & (ARENA_MAP_SIZE - 1)] = arena;
+    }
+    return 1;
+}
+
+static void arena_block_del(arena_block * block) {
+    arena_map_set(block, NULL);
+    free(block);
+}
+
+static arena_block * arena_block_new(hplibs_arena * arena, size_t size) {
+    arena_block * block = NULL;
+    if (size <= ((size_t)-1) / 2) {
+        size = ARENA_GRANULE_ALIGN(size);
+        // Over-allocate, so that the data can start on a granule boundary.
+        block = (arena_block *)malloc(sizeof(*block) + ARENA_GRANULE_SIZE + size);
+        if (block != NULL) {
+            block->next = NULL;
+            block->size = size;
+            block->used = 0;
+            block->data = (uint8_t *)ARENA_GRANULE_ALIGN((uintptr_t)(block + 1));
+            if (!arena_map_set(block, arena)) {
+                arena_block_del(block);
+                block = NULL;
+            }
+        }
+    }
+    return block;
+}
+
+HPEXPORT hplibs_arena * HPCALL hplibs_arena_new(size_t block_size) {
+    hplibs_arena * arena = (hplibs_arena *)malloc(sizeof(*arena));
+    if (arena != NULL) {
+        arena->block_size = ARENA_GRANULE_ALIGN(block_size != 0 ? block_size : HPLIBS_ARENA_DEFAULT_BLOCK_SIZE);
+        arena->blocks = arena_block_new(arena, arena->block_size);
+        arena->last = NULL;
+        if (arena->blocks == NULL) {
+            free(arena);
+            arena = NULL;
+        }
+    }
+    if (arena == NULL) {
+        hpcalcs_error("%s: couldn't allocate arena", __FUNCTION__);
+    }
+    return arena;
+}
+
+HPEXPORT void HPCALL hplibs_arena_reset(hplibs_arena * arena) {
+    if (arena != NULL) {
+        // Keep the first (oldest) block, release the others.
+        arena_block * block = arena->blocks;
+        while (block->next != NULL) {
+            arena_block * next = block->next;
+            arena_block_del(block);
+            block = next;
+        }
+        block->used = 0;
+        arena->blocks = block;
+        arena->last = NULL;
+    }
+    else {
+        hpcalcs_error("%s: arena is NULL", __FUNCTION__);
+    }
+}
+
+HPEXPORT void HPCALL hplibs_arena_del(hplibs_arena * arena) {
+    if (arena != NULL) {
+        arena_block * block = arena->blocks;
+        while (block != NULL) {
+            arena_block * next = block->next;
+            arena_block_del(block);
+            block = next;
+        }
+        free(arena);
+    }
+    else {
+        hpcalcs_error("%s: arena is NULL", __FUNCTION__);
+    }
+}
+
+static void * arena_malloc(hplibs_arena * arena, size_t size) {
+    void * ptr = NULL;
+    size_t needed = ARENA_HEADER_SIZE + ARENA_ALIGN(size);
+    arena_block * block = arena->blocks;
+    if (size > ((size_t)-1) / 2) {
+        return NULL;
+    }
+    if (block->size - block->used < needed) {
+        // Oversized requests get a block of their own.
+        block = arena_block_new(arena, needed > arena->block_size ? needed : arena->block_size);
+        if (block != NULL) {
+            block->next = arena->blocks;
+            arena->blocks = block;
+        }
+    }
+    if (block != NULL) {
+        uint8_t * header = block->data + block->used;
+        *(size_t *)header = size;
+        block->used += needed;
+        ptr = header + ARENA_HEADER_SIZE;
+        arena->last = ptr;
+    }
+    return ptr;
+}
+
+static size_t arena_allocation_size(const void * ptr) {
+    return *(const size_t *)((const uint8_t *)ptr - ARENA_HEADER_SIZE);
+}
+
+static void * arena_realloc(hplibs_arena * arena, void * ptr, size_t size) {
+    void * new_ptr = NULL;
+    size_t old_size = arena_allocation_size(ptr);
+    if (ptr == arena->last) {
+        // Grow or shrink the most recent allocation in place, if it fits.
+        arena_block * block = arena->blocks;
+        uint8_t * header = (uint8_t *)ptr - ARENA_HEADER_SIZE;
+        size_t needed = ARENA_HEADER_SIZE + ARENA_ALIGN(size);
+        if (size <= ((size_t)-1) / 2 && (size_t)(header - block->data) + needed <= block->size) {
+            block->used = (size_t)(header - block->data) + needed;
+            *(size_t *)header = size;
+            new_ptr = ptr;
+        }
+    }
+    if (new_ptr == NULL) {
+        new_ptr = arena_malloc(arena, size);
+        if (new_ptr != NULL) {
+            memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+        }
+    }
+    return new_ptr;
+}
+
+#define SCOPE_FUNCS(base) ((current_scope.funcs != NULL) ? current_scope.funcs : (base))
+
+void * hplibs_scoped_malloc(const hplibs_malloc_funcs * base, size_t size) {
+    void * ptr;
+    if (current_scope.arena != NULL) {
+        ptr = arena_malloc(current_scope.arena, size);
+    }
+    else {
+        ptr = (SCOPE_FUNCS(base)->malloc)(size);
+    }
+    return ptr;
+}
+
+void * hplibs_scoped_calloc(const hplibs_malloc_funcs * base, size_t nmemb, size_t size) {
+    void * ptr = NULL;
+    if (current_scope.arena != NULL) {
+        if (size == 0 || nmemb <= ((size_t)-1) / size) {
+            ptr = arena_malloc(current_scope.arena, nmemb * size);
+            if (ptr != NULL) {
+                memset(ptr, 0, nmemb * size);
+            }
+        }
+    }
+    else {
+        ptr = (SCOPE_FUNCS(base)->calloc)(nmemb, size);
+    }
+    return ptr;
+}
+
+void * hplibs_scoped_realloc(const hplibs_malloc_funcs * base, void * ptr, size_t size) {
+    void * new_ptr;
+    hplibs_arena * owner = (ptr != NULL) ? arena_of(ptr) : NULL;
+    if (ptr == NULL) {
+        new_ptr = hplibs_scoped_malloc(base, size);
+    }
+    else if (owner != NULL && owner == current_scope.arena) {
+        new_ptr = arena_realloc(owner, ptr, size);
+    }
+    else if (owner != NULL) {
+        // Block from an arena, reallocated outside of its scope: move it to the current allocator.
+        new_ptr = hplibs_scoped_malloc(base, size);
+        if (new_ptr != NULL) {
+            size_t old_size = arena_allocation_size(ptr);
+            memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+        }
+    }
+    else {
+        new_ptr = (SCOPE_FUNCS(base)->realloc)(ptr, size);
+    }
+    return new_ptr;
+}
+
+void hplibs_scoped_free(const hplibs_malloc_funcs * base, void * ptr) {
+    // Blocks from arenas are released all at once, by hplibs_arena_reset or hplibs_arena_del.
+    if (ptr != NULL && arena_of(ptr) == NULL) {
+        (SCOPE_FUNCS(base)->free)(ptr);
+    }
+}
+
+#undef SCOPE_FUNCS
+
+int hplibs_alloc_scope_is_default(void) {
+    return current_scope.funcs == NULL && current_scope.arena == NULL;
+}
+
+hplibs_release_func hplibs_scoped_release_func(const hplibs_malloc_funcs * funcs) {
+    // Blocks from a handle's own allocator must go back to it, even if they are released outside of the operation which allocated them.
+    // The dispatchers take care of blocks from arenas and from the base allocators.
+    return (current_scope.funcs != NULL && current_scope.arena == NULL) ? current_scope.funcs->free : funcs->free;
+}
+
+int hplibs_release_func_matches(hplibs_release_func release, const hplibs_malloc_funcs * funcs) {
+    int res = (release == funcs->free || release == hplibs_scoped_release_func(funcs));
+    if (!res && (release == hpfiles_alloc_funcs.free || release == hpcalcs_alloc_funcs.free)) {
+        // The dispatchers of libhpfiles and libhpcalcs release blocks alike if their base allocators do.
+        res = (hpfiles_base_alloc_funcs.free == hpcalcs_base_alloc_funcs.free && hpfiles_base_alloc_funcs.realloc == hpcalcs_base_alloc_funcs.realloc);
+    }
+    return res;
+}
+
+int hplibs_block_is_base(const void * ptr) {
+    return current_scope.funcs == NULL && arena_of(ptr) == NULL;
+}
+
+HPEXPORT void HPCALL hplibs_buffer_view_release(hplibs_buffer_view * view) {
+    if (view != NULL) {
+        if (view->base != NULL && view->release != NULL) {
+            (*view->release)(view->base);
+        }
+        memset(view, 0, sizeof(*view));
+    }
+    else {
+        hpcalcs_error("%s: view is NULL", __FUNCTION__);
+    }
+}
+
+HPEXPORT uint8_t * HPCALL hplibs_buffer_view_flatten(hplibs_buffer_view * view) {
+    uint8_t * base = NULL;
+    if (view != NULL) {
+        if (view->offset != 0 && view->base != NULL) {
+            memmove(view->base, view->base + view->offset, view->size);
+            view->offset = 0;
+        }
+        base = view->base;
+    }
+    else {
+        hpcalcs_error("%s: view is NULL", __FUNCTION__);
+    }
+    return base;
+}
+
+HPEXPORT int HPCALL hpcalcs_alloc_scope_enter(calc_handle * handle, calc_alloc_scope * out_saved) {
+    int res;
+    if (handle != NULL && out_saved != NULL) {
+        *out_saved = current_scope;
+        current_scope.funcs = handle->has_alloc_funcs ? &handle->alloc_funcs : NULL;
+        current_scope.arena = handle->arena;
+        res = ERR_SUCCESS;
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcalcs_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcalcs_alloc_scope_leave(const calc_alloc_scope * saved) {
+    int res;
+    if (saved != NULL) {
+        current_scope = *saved;
+        res = ERR_SUCCESS;
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcalcs_error("%s: saved is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+// The allocator and arena of a handle aren't required to be thread-safe, and arenas have no lock:
+// with either, the memory of the handle's operations must be allocated and freed on the thread calling them.
+int hpcalcs_handle_uses_base_alloc(calc_handle * handle) {
+    return handle->arena == NULL && !handle->has_alloc_funcs;
+}
+
+HPEXPORT int HPCALL hpcalcs_handle_set_alloc_funcs(calc_handle * handle, hplibs_malloc_funcs * alloc_funcs) {
+    int res;
+    if (handle != NULL) {
+        if (alloc_funcs != NULL) {
+            handle->alloc_funcs = *alloc_funcs;
+            handle->has_alloc_funcs = 1;
+        }
+        else {
+            handle->has_alloc_funcs = 0;
+        }
+        res = ERR_SUCCESS;
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcalcs_handle_set_arena(calc_handle * handle, hplibs_arena * arena) {
+    int res;
+    if (handle != NULL) {
+        handle->arena = arena;
+        res = ERR_SUCCESS;
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
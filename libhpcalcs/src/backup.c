@@ -0,0 +1,1500 @@
+/*
+ * libhpcalcs: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+/**
+ * \file backup.c Higher-level operations: backups to and from folders, optionally recorded in a journal.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <direct.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <dirent.h>
+#include <unistd.h>
+#endif
+
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <hpopers.h>
+#include "internal.h"
+#include "logging.h"
+#include "error.h"
+#include "utils.h"
+#include "typesprime.h"
+
+//! Room for a calculator-side name converted to UTF-8, plus extension.
+#define HOST_FILENAME_MAX (FILES_VARNAME_MAXLEN * 3 + 32)
+//! Room for a journal line: type, size, CRC and host file name.
+#define JOURNAL_LINE_MAX (HOST_FILENAME_MAX + 32)
+#define JOURNAL_HEADER "# hpbackup journal 1\n"
+#define MANIFEST_HEADER "# hpbackup manifest 1\n"
+//! Room for a sanitized device name.
+#define DEVICE_NAME_MAX (64)
+
+//! A file recorded in a journal.
+typedef struct {
+    char * name; ///< Host-side file name, without folder.
+    uint32_t size;
+    uint32_t crc; ///< CRC-32 of the file contents.
+    uint8_t type;
+} journal_record;
+
+//! Journal of the files completed in a folder: one line per file, appended (and flushed) as soon as the file is complete, so that it survives interruptions.
+typedef struct {
+    FILE * file;
+    journal_record * records;
+    uint32_t count;
+    uint32_t capacity;
+} backup_journal;
+
+static char * copy_string(const char * str) {
+    size_t length = strlen(str);
+    char * copy = (char *)(hpopers_alloc_funcs.malloc)(length + 1);
+    if (copy != NULL) {
+        memcpy(copy, str, length + 1);
+    }
+    return copy;
+}
+
+// Converts a calculator-side UTF-16 name to a UTF-8 host file name which stays within the folder: path separators, control and reserved characters are replaced, and so is a leading dot, so that the name can neither be hidden, nor clash with the journals.
+static void host_filename(const char16_t * name, const char * extension, char * out) {
+    uint32_t i;
+    char * ptr = out;
+    for (i = 0; i < FILES_VARNAME_MAXLEN && name[i] != 0; i++) {
+        uint32_t c = name[i];
+        if (c >= 0xD800 && c <= 0xDBFF && i + 1 < FILES_VARNAME_MAXLEN && name[i + 1] >= 0xDC00 && name[i + 1] <= 0xDFFF) {
+            c = 0x10000 + ((c - 0xD800) << 10) + (name[i + 1] - 0xDC00);
+            i++;
+        }
+        else if (c >= 0xD800 && c <= 0xDFFF) {
+            c = '_';
+        }
+        if (c < 0x20 || c == 0x7F || (c < 0x80 && strchr("/\\:*?\"<>|", (int)c) != NULL) || (c == '.' && ptr == out)) {
+            c = '_';
+        }
+
+        if (c < 0x80) {
+            *ptr++ = (char)c;
+        }
+        else if (c < 0x800) {
+            *ptr++ = (char)(0xC0 | (c >> 6));
+            *ptr++ = (char)(0x80 | (c & 0x3F));
+        }
+        else if (c < 0x10000) {
+            *ptr++ = (char)(0xE0 | (c >> 12));
+            *ptr++ = (char)(0x80 | ((c >> 6) & 0x3F));
+            *ptr++ = (char)(0x80 | (c & 0x3F));
+        }
+        else {
+            *ptr++ = (char)(0xF0 | (c >> 18));
+            *ptr++ = (char)(0x80 | ((c >> 12) & 0x3F));
+            *ptr++ = (char)(0x80 | ((c >> 6) & 0x3F));
+            *ptr++ = (char)(0x80 | (c & 0x3F));
+        }
+    }
+    if (ptr == out) {
+        *ptr++ = '_';
+    }
+    if (extension != NULL && extension[0] != 0) {
+        *ptr++ = '.';
+        strcpy(ptr, extension);
+    }
+    else {
+        *ptr = 0;
+    }
+}
+
+// Converts a UTF-8 host file name to a calculator-side UTF-16 name; bytes which aren't valid UTF-8 are taken as Latin-1.
+static void calc_filename(const char * str, char16_t * out) {
+    const uint8_t * ptr = (const uint8_t *)str;
+    uint32_t i = 0;
+    while (*ptr != 0 && i < FILES_VARNAME_MAXLEN) {
+        uint32_t c = *ptr;
+        uint32_t length = 1;
+        if (c >= 0xC2 && c <= 0xDF && (ptr[1] & 0xC0) == 0x80) {
+            c = ((c & 0x1F) << 6) | (ptr[1] & 0x3F);
+            length = 2;
+        }
+        else if (c >= 0xE0 && c <= 0xEF && (ptr[1] & 0xC0) == 0x80 && (ptr[2] & 0xC0) == 0x80) {
+            c = ((c & 0x0F) << 12) | ((uint32_t)(ptr[1] & 0x3F) << 6) | (ptr[2] & 0x3F);
+            length = 3;
+        }
+        else if (c >= 0xF0 && c <= 0xF4 && (ptr[1] & 0xC0) == 0x80 && (ptr[2] & 0xC0) == 0x80 && (ptr[3] & 0xC0) == 0x80) {
+            c = ((c & 0x07) << 18) | ((uint32_t)(ptr[1] & 0x3F) << 12) | ((uint32_t)(ptr[2] & 0x3F) << 6) | (ptr[3] & 0x3F);
+            length = 4;
+        }
+        if (c >= 0x10000) {
+            if (i + 2 > FILES_VARNAME_MAXLEN) {
+                break;
+            }
+            c -= 0x10000;
+            out[i++] = (char16_t)(0xD800 + (c >> 10));
+            out[i++] = (char16_t)(0xDC00 + (c & 0x3FF));
+        }
+        else {
+            out[i++] = (char16_t)c;
+        }
+        ptr += length;
+    }
+    out[i] = 0;
+}
+
+static int host_file_has_size(const char * path, uint32_t size) {
+    struct stat st;
+    return stat(path, &st) == 0 && (st.st_mode & S_IFMT) == S_IFREG && (uint64_t)st.st_size == size;
+}
+
+static int make_folder(const char * path) {
+    int res = ERR_SUCCESS;
+#ifdef _WIN32
+    if (_mkdir(path) != 0 && errno != EEXIST) {
+#else
+    if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+#endif
+        res = ERR_OPER_IO;
+        hpopers_error("%s: couldn't create folder %s", __FUNCTION__, path);
+    }
+    return res;
+}
+
+// Writes to a temporary file first, so that an interrupted write never leaves a truncated file under the final name.
+static int write_host_file(const char * path, const uint8_t * data, uint32_t size) {
+    int res = ERR_OPER_IO;
+    size_t length = strlen(path);
+    char * temp_path = (char *)(hpopers_alloc_funcs.malloc)(length + sizeof(".part"));
+    if (temp_path != NULL) {
+        FILE * f;
+        memcpy(temp_path, path, length);
+        memcpy(temp_path + length, ".part", sizeof(".part"));
+        f = fopen(temp_path, "wb");
+        if (f != NULL) {
+            int written = (size == 0 || fwrite(data, 1, size, f) == size);
+            if (fclose(f) == 0 && written) {
+#ifdef _WIN32
+                remove(path);
+#endif
+                if (rename(temp_path, path) == 0) {
+                    res = ERR_SUCCESS;
+                }
+            }
+            if (res != ERR_SUCCESS) {
+                remove(temp_path);
+            }
+        }
+        if (res != ERR_SUCCESS) {
+            hpopers_error("%s: couldn't write %s", __FUNCTION__, path);
+        }
+        (hpopers_alloc_funcs.free)(temp_path);
+    }
+    else {
+        res = ERR_MALLOC;
+        hpopers_error("%s: couldn't allocate path", __FUNCTION__);
+    }
+    return res;
+}
+
+static int journal_add_record(backup_journal * journal, const char * name, uint8_t type, uint32_t size, uint32_t crc) {
+    int res = ERR_SUCCESS;
+    if (journal->count == journal->capacity) {
+        uint32_t capacity = journal->capacity != 0 ? journal->capacity * 2 : 32;
+        journal_record * records = (journal_record *)(hpopers_alloc_funcs.realloc)(journal->records, capacity * sizeof(*records));
+        if (records != NULL) {
+            journal->records = records;
+            journal->capacity = capacity;
+        }
+        else {
+            res = ERR_MALLOC;
+        }
+    }
+    if (res == ERR_SUCCESS) {
+        journal_record * record = &journal->records[journal->count];
+        record->name = copy_string(name);
+        if (record->name != NULL) {
+            record->size = size;
+            record->crc = crc;
+            record->type = type;
+            journal->count++;
+        }
+        else {
+            res = ERR_MALLOC;
+        }
+    }
+    if (res != ERR_SUCCESS) {
+        hpopers_error("%s: couldn't store record", __FUNCTION__);
+    }
+    return res;
+}
+
+static void journal_close(backup_journal * journal) {
+    uint32_t i;
+    if (journal->file != NULL) {
+        fclose(journal->file);
+    }
+    for (i = 0; i < journal->count; i++) {
+        (hpopers_alloc_funcs.free)(journal->records[i].name);
+    }
+    (hpopers_alloc_funcs.free)(journal->records);
+    memset(journal, 0, sizeof(*journal));
+}
+
+// Loads the records of an existing journal, then opens it for appending. Lines which can't be parsed, e.g. the last one after an interruption, are ignored.
+static int journal_open(backup_journal * journal, const char * folder, const char * journal_name) {
+    int res = ERR_SUCCESS;
+    char * path = join_path(folder, journal_name);
+    memset(journal, 0, sizeof(*journal));
+    if (path != NULL) {
+        FILE * f = fopen(path, "rb");
+        if (f != NULL) {
+            char line[JOURNAL_LINE_MAX];
+            while (res == ERR_SUCCESS && fgets(line, sizeof(line), f) != NULL) {
+                size_t length = strlen(line);
+                unsigned int type;
+                uint32_t size;
+                uint32_t crc;
+                int offset = 0;
+                if (line[0] == '#' || length < 2 || line[length - 1] != '\n') {
+                    continue;
+                }
+                line[length - 1] = 0;
+                if (sscanf(line, "%2x %" SCNu32 " %8" SCNx32 "%n", &type, &size, &crc, &offset) == 3 && offset > 0 && line[offset] == ' ' && line[offset + 1] != 0) {
+                    res = journal_add_record(journal, line + offset + 1, (uint8_t)type, size, crc);
+                }
+            }
+            fclose(f);
+            hpopers_info("%s: %" PRIu32 " files recorded in %s", __FUNCTION__, journal->count, path);
+        }
+        if (res == ERR_SUCCESS) {
+            journal->file = fopen(path, "ab");
+            if (journal->file != NULL) {
+                fseek(journal->file, 0, SEEK_END);
+                if (ftell(journal->file) == 0) {
+                    fputs(JOURNAL_HEADER, journal->file);
+                }
+            }
+            else {
+                res = ERR_OPER_IO;
+                hpopers_error("%s: couldn't open %s", __FUNCTION__, path);
+            }
+        }
+        (hpopers_alloc_funcs.free)(path);
+    }
+    else {
+        res = ERR_MALLOC;
+    }
+    if (res != ERR_SUCCESS) {
+        journal_close(journal);
+    }
+    return res;
+}
+
+static int journal_contains(const backup_journal * journal, const char * name, uint8_t type, uint32_t size, uint32_t crc) {
+    int found = 0;
+    uint32_t i;
+    for (i = 0; i < journal->count && !found; i++) {
+        const journal_record * record = &journal->records[i];
+        found = (record->type == type && record->size == size && record->crc == crc && !strcmp(record->name, name));
+    }
+    return found;
+}
+
+static int journal_append(backup_journal * journal, const char * name, uint8_t type, uint32_t size, uint32_t crc) {
+    int res = ERR_SUCCESS;
+    if (   fprintf(journal->file, "%02X %" PRIu32 " %08" PRIX32 " %s\n", (unsigned int)type, size, crc, name) < 0
+        || fflush(journal->file) != 0) {
+        res = ERR_OPER_IO;
+        hpopers_error("%s: couldn't write to journal", __FUNCTION__);
+    }
+    return res;
+}
+
+// The store and the device name came with version 2 of the options, incremental backups with version 3: older callers get neither.
+static int get_backup_options(const hpopers_backup_options * options, hpopers_backup_options * out_options) {
+    int res = ERR_SUCCESS;
+    memset(out_options, 0, sizeof(*out_options));
+    out_options->version = HPOPERS_BACKUP_OPTIONS_VERSION;
+    if (options != NULL) {
+        if (options->version >= 1 && options->version <= HPOPERS_BACKUP_OPTIONS_VERSION) {
+            out_options->use_journal = (options->use_journal != 0);
+            if (options->version >= 2) {
+                out_options->use_store = (options->use_store != 0);
+                out_options->device_name = options->device_name;
+            }
+            if (options->version >= 3) {
+                out_options->incremental = (options->incremental != 0);
+            }
+        }
+        else {
+            res = ERR_LIBRARY_CONFIG_VERSION;
+            hpopers_error("%s: unsupported options version %u", __FUNCTION__, options->version);
+        }
+    }
+    return res;
+}
+
+static int compare_names(const void * a, const void * b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static void free_names(char ** names, uint32_t count) {
+    uint32_t i;
+    if (names != NULL) {
+        for (i = 0; i < count; i++) {
+            (hpopers_alloc_funcs.free)(names[i]);
+        }
+        (hpopers_alloc_funcs.free)(names);
+    }
+}
+
+static int add_name(char *** names, uint32_t * count, uint32_t * capacity, const char * name) {
+    int res = ERR_SUCCESS;
+    if (*count == *capacity) {
+        uint32_t new_capacity = *capacity != 0 ? *capacity * 2 : 32;
+        char ** new_names = (char **)(hpopers_alloc_funcs.realloc)(*names, new_capacity * sizeof(*new_names));
+        if (new_names != NULL) {
+            *names = new_names;
+            *capacity = new_capacity;
+        }
+        else {
+            res = ERR_MALLOC;
+        }
+    }
+    if (res == ERR_SUCCESS) {
+        (*names)[*count] = copy_string(name);
+        if ((*names)[*count] != NULL) {
+            (*count)++;
+        }
+        else {
+            res = ERR_MALLOC;
+        }
+    }
+    return res;
+}
+
+// Lists the regular files of a folder, sorted by name; hidden files, among which the journals, are left out.
+static int list_folder(const char * path, char *** out_names, uint32_t * out_count) {
+    int res = ERR_SUCCESS;
+    char ** names = NULL;
+    uint32_t count = 0;
+    uint32_t capacity = 0;
+#ifdef _WIN32
+    char * pattern = join_path(path, "*");
+    if (pattern != NULL) {
+        WIN32_FIND_DATAA data;
+        HANDLE find = FindFirstFileA(pattern, &data);
+        if (find != INVALID_HANDLE_VALUE) {
+            do {
+                if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && data.cFileName[0] != '.') {
+                    res = add_name(&names, &count, &capacity, data.cFileName);
+                }
+            } while (res == ERR_SUCCESS && FindNextFileA(find, &data));
+            FindClose(find);
+        }
+        else {
+            res = ERR_OPER_IO;
+        }
+        (hpopers_alloc_funcs.free)(pattern);
+    }
+    else {
+        res = ERR_MALLOC;
+    }
+#else
+    DIR * dir = opendir(path);
+    if (dir != NULL) {
+        struct dirent * de;
+        while (res == ERR_SUCCESS && (de = readdir(dir)) != NULL) {
+            if (de->d_name[0] != '.') {
+                char * file_path = join_path(path, de->d_name);
+                if (file_path != NULL) {
+                    struct stat st;
+                    if (stat(file_path, &st) == 0 && (st.st_mode & S_IFMT) == S_IFREG) {
+                        res = add_name(&names, &count, &capacity, de->d_name);
+                    }
+                    (hpopers_alloc_funcs.free)(file_path);
+                }
+                else {
+                    res = ERR_MALLOC;
+                }
+            }
+        }
+        closedir(dir);
+    }
+    else {
+        res = ERR_OPER_IO;
+    }
+#endif
+    if (res == ERR_SUCCESS) {
+        if (count != 0) {
+            qsort(names, count, sizeof(*names), compare_names);
+        }
+        *out_names = names;
+        *out_count = count;
+    }
+    else {
+        hpopers_error("%s: couldn't list folder %s", __FUNCTION__, path);
+        free_names(names, count);
+    }
+    return res;
+}
+
+// Copies a name for use as a single path component, replacing separators, control and reserved characters, and a leading dot.
+static void sanitize_component(const char * name, char * out, size_t out_size) {
+    size_t i;
+    for (i = 0; name[i] != 0 && i + 1 < out_size; i++) {
+        char c = name[i];
+        if ((unsigned char)c < 0x20 || c == 0x7F || strchr("/\\:*?\"<>|", c) != NULL || (c == '.' && i == 0)) {
+            c = '_';
+        }
+        out[i] = c;
+    }
+    if (i == 0) {
+        out[i++] = '_';
+    }
+    out[i] = 0;
+}
+
+// Stores data as objects/<first two hex digits>/<hex digest>, unless the store already has it.
+static int store_object(const char * objects_path, const uint8_t * data, uint32_t size, const char * hex, int * out_stored) {
+    int res;
+    char subfolder_name[3];
+    char * subfolder;
+    *out_stored = 0;
+    subfolder_name[0] = hex[0];
+    subfolder_name[1] = hex[1];
+    subfolder_name[2] = 0;
+    subfolder = join_path(objects_path, subfolder_name);
+    if (subfolder != NULL) {
+        res = make_folder(subfolder);
+        if (res == ERR_SUCCESS) {
+            char * path = join_path(subfolder, hex);
+            if (path != NULL) {
+                if (!host_file_has_size(path, size)) {
+                    res = write_host_file(path, data, size);
+                    *out_stored = (res == ERR_SUCCESS);
+                }
+                (hpopers_alloc_funcs.free)(path);
+            }
+            else {
+                res = ERR_MALLOC;
+            }
+        }
+        (hpopers_alloc_funcs.free)(subfolder);
+    }
+    else {
+        res = ERR_MALLOC;
+    }
+    return res;
+}
+
+//! A file listed in a manifest.
+typedef struct {
+    char * name; ///< Host-side file name.
+    char hash[65]; ///< SHA-256 in hex.
+    uint32_t size;
+    uint8_t type;
+    uint8_t seen; ///< Whether the file is still in the backup being received.
+} manifest_record;
+
+//! Files of the previous manifest of a device, sorted by name.
+typedef struct {
+    manifest_record * records;
+    uint32_t count;
+    uint32_t capacity;
+} previous_manifest;
+
+static int compare_manifest_records(const void * a, const void * b) {
+    return strcmp(((const manifest_record *)a)->name, ((const manifest_record *)b)->name);
+}
+
+static void previous_manifest_clear(previous_manifest * previous) {
+    uint32_t i;
+    for (i = 0; i < previous->count; i++) {
+        (hpopers_alloc_funcs.free)(previous->records[i].name);
+    }
+    (hpopers_alloc_funcs.free)(previous->records);
+    memset(previous, 0, sizeof(*previous));
+}
+
+static int previous_manifest_add(previous_manifest * previous, const char * name, const char * hash, uint32_t size, uint8_t type) {
+    int res = ERR_SUCCESS;
+    if (previous->count == previous->capacity) {
+        uint32_t capacity = previous->capacity != 0 ? previous->capacity * 2 : 32;
+        manifest_record * records = (manifest_record *)(hpopers_alloc_funcs.realloc)(previous->records, capacity * sizeof(*records));
+        if (records != NULL) {
+            previous->records = records;
+            previous->capacity = capacity;
+        }
+        else {
+            res = ERR_MALLOC;
+        }
+    }
+    if (res == ERR_SUCCESS) {
+        manifest_record * record = &previous->records[previous->count];
+        record->name = copy_string(name);
+        if (record->name != NULL) {
+            memcpy(record->hash, hash, sizeof(record->hash));
+            record->size = size;
+            record->type = type;
+            record->seen = 0;
+            previous->count++;
+        }
+        else {
+            res = ERR_MALLOC;
+        }
+    }
+    return res;
+}
+
+static int has_suffix(const char * str, const char * suffix) {
+    size_t length = strlen(str);
+    size_t suffix_length = strlen(suffix);
+    return length > suffix_length && !strcmp(str + length - suffix_length, suffix);
+}
+
+// Loads the latest manifest of the device folder, if any: manifest names sort chronologically.
+static int load_previous_manifest(const char * device_path, previous_manifest * previous) {
+    char ** names;
+    uint32_t count;
+    int res;
+    memset(previous, 0, sizeof(*previous));
+    res = list_folder(device_path, &names, &count);
+    if (res == ERR_SUCCESS) {
+        uint32_t i = count;
+        while (i > 0 && !has_suffix(names[i - 1], ".manifest")) {
+            i--;
+        }
+        if (i > 0) {
+            char * path = join_path(device_path, names[i - 1]);
+            if (path != NULL) {
+                FILE * f = fopen(path, "rb");
+                if (f != NULL) {
+                    char line[JOURNAL_LINE_MAX + 64];
+                    while (res == ERR_SUCCESS && fgets(line, sizeof(line), f) != NULL) {
+                        size_t length = strlen(line);
+                        unsigned int type;
+                        uint32_t size;
+                        char hash[65];
+                        char flag;
+                        int offset = 0;
+                        if (line[0] == '#' || length < 2 || line[length - 1] != '\n') {
+                            continue;
+                        }
+                        line[length - 1] = 0;
+                        if (sscanf(line, "%2x %" SCNu32 " %64s %c%n", &type, &size, hash, &flag, &offset) == 4 && offset > 0 && line[offset] == ' ' && line[offset + 1] != 0) {
+                            // Corrupted files are never considered unchanged.
+                            if (flag != 'C') {
+                                res = previous_manifest_add(previous, line + offset + 1, hash, size, (uint8_t)type);
+                            }
+                        }
+                    }
+                    fclose(f);
+                    if (previous->count != 0) {
+                        qsort(previous->records, previous->count, sizeof(*previous->records), compare_manifest_records);
+                    }
+                    hpopers_info("%s: %" PRIu32 " files in previous manifest %s", __FUNCTION__, previous->count, path);
+                }
+                else {
+                    res = ERR_OPER_IO;
+                    hpopers_error("%s: couldn't open %s", __FUNCTION__, path);
+                }
+                (hpopers_alloc_funcs.free)(path);
+            }
+            else {
+                res = ERR_MALLOC;
+            }
+        }
+        free_names(names, count);
+    }
+    else {
+        // No manifest yet.
+        res = ERR_SUCCESS;
+    }
+    if (res != ERR_SUCCESS) {
+        previous_manifest_clear(previous);
+    }
+    return res;
+}
+
+static manifest_record * find_manifest_record(previous_manifest * previous, const char * name) {
+    manifest_record * record = NULL;
+    if (previous->count != 0) {
+        manifest_record key;
+        key.name = (char *)name;
+        record = (manifest_record *)bsearch(&key, previous->records, previous->count, sizeof(*previous->records), compare_manifest_records);
+    }
+    return record;
+}
+
+static int write_change(FILE * changes, char change, uint8_t type, uint32_t size, const char * hash, const char * name) {
+    return fprintf(changes, "%c\t%02X\t%" PRIu32 "\t%s\t%s\n", change, (unsigned int)type, size, hash, name) < 0 ? ERR_OPER_IO : ERR_SUCCESS;
+}
+
+// Renames a complete temporary file into place, or removes it.
+static int commit_temp_file(FILE * f, const char * temp_path, const char * path, int res) {
+    if (fclose(f) != 0 && res == ERR_SUCCESS) {
+        res = ERR_OPER_IO;
+    }
+    if (res == ERR_SUCCESS) {
+#ifdef _WIN32
+        remove(path);
+#endif
+        if (rename(temp_path, path) != 0) {
+            res = ERR_OPER_IO;
+        }
+    }
+    if (res != ERR_SUCCESS) {
+        remove(temp_path);
+        hpopers_error("%s: couldn't write %s", __FUNCTION__, path);
+    }
+    return res;
+}
+
+//! Host file names used by a backup, compared case-insensitively as some host file systems do, in an open addressing hash table.
+typedef struct {
+    char ** slots; ///< NULL for free slots.
+    uint32_t count;
+    uint32_t capacity; ///< Power of two.
+} host_name_set;
+
+static uint32_t host_name_hash(const char * name) {
+    // FNV-1a over the lowercased name.
+    uint32_t hash = 2166136261U;
+    for (; *name != 0; name++) {
+        hash = (hash ^ (uint8_t)tolower((unsigned char)*name)) * 16777619U;
+    }
+    return hash;
+}
+
+static char ** host_name_set_find(host_name_set * set, const char * name) {
+    uint32_t i = host_name_hash(name) & (set->capacity - 1);
+    while (set->slots[i] != NULL && strcasecmp(set->slots[i], name)) {
+        i = (i + 1) & (set->capacity - 1);
+    }
+    return &set->slots[i];
+}
+
+static int host_name_set_contains(host_name_set * set, const char * name) {
+    return set->count != 0 && *host_name_set_find(set, name) != NULL;
+}
+
+static int host_name_set_add(host_name_set * set, const char * name) {
+    int res = ERR_SUCCESS;
+    if ((set->count + 1) * 2 > set->capacity) {
+        // Keep the load factor under 1/2.
+        host_name_set grown;
+        uint32_t i;
+        grown.capacity = (set->capacity != 0) ? set->capacity * 2 : 64;
+        grown.count = set->count;
+        grown.slots = (char **)(hpopers_alloc_funcs.calloc)(grown.capacity, sizeof(*grown.slots));
+        if (grown.slots != NULL) {
+            for (i = 0; i < set->capacity; i++) {
+                if (set->slots[i] != NULL) {
+                    *host_name_set_find(&grown, set->slots[i]) = set->slots[i];
+                }
+            }
+            (hpopers_alloc_funcs.free)(set->slots);
+            *set = grown;
+        }
+        else {
+            res = ERR_MALLOC;
+        }
+    }
+    if (res == ERR_SUCCESS) {
+        char * copy = copy_string(name);
+        if (copy != NULL) {
+            *host_name_set_find(set, copy) = copy;
+            set->count++;
+        }
+        else {
+            res = ERR_MALLOC;
+        }
+    }
+    return res;
+}
+
+static void host_name_set_clear(host_name_set * set) {
+    uint32_t i;
+    for (i = 0; i < set->capacity; i++) {
+        (hpopers_alloc_funcs.free)(set->slots[i]);
+    }
+    (hpopers_alloc_funcs.free)(set->slots);
+    memset(set, 0, sizeof(*set));
+}
+
+//! State of the writing of a received backup, to a plain folder or to a store. Entries are written one at a time, in order, possibly on another thread than the one receiving them.
+typedef struct {
+    calc_model model;
+    const char * out_path;
+    hpopers_backup_options options;
+    int res; ///< First error, after which entries are dropped.
+    uint32_t count;
+    uint32_t written; ///< Files written, or objects stored.
+    uint32_t skipped; ///< Files already present, or unchanged since the previous manifest.
+    uint32_t changed;
+    host_name_set names; ///< Host file names used so far.
+    // For plain folders.
+    backup_journal journal;
+    // For stores.
+    char * objects_path;
+    char * manifests_path;
+    char * device_path;
+    char * manifest_path;
+    char * temp_manifest_path;
+    char * changes_path;
+    char * temp_changes_path;
+    FILE * manifest;
+    FILE * changes;
+    previous_manifest previous;
+} backup_writer;
+
+static int backup_writer_open_store(backup_writer * writer) {
+    int res = ERR_MALLOC;
+    char device_folder_name[DEVICE_NAME_MAX];
+    char date[32];
+    char temp_suffix[40];
+    char file_name[64];
+    uint64_t now_ms = get_wall_time_ms();
+    time_t now = (time_t)(now_ms / 1000);
+    struct tm tm;
+    size_t length;
+
+#ifdef _WIN32
+    gmtime_s(&tm, &now);
+#else
+    gmtime_r(&now, &tm);
+#endif
+    // Milliseconds keep apart the backups made within the same second; the names still sort by date.
+    length = strftime(date, sizeof(date), "%Y%m%dT%H%M%S", &tm);
+    snprintf(date + length, sizeof(date) - length, ".%03uZ", (unsigned int)(now_ms % 1000));
+    // Backups in progress to the same device, from other processes or threads, mustn't share their temporary files.
+    snprintf(temp_suffix, sizeof(temp_suffix), "%lu.%p.part", (unsigned long)getpid(), (void *)writer);
+    sanitize_component(writer->options.device_name, device_folder_name, sizeof(device_folder_name));
+    writer->objects_path = join_path(writer->out_path, "objects");
+    writer->manifests_path = join_path(writer->out_path, "manifests");
+    if (writer->manifests_path != NULL) {
+        writer->device_path = join_path(writer->manifests_path, device_folder_name);
+        if (writer->device_path != NULL) {
+            snprintf(file_name, sizeof(file_name), "%s.manifest", date);
+            writer->manifest_path = join_path(writer->device_path, file_name);
+            snprintf(file_name, sizeof(file_name), "manifest.%s", temp_suffix);
+            writer->temp_manifest_path = join_path(writer->device_path, file_name);
+            snprintf(file_name, sizeof(file_name), "%s.changes.tsv", date);
+            writer->changes_path = join_path(writer->device_path, file_name);
+            snprintf(file_name, sizeof(file_name), "changes.%s", temp_suffix);
+            writer->temp_changes_path = join_path(writer->device_path, file_name);
+        }
+    }
+
+    if (   writer->objects_path != NULL && writer->manifest_path != NULL && writer->temp_manifest_path != NULL
+        && writer->changes_path != NULL && writer->temp_changes_path != NULL) {
+        res = make_folder(writer->objects_path);
+        if (res == ERR_SUCCESS) {
+            res = make_folder(writer->manifests_path);
+        }
+        if (res == ERR_SUCCESS) {
+            res = make_folder(writer->device_path);
+        }
+        if (res == ERR_SUCCESS && writer->options.incremental) {
+            res = load_previous_manifest(writer->device_path, &writer->previous);
+        }
+        if (res == ERR_SUCCESS) {
+            writer->manifest = fopen(writer->temp_manifest_path, "wb");
+            if (writer->manifest != NULL) {
+                fputs(MANIFEST_HEADER, writer->manifest);
+                if (writer->options.incremental) {
+                    writer->changes = fopen(writer->temp_changes_path, "wb");
+                    if (writer->changes != NULL) {
+                        fputs("change\ttype\tsize\tsha256\tname\n", writer->changes);
+                    }
+                    else {
+                        res = ERR_OPER_IO;
+                    }
+                }
+            }
+            else {
+                res = ERR_OPER_IO;
+            }
+            if (res != ERR_SUCCESS) {
+                hpopers_error("%s: couldn't create manifest in %s", __FUNCTION__, writer->device_path);
+            }
+        }
+    }
+    else {
+        hpopers_error("%s: couldn't allocate paths", __FUNCTION__);
+    }
+    return res;
+}
+
+// Prepares the folder or store, before anything is received.
+static int backup_writer_open(backup_writer * writer, calc_model model, const char * out_path, const hpopers_backup_options * options) {
+    int res;
+    memset(writer, 0, sizeof(*writer));
+    writer->model = model;
+    writer->out_path = out_path;
+    writer->options = *options;
+    res = make_folder(out_path);
+    if (res == ERR_SUCCESS) {
+        if (options->use_store) {
+            res = backup_writer_open_store(writer);
+        }
+        else if (options->use_journal) {
+            res = journal_open(&writer->journal, out_path, HPOPERS_BACKUP_JOURNAL_NAME);
+        }
+    }
+    writer->res = res;
+    return res;
+}
+
+// Writes an entry to the folder, unless the journal (if any) records it as already there.
+static int backup_writer_write_file(backup_writer * writer, files_var_entry * entry, const char * filename) {
+    int res = ERR_MALLOC;
+    char * path = join_path(writer->out_path, filename);
+    if (path != NULL) {
+        int use_journal = writer->options.use_journal;
+        uint32_t crc = crc32_block(0, entry->data, entry->size);
+        if (   use_journal
+            && journal_contains(&writer->journal, filename, entry->type, entry->size, crc)
+            && host_file_has_size(path, entry->size)) {
+            writer->skipped++;
+            res = ERR_SUCCESS;
+        }
+        else {
+            res = write_host_file(path, entry->data, entry->size);
+            if (res == ERR_SUCCESS) {
+                writer->written++;
+                // Corrupted files are written for salvaging, but not recorded, so that they're written again by the next attempt.
+                if (use_journal && !entry->invalid) {
+                    res = journal_append(&writer->journal, filename, entry->type, entry->size, crc);
+                }
+            }
+        }
+        (hpopers_alloc_funcs.free)(path);
+    }
+    return res;
+}
+
+// Stores an entry's contents, unless unchanged since the previous manifest, and lists it in the new manifest.
+static int backup_writer_write_object(backup_writer * writer, files_var_entry * entry, const char * filename) {
+    int res = ERR_SUCCESS;
+    uint8_t digest[32];
+    char hex[65];
+    uint32_t j;
+    manifest_record * record = NULL;
+
+    sha256_block(entry->data, entry->size, digest);
+    for (j = 0; j < 32; j++) {
+        sprintf(&hex[2 * j], "%02x", digest[j]);
+    }
+    if (writer->options.incremental) {
+        record = find_manifest_record(&writer->previous, filename);
+        if (record != NULL) {
+            record->seen = 1;
+        }
+    }
+    if (   record != NULL && !entry->invalid
+        && record->type == entry->type && record->size == entry->size && !strcmp(record->hash, hex)) {
+        writer->skipped++;
+    }
+    else {
+        int object_stored;
+        res = store_object(writer->objects_path, entry->data, entry->size, hex, &object_stored);
+        if (res == ERR_SUCCESS) {
+            if (object_stored) {
+                writer->written++;
+            }
+            if (writer->changes != NULL) {
+                writer->changed++;
+                res = write_change(writer->changes, record != NULL ? 'M' : 'A', entry->type, entry->size, hex, filename);
+            }
+        }
+    }
+    // Corrupted files are flagged with 'C'.
+    if (res == ERR_SUCCESS && fprintf(writer->manifest, "%02X %" PRIu32 " %s %c %s\n", (unsigned int)entry->type, entry->size, hex, entry->invalid ? 'C' : '-', filename) < 0) {
+        res = ERR_OPER_IO;
+    }
+    return res;
+}
+
+// Sanitizing can map distinct calculator names (e.g. "a:b" and "a_b") to the same host file name:
+// the later files get a "~N" suffix before the extension, instead of overwriting the earlier ones.
+static int backup_writer_claim_filename(backup_writer * writer, char * filename) {
+    if (host_name_set_contains(&writer->names, filename)) {
+        char original[HOST_FILENAME_MAX];
+        const char * extension;
+        int base_length;
+        uint32_t n = 2;
+        strcpy(original, filename);
+        // host_filename never starts names with a dot.
+        extension = strrchr(original, '.');
+        if (extension == NULL) {
+            extension = original + strlen(original);
+        }
+        base_length = (int)(extension - original);
+        do {
+            snprintf(filename, HOST_FILENAME_MAX, "%.*s~%" PRIu32 "%s", base_length, original, n++, extension);
+        } while (host_name_set_contains(&writer->names, filename));
+        hpopers_warning("%s: %s is already used, writing %s instead", __FUNCTION__, original, filename);
+    }
+    return host_name_set_add(&writer->names, filename);
+}
+
+static void backup_writer_write(backup_writer * writer, files_var_entry * entry) {
+    if (writer->res == ERR_SUCCESS) {
+        char filename[HOST_FILENAME_MAX];
+        host_filename(entry->name, hpfiles_vartype2fext(writer->model, entry->type), filename);
+        writer->res = backup_writer_claim_filename(writer, filename);
+        if (writer->res != ERR_SUCCESS) {
+            return;
+        }
+        if (entry->invalid) {
+            hpopers_warning("%s: %s is corrupted", __FUNCTION__, filename);
+        }
+        if (writer->options.use_store) {
+            writer->res = backup_writer_write_object(writer, entry, filename);
+        }
+        else {
+            writer->res = backup_writer_write_file(writer, entry, filename);
+        }
+        writer->count++;
+    }
+}
+
+// Completes the change list and the manifest of a store, unless the backup is incomplete, then frees everything.
+static int backup_writer_close(backup_writer * writer, int complete) {
+    int res = writer->res;
+    if (!complete && writer->manifest != NULL) {
+        // A partial manifest would make the next incremental backup consider the missing files as deleted.
+        hpopers_warning("%s: backup is incomplete, no manifest written", __FUNCTION__);
+        fclose(writer->manifest);
+        remove(writer->temp_manifest_path);
+        writer->manifest = NULL;
+        if (writer->changes != NULL) {
+            fclose(writer->changes);
+            remove(writer->temp_changes_path);
+            writer->changes = NULL;
+        }
+    }
+    if (writer->changes != NULL) {
+        uint32_t i;
+        for (i = 0; i < writer->previous.count && res == ERR_SUCCESS; i++) {
+            const manifest_record * record = &writer->previous.records[i];
+            if (!record->seen) {
+                writer->changed++;
+                res = write_change(writer->changes, 'D', record->type, record->size, record->hash, record->name);
+            }
+        }
+        // The change list goes first: a manifest implies a complete change list.
+        res = commit_temp_file(writer->changes, writer->temp_changes_path, writer->changes_path, res);
+    }
+    if (writer->manifest != NULL) {
+        // The manifest goes last: an interrupted backup leaves no manifest, but the objects already stored aren't written again by the next attempt.
+        res = commit_temp_file(writer->manifest, writer->temp_manifest_path, writer->manifest_path, res);
+    }
+    if (res == ERR_SUCCESS) {
+        if (writer->options.use_store) {
+            hpopers_info("%s: %" PRIu32 " files, %" PRIu32 " new objects, %" PRIu32 " changes, %" PRIu32 " unchanged, manifest %s", __FUNCTION__, writer->count, writer->written, writer->changed, writer->skipped, writer->manifest_path);
+        }
+        else {
+            hpopers_info("%s: %" PRIu32 " files written, %" PRIu32 " already present", __FUNCTION__, writer->written, writer->skipped);
+        }
+    }
+    journal_close(&writer->journal);
+    previous_manifest_clear(&writer->previous);
+    host_name_set_clear(&writer->names);
+    (hpopers_alloc_funcs.free)(writer->temp_changes_path);
+    (hpopers_alloc_funcs.free)(writer->changes_path);
+    (hpopers_alloc_funcs.free)(writer->temp_manifest_path);
+    (hpopers_alloc_funcs.free)(writer->manifest_path);
+    (hpopers_alloc_funcs.free)(writer->device_path);
+    (hpopers_alloc_funcs.free)(writer->manifests_path);
+    (hpopers_alloc_funcs.free)(writer->objects_path);
+    return res;
+}
+
+//! Maximum amount of received data waiting to be written.
+#define WRITE_BEHIND_MAX_BYTES (16 * 1024 * 1024)
+
+//! An entry handed to the writer thread.
+typedef struct {
+    backup_writer * writer;
+    files_var_entry * entry;
+} write_job;
+
+//! State of the write-behind, shared with the entry callback.
+typedef struct {
+    hplibs_workers * workers;
+    backup_writer * writer;
+    uint32_t pending_bytes;
+    int synchronous; // Set once an entry was left to the operation, so that the order of the entries is kept.
+} write_behind;
+
+// Runs on the writer thread. The single thread processes the jobs one at a time, in order, so the writer needs no locking.
+static void write_backup_job(void * arg) {
+    write_job * job = (write_job *)arg;
+    backup_writer_write(job->writer, job->entry);
+}
+
+static void collect_write_job(write_behind * behind, write_job * job) {
+    behind->pending_bytes -= job->entry->size;
+    hpfiles_ve_delete(job->entry);
+    (hpcalcs_base_alloc_funcs.free)(job);
+}
+
+// Called by the receive operation for each file: queues it for the writer thread, waiting while too much data is queued.
+static int write_behind_entry_callback(calc_handle * handle, files_var_entry * entry, void * user_data) {
+    write_behind * behind = (write_behind *)user_data;
+    write_job * job = NULL;
+
+    if (!behind->synchronous) {
+        while (   hplibs_workers_get_pending(behind->workers) >= HPLIBS_WORKERS_MAX_PENDING
+               || (behind->pending_bytes != 0 && behind->pending_bytes + entry->size > WRITE_BEHIND_MAX_BYTES)) {
+            collect_write_job(behind, (write_job *)hplibs_workers_take(behind->workers, 1));
+        }
+        job = (write_job *)(hpcalcs_base_alloc_funcs.malloc)(sizeof(*job));
+        if (job != NULL) {
+            job->writer = behind->writer;
+            job->entry = entry;
+            if (hplibs_workers_submit(behind->workers, job) == ERR_SUCCESS) {
+                behind->pending_bytes += entry->size;
+            }
+            else {
+                (hpcalcs_base_alloc_funcs.free)(job);
+                job = NULL;
+            }
+        }
+        if (job == NULL) {
+            // Leave this entry, and the next ones, to the operation: they'll be written afterwards.
+            behind->synchronous = 1;
+        }
+        while ((job = (write_job *)hplibs_workers_take(behind->workers, 0)) != NULL) {
+            collect_write_job(behind, job);
+        }
+    }
+    return !behind->synchronous;
+}
+
+HPEXPORT int HPCALL hpopers_calc_recv_backup_ex(calc_handle * handle, const char * out_path, const hpopers_backup_options * options) {
+    int res;
+    if (handle != NULL && out_path != NULL) {
+        hpopers_backup_options backup_options;
+        res = get_backup_options(options, &backup_options);
+        if (res == ERR_SUCCESS && backup_options.use_store && (backup_options.device_name == NULL || backup_options.device_name[0] == 0)) {
+            // The manifests of different devices mustn't be mixed in a shared folder.
+            res = ERR_INVALID_PARAMETER;
+            hpopers_error("%s: a device name is required for stores", __FUNCTION__);
+        }
+        if (res == ERR_SUCCESS) {
+            backup_writer writer;
+            res = backup_writer_open(&writer, hpcalcs_get_model(handle), out_path, &backup_options);
+            if (res == ERR_SUCCESS) {
+                files_ve_vector * entries = hpfiles_ve_vector_new(0);
+                if (entries != NULL) {
+                    write_behind behind;
+                    uint32_t count;
+                    uint32_t i;
+                    write_job * job;
+
+                    memset(&behind, 0, sizeof(behind));
+                    behind.writer = &writer;
+                    // Files are written by a separate thread while the next ones are received.
+                    if (hpcalcs_handle_uses_base_alloc(handle)) {
+                        behind.workers = hplibs_workers_new(1, write_backup_job);
+                    }
+                    if (behind.workers != NULL) {
+                        hpcalcs_calc_set_entry_callback(handle, write_behind_entry_callback, &behind);
+                    }
+                    res = hpcalcs_calc_recv_backup_vector(handle, entries);
+                    if (behind.workers != NULL) {
+                        hpcalcs_calc_set_entry_callback(handle, NULL, NULL);
+                        while ((job = (write_job *)hplibs_workers_take(behind.workers, 1)) != NULL) {
+                            collect_write_job(&behind, job);
+                        }
+                        hplibs_workers_del(behind.workers);
+                    }
+
+                    count = hpfiles_ve_vector_get_count(entries);
+                    if (res != ERR_SUCCESS) {
+                        hpopers_warning("%s: backup failed, writing the files received so far", __FUNCTION__);
+                    }
+                    for (i = 0; i < count; i++) {
+                        backup_writer_write(&writer, hpfiles_ve_vector_get(entries, i));
+                    }
+                    hpfiles_ve_vector_delete(entries);
+                }
+                else {
+                    res = ERR_MALLOC;
+                    hpopers_error("%s: couldn't create vector", __FUNCTION__);
+                }
+            }
+            {
+                int write_res = backup_writer_close(&writer, res == ERR_SUCCESS);
+                if (res == ERR_SUCCESS) {
+                    res = write_res;
+                }
+            }
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpopers_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpopers_calc_recv_backup(calc_handle * handle, const char * out_path) {
+    return hpopers_calc_recv_backup_ex(handle, out_path, NULL);
+}
+
+// Reads a host file into an entry.
+static int read_host_file(const char * path, files_var_entry ** out_entry) {
+    int res = ERR_OPER_IO;
+    FILE * f = fopen(path, "rb");
+    *out_entry = NULL;
+    if (f != NULL) {
+        long size;
+        if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) >= 0 && (uint64_t)size <= UINT32_MAX && fseek(f, 0, SEEK_SET) == 0) {
+            files_var_entry * entry = hpfiles_ve_create_with_size((uint32_t)size);
+            if (entry != NULL) {
+                if (fread(entry->data, 1, (size_t)size, f) == (size_t)size) {
+                    *out_entry = entry;
+                    res = ERR_SUCCESS;
+                }
+                else {
+                    hpfiles_ve_delete(entry);
+                }
+            }
+            else {
+                res = ERR_MALLOC;
+            }
+        }
+        fclose(f);
+    }
+    if (res != ERR_SUCCESS) {
+        hpopers_error("%s: couldn't read %s", __FUNCTION__, path);
+    }
+    return res;
+}
+
+//! Maximum depth of the folders scanned for sending.
+#define SCAN_MAX_DEPTH (8)
+//! Maximum amount of file data read ahead of sending.
+#define READ_AHEAD_MAX_BYTES (8 * 1024 * 1024)
+
+//! A file to be sent, found by the scan of the folder.
+typedef struct {
+    char * path;
+    char * filename; ///< Relative to the scanned folder, used in the journal.
+    char * calcfilename; ///< Allocated by strdup in hpfiles_parsefilename.
+    uint32_t size;
+    uint8_t type;
+    int rank; ///< Files are sent by increasing rank, then name.
+    // Filled by read-ahead.
+    files_var_entry * entry;
+    uint32_t crc;
+    int res;
+} send_item;
+
+//! Files found by the scan of the folder.
+typedef struct {
+    send_item * items;
+    uint32_t count;
+    uint32_t capacity;
+} send_list;
+
+// Settings go first, so that e.g. the angle mode is right before anything depending on it is restored, then applications, then the files which may belong to them.
+static int send_rank(calc_model model, uint8_t type) {
+    int rank = 2;
+    if (model == CALC_PRIME) {
+        if (type == PRIME_TYPE_SETTINGS || type == PRIME_TYPE_TESTMODECONFIG) {
+            rank = 0;
+        }
+        else if (type == PRIME_TYPE_APP) {
+            rank = 1;
+        }
+    }
+    return rank;
+}
+
+static int compare_send_items(const void * a, const void * b) {
+    const send_item * item_a = (const send_item *)a;
+    const send_item * item_b = (const send_item *)b;
+    int res = item_a->rank - item_b->rank;
+    if (res == 0) {
+        res = strcmp(item_a->filename, item_b->filename);
+    }
+    return res;
+}
+
+static void send_list_clear(send_list * list) {
+    uint32_t i;
+    for (i = 0; i < list->count; i++) {
+        send_item * item = &list->items[i];
+        (hpopers_alloc_funcs.free)(item->path);
+        (hpopers_alloc_funcs.free)(item->filename);
+        free(item->calcfilename); // Allocated by strdup.
+        hpfiles_ve_delete(item->entry);
+    }
+    (hpopers_alloc_funcs.free)(list->items);
+    memset(list, 0, sizeof(*list));
+}
+
+// Classifies a file found by the scan, and adds it to the list if its type is known.
+static int send_list_add(send_list * list, calc_model model, const char * path, const char * filename, uint64_t size) {
+    int res = ERR_SUCCESS;
+    uint8_t type;
+    char * calcfilename = NULL;
+    if (size > UINT32_MAX) {
+        hpopers_warning("%s: skipping %s, which is too large", __FUNCTION__, filename);
+    }
+    else if (hpfiles_parsefilename(model, path, &type, &calcfilename) != ERR_SUCCESS || calcfilename == NULL) {
+        hpopers_warning("%s: skipping %s, whose type is unknown", __FUNCTION__, filename);
+    }
+    else {
+        if (list->count == list->capacity) {
+            uint32_t capacity = list->capacity != 0 ? list->capacity * 2 : 32;
+            send_item * items = (send_item *)(hpopers_alloc_funcs.realloc)(list->items, capacity * sizeof(*items));
+            if (items != NULL) {
+                list->items = items;
+                list->capacity = capacity;
+            }
+            else {
+                res = ERR_MALLOC;
+            }
+        }
+        if (res == ERR_SUCCESS) {
+            send_item * item = &list->items[list->count];
+            memset(item, 0, sizeof(*item));
+            item->path = copy_string(path);
+            item->filename = copy_string(filename);
+            item->calcfilename = calcfilename;
+            item->size = (uint32_t)size;
+            item->type = type;
+            item->rank = send_rank(model, type);
+            // Counted even upon failure, for send_list_clear.
+            list->count++;
+            calcfilename = NULL;
+            if (item->path == NULL || item->filename == NULL) {
+                res = ERR_MALLOC;
+            }
+        }
+    }
+    free(calcfilename);
+    return res;
+}
+
+static int scan_folder(send_list * list, calc_model model, const char * folder, const char * relative, uint32_t depth);
+
+// Handles an entry of a scanned folder: regular files are classified, folders are scanned in turn; hidden entries, among which the journals, are left out.
+static int scan_folder_entry(send_list * list, calc_model model, const char * folder, const char * relative, const char * name, uint32_t depth) {
+    int res = ERR_SUCCESS;
+    if (name[0] != '.') {
+        char * path = join_path(folder, name);
+        char * filename = (relative != NULL) ? join_path(relative, name) : copy_string(name);
+        if (path != NULL && filename != NULL) {
+            struct stat st;
+            if (stat(path, &st) == 0) {
+                if ((st.st_mode & S_IFMT) == S_IFREG) {
+                    res = send_list_add(list, model, path, filename, (uint64_t)st.st_size);
+                }
+                else if ((st.st_mode & S_IFMT) == S_IFDIR) {
+                    if (depth < SCAN_MAX_DEPTH) {
+                        res = scan_folder(list, model, path, filename, depth + 1);
+                    }
+                    else {
+                        hpopers_warning("%s: skipping %s, which is nested too deeply", __FUNCTION__, filename);
+                    }
+                }
+            }
+        }
+        else {
+            res = ERR_MALLOC;
+        }
+        (hpopers_alloc_funcs.free)(filename);
+        (hpopers_alloc_funcs.free)(path);
+    }
+    return res;
+}
+
+static int scan_folder(send_list * list, calc_model model, const char * folder, const char * relative, uint32_t depth) {
+    int res = ERR_SUCCESS;
+#ifdef _WIN32
+    char * pattern = join_path(folder, "*");
+    if (pattern != NULL) {
+        WIN32_FIND_DATAA data;
+        HANDLE find = FindFirstFileA(pattern, &data);
+        if (find != INVALID_HANDLE_VALUE) {
+            do {
+                res = scan_folder_entry(list, model, folder, relative, data.cFileName, depth);
+            } while (res == ERR_SUCCESS && FindNextFileA(find, &data));
+            FindClose(find);
+        }
+        else {
+            res = ERR_OPER_IO;
+        }
+        (hpopers_alloc_funcs.free)(pattern);
+    }
+    else {
+        res = ERR_MALLOC;
+    }
+#else
+    DIR * dir = opendir(folder);
+    if (dir != NULL) {
+        struct dirent * de;
+        while (res == ERR_SUCCESS && (de = readdir(dir)) != NULL) {
+            res = scan_folder_entry(list, model, folder, relative, de->d_name, depth);
+        }
+        closedir(dir);
+    }
+    else {
+        res = ERR_OPER_IO;
+    }
+#endif
+    if (res == ERR_OPER_IO) {
+        hpopers_error("%s: couldn't list folder %s", __FUNCTION__, folder);
+    }
+    return res;
+}
+
+// Loads a file and prepares its entry, on the read-ahead thread when there is one.
+static void read_send_item(void * arg) {
+    send_item * item = (send_item *)arg;
+    item->res = read_host_file(item->path, &item->entry);
+    if (item->res == ERR_SUCCESS) {
+        item->entry->type = item->type;
+        calc_filename(item->calcfilename, item->entry->name);
+        item->crc = crc32_block(0, item->entry->data, item->entry->size);
+    }
+}
+
+// Sends a prepared file, unless the journal (if any) records it as already sent.
+static int send_item_entry(calc_handle * handle, send_item * item, backup_journal * journal, uint32_t * sent, uint32_t * skipped) {
+    int res = item->res;
+    if (res == ERR_SUCCESS) {
+        if (journal != NULL && journal_contains(journal, item->filename, item->type, item->entry->size, item->crc)) {
+            (*skipped)++;
+        }
+        else {
+            res = hpcalcs_calc_send_file(handle, item->entry);
+            if (res == ERR_SUCCESS) {
+                (*sent)++;
+                if (journal != NULL) {
+                    res = journal_append(journal, item->filename, item->type, item->entry->size, item->crc);
+                }
+            }
+            else {
+                hpopers_error("%s: couldn't send %s", __FUNCTION__, item->filename);
+            }
+        }
+    }
+    hpfiles_ve_delete(item->entry);
+    item->entry = NULL;
+    return res;
+}
+
+// Sends the files in order, while a read-ahead thread loads the next ones, within a memory budget.
+static int send_items(calc_handle * handle, send_list * list, backup_journal * journal) {
+    int res = ERR_SUCCESS;
+    hplibs_workers * workers = hplibs_workers_new(1, read_send_item);
+    uint32_t next_read = 0; // Next item to be handed to the read-ahead thread.
+    uint32_t pending_bytes = 0;
+    uint32_t sent = 0;
+    uint32_t skipped = 0;
+    uint32_t i;
+
+    for (i = 0; i < list->count && res == ERR_SUCCESS; i++) {
+        send_item * item = &list->items[i];
+        while (   workers != NULL && next_read < list->count
+               && hplibs_workers_get_pending(workers) < HPLIBS_WORKERS_MAX_PENDING
+               && (pending_bytes == 0 || pending_bytes + list->items[next_read].size <= READ_AHEAD_MAX_BYTES)) {
+            if (hplibs_workers_submit(workers, &list->items[next_read]) != ERR_SUCCESS) {
+                break;
+            }
+            pending_bytes += list->items[next_read].size;
+            next_read++;
+        }
+        if (i < next_read) {
+            // Jobs are handed back in submission order.
+            hplibs_workers_take(workers, 1);
+            pending_bytes -= item->size;
+        }
+        else {
+            read_send_item(item);
+            next_read++;
+        }
+        res = send_item_entry(handle, item, journal, &sent, &skipped);
+    }
+    // Wait for the files read ahead in vain, they're freed by send_list_clear.
+    while (hplibs_workers_take(workers, 1) != NULL) {
+    }
+    hplibs_workers_del(workers);
+    hpopers_info("%s: %" PRIu32 " files sent, %" PRIu32 " already sent", __FUNCTION__, sent, skipped);
+    return res;
+}
+
+HPEXPORT int HPCALL hpopers_calc_send_backup_ex(calc_handle * handle, const char * in_path, const hpopers_backup_options * options) {
+    int res;
+    if (handle != NULL && in_path != NULL) {
+        hpopers_backup_options backup_options;
+        res = get_backup_options(options, &backup_options);
+        if (res == ERR_SUCCESS) {
+            send_list list;
+            memset(&list, 0, sizeof(list));
+            res = scan_folder(&list, hpcalcs_get_model(handle), in_path, NULL, 0);
+            if (res == ERR_SUCCESS) {
+                backup_journal journal;
+                memset(&journal, 0, sizeof(journal));
+                if (list.count != 0) {
+                    qsort(list.items, list.count, sizeof(*list.items), compare_send_items);
+                }
+                if (backup_options.use_journal) {
+                    res = journal_open(&journal, in_path, HPOPERS_BACKUP_SENT_JOURNAL_NAME);
+                }
+                if (res == ERR_SUCCESS) {
+                    res = send_items(handle, &list, backup_options.use_journal ? &journal : NULL);
+                }
+                journal_close(&journal);
+            }
+            send_list_clear(&list);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpopers_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpopers_calc_send_backup(calc_handle * handle, const char * in_path) {
+    return hpopers_calc_send_backup_ex(handle, in_path, NULL);
+}
@@ -30,6 +30,7 @@
 #endif
 
 #include <hpcalcs.h>
+#include "error.h"
 
 static int calc_none_check_ready(calc_handle * handle, uint8_t ** out_data, uint32_t * out_size) {
     return 0;
@@ -43,7 +44,7 @@ static int calc_none_set_date_time(calc_handle * handle, time_t timestamp) {
     return 0;
 }
 
-static int calc_none_recv_screen(calc_handle * handle, calc_screenshot_format format, uint8_t ** out_data, uint32_t * out_size) {
+static int calc_none_recv_screen(calc_handle * handle, calc_screenshot_format format, hplibs_buffer_view * out_view) {
     return 0;
 }
 
@@ -55,7 +56,7 @@ static int calc_none_recv_file(calc_handle * handle, files_var_entry * request,
     return 0;
 }
 
-static int calc_none_recv_backup(calc_handle * handle, files_var_entry *** out_vars) {
+static int calc_none_recv_backup(calc_handle * handle, files_ve_vector * out_vars) {
     return 0;
 }
 
@@ -71,7 +72,38 @@ static int calc_none_send_chat(calc_handle * handle, const uint16_t * data, uint
     return 0;
 }
 
-static int calc_none_recv_chat(calc_handle * handle, uint16_t ** out_data, uint32_t * out_size) {
+static int calc_none_recv_chat(calc_handle * handle, hplibs_buffer_view * out_view) {
+    return 0;
+}
+
+static int calc_none_poll_events(calc_handle * handle, int timeout) {
+    return 0;
+}
+
+// The batch functions report per-file results, which are meaningless without a calculator: nothing is attempted.
+static int calc_none_skip_files(uint32_t count, int * out_results) {
+    uint32_t i;
+    if (out_results != NULL) {
+        for (i = 0; i < count; i++) {
+            out_results[i] = ERR_CALC_SKIPPED;
+        }
+    }
+    return ERR_CALC_INVALID_FNCTS;
+}
+
+static int calc_none_send_files(calc_handle * handle, files_var_entry ** files, uint32_t count, int * out_results) {
+    return calc_none_skip_files(count, out_results);
+}
+
+static int calc_none_recv_files(calc_handle * handle, files_var_entry ** requests, uint32_t count, files_ve_vector * out_vars, int * out_results) {
+    return calc_none_skip_files(count, out_results);
+}
+
+static int calc_none_recv_screen_next(calc_handle * handle, calc_screenshot_format format, int send_next, int * inout_pending, hplibs_buffer_view * out_view) {
+    return 0;
+}
+
+static int calc_none_recv_file_view(calc_handle * handle, files_var_entry * request, files_var_entry ** out_file, hplibs_buffer_view * out_view) {
     return 0;
 }
 
@@ -91,5 +123,10 @@ const calc_fncts calc_none_fncts =
     &calc_none_send_key,
     &calc_none_send_keys,
     &calc_none_send_chat,
-    &calc_none_recv_chat
+    &calc_none_recv_chat,
+    &calc_none_poll_events,
+    &calc_none_send_files,
+    &calc_none_recv_files,
+    &calc_none_recv_screen_next,
+    &calc_none_recv_file_view
 };
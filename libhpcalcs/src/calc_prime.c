@@ -30,10 +30,15 @@
 #endif
 
 #include <hpcalcs.h>
+#include "internal.h"
 #include "logging.h"
+#include "error.h"
+#include "utils.h"
 
 #include "prime_cmd.h"
 
+#include <inttypes.h>
+
 static int calc_prime_check_ready(calc_handle * handle, uint8_t ** out_data, uint32_t * out_size) {
     int res;
 
@@ -82,12 +87,12 @@ static int calc_prime_set_date_time(calc_handle * handle, time_t timestamp) {
     return res;
 }
 
-static int calc_prime_recv_screen(calc_handle * handle, calc_screenshot_format format, uint8_t ** out_data, uint32_t * out_size) {
+static int calc_prime_recv_screen(calc_handle * handle, calc_screenshot_format format, hplibs_buffer_view * out_view) {
     int res;
 
     res = calc_prime_s_recv_screen(handle, format);
     if (res == 0) {
-        res = calc_prime_r_recv_screen(handle, format, out_data, out_size);
+        res = calc_prime_r_recv_screen(handle, format, out_view);
         if (res != 0) {
             hpcalcs_error("%s: r_recv_screen failed", __FUNCTION__);
         }
@@ -98,6 +103,27 @@ static int calc_prime_recv_screen(calc_handle * handle, calc_screenshot_format f
     return res;
 }
 
+static int calc_prime_recv_screen_next(calc_handle * handle, calc_screenshot_format format, int send_next, int * inout_pending, hplibs_buffer_view * out_view) {
+    int res = ERR_SUCCESS;
+
+    if (*inout_pending == 0) {
+        res = calc_prime_s_recv_screen(handle, format);
+        if (res == 0) {
+            *inout_pending = 1;
+        }
+        else {
+            hpcalcs_error("%s: s_recv_screen failed", __FUNCTION__);
+        }
+    }
+    if (res == 0) {
+        res = calc_prime_r_recv_screen_next(handle, format, send_next, inout_pending, out_view);
+        if (res != 0) {
+            hpcalcs_error("%s: r_recv_screen_next failed", __FUNCTION__);
+        }
+    }
+    return res;
+}
+
 static int calc_prime_send_file(calc_handle * handle, files_var_entry * file) {
     int res;
 
@@ -114,6 +140,100 @@ static int calc_prime_send_file(calc_handle * handle, files_var_entry * file) {
     return res;
 }
 
+// Number of files whose packet is built ahead of the one being sent.
+#define SEND_FILES_AHEAD (2)
+
+typedef struct {
+    files_var_entry * file;
+    prime_vtl_pkt * pkt;
+    int res;
+} send_files_job;
+
+static void build_send_files_job(void * arg) {
+    send_files_job * job = (send_files_job *)arg;
+    job->res = calc_prime_build_file_pkt(job->file, &job->pkt);
+}
+
+static int calc_prime_send_files(calc_handle * handle, files_var_entry ** files, uint32_t count, int * out_results) {
+    int res = ERR_SUCCESS;
+    send_files_job * jobs = NULL;
+    hplibs_workers * workers = NULL;
+    uint32_t submitted = 0;
+    uint32_t i;
+
+    if (out_results != NULL) {
+        for (i = 0; i < count; i++) {
+            out_results[i] = ERR_CALC_SKIPPED;
+        }
+    }
+    if (count > 0) {
+        jobs = (send_files_job *)(hpcalcs_alloc_funcs.malloc)(count * sizeof(*jobs));
+        if (jobs != NULL) {
+            for (i = 0; i < count; i++) {
+                jobs[i].file = files[i];
+                jobs[i].pkt = NULL;
+                jobs[i].res = ERR_SUCCESS;
+            }
+            // Packets built by another thread come from the base allocators, which a calculator handle allocator or arena rules out.
+            if (count > 1 && hplibs_alloc_scope_is_default()) {
+                workers = hplibs_workers_new(1, build_send_files_job);
+            }
+        }
+        else {
+            res = ERR_MALLOC;
+            hpcalcs_error("%s: couldn't allocate jobs", __FUNCTION__);
+        }
+    }
+
+    for (i = 0; res == ERR_SUCCESS && i < count; i++) {
+        send_files_job * job = &jobs[i];
+        // Keep the packets of the next files being built while this one goes over the wire.
+        while (workers != NULL && submitted < count && submitted <= i + SEND_FILES_AHEAD) {
+            if (hplibs_workers_submit(workers, &jobs[submitted]) != 0) {
+                break;
+            }
+            submitted++;
+        }
+        if (i < submitted) {
+            hplibs_workers_take(workers, 1);
+        }
+        else {
+            build_send_files_job(job);
+        }
+        res = job->res;
+        if (res == ERR_SUCCESS) {
+            res = calc_prime_s_send_file_pkt(handle, job->pkt);
+            if (res == ERR_SUCCESS) {
+                // The acknowledgement doesn't name the file it is for, so the next file isn't written before it arrives.
+                res = calc_prime_r_send_file(handle);
+                if (res != ERR_SUCCESS) {
+                    hpcalcs_error("%s: r_send_file failed for file %" PRIu32, __FUNCTION__, i);
+                }
+            }
+            else {
+                hpcalcs_error("%s: s_send_file_pkt failed for file %" PRIu32, __FUNCTION__, i);
+            }
+        }
+        prime_vtl_pkt_del(job->pkt);
+        job->pkt = NULL;
+        if (out_results != NULL) {
+            out_results[i] = res;
+        }
+    }
+
+    // After a failure, the packets built ahead are dropped.
+    while (hplibs_workers_take(workers, 1) != NULL) {
+    }
+    hplibs_workers_del(workers);
+    if (jobs != NULL) {
+        for (i = 0; i < count; i++) {
+            prime_vtl_pkt_del(jobs[i].pkt);
+        }
+        (hpcalcs_alloc_funcs.free)(jobs);
+    }
+    return res;
+}
+
 static int calc_prime_recv_file(calc_handle * handle, files_var_entry * request, files_var_entry ** out_file) {
     int res;
 
@@ -130,7 +250,122 @@ static int calc_prime_recv_file(calc_handle * handle, files_var_entry * request,
     return res;
 }
 
-static int calc_prime_recv_backup(calc_handle * handle, files_var_entry *** out_vars) {
+static int calc_prime_recv_file_view(calc_handle * handle, files_var_entry * request, files_var_entry ** out_file, hplibs_buffer_view * out_view) {
+    int res;
+
+    res = calc_prime_s_recv_file(handle, request);
+    if (res == 0) {
+        res = calc_prime_r_recv_file_view(handle, out_file, out_view);
+        if (res != 0) {
+            hpcalcs_error("%s: r_recv_file_view failed", __FUNCTION__);
+        }
+    }
+    else {
+        hpcalcs_error("%s: s_recv_file failed", __FUNCTION__);
+    }
+    return res;
+}
+
+// States of the requests of calc_prime_recv_files.
+#define RECV_FILES_REQUESTED (1)
+#define RECV_FILES_DONE (2)
+
+static int recv_files_reply_is_for(files_var_entry * entry, files_var_entry * request) {
+    return entry != NULL && char16_strcmp(entry->name, request->name) == 0;
+}
+
+// While pipelining, request N + 1 is sent before the reply to request N is read.
+// If the calculator turns out not to cope with that (the reply to N goes missing, or the reply to N + 1 comes first), the remaining requests are made one at a time.
+static int calc_prime_recv_files(calc_handle * handle, files_var_entry ** requests, uint32_t count, files_ve_vector * out_vars, int * out_results) {
+    int res = ERR_SUCCESS;
+    uint8_t * states = NULL;
+    int pipelined = 1;
+    uint32_t i;
+
+    if (out_results != NULL) {
+        for (i = 0; i < count; i++) {
+            out_results[i] = ERR_CALC_SKIPPED;
+        }
+    }
+    if (count > 0) {
+        states = (uint8_t *)(hpcalcs_alloc_funcs.calloc)(count, sizeof(*states));
+        if (states == NULL) {
+            res = ERR_MALLOC;
+            hpcalcs_error("%s: couldn't allocate states", __FUNCTION__);
+        }
+    }
+
+    for (i = 0; res == ERR_SUCCESS && i < count; i++) {
+        files_var_entry * entry = NULL;
+        uint32_t reply_index = i;
+
+        if (states[i] & RECV_FILES_DONE) {
+            continue;
+        }
+        if (!(states[i] & RECV_FILES_REQUESTED)) {
+            res = calc_prime_s_recv_file(handle, requests[i]);
+            if (res != ERR_SUCCESS) {
+                hpcalcs_error("%s: s_recv_file failed for request %" PRIu32, __FUNCTION__, i);
+                break;
+            }
+            states[i] |= RECV_FILES_REQUESTED;
+        }
+        if (pipelined && i + 1 < count && !(states[i + 1] & RECV_FILES_REQUESTED)) {
+            res = calc_prime_s_recv_file(handle, requests[i + 1]);
+            if (res != ERR_SUCCESS) {
+                hpcalcs_error("%s: s_recv_file failed for request %" PRIu32, __FUNCTION__, i + 1);
+                break;
+            }
+            states[i + 1] |= RECV_FILES_REQUESTED;
+        }
+
+        res = calc_prime_r_recv_file(handle, &entry);
+        if (res != ERR_SUCCESS) {
+            if (pipelined && i + 1 < count) {
+                hpcalcs_info("%s: no reply to request %" PRIu32 " while pipelining, making requests one at a time", __FUNCTION__, i);
+                pipelined = 0;
+                states[i] &= (uint8_t)~RECV_FILES_REQUESTED;
+                res = ERR_SUCCESS;
+                i--; // Ask again.
+            }
+            else {
+                hpcalcs_error("%s: r_recv_file failed for request %" PRIu32, __FUNCTION__, i);
+                if (out_results != NULL) {
+                    out_results[i] = res;
+                }
+            }
+            continue;
+        }
+
+        // A reply to the next request, which was sent ahead, may come instead of the reply to this one.
+        if (   i + 1 < count
+            && (states[i + 1] & RECV_FILES_REQUESTED) && !(states[i + 1] & RECV_FILES_DONE)
+            && !recv_files_reply_is_for(entry, requests[i])
+            && recv_files_reply_is_for(entry, requests[i + 1])
+           ) {
+            reply_index = i + 1;
+            if (pipelined) {
+                hpcalcs_info("%s: reply to request %" PRIu32 " came first, making requests one at a time", __FUNCTION__, reply_index);
+                pipelined = 0;
+                states[i] &= (uint8_t)~RECV_FILES_REQUESTED;
+            }
+            i--; // Ask again, or keep waiting for the reply to this request.
+        }
+
+        states[reply_index] |= RECV_FILES_DONE;
+        if (entry != NULL) {
+            res = hpcalcs_deliver_entry(handle, entry, out_vars);
+        }
+        if (out_results != NULL) {
+            out_results[reply_index] = res;
+        }
+    }
+
+    (hpcalcs_alloc_funcs.free)(states);
+    return res;
+}
+
+static int calc_prime_recv_backup(calc_handle * handle, files_ve_vector * out_vars) {
     int res;
 
     res = calc_prime_s_recv_backup(handle);
@@ -194,16 +429,26 @@ static int calc_prime_send_chat(calc_handle * handle, const uint16_t * data, uin
     return res;
 }
 
-static int calc_prime_recv_chat(calc_handle * handle, uint16_t ** out_data, uint32_t * out_size) {
+static int calc_prime_recv_chat(calc_handle * handle, hplibs_buffer_view * out_view) {
     int res;
 
-    res = calc_prime_r_recv_chat(handle, out_data, out_size);
+    res = calc_prime_r_recv_chat(handle, out_view);
     if (res != 0) {
         hpcalcs_error("%s: r_recv_chat failed", __FUNCTION__);
     }
     return res;
 }
 
+static int calc_prime_poll_events(calc_handle * handle, int timeout) {
+    int res;
+
+    res = calc_prime_r_poll_events(handle, timeout);
+    if (res != 0) {
+        hpcalcs_error("%s: r_poll_events failed", __FUNCTION__);
+    }
+    return res;
+}
+
 const calc_fncts calc_prime_fncts =
 {
     CALC_PRIME,
@@ -211,7 +456,8 @@ const calc_fncts calc_prime_fncts =
     "HP Prime Graphing Calculator",
       CALC_OPS_CHECK_READY | CALC_OPS_GET_INFOS | CALC_OPS_SET_DATE_TIME | CALC_OPS_RECV_SCREEN
     | CALC_OPS_SEND_FILE | CALC_OPS_RECV_FILE | CALC_OPS_RECV_BACKUP | CALC_OPS_SEND_KEY
-    | CALC_OPS_SEND_KEYS | CALC_OPS_SEND_CHAT | CALC_OPS_RECV_CHAT,
+    | CALC_OPS_SEND_KEYS | CALC_OPS_SEND_CHAT | CALC_OPS_RECV_CHAT | CALC_OPS_POLL_EVENTS
+    | CALC_OPS_SEND_FILES | CALC_OPS_RECV_FILES | CALC_OPS_RECV_SCREEN_NEXT,
     &calc_prime_check_ready,
     &calc_prime_get_infos,
     &calc_prime_set_date_time,
@@ -222,5 +468,10 @@ const calc_fncts calc_prime_fncts =
     &calc_prime_send_key,
     &calc_prime_send_keys,
     &calc_prime_send_chat,
-    &calc_prime_recv_chat
+    &calc_prime_recv_chat,
+    &calc_prime_poll_events,
+    &calc_prime_send_files,
+    &calc_prime_recv_files,
+    &calc_prime_recv_screen_next,
+    &calc_prime_recv_file_view
 };
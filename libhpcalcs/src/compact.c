@@ -0,0 +1,327 @@
+/*
+ * libhpcalcs: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+/**
+ * \file compact.c Files: compact variable entries, whose names are interned in a shared string pool.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <inttypes.h>
+#include <string.h>
+
+#include <hpfiles.h>
+#include "internal.h"
+#include "logging.h"
+#include "error.h"
+#include "utils.h"
+
+//! Number of characters in a string pool block; longer names get a block of their own.
+#define STRING_POOL_BLOCK_CHARS (8192)
+//! Initial number of slots of the hash table of a string pool; always a power of 2.
+#define STRING_POOL_INITIAL_SLOTS (256)
+
+typedef struct _string_pool_block string_pool_block;
+struct _string_pool_block {
+    string_pool_block * next;
+    uint32_t used;
+    uint32_t capacity;
+    char16_t chars[];
+};
+
+typedef struct {
+    const char16_t * str;
+    uint32_t length;
+    uint32_t hash;
+} string_pool_slot;
+
+struct _files_string_pool {
+    string_pool_block * blocks;
+    string_pool_slot * slots;
+    uint32_t slots_count;
+    uint32_t count;
+};
+
+struct _files_compact_entry {
+    const char16_t * name; ///< Interned, NUL-terminated.
+    uint8_t * data;
+    uint32_t size;
+    uint16_t name_length;
+    uint8_t type;
+    uint8_t model;
+    uint8_t invalid;
+};
+
+// FNV-1a over the UTF-16LE code units.
+static uint32_t string_hash(const char16_t * str, uint32_t length) {
+    uint32_t hash = UINT32_C(2166136261);
+    uint32_t i;
+    for (i = 0; i < length; i++) {
+        hash ^= (uint32_t)(str[i] & 0xFF);
+        hash *= UINT32_C(16777619);
+        hash ^= (uint32_t)(str[i] >> 8);
+        hash *= UINT32_C(16777619);
+    }
+    return hash;
+}
+
+static string_pool_slot * string_pool_find_slot(string_pool_slot * slots, uint32_t slots_count, const char16_t * str, uint32_t length, uint32_t hash) {
+    uint32_t mask = slots_count - 1;
+    uint32_t i = hash & mask;
+    // Linear probing; the table is never more than half full, so that an empty slot is always found.
+    while (   slots[i].str != NULL
+           && (slots[i].hash != hash || slots[i].length != length || memcmp(slots[i].str, str, length * sizeof(char16_t)) != 0)) {
+        i = (i + 1) & mask;
+    }
+    return &slots[i];
+}
+
+static int string_pool_grow(files_string_pool * pool) {
+    int res;
+    uint32_t new_count = pool->slots_count * 2;
+    string_pool_slot * new_slots = (hpfiles_alloc_funcs.calloc)(new_count, sizeof(*new_slots));
+    if (new_slots != NULL) {
+        uint32_t i;
+        for (i = 0; i < pool->slots_count; i++) {
+            if (pool->slots[i].str != NULL) {
+                *string_pool_find_slot(new_slots, new_count, pool->slots[i].str, pool->slots[i].length, pool->slots[i].hash) = pool->slots[i];
+            }
+        }
+        (hpfiles_alloc_funcs.free)(pool->slots);
+        pool->slots = new_slots;
+        pool->slots_count = new_count;
+        res = ERR_SUCCESS;
+    }
+    else {
+        res = ERR_MALLOC;
+    }
+    return res;
+}
+
+static char16_t * string_pool_store(files_string_pool * pool, const char16_t * str, uint32_t length) {
+    char16_t * dst = NULL;
+    string_pool_block * block = pool->blocks;
+    uint32_t needed = length + 1;
+
+    if (block == NULL || block->capacity - block->used < needed) {
+        uint32_t capacity = (needed > STRING_POOL_BLOCK_CHARS) ? needed : STRING_POOL_BLOCK_CHARS;
+        block = (hpfiles_alloc_funcs.malloc)(sizeof(*block) + capacity * sizeof(char16_t));
+        if (block != NULL) {
+            block->used = 0;
+            block->capacity = capacity;
+            if (needed > STRING_POOL_BLOCK_CHARS && pool->blocks != NULL) {
+                // Keep filling the current block afterwards.
+                block->next = pool->blocks->next;
+                pool->blocks->next = block;
+            }
+            else {
+                block->next = pool->blocks;
+                pool->blocks = block;
+            }
+        }
+    }
+    if (block != NULL) {
+        dst = block->chars + block->used;
+        memcpy(dst, str, length * sizeof(char16_t));
+        dst[length] = 0;
+        block->used += needed;
+    }
+    return dst;
+}
+
+HPEXPORT files_string_pool * HPCALL hpfiles_string_pool_new(void) {
+    files_string_pool * pool = (hpfiles_alloc_funcs.calloc)(1, sizeof(*pool));
+    if (pool != NULL) {
+        pool->slots = (hpfiles_alloc_funcs.calloc)(STRING_POOL_INITIAL_SLOTS, sizeof(*pool->slots));
+        if (pool->slots != NULL) {
+            pool->slots_count = STRING_POOL_INITIAL_SLOTS;
+        }
+        else {
+            (hpfiles_alloc_funcs.free)(pool);
+            pool = NULL;
+        }
+    }
+    if (pool == NULL) {
+        hpfiles_error("%s: couldn't allocate string pool", __FUNCTION__);
+    }
+    return pool;
+}
+
+HPEXPORT void HPCALL hpfiles_string_pool_del(files_string_pool * pool) {
+    if (pool != NULL) {
+        string_pool_block * block = pool->blocks;
+        while (block != NULL) {
+            string_pool_block * next = block->next;
+            (hpfiles_alloc_funcs.free)(block);
+            block = next;
+        }
+        (hpfiles_alloc_funcs.free)(pool->slots);
+        (hpfiles_alloc_funcs.free)(pool);
+    }
+    else {
+        hpfiles_error("%s: pool is NULL", __FUNCTION__);
+    }
+}
+
+HPEXPORT const char16_t * HPCALL hpfiles_string_pool_intern(files_string_pool * pool, const char16_t * str, uint32_t length) {
+    const char16_t * interned = NULL;
+    if (pool != NULL && str != NULL) {
+        uint32_t hash = string_hash(str, length);
+        string_pool_slot * slot = string_pool_find_slot(pool->slots, pool->slots_count, str, length, hash);
+        if (slot->str != NULL) {
+            interned = slot->str;
+        }
+        else if ((pool->count + 1) * 2 <= pool->slots_count || string_pool_grow(pool) == ERR_SUCCESS) {
+            interned = string_pool_store(pool, str, length);
+            if (interned != NULL) {
+                slot = string_pool_find_slot(pool->slots, pool->slots_count, str, length, hash);
+                slot->str = interned;
+                slot->length = length;
+                slot->hash = hash;
+                pool->count++;
+            }
+        }
+        if (interned == NULL) {
+            hpfiles_error("%s: couldn't intern string", __FUNCTION__);
+        }
+    }
+    else {
+        hpfiles_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return interned;
+}
+
+HPEXPORT uint32_t HPCALL hpfiles_string_pool_get_count(files_string_pool * pool) {
+    uint32_t count = 0;
+    if (pool != NULL) {
+        count = pool->count;
+    }
+    else {
+        hpfiles_error("%s: pool is NULL", __FUNCTION__);
+    }
+    return count;
+}
+
+
+HPEXPORT files_compact_entry * HPCALL hpfiles_ce_create(files_string_pool * pool, const char16_t * name, uint8_t type, uint8_t * data, uint32_t size) {
+    files_compact_entry * ce = NULL;
+    if (pool != NULL && name != NULL) {
+        uint32_t length = 0;
+        while (length < FILES_VARNAME_MAXLEN && name[length] != 0) {
+            length++;
+        }
+        ce = (hpfiles_alloc_funcs.calloc)(1, sizeof(*ce));
+        if (ce != NULL) {
+            ce->name = hpfiles_string_pool_intern(pool, name, length);
+            if (ce->name != NULL) {
+                ce->name_length = (uint16_t)length;
+                ce->type = type;
+                ce->data = data;
+                ce->size = size;
+            }
+            else {
+                (hpfiles_alloc_funcs.free)(ce);
+                ce = NULL;
+            }
+        }
+        if (ce == NULL) {
+            hpfiles_error("%s: failed to create entry", __FUNCTION__);
+        }
+    }
+    else {
+        hpfiles_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return ce;
+}
+
+HPEXPORT files_compact_entry * HPCALL hpfiles_ce_create_from_ve(files_string_pool * pool, files_var_entry * ve) {
+    files_compact_entry * ce = NULL;
+    if (pool != NULL && ve != NULL) {
+        ce = hpfiles_ce_create(pool, ve->name, ve->type, ve->data, ve->size);
+        if (ce != NULL) {
+            ce->model = ve->model;
+            ce->invalid = ve->invalid;
+            // The data now belongs to the compact entry.
+            ve->data = NULL;
+            ve->size = 0;
+        }
+    }
+    else {
+        hpfiles_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return ce;
+}
+
+HPEXPORT files_var_entry * HPCALL hpfiles_ce_to_ve(files_compact_entry * ce) {
+    files_var_entry * ve = NULL;
+    if (ce != NULL) {
+        ve = (ce->data != NULL) ? hpfiles_ve_create_with_data(ce->data, ce->size) : hpfiles_ve_create();
+        if (ve != NULL) {
+            memcpy(ve->name, ce->name, ce->name_length * sizeof(char16_t));
+            ve->type = ce->type;
+            ve->model = ce->model;
+            ve->invalid = ce->invalid;
+        }
+    }
+    else {
+        hpfiles_error("%s: ce is NULL", __FUNCTION__);
+    }
+    return ve;
+}
+
+HPEXPORT void HPCALL hpfiles_ce_delete(files_compact_entry * ce) {
+    if (ce != NULL) {
+        (hpfiles_alloc_funcs.free)(ce->data);
+        (hpfiles_alloc_funcs.free)(ce);
+    }
+    else {
+        hpfiles_error("%s: ce is NULL", __FUNCTION__);
+    }
+}
+
+HPEXPORT const char16_t * HPCALL hpfiles_ce_get_name(files_compact_entry * ce) {
+    return (ce != NULL) ? ce->name : NULL;
+}
+
+HPEXPORT uint32_t HPCALL hpfiles_ce_get_name_length(files_compact_entry * ce) {
+    return (ce != NULL) ? ce->name_length : 0;
+}
+
+HPEXPORT uint8_t HPCALL hpfiles_ce_get_type(files_compact_entry * ce) {
+    return (ce != NULL) ? ce->type : 0;
+}
+
+HPEXPORT uint8_t HPCALL hpfiles_ce_get_model(files_compact_entry * ce) {
+    return (ce != NULL) ? ce->model : 0;
+}
+
+HPEXPORT int HPCALL hpfiles_ce_is_invalid(files_compact_entry * ce) {
+    return (ce != NULL) ? ce->invalid : 0;
+}
+
+HPEXPORT uint32_t HPCALL hpfiles_ce_get_size(files_compact_entry * ce) {
+    return (ce != NULL) ? ce->size : 0;
+}
+
+HPEXPORT const uint8_t * HPCALL hpfiles_ce_get_data(files_compact_entry * ce) {
+    return (ce != NULL) ? ce->data : NULL;
+}
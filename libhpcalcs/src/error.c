@@ -95,6 +95,12 @@ HPEXPORT int HPCALL hpcables_error_get(int number, char **message) {
                 case ERR_CABLE_PROBE_FAILED:
                     *message = strdup(_("Cable probing failed"));
                     break;
+                case ERR_CABLE_UNPLUGGED:
+                    *message = strdup(_("Device was unplugged"));
+                    break;
+                case ERR_CABLE_HOTPLUG:
+                    *message = strdup(_("Hotplug monitoring failed or is unsupported"));
+                    break;
                 default:
                     *message = strdup(_("<Unknown error code>"));
                     break;
@@ -139,6 +145,18 @@ HPEXPORT int HPCALL hpcalcs_error_get(int number, char **message) {
                 case ERR_CALC_PROBE_FAILED:
                     *message = strdup(_("Calc probing failed"));
                     break;
+                case ERR_CALC_OPERATION_TIMEOUT:
+                    *message = strdup(_("Operation timed out"));
+                    break;
+                case ERR_CALC_SKIPPED:
+                    *message = strdup(_("Skipped because of an earlier error"));
+                    break;
+                case ERR_CALC_NO_THREADS:
+                    *message = strdup(_("Couldn't start threads"));
+                    break;
+                case ERR_CALC_NO_FRAME:
+                    *message = strdup(_("No screenshot kept for that time"));
+                    break;
                 default:
                     *message = strdup(_("<Unknown error code>"));
                     break;
@@ -162,6 +180,18 @@ HPEXPORT int HPCALL hpopers_error_get(int number, char **message) {
     if (message != NULL) {
         if (number >= ERR_OPER_FIRST && number <= ERR_OPER_LAST) {
             switch (number) {
+                case ERR_OPER_IO:
+                    *message = strdup(_("Error reading or writing files on the computer"));
+                    break;
+                case ERR_OPER_IMAGE:
+                    *message = strdup(_("Invalid or unsupported screenshot image"));
+                    break;
+                case ERR_OPER_SCRIPT:
+                    *message = strdup(_("Syntax error in script"));
+                    break;
+                case ERR_OPER_MISMATCH:
+                    *message = strdup(_("Screen differs from the expected image"));
+                    break;
                 default:
                     *message = strdup(_("<Unknown error code>"));
                     break;
@@ -52,6 +52,8 @@ typedef enum {
     ERR_CABLE_READ_ERROR,
     ERR_CABLE_INVALID_FNCTS,
     ERR_CABLE_PROBE_FAILED,
+    ERR_CABLE_UNPLUGGED,
+    ERR_CABLE_HOTPLUG,
     ERR_CABLE_LAST = 383,
 
     ERR_CALC_FIRST = 384,
@@ -62,9 +64,17 @@ typedef enum {
     ERR_CALC_PACKET_FORMAT,
     ERR_CALC_SPLIT_TIMESTAMP,
     ERR_CALC_PROBE_FAILED,
+    ERR_CALC_OPERATION_TIMEOUT,
+    ERR_CALC_SKIPPED,
+    ERR_CALC_NO_THREADS,
+    ERR_CALC_NO_FRAME,
     ERR_CALC_LAST = 511,
 
     ERR_OPER_FIRST = 512,
+    ERR_OPER_IO = 512,
+    ERR_OPER_IMAGE,
+    ERR_OPER_SCRIPT,
+    ERR_OPER_MISMATCH,
     ERR_OPER_LAST = 639
 } hplibs_error;
 
@@ -0,0 +1,245 @@
+/*
+ * libhpcalcs: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * \file events.c Calcs: demultiplexing of the messages sent by the calculator into per-type queues.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <hpcalcs.h>
+#include "internal.h"
+#include "logging.h"
+#include "error.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+HPEXPORT int HPCALL hpcalcs_events_set_callback(calc_handle * handle, calc_event_callback callback, void * user_data) {
+    int res;
+    if (handle != NULL) {
+        handle->event_callback = callback;
+        handle->event_user_data = user_data;
+        res = ERR_SUCCESS;
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+// Set on the threads which receive packets for a handle without running its operations, e.g. the capture thread of a screen stream.
+static HPLIBS_THREAD_LOCAL calc_event_list * held_events;
+
+// Hands an event to the callback, or else queues it.
+static void deliver_event(calc_handle * handle, calc_event * event) {
+    calc_event_type type = event->type;
+    if (handle->event_callback != NULL && (*handle->event_callback)(handle, event, handle->event_user_data)) {
+        hpcalcs_debug("%s: event %d (cmd %02X) handled by callback", __FUNCTION__, type, event->cmd);
+        hpcalcs_event_del(event);
+    }
+    else {
+        // Nobody reads the status reports during e.g. screenshots: bound the queues.
+        if (handle->events_count[type] >= CALC_EVENTS_MAX_QUEUED) {
+            calc_event * oldest = handle->events_head[type];
+            handle->events_head[type] = oldest->next;
+            handle->events_count[type]--;
+            hpcalcs_warning("%s: queue %d full, dropping oldest event (cmd %02X)", __FUNCTION__, type, oldest->cmd);
+            hpcalcs_event_del(oldest);
+        }
+        if (handle->events_head[type] == NULL) {
+            handle->events_head[type] = event;
+        }
+        else {
+            handle->events_tail[type]->next = event;
+        }
+        handle->events_tail[type] = event;
+        handle->events_count[type]++;
+        hpcalcs_info("%s: queued event %d (cmd %02X, %" PRIu32 " bytes)", __FUNCTION__, type, event->cmd, event->size);
+    }
+}
+
+void hpcalcs_events_hold(calc_event_list * list) {
+    held_events = list;
+}
+
+void hpcalcs_events_release(calc_handle * handle, calc_event_list * list) {
+    calc_event * event = list->head;
+    while (event != NULL) {
+        calc_event * next = event->next;
+        event->next = NULL;
+        deliver_event(handle, event);
+        event = next;
+    }
+    list->head = NULL;
+    list->tail = NULL;
+    list->count = 0;
+}
+
+int hpcalcs_events_push_copy(calc_handle * handle, calc_event_type type, uint8_t cmd, const uint8_t * data, uint32_t size) {
+    int res;
+    if (handle != NULL && type < CALC_EVENT_LAST && (data != NULL || size == 0)) {
+        // Events outlive the operation which received them, and may be freed outside of any allocation scope:
+        // they can't come from the handle's allocator or arena.
+        calc_event * event = (calc_event *)(hpcalcs_base_alloc_funcs.malloc)(sizeof(*event) + size);
+        if (event != NULL) {
+            event->type = type;
+            event->cmd = cmd;
+            event->size = size;
+            event->data = (uint8_t *)(event + 1);
+            event->next = NULL;
+            if (size != 0) {
+                memcpy(event->data, data, size);
+            }
+            res = ERR_SUCCESS;
+
+            if (held_events != NULL) {
+                // Held events are only released when e.g. the screen stream stops: bound the list like the queues.
+                if (held_events->count >= CALC_EVENTS_MAX_QUEUED) {
+                    calc_event * oldest = held_events->head;
+                    held_events->head = oldest->next;
+                    if (held_events->head == NULL) {
+                        held_events->tail = NULL;
+                    }
+                    held_events->count--;
+                    hpcalcs_warning("%s: too many held events, dropping oldest event (cmd %02X)", __FUNCTION__, oldest->cmd);
+                    hpcalcs_event_del(oldest);
+                }
+                if (held_events->head == NULL) {
+                    held_events->head = event;
+                }
+                else {
+                    held_events->tail->next = event;
+                }
+                held_events->tail = event;
+                held_events->count++;
+                hpcalcs_debug("%s: holding event %d (cmd %02X)", __FUNCTION__, type, cmd);
+            }
+            else {
+                deliver_event(handle, event);
+            }
+        }
+        else {
+            res = ERR_MALLOC;
+            hpcalcs_error("%s: couldn't create event", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcalcs_error("%s: invalid argument", __FUNCTION__);
+    }
+    return res;
+}
+
+void hpcalcs_events_take(calc_handle * handle, calc_event_type type, uint8_t cmd, calc_event ** out_event) {
+    *out_event = NULL;
+    if (held_events == NULL) {
+        hpcalcs_events_pop(handle, type, cmd, out_event);
+    }
+}
+
+void hpcalcs_events_discard_replies(calc_handle * handle, uint8_t cmd) {
+    if (held_events == NULL && cmd != 0) {
+        for (;;) {
+            calc_event * event;
+            hpcalcs_events_pop(handle, CALC_EVENT_REPLY, cmd, &event);
+            if (event == NULL) {
+                break;
+            }
+            hpcalcs_info("%s: discarding stale reply (cmd %02X, %" PRIu32 " bytes)", __FUNCTION__, cmd, event->size);
+            hpcalcs_event_del(event);
+        }
+    }
+}
+
+HPEXPORT int HPCALL hpcalcs_events_push(calc_handle * handle, calc_event_type type, uint8_t cmd, uint8_t * data, uint32_t size) {
+    int res = hpcalcs_events_push_copy(handle, type, cmd, data, size);
+    (hpcalcs_alloc_funcs.free)(data);
+    return res;
+}
+
+HPEXPORT int HPCALL hpcalcs_events_pop(calc_handle * handle, calc_event_type type, uint8_t cmd, calc_event ** out_event) {
+    int res;
+    if (handle != NULL && type < CALC_EVENT_LAST && out_event != NULL) {
+        calc_event * prev = NULL;
+        calc_event * event = handle->events_head[type];
+        while (event != NULL && cmd != 0 && event->cmd != cmd) {
+            prev = event;
+            event = event->next;
+        }
+        if (event != NULL) {
+            if (prev == NULL) {
+                handle->events_head[type] = event->next;
+            }
+            else {
+                prev->next = event->next;
+            }
+            if (handle->events_tail[type] == event) {
+                handle->events_tail[type] = prev;
+            }
+            handle->events_count[type]--;
+            event->next = NULL;
+        }
+        *out_event = event;
+        res = ERR_SUCCESS;
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcalcs_error("%s: invalid argument", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcalcs_events_clear(calc_handle * handle) {
+    int res;
+    if (handle != NULL) {
+        calc_event_type type;
+        for (type = CALC_EVENT_REPLY; type < CALC_EVENT_LAST; type++) {
+            calc_event * event = handle->events_head[type];
+            while (event != NULL) {
+                calc_event * next = event->next;
+                hpcalcs_event_del(event);
+                event = next;
+            }
+            handle->events_head[type] = NULL;
+            handle->events_tail[type] = NULL;
+            handle->events_count[type] = 0;
+        }
+        res = ERR_SUCCESS;
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT void HPCALL hpcalcs_event_del(calc_event * event) {
+    if (event != NULL) {
+        // The message lives in the same block.
+        (hpcalcs_base_alloc_funcs.free)(event);
+    }
+    else {
+        hpcalcs_error("%s: event is NULL", __FUNCTION__);
+    }
+}
@@ -0,0 +1,366 @@
+/*
+ * libhpcalcs: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+/**
+ * \file hotplug.c Cables: hotplug monitoring of the Prime HID devices, and invalidation of the handles of unplugged devices.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <hpcables.h>
+#include "internal.h"
+#include "logging.h"
+#include "error.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_LIBUDEV
+
+#include <libudev.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+
+//! A Prime seen by the monitor; the identity of a device can no longer be read from sysfs once it is gone.
+typedef struct _hotplug_device hotplug_device;
+struct _hotplug_device {
+    char * path;
+    char * serial;
+    uint16_t pid;
+    hotplug_device * next;
+};
+
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static cable_handle ** registry;
+static uint32_t registry_count;
+static uint32_t registry_size;
+
+static pthread_mutex_t monitor_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int monitor_running;
+static pthread_t monitor_thread;
+static int monitor_stop_pipe[2];
+static struct udev * monitor_udev;
+static struct udev_monitor * monitor;
+static hotplug_device * monitor_devices;
+static cable_hotplug_callback monitor_callback;
+static void * monitor_user_data;
+
+static char * copy_string(const char * str) {
+    char * copy = NULL;
+    if (str != NULL) {
+        size_t len = strlen(str) + 1;
+        copy = (char *)(hpcables_alloc_funcs.malloc)(len);
+        if (copy != NULL) {
+            memcpy(copy, str, len);
+        }
+    }
+    return copy;
+}
+
+void hpcables_hotplug_register(cable_handle * handle) {
+    pthread_mutex_lock(&registry_mutex);
+    if (registry_count == registry_size) {
+        uint32_t new_size = registry_size ? registry_size * 2 : 4;
+        cable_handle ** new_registry = (cable_handle **)(hpcables_alloc_funcs.realloc)(registry, new_size * sizeof(*registry));
+        if (new_registry != NULL) {
+            registry = new_registry;
+            registry_size = new_size;
+        }
+    }
+    if (registry_count < registry_size) {
+        registry[registry_count++] = handle;
+    }
+    else {
+        hpcables_error("%s: couldn't register handle, it won't be invalidated when unplugged", __FUNCTION__);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+void hpcables_hotplug_unregister(cable_handle * handle) {
+    uint32_t i;
+    pthread_mutex_lock(&registry_mutex);
+    for (i = 0; i < registry_count; i++) {
+        if (registry[i] == handle) {
+            registry[i] = registry[--registry_count];
+            break;
+        }
+    }
+    if (registry_count == 0) {
+        (hpcables_alloc_funcs.free)(registry);
+        registry = NULL;
+        registry_size = 0;
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+static void invalidate_handles(const char * path) {
+    uint32_t i;
+    pthread_mutex_lock(&registry_mutex);
+    for (i = 0; i < registry_count; i++) {
+        if (registry[i]->path != NULL && !strcmp(registry[i]->path, path)) {
+            registry[i]->unplugged = 1;
+            hpcables_info("%s: invalidated handle %p for %s", __FUNCTION__, (void *)registry[i], path);
+        }
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+static void notify(cable_hotplug_event_type type, hotplug_device * device) {
+    cable_hotplug_event event;
+
+    event.type = type;
+    event.model = CABLE_PRIME_HID;
+    event.vid = USB_VID_HP;
+    event.pid = device->pid;
+    event.path = device->path;
+    event.serial = device->serial;
+    hpcables_info("%s: %s %s (PID %04X)", __FUNCTION__, (type == CABLE_HOTPLUG_ATTACHED) ? "attached" : "detached", device->path, device->pid);
+    if (monitor_callback != NULL) {
+        (*monitor_callback)(&event, monitor_user_data);
+    }
+}
+
+static void device_del(hotplug_device * device) {
+    (hpcables_alloc_funcs.free)(device->path);
+    (hpcables_alloc_funcs.free)(device->serial);
+    (hpcables_alloc_funcs.free)(device);
+}
+
+static void device_added(struct udev_device * dev) {
+    const char * devnode = udev_device_get_devnode(dev);
+    struct udev_device * usb = udev_device_get_parent_with_subsystem_devtype(dev, "usb", "usb_device");
+    if (devnode != NULL && usb != NULL) {
+        const char * vid = udev_device_get_sysattr_value(usb, "idVendor");
+        const char * pid = udev_device_get_sysattr_value(usb, "idProduct");
+        if (vid != NULL && pid != NULL && strtoul(vid, NULL, 16) == USB_VID_HP) {
+            unsigned long pid_value = strtoul(pid, NULL, 16);
+            if (pid_value == USB_PID_PRIME1 || pid_value == USB_PID_PRIME2) {
+                hotplug_device * device = (hotplug_device *)(hpcables_alloc_funcs.calloc)(1, sizeof(*device));
+                if (device != NULL) {
+                    device->path = copy_string(devnode);
+                    device->serial = copy_string(udev_device_get_sysattr_value(usb, "serial"));
+                    device->pid = (uint16_t)pid_value;
+                    if (device->path != NULL) {
+                        hpcables_enumeration_invalidate();
+                        device->next = monitor_devices;
+                        monitor_devices = device;
+                        notify(CABLE_HOTPLUG_ATTACHED, device);
+                    }
+                    else {
+                        device_del(device);
+                    }
+                }
+                else {
+                    hpcables_error("%s: couldn't allocate memory", __FUNCTION__);
+                }
+            }
+        }
+    }
+}
+
+static void device_removed(struct udev_device * dev) {
+    const char * devnode = udev_device_get_devnode(dev);
+    if (devnode != NULL) {
+        hotplug_device ** prev = &monitor_devices;
+        hotplug_device * device = monitor_devices;
+        while (device != NULL) {
+            if (!strcmp(device->path, devnode)) {
+                *prev = device->next;
+                hpcables_enumeration_invalidate();
+                invalidate_handles(device->path);
+                notify(CABLE_HOTPLUG_DETACHED, device);
+                device_del(device);
+                break;
+            }
+            prev = &device->next;
+            device = device->next;
+        }
+    }
+}
+
+static void enumerate_present_devices(void) {
+    struct udev_enumerate * enumerate = udev_enumerate_new(monitor_udev);
+    if (enumerate != NULL) {
+        struct udev_list_entry * entry;
+        udev_enumerate_add_match_subsystem(enumerate, "hidraw");
+        udev_enumerate_scan_devices(enumerate);
+        udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(enumerate)) {
+            struct udev_device * dev = udev_device_new_from_syspath(monitor_udev, udev_list_entry_get_name(entry));
+            if (dev != NULL) {
+                device_added(dev);
+                udev_device_unref(dev);
+            }
+        }
+        udev_enumerate_unref(enumerate);
+    }
+}
+
+static void * monitor_thread_main(void * arg) {
+    struct pollfd fds[2];
+    (void)arg;
+
+    fds[0].fd = udev_monitor_get_fd(monitor);
+    fds[0].events = POLLIN;
+    fds[1].fd = monitor_stop_pipe[0];
+    fds[1].events = POLLIN;
+
+    enumerate_present_devices();
+
+    for (;;) {
+        fds[0].revents = 0;
+        fds[1].revents = 0;
+        if (poll(fds, 2, -1) < 0) {
+            continue;
+        }
+        if (fds[1].revents) {
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            struct udev_device * dev = udev_monitor_receive_device(monitor);
+            if (dev != NULL) {
+                const char * action = udev_device_get_action(dev);
+                if (action != NULL) {
+                    if (!strcmp(action, "add")) {
+                        device_added(dev);
+                    }
+                    else if (!strcmp(action, "remove")) {
+                        device_removed(dev);
+                    }
+                }
+                udev_device_unref(dev);
+            }
+        }
+    }
+
+    while (monitor_devices != NULL) {
+        hotplug_device * next = monitor_devices->next;
+        device_del(monitor_devices);
+        monitor_devices = next;
+    }
+    return NULL;
+}
+
+HPEXPORT int HPCALL hpcables_hotplug_start(cable_hotplug_callback callback, void * user_data) {
+    int res;
+    pthread_mutex_lock(&monitor_mutex);
+    if (!monitor_running) {
+        monitor_udev = udev_new();
+        if (monitor_udev != NULL) {
+            monitor = udev_monitor_new_from_netlink(monitor_udev, "udev");
+            if (   monitor != NULL
+                && udev_monitor_filter_add_match_subsystem_devtype(monitor, "hidraw", NULL) >= 0
+                && udev_monitor_enable_receiving(monitor) >= 0
+                && pipe(monitor_stop_pipe) == 0) {
+                monitor_callback = callback;
+                monitor_user_data = user_data;
+                if (pthread_create(&monitor_thread, NULL, monitor_thread_main, NULL) == 0) {
+                    monitor_running = 1;
+                    res = ERR_SUCCESS;
+                    hpcables_info("%s: hotplug monitoring started", __FUNCTION__);
+                }
+                else {
+                    close(monitor_stop_pipe[0]);
+                    close(monitor_stop_pipe[1]);
+                    res = ERR_CABLE_HOTPLUG;
+                    hpcables_error("%s: couldn't create monitor thread", __FUNCTION__);
+                }
+            }
+            else {
+                res = ERR_CABLE_HOTPLUG;
+                hpcables_error("%s: couldn't set up udev monitor", __FUNCTION__);
+            }
+            if (res != ERR_SUCCESS) {
+                if (monitor != NULL) {
+                    udev_monitor_unref(monitor);
+                    monitor = NULL;
+                }
+                udev_unref(monitor_udev);
+                monitor_udev = NULL;
+            }
+        }
+        else {
+            res = ERR_CABLE_HOTPLUG;
+            hpcables_error("%s: couldn't create udev context", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_CABLE_HOTPLUG;
+        hpcables_error("%s: hotplug monitoring already started", __FUNCTION__);
+    }
+    pthread_mutex_unlock(&monitor_mutex);
+    return res;
+}
+
+HPEXPORT int HPCALL hpcables_hotplug_stop(void) {
+    int res;
+    pthread_mutex_lock(&monitor_mutex);
+    if (monitor_running) {
+        const char c = 0;
+        if (write(monitor_stop_pipe[1], &c, 1) != 1) {
+            hpcables_warning("%s: couldn't signal monitor thread", __FUNCTION__);
+        }
+        pthread_join(monitor_thread, NULL);
+        close(monitor_stop_pipe[0]);
+        close(monitor_stop_pipe[1]);
+        udev_monitor_unref(monitor);
+        monitor = NULL;
+        udev_unref(monitor_udev);
+        monitor_udev = NULL;
+        monitor_callback = NULL;
+        monitor_user_data = NULL;
+        monitor_running = 0;
+        res = ERR_SUCCESS;
+        hpcables_info("%s: hotplug monitoring stopped", __FUNCTION__);
+    }
+    else {
+        res = ERR_SUCCESS;
+    }
+    pthread_mutex_unlock(&monitor_mutex);
+    return res;
+}
+
+#else
+
+// No hotplug notification mechanism on this platform: handles are never invalidated.
+
+void hpcables_hotplug_register(cable_handle * handle) {
+    (void)handle;
+}
+
+void hpcables_hotplug_unregister(cable_handle * handle) {
+    (void)handle;
+}
+
+HPEXPORT int HPCALL hpcables_hotplug_start(cable_hotplug_callback callback, void * user_data) {
+    (void)callback;
+    (void)user_data;
+    hpcables_error("%s: hotplug monitoring is not supported by this build", __FUNCTION__);
+    return ERR_CABLE_HOTPLUG;
+}
+
+HPEXPORT int HPCALL hpcables_hotplug_stop(void) {
+    return ERR_SUCCESS;
+}
+
+#endif
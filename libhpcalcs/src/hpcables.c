@@ -29,7 +29,9 @@
 # include <config.h>
 #endif
 
+#include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <hidapi.h>
 
@@ -38,6 +40,7 @@
 #include "logging.h"
 #include "error.h"
 #include "gettext.h"
+#include "utils.h"
 
 
 extern const cable_fncts cable_nul_fncts;
@@ -130,6 +133,8 @@ HPEXPORT int HPCALL hpcables_exit(void) {
     }
     else {
         if (hpcables_instance_count == 1) {
+            hpcables_hotplug_stop();
+            hpcables_enumeration_invalidate();
             hid_exit();
         }
 
@@ -178,6 +183,12 @@ HPEXPORT cable_handle * HPCALL hpcables_handle_new(cable_model model) {
 HPEXPORT int HPCALL hpcables_handle_del(cable_handle * handle) {
     int res;
     if (handle != NULL) {
+        hpcables_hotplug_unregister(handle);
+
+        (hpcables_alloc_funcs.free)(handle->path);
+        handle->path = NULL;
+        (hpcables_alloc_funcs.free)(handle->requested_path);
+        handle->requested_path = NULL;
         (hpcables_alloc_funcs.free)(handle->handle);
         handle->handle = NULL;
 
@@ -201,6 +212,8 @@ HPEXPORT int HPCALL hpcables_handle_display(cable_handle * handle) {
         hpcables_info("\tread_timeout: %d", handle->read_timeout);
         hpcables_info("\topen: %d", handle->open);
         hpcables_info("\tbusy: %d", handle->busy);
+        hpcables_info("\tlatency: %" PRIu32 " ms (%" PRIu32 " samples)", handle->stats.latency, handle->stats.latency_samples);
+        hpcables_info("\tbandwidth: %" PRIu32 " bytes/s (%" PRIu32 " samples)", handle->stats.bandwidth, handle->stats.bandwidth_samples);
         res = ERR_SUCCESS;
     }
     else {
@@ -243,6 +256,13 @@ HPEXPORT cable_model HPCALL hpcables_get_model(cable_handle * handle) {
         break; \
     }
 
+#define DO_PLUGGED_CHECK() \
+    if (handle->unplugged) { \
+        res = ERR_CABLE_UNPLUGGED; \
+        hpcables_error("%s: device was unplugged", __FUNCTION__); \
+        break; \
+    }
+
 HPEXPORT int HPCALL hpcables_options_get_read_timeout(cable_handle * handle) {
     int timeout = 0;
     if (handle != NULL) {
@@ -254,6 +274,19 @@ HPEXPORT int HPCALL hpcables_options_get_read_timeout(cable_handle * handle) {
     return timeout;
 }
 
+HPEXPORT int HPCALL hpcables_get_link_stats(cable_handle * handle, cable_link_stats * out_stats) {
+    int res;
+    if (handle != NULL && out_stats != NULL) {
+        *out_stats = handle->stats;
+        res = ERR_SUCCESS;
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcables_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
 HPEXPORT int HPCALL hpcables_options_set_read_timeout(cable_handle * handle, int read_timeout) {
     int res;
     if (handle != NULL) {
@@ -287,6 +320,35 @@ HPEXPORT int HPCALL hpcables_options_set_read_timeout(cable_handle * handle, int
     return res;
 }
 
+HPEXPORT int HPCALL hpcables_options_set_device_path(cable_handle * handle, const char * path) {
+    int res;
+    if (handle != NULL) {
+        char * copy = NULL;
+        res = ERR_SUCCESS;
+        if (path != NULL) {
+            size_t len = strlen(path) + 1;
+            copy = (char *)(hpcables_alloc_funcs.malloc)(len);
+            if (copy != NULL) {
+                memcpy(copy, path, len);
+            }
+            else {
+                res = ERR_MALLOC;
+                hpcables_error("%s: couldn't copy path", __FUNCTION__);
+            }
+        }
+        if (res == ERR_SUCCESS) {
+            (hpcables_alloc_funcs.free)(handle->requested_path);
+            handle->requested_path = copy;
+            hpcables_info("%s: device path set to %s", __FUNCTION__, path != NULL ? path : "(first found)");
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcables_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
 HPEXPORT int HPCALL hpcables_cable_probe(cable_handle * handle) {
     int res;
     if (handle != NULL) {
@@ -339,7 +401,10 @@ HPEXPORT int HPCALL hpcables_cable_open(cable_handle * handle) {
                 handle->busy = 1;
                 res = (*open)(handle);
                 if (res == ERR_SUCCESS) {
+                    memset(&handle->stats, 0, sizeof(handle->stats));
+                    handle->unplugged = 0;
                     handle->open = 1;
+                    hpcables_hotplug_register(handle);
                     hpcables_info("%s: open succeeded", __FUNCTION__);
                 }
                 else {
@@ -370,6 +435,7 @@ HPEXPORT int HPCALL hpcables_cable_close(cable_handle * handle) {
 
             close = handle->fncts->close;
             if (close != NULL) {
+                hpcables_hotplug_unregister(handle);
                 handle->busy = 1;
                 res = (*close)(handle);
                 if (res == ERR_SUCCESS) {
@@ -394,6 +460,50 @@ HPEXPORT int HPCALL hpcables_cable_close(cable_handle * handle) {
     return res;
 }
 
+// Weight of the previous estimate in the smoothed link statistics, out of 4.
+#define LINK_STATS_HISTORY_WEIGHT (3)
+// Minimum duration of a throughput sample, for the sake of the clock's granularity.
+#define LINK_STATS_MIN_BURST_MS (50)
+// Gap between reads beyond which the sender is assumed to have paused, rather than being limited by the link.
+#define LINK_STATS_MAX_GAP_MS (100)
+
+static uint32_t link_stats_smooth(uint32_t estimate, uint32_t samples, uint32_t sample) {
+    return (samples != 0) ? (uint32_t)(((uint64_t)estimate * LINK_STATS_HISTORY_WEIGHT + sample) / (LINK_STATS_HISTORY_WEIGHT + 1)) : sample;
+}
+
+static void link_stats_sent(cable_handle * handle) {
+    handle->stats.last_send_time = get_monotonic_time_ms();
+    handle->stats.awaiting_reply = 1;
+}
+
+static void link_stats_received(cable_handle * handle, uint32_t len) {
+    cable_link_stats * stats = &handle->stats;
+    uint64_t now = get_monotonic_time_ms();
+
+    if (stats->awaiting_reply) {
+        stats->latency = link_stats_smooth(stats->latency, stats->latency_samples, (uint32_t)(now - stats->last_send_time));
+        stats->latency_samples++;
+        stats->awaiting_reply = 0;
+        stats->burst_start_time = now;
+        stats->burst_bytes = 0;
+    }
+    else if (now - stats->last_recv_time > LINK_STATS_MAX_GAP_MS) {
+        stats->burst_start_time = now;
+        stats->burst_bytes = 0;
+    }
+    else {
+        stats->burst_bytes += len;
+        if (now - stats->burst_start_time >= LINK_STATS_MIN_BURST_MS) {
+            uint32_t sample = (uint32_t)(((uint64_t)stats->burst_bytes * 1000) / (now - stats->burst_start_time));
+            stats->bandwidth = link_stats_smooth(stats->bandwidth, stats->bandwidth_samples, sample);
+            stats->bandwidth_samples++;
+            stats->burst_start_time = now;
+            stats->burst_bytes = 0;
+        }
+    }
+    stats->last_recv_time = now;
+}
+
 HPEXPORT int HPCALL hpcables_cable_send(cable_handle * handle, uint8_t * data, uint32_t len) {
     int res;
     if (handle != NULL) {
@@ -401,6 +511,7 @@ HPEXPORT int HPCALL hpcables_cable_send(cable_handle * handle, uint8_t * data, u
             int (*send) (cable_handle *, uint8_t *, uint32_t);
 
             DO_BASIC_HANDLE_CHECKS()
+            DO_PLUGGED_CHECK()
 
             send = handle->fncts->send;
             if (send != NULL) {
@@ -408,6 +519,7 @@ HPEXPORT int HPCALL hpcables_cable_send(cable_handle * handle, uint8_t * data, u
                 res = (*send)(handle, data, len);
                 if (res == ERR_SUCCESS) {
                     //hpcables_info("%s: send succeeded", __FUNCTION__);
+                    link_stats_sent(handle);
                 }
                 else {
                     hpcables_warning("%s: send failed", __FUNCTION__);
@@ -434,6 +546,7 @@ HPEXPORT int HPCALL hpcables_cable_recv(cable_handle * handle, uint8_t ** data,
             int (*recv) (cable_handle *, uint8_t **, uint32_t *);
 
             DO_BASIC_HANDLE_CHECKS()
+            DO_PLUGGED_CHECK()
 
             recv = handle->fncts->recv;
             if (recv != NULL) {
@@ -441,6 +554,9 @@ HPEXPORT int HPCALL hpcables_cable_recv(cable_handle * handle, uint8_t ** data,
                 res = (*recv)(handle, data, len);
                 if (res == ERR_SUCCESS) {
                     //hpcables_info("%s: recv succeeded", __FUNCTION__);
+                    if (*len != 0) {
+                        link_stats_received(handle, *len);
+                    }
                 }
                 else {
                     hpcables_warning("%s: recv failed", __FUNCTION__);
@@ -460,6 +576,7 @@ HPEXPORT int HPCALL hpcables_cable_recv(cable_handle * handle, uint8_t ** data,
     return res;
 }
 
+#undef DO_PLUGGED_CHECK
 #undef DO_BASIC_HANDLE_CHECKS2
 #undef DO_BASIC_HANDLE_CHECKS
 
@@ -470,27 +587,19 @@ HPEXPORT int HPCALL hpcables_probe_cables(uint8_t ** result) {
         uint8_t * ptr = models;
         if (models != NULL) {
             for (cable_model model = CABLE_NUL; model < CABLE_MAX; model++) {
-                cable_handle * handle = hpcables_handle_new(model);
-                if (handle != NULL) {
-                    if (hpcables_cable_probe(handle) == ERR_SUCCESS) {
-                        res++;
-                        *ptr++ = 1;
-                        hpcables_info("%s: probing cable %s succeeded", __FUNCTION__, hpcables_model_to_string(model));
-                    }
-                    else {
-                        ptr++;
-                        hpcables_error("%s: probing cable %s failed", __FUNCTION__, hpcables_model_to_string(model));
-                    }
-
-                    if (hpcables_handle_del(handle) != ERR_SUCCESS) {
-                        hpcables_error("%s: failed to destroy handle for model %s", __FUNCTION__, hpcables_model_to_string(model));
-                    }
-                    else {
-                        hpcables_info("%s: destroy handle for model %s success", __FUNCTION__, hpcables_model_to_string(model));
-                    }
+                // Probing needs no device state: a temporary handle on the stack is enough.
+                cable_handle handle;
+                memset(&handle, 0, sizeof(handle));
+                handle.model = model;
+                handle.fncts = hpcables_all_cables[model];
+                if (hpcables_cable_probe(&handle) == ERR_SUCCESS) {
+                    res++;
+                    *ptr++ = 1;
+                    hpcables_info("%s: probing cable %s succeeded", __FUNCTION__, hpcables_model_to_string(model));
                 }
                 else {
-                    hpcables_error("%s: failed to create handle for model %s", __FUNCTION__, hpcables_model_to_string(model));
+                    ptr++;
+                    hpcables_error("%s: probing cable %s failed", __FUNCTION__, hpcables_model_to_string(model));
                 }
             }
         }
@@ -535,3 +644,34 @@ HPEXPORT int HPCALL hpcables_probe_display(uint8_t * models) {
     }
     return res;
 }
+
+HPEXPORT int HPCALL hpcables_enumerate_devices(cable_model model, cable_device_info ** out_devices, uint32_t * out_count) {
+    int res;
+    if (model < CABLE_MAX && out_devices != NULL && out_count != NULL) {
+        if (model == CABLE_PRIME_HID) {
+            res = hpcables_prime_hid_enumerate(out_devices, out_count);
+        }
+        else {
+            // The null cable has no devices.
+            *out_devices = NULL;
+            *out_count = 0;
+            res = ERR_SUCCESS;
+        }
+        if (res == ERR_SUCCESS) {
+            hpcables_info("%s: found %" PRIu32 " devices for cable %s", __FUNCTION__, *out_count, hpcables_model_to_string(model));
+        }
+        else {
+            hpcables_error("%s: enumeration failed", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcables_error("%s: invalid argument", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcables_enumerate_free(cable_device_info * devices) {
+    (hpcables_alloc_funcs.free)(devices);
+    return ERR_SUCCESS;
+}
@@ -51,6 +51,19 @@ struct _cable_fncts {
     int (*recv) (cable_handle * handle, uint8_t ** data, uint32_t * len);
 };
 
+//! Running estimate of the speed of the link, updated by \a hpcables_cable_send and \a hpcables_cable_recv.
+typedef struct {
+    uint32_t latency; ///< Smoothed delay (in ms) between sending data and receiving the first reply data.
+    uint32_t latency_samples;
+    uint32_t bandwidth; ///< Smoothed throughput (in bytes/s) of the data following the first reply data.
+    uint32_t bandwidth_samples;
+    uint64_t last_send_time;
+    uint64_t last_recv_time;
+    uint64_t burst_start_time;
+    uint32_t burst_bytes;
+    int awaiting_reply;
+} cable_link_stats;
+
 //! Internal structure containing state about the cable, returned and passed around by the user.
 struct _cable_handle {
     cable_model model;
@@ -59,8 +72,45 @@ struct _cable_handle {
     int read_timeout;
     int open; // Should be made explicitly atomic with GCC >= 4.7 or Clang, but int is atomic on most ISAs anyway.
     int busy; // Should be made explicitly atomic with GCC >= 4.7 or Clang, but int is atomic on most ISAs anyway.
+    cable_link_stats stats;
+    char * path; ///< System path of the open device, if known.
+    char * requested_path; ///< System path of the device to open, NULL for the first one found; see \a hpcables_options_set_device_path.
+    int unplugged; ///< Set by the hotplug monitor when the device vanished. Should be made explicitly atomic with GCC >= 4.7 or Clang, but int is atomic on most ISAs anyway.
 };
 
+//! Kinds of hotplug events.
+typedef enum {
+    CABLE_HOTPLUG_ATTACHED = 0,
+    CABLE_HOTPLUG_DETACHED
+} cable_hotplug_event_type;
+
+//! Structure passed to the hotplug callback, describing the device which appeared or vanished.
+typedef struct {
+    cable_hotplug_event_type type;
+    cable_model model;
+    uint16_t vid;
+    uint16_t pid;
+    const char * path; ///< System path of the device, as used for opening it.
+    const char * serial; ///< Serial number of the device, may be NULL.
+} cable_hotplug_event;
+
+//! A device found by \a hpcables_enumerate_devices.
+typedef struct {
+    cable_model model;
+    uint16_t vid;
+    uint16_t pid;
+    const char * path; ///< System path of the device, for \a hpcables_options_set_device_path.
+    const char * serial; ///< Serial number of the device, empty if unknown.
+} cable_device_info;
+
+/**
+ * \brief Callback type for being notified of devices being plugged in or unplugged.
+ * \param event the event, only valid during the call.
+ * \param user_data the pointer given to \a hpcables_hotplug_start.
+ * \note the callback is called from the monitor thread.
+ */
+typedef void (*cable_hotplug_callback)(const cable_hotplug_event * event, void * user_data);
+
 
 //! Structure passed to \a hpcables_init, contains e.g. callbacks for logging and memory allocation.
 typedef struct {
@@ -172,6 +222,21 @@ HPEXPORT int HPCALL hpcables_options_get_read_timeout(cable_handle * handle);
  * \return 0 if the operation succeeded, nonzero otherwise.
  */
 HPEXPORT int HPCALL hpcables_options_set_read_timeout(cable_handle * handle, int timeout);
+/**
+ * \brief Sets which device the given cable handle opens, e.g. one of several calculators.
+ * \param handle the cable handle
+ * \param path the system path of the device, as found by \a hpcables_enumerate_devices; NULL for the first device found. The string is copied.
+ * \return 0 if the operation succeeded, nonzero otherwise.
+ * \note This takes effect at the next \a hpcables_cable_open. Opening fails if that device can't be opened, instead of falling back to another one.
+ */
+HPEXPORT int HPCALL hpcables_options_set_device_path(cable_handle * handle, const char * path);
+/**
+ * \brief Gets the current estimate of the latency and bandwidth of the link for the given cable handle.
+ * \param handle the cable handle
+ * \param out_stats storage area for the statistics.
+ * \return 0 if the operation succeeded, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcables_get_link_stats(cable_handle * handle, cable_link_stats * out_stats);
 
 /**
  * \brief Probes the given cable.
@@ -226,6 +291,36 @@ HPEXPORT int HPCALL hpcables_probe_free(uint8_t * models);
  * \return 0 if the operation succeeded, nonzero otherwise.
  **/
 HPEXPORT int HPCALL hpcables_probe_display(uint8_t * models);
+/**
+ * \brief Lists the connected devices which the given cable model can open.
+ * \param model the cable model.
+ * \param out_devices storage area for the array of devices, NULL if none was found. Use \a hpcables_enumerate_free to free the allocated memory.
+ * \param out_count storage area for the number of devices.
+ * \return 0 if the operation succeeded, nonzero otherwise.
+ * \note A recent enumeration is reused, as when opening a cable.
+ */
+HPEXPORT int HPCALL hpcables_enumerate_devices(cable_model model, cable_device_info ** out_devices, uint32_t * out_count);
+/**
+ * \brief Frees the result of an enumeration, created by \a hpcables_enumerate_devices.
+ * \param devices the memory to be freed, may be NULL.
+ * \return 0 if the operation succeeded, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcables_enumerate_free(cable_device_info * devices);
+
+/**
+ * \brief Starts monitoring the devices being plugged in or unplugged, on a background thread.
+ * An attach event is first reported for each device already present.
+ * While monitoring, the open handles of the devices which vanish are flagged, and their operations fail with ERR_CABLE_UNPLUGGED.
+ * \param callback the function notified of the events, may be NULL.
+ * \param user_data opaque pointer passed to the callback.
+ * \return 0 if the operation succeeded, nonzero otherwise (e.g. hotplug monitoring is not supported on this platform).
+ */
+HPEXPORT int HPCALL hpcables_hotplug_start(cable_hotplug_callback callback, void * user_data);
+/**
+ * \brief Stops monitoring the devices, waiting for the background thread to terminate.
+ * \return 0 if the operation succeeded, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcables_hotplug_stop(void);
 
 
 
@@ -38,6 +38,7 @@
 #include "logging.h"
 #include "error.h"
 #include "gettext.h"
+#include "utils.h"
 
 extern const calc_fncts calc_none_fncts;
 extern const calc_fncts calc_prime_fncts;
@@ -52,13 +53,37 @@ static const uint32_t supported_calcs =
 	| (1U << CALC_PRIME)
 ;
 
-hplibs_malloc_funcs hpcalcs_alloc_funcs = {
+hplibs_malloc_funcs hpcalcs_base_alloc_funcs = {
     .malloc = malloc,
     .calloc = calloc,
     .realloc = realloc,
     .free = free
 };
 
+// The allocations are routed to the allocator of the calculator handle being operated on, if any.
+static void * hpcalcs_malloc(size_t size) {
+    return hplibs_scoped_malloc(&hpcalcs_base_alloc_funcs, size);
+}
+
+static void * hpcalcs_calloc(size_t nmemb, size_t size) {
+    return hplibs_scoped_calloc(&hpcalcs_base_alloc_funcs, nmemb, size);
+}
+
+static void * hpcalcs_realloc(void * ptr, size_t size) {
+    return hplibs_scoped_realloc(&hpcalcs_base_alloc_funcs, ptr, size);
+}
+
+static void hpcalcs_free(void * ptr) {
+    hplibs_scoped_free(&hpcalcs_base_alloc_funcs, ptr);
+}
+
+hplibs_malloc_funcs hpcalcs_alloc_funcs = {
+    .malloc = hpcalcs_malloc,
+    .calloc = hpcalcs_calloc,
+    .realloc = hpcalcs_realloc,
+    .free = hpcalcs_free
+};
+
 
 // not static, must be shared between instances
 int hpcalcs_instance_count = 0;
@@ -95,7 +120,7 @@ HPEXPORT int HPCALL hpcalcs_init(hpcalcs_config * config) {
         if (!hpcalcs_instance_count) {
             hpcalcs_log_set_callback(log_callback);
             if (alloc_funcs != NULL) {
-                hpcalcs_alloc_funcs = *alloc_funcs;
+                hpcalcs_base_alloc_funcs = *alloc_funcs;
             }
             hpcalcs_info(_("hpcalcs library version %s"), hpcalcs_version_get());
 
@@ -119,6 +144,7 @@ HPEXPORT int HPCALL hpcalcs_exit(void) {
     }
     else {
         hpcalcs_instance_count--;
+        prime_vtl_pkt_pool_trim();
 
         hpcalcs_info(_("%s: exit succeeded"), __FUNCTION__);
         res = ERR_SUCCESS;
@@ -167,6 +193,9 @@ HPEXPORT int HPCALL hpcalcs_handle_del(calc_handle * handle) {
             res = ERR_SUCCESS;
         }
 
+        hpcalcs_events_clear(handle);
+        hpcalcs_calc_screen_history_disable(handle);
+
         (hpcalcs_alloc_funcs.free)(handle->handle);
         handle->handle = NULL;
 
@@ -204,6 +233,12 @@ HPEXPORT int HPCALL hpcalcs_cable_attach(calc_handle * handle, cable_handle * ca
 HPEXPORT int HPCALL hpcalcs_cable_detach(calc_handle * handle) {
     int res;
     if (handle != NULL) {
+        // The stream's thread must be done with the cable first.
+        if (handle->screen_stream != NULL) {
+            hpcalcs_screen_stream_del(handle->screen_stream);
+            handle->screen_stream = NULL;
+            handle->busy = 0;
+        }
         res = hpcables_cable_close(handle->cable);
         if (res == ERR_SUCCESS) {
             handle->open = 0;
@@ -234,6 +269,36 @@ HPEXPORT cable_handle * HPCALL hpcalcs_cable_get(calc_handle * handle) {
     return res;
 }
 
+HPEXPORT int HPCALL hpcalcs_options_get_operation_timeout(calc_handle * handle) {
+    int timeout = 0;
+    if (handle != NULL) {
+        timeout = handle->operation_timeout;
+    }
+    else {
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return timeout;
+}
+
+HPEXPORT int HPCALL hpcalcs_options_set_operation_timeout(calc_handle * handle, int timeout) {
+    int res;
+    if (handle != NULL) {
+        if (timeout >= 0) {
+            handle->operation_timeout = timeout;
+            res = ERR_SUCCESS;
+        }
+        else {
+            res = ERR_INVALID_PARAMETER;
+            hpcalcs_error("%s: timeout is negative", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
 HPEXPORT int HPCALL hpcalcs_handle_display(calc_handle * handle) {
     int res;
     if (handle != NULL) {
@@ -285,12 +350,14 @@ HPEXPORT calc_model HPCALL hpcalcs_get_model(calc_handle * handle) {
         res = ERR_CALC_INVALID_FNCTS; \
         hpcalcs_error("%s: fncts is NULL", __FUNCTION__); \
         break; \
-    }
+    } \
+    handle->operation_deadline = (handle->operation_timeout > 0) ? get_monotonic_time_ms() + handle->operation_timeout : 0;
 
 HPEXPORT int HPCALL hpcalcs_calc_check_ready(calc_handle * handle, uint8_t ** out_data, uint32_t * out_size) {
     int res;
     if (handle != NULL) {
         do {
+            calc_alloc_scope scope;
             int (*check_ready) (calc_handle *, uint8_t **, uint32_t *);
 
             DO_BASIC_HANDLE_CHECKS()
@@ -298,7 +365,9 @@ HPEXPORT int HPCALL hpcalcs_calc_check_ready(calc_handle * handle, uint8_t ** ou
             check_ready = handle->fncts->check_ready;
             if (check_ready != NULL) {
                 handle->busy = 1;
+                hpcalcs_alloc_scope_enter(handle, &scope);
                 res = (*check_ready)(handle, out_data, out_size);
+                hpcalcs_alloc_scope_leave(&scope);
                 if (res == ERR_SUCCESS) {
                     hpcalcs_info("%s: check_ready succeeded", __FUNCTION__);
                 }
@@ -324,6 +393,7 @@ HPEXPORT int HPCALL hpcalcs_calc_get_infos(calc_handle * handle, calc_infos * in
     int res;
     if (handle != NULL) {
         do {
+            calc_alloc_scope scope;
             int (*get_infos) (calc_handle *, calc_infos *);
 
             DO_BASIC_HANDLE_CHECKS()
@@ -331,7 +401,9 @@ HPEXPORT int HPCALL hpcalcs_calc_get_infos(calc_handle * handle, calc_infos * in
             get_infos = handle->fncts->get_infos;
             if (get_infos != NULL) {
                 handle->busy = 1;
+                hpcalcs_alloc_scope_enter(handle, &scope);
                 res = (*get_infos)(handle, infos);
+                hpcalcs_alloc_scope_leave(&scope);
                 if (res == 0) {
                     hpcalcs_info("%s: get_infos succeeded", __FUNCTION__);
                 }
@@ -357,6 +429,7 @@ HPEXPORT int HPCALL hpcalcs_calc_set_date_time(calc_handle * handle, time_t time
     int res;
     if (handle != NULL) {
         do {
+            calc_alloc_scope scope;
             int (*set_date_time) (calc_handle *, time_t);
 
             DO_BASIC_HANDLE_CHECKS()
@@ -364,7 +437,9 @@ HPEXPORT int HPCALL hpcalcs_calc_set_date_time(calc_handle * handle, time_t time
             set_date_time = handle->fncts->set_date_time;
             if (set_date_time != NULL) {
                 handle->busy = 1;
+                hpcalcs_alloc_scope_enter(handle, &scope);
                 res = (*set_date_time)(handle, timestamp);
+                hpcalcs_alloc_scope_leave(&scope);
                 if (res == 0) {
                     hpcalcs_info("%s: set_date_time succeeded", __FUNCTION__);
                 }
@@ -387,19 +462,39 @@ HPEXPORT int HPCALL hpcalcs_calc_set_date_time(calc_handle * handle, time_t time
 }
 
 HPEXPORT int HPCALL hpcalcs_calc_recv_screen(calc_handle * handle, calc_screenshot_format format, uint8_t ** out_data, uint32_t * out_size) {
+    int res;
+    hplibs_buffer_view view;
+
+    memset(&view, 0, sizeof(view));
+    res = hpcalcs_calc_recv_screen_view(handle, format, (out_data != NULL && out_size != NULL) ? &view : NULL);
+    if (view.base != NULL) {
+        // The image may have been handed over even though an error was reported (e.g. CRC mismatch).
+        *out_data = hplibs_buffer_view_flatten(&view);
+        *out_size = view.size;
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcalcs_calc_recv_screen_view(calc_handle * handle, calc_screenshot_format format, hplibs_buffer_view * out_view) {
     int res;
     // TODO: some checking on format, but for now, it would hamper documentation efforts.
     if (handle != NULL) {
         do {
-            int (*recv_screen) (calc_handle *, calc_screenshot_format, uint8_t **, uint32_t *);
+            calc_alloc_scope scope;
+            int (*recv_screen) (calc_handle *, calc_screenshot_format, hplibs_buffer_view *);
 
             DO_BASIC_HANDLE_CHECKS()
 
             recv_screen = handle->fncts->recv_screen;
             if (recv_screen != NULL) {
                 handle->busy = 1;
-                res = (*recv_screen)(handle, format, out_data, out_size);
+                hpcalcs_alloc_scope_enter(handle, &scope);
+                res = (*recv_screen)(handle, format, out_view);
+                hpcalcs_alloc_scope_leave(&scope);
                 if (res == 0) {
+                    if (out_view != NULL && out_view->base != NULL) {
+                        hpcalcs_screen_history_record(handle, format, out_view->base + out_view->offset, out_view->size);
+                    }
                     hpcalcs_info("%s: recv_screen succeeded", __FUNCTION__);
                 }
                 else {
@@ -420,10 +515,89 @@ HPEXPORT int HPCALL hpcalcs_calc_recv_screen(calc_handle * handle, calc_screensh
     return res;
 }
 
+HPEXPORT int HPCALL hpcalcs_calc_screen_stream_start(calc_handle * handle, calc_screenshot_format format, calc_screen_callback callback, void * user_data) {
+    int res;
+    if (handle != NULL) {
+        do {
+            DO_BASIC_HANDLE_CHECKS()
+
+            if (callback == NULL) {
+                res = ERR_INVALID_PARAMETER;
+                hpcalcs_error("%s: callback is NULL", __FUNCTION__);
+                break;
+            }
+            if (handle->fncts->recv_screen_next != NULL || handle->fncts->recv_screen != NULL) {
+                // Stays busy until the stream is stopped. The per-read timeouts keep applying to each frame.
+                handle->busy = 1;
+                handle->operation_deadline = 0;
+                res = hpcalcs_screen_stream_new(handle, format, callback, user_data, &handle->screen_stream);
+                if (res == 0) {
+                    hpcalcs_info("%s: screen stream started", __FUNCTION__);
+                }
+                else {
+                    hpcalcs_error("%s: couldn't start screen stream", __FUNCTION__);
+                    handle->busy = 0;
+                }
+            }
+            else {
+                res = ERR_CALC_INVALID_FNCTS;
+                hpcalcs_error("%s: fncts->recv_screen is NULL", __FUNCTION__);
+            }
+        } while (0);
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcalcs_calc_screen_stream_stop(calc_handle * handle) {
+    int res;
+    if (handle != NULL) {
+        if (handle->screen_stream != NULL) {
+            hpcalcs_screen_stream_del(handle->screen_stream);
+            handle->screen_stream = NULL;
+            handle->busy = 0;
+            hpcalcs_info("%s: screen stream stopped", __FUNCTION__);
+            res = ERR_SUCCESS;
+        }
+        else {
+            res = ERR_INVALID_PARAMETER;
+            hpcalcs_error("%s: no screen stream in progress", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcalcs_calc_screen_stream_get_stats(calc_handle * handle, calc_screen_stream_stats * stats) {
+    int res;
+    if (handle != NULL && stats != NULL) {
+        if (handle->screen_stream != NULL) {
+            hpcalcs_screen_stream_get_stats(handle->screen_stream, stats);
+            res = ERR_SUCCESS;
+        }
+        else {
+            res = ERR_INVALID_PARAMETER;
+            hpcalcs_error("%s: no screen stream in progress", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcalcs_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
 HPEXPORT int HPCALL hpcalcs_calc_send_file(calc_handle * handle, files_var_entry * file) {
     int res;
     if (handle != NULL) {
         do {
+            calc_alloc_scope scope;
             int (*send_file) (calc_handle *, files_var_entry *);
 
             DO_BASIC_HANDLE_CHECKS()
@@ -431,7 +605,9 @@ HPEXPORT int HPCALL hpcalcs_calc_send_file(calc_handle * handle, files_var_entry
             send_file = handle->fncts->send_file;
             if (send_file != NULL) {
                 handle->busy = 1;
+                hpcalcs_alloc_scope_enter(handle, &scope);
                 res = (*send_file)(handle, file);
+                hpcalcs_alloc_scope_leave(&scope);
                 if (res == 0) {
                     hpcalcs_info("%s: send_file succeeded", __FUNCTION__);
                 }
@@ -453,10 +629,76 @@ HPEXPORT int HPCALL hpcalcs_calc_send_file(calc_handle * handle, files_var_entry
     return res;
 }
 
+// For calculators which can only send files one at a time.
+static int send_files_one_by_one(calc_handle * handle, int (*send_file) (calc_handle *, files_var_entry *), files_var_entry ** files, uint32_t count, int * out_results) {
+    int res = ERR_SUCCESS;
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        int file_res = ERR_CALC_SKIPPED;
+        if (res == ERR_SUCCESS) {
+            file_res = (*send_file)(handle, files[i]);
+            res = file_res;
+        }
+        if (out_results != NULL) {
+            out_results[i] = file_res;
+        }
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcalcs_calc_send_files(calc_handle * handle, files_var_entry ** files, uint32_t count, int * out_results) {
+    int res;
+    if (handle != NULL) {
+        do {
+            calc_alloc_scope scope;
+            int (*send_files) (calc_handle *, files_var_entry **, uint32_t, int *);
+            int (*send_file) (calc_handle *, files_var_entry *);
+
+            DO_BASIC_HANDLE_CHECKS()
+
+            if (files == NULL && count != 0) {
+                res = ERR_INVALID_PARAMETER;
+                hpcalcs_error("%s: files is NULL", __FUNCTION__);
+                break;
+            }
+            send_files = handle->fncts->send_files;
+            send_file = handle->fncts->send_file;
+            if (send_files != NULL || send_file != NULL) {
+                handle->busy = 1;
+                hpcalcs_alloc_scope_enter(handle, &scope);
+                if (send_files != NULL) {
+                    res = (*send_files)(handle, files, count, out_results);
+                }
+                else {
+                    res = send_files_one_by_one(handle, send_file, files, count, out_results);
+                }
+                hpcalcs_alloc_scope_leave(&scope);
+                if (res == 0) {
+                    hpcalcs_info("%s: send_files succeeded", __FUNCTION__);
+                }
+                else {
+                    hpcalcs_error("%s: send_files failed", __FUNCTION__);
+                }
+                handle->busy = 0;
+            }
+            else {
+                res = ERR_CALC_INVALID_FNCTS;
+                hpcalcs_error("%s: fncts->send_files is NULL", __FUNCTION__);
+            }
+        } while (0);
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
 HPEXPORT int HPCALL hpcalcs_calc_recv_file(calc_handle * handle, files_var_entry * name, files_var_entry ** out_file) {
     int res;
     if (handle != NULL) {
         do {
+            calc_alloc_scope scope;
             int (*recv_file) (calc_handle *, files_var_entry *, files_var_entry **);
 
             DO_BASIC_HANDLE_CHECKS()
@@ -464,7 +706,9 @@ HPEXPORT int HPCALL hpcalcs_calc_recv_file(calc_handle * handle, files_var_entry
             recv_file = handle->fncts->recv_file;
             if (recv_file != NULL) {
                 handle->busy = 1;
+                hpcalcs_alloc_scope_enter(handle, &scope);
                 res = (*recv_file)(handle, name, out_file);
+                hpcalcs_alloc_scope_leave(&scope);
                 if (res == 0) {
                     hpcalcs_info("%s: recv_file succeeded", __FUNCTION__);
                 }
@@ -486,18 +730,193 @@ HPEXPORT int HPCALL hpcalcs_calc_recv_file(calc_handle * handle, files_var_entry
     return res;
 }
 
+HPEXPORT int HPCALL hpcalcs_calc_recv_file_view(calc_handle * handle, files_var_entry * name, files_var_entry ** out_file, hplibs_buffer_view * out_view) {
+    int res;
+    if (handle != NULL) {
+        do {
+            calc_alloc_scope scope;
+            int (*recv_file_view) (calc_handle *, files_var_entry *, files_var_entry **, hplibs_buffer_view *);
+
+            DO_BASIC_HANDLE_CHECKS()
+
+            recv_file_view = handle->fncts->recv_file_view;
+            if (recv_file_view != NULL) {
+                handle->busy = 1;
+                hpcalcs_alloc_scope_enter(handle, &scope);
+                res = (*recv_file_view)(handle, name, out_file, out_view);
+                hpcalcs_alloc_scope_leave(&scope);
+                if (res == 0) {
+                    hpcalcs_info("%s: recv_file_view succeeded", __FUNCTION__);
+                }
+                else {
+                    hpcalcs_error("%s: recv_file_view failed", __FUNCTION__);
+                }
+                handle->busy = 0;
+            }
+            else {
+                res = ERR_CALC_INVALID_FNCTS;
+                hpcalcs_error("%s: fncts->recv_file_view is NULL", __FUNCTION__);
+            }
+        } while (0);
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+int hpcalcs_deliver_entry(calc_handle * handle, files_var_entry * entry, files_ve_vector * out_vars) {
+    int res = ERR_SUCCESS;
+    if (handle->entry_callback != NULL && (*handle->entry_callback)(handle, entry, handle->entry_user_data)) {
+        // Taken over by the callback.
+    }
+    else if (out_vars == NULL) {
+        hpfiles_ve_delete(entry);
+    }
+    else if (hpfiles_ve_vector_append(out_vars, entry) != ERR_SUCCESS) {
+        hpfiles_ve_delete(entry);
+        res = ERR_MALLOC;
+        hpcalcs_error("%s: couldn't store entry", __FUNCTION__);
+    }
+    return res;
+}
+
+// For calculators which can only receive files one at a time.
+static int recv_files_one_by_one(calc_handle * handle, int (*recv_file) (calc_handle *, files_var_entry *, files_var_entry **), files_var_entry ** requests, uint32_t count, files_ve_vector * out_vars, int * out_results) {
+    int res = ERR_SUCCESS;
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        int file_res = ERR_CALC_SKIPPED;
+        if (res == ERR_SUCCESS) {
+            files_var_entry * entry = NULL;
+            file_res = (*recv_file)(handle, requests[i], &entry);
+            if (file_res == ERR_SUCCESS && entry != NULL) {
+                file_res = hpcalcs_deliver_entry(handle, entry, out_vars);
+            }
+            res = file_res;
+        }
+        if (out_results != NULL) {
+            out_results[i] = file_res;
+        }
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcalcs_calc_recv_files(calc_handle * handle, files_var_entry ** requests, uint32_t count, files_ve_vector * out_vars, int * out_results) {
+    int res;
+    if (handle != NULL) {
+        do {
+            calc_alloc_scope scope;
+            int (*recv_files) (calc_handle *, files_var_entry **, uint32_t, files_ve_vector *, int *);
+            int (*recv_file) (calc_handle *, files_var_entry *, files_var_entry **);
+
+            DO_BASIC_HANDLE_CHECKS()
+
+            if (requests == NULL && count != 0) {
+                res = ERR_INVALID_PARAMETER;
+                hpcalcs_error("%s: requests is NULL", __FUNCTION__);
+                break;
+            }
+            recv_files = handle->fncts->recv_files;
+            recv_file = handle->fncts->recv_file;
+            if (recv_files != NULL || recv_file != NULL) {
+                handle->busy = 1;
+                hpcalcs_alloc_scope_enter(handle, &scope);
+                if (recv_files != NULL) {
+                    res = (*recv_files)(handle, requests, count, out_vars, out_results);
+                }
+                else {
+                    res = recv_files_one_by_one(handle, recv_file, requests, count, out_vars, out_results);
+                }
+                hpcalcs_alloc_scope_leave(&scope);
+                if (res == 0) {
+                    hpcalcs_info("%s: recv_files succeeded", __FUNCTION__);
+                }
+                else {
+                    hpcalcs_error("%s: recv_files failed", __FUNCTION__);
+                }
+                handle->busy = 0;
+            }
+            else {
+                res = ERR_CALC_INVALID_FNCTS;
+                hpcalcs_error("%s: fncts->recv_files is NULL", __FUNCTION__);
+            }
+        } while (0);
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
 HPEXPORT int HPCALL hpcalcs_calc_recv_backup(calc_handle * handle, files_var_entry *** out_vars) {
     int res;
     if (handle != NULL) {
         do {
-            int (*recv_backup) (calc_handle *, files_var_entry ***);
+            calc_alloc_scope scope;
+            int (*recv_backup) (calc_handle *, files_ve_vector *);
 
             DO_BASIC_HANDLE_CHECKS()
 
             recv_backup = handle->fncts->recv_backup;
             if (recv_backup != NULL) {
+                files_ve_vector * entries;
                 handle->busy = 1;
+                hpcalcs_alloc_scope_enter(handle, &scope);
+                // Like the entries, the array must come from the handle's allocator.
+                entries = hpfiles_ve_vector_new(0);
+                if (entries != NULL) {
+                    res = (*recv_backup)(handle, entries);
+                    // Hand over the files received so far even upon failure, so that they can be salvaged.
+                    if (out_vars != NULL) {
+                        *out_vars = hpfiles_ve_vector_detach_array(entries);
+                    }
+                    else {
+                        hpfiles_ve_vector_delete(entries);
+                    }
+                }
+                else {
+                    res = ERR_MALLOC;
+                }
+                hpcalcs_alloc_scope_leave(&scope);
+                if (res == 0) {
+                    hpcalcs_info("%s: recv_backup succeeded", __FUNCTION__);
+                }
+                else {
+                    hpcalcs_error("%s: recv_backup failed", __FUNCTION__);
+                }
+                handle->busy = 0;
+            }
+            else {
+                res = ERR_CALC_INVALID_FNCTS;
+                hpcalcs_error("%s: fncts->recv_backup is NULL", __FUNCTION__);
+            }
+        } while (0);
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcalcs_calc_recv_backup_vector(calc_handle * handle, files_ve_vector * out_vars) {
+    int res;
+    if (handle != NULL) {
+        do {
+            calc_alloc_scope scope;
+            int (*recv_backup) (calc_handle *, files_ve_vector *);
+
+            DO_BASIC_HANDLE_CHECKS()
+
+            recv_backup = handle->fncts->recv_backup;
+            if (recv_backup != NULL) {
+                handle->busy = 1;
+                hpcalcs_alloc_scope_enter(handle, &scope);
                 res = (*recv_backup)(handle, out_vars);
+                hpcalcs_alloc_scope_leave(&scope);
                 if (res == 0) {
                     hpcalcs_info("%s: recv_backup succeeded", __FUNCTION__);
                 }
@@ -519,10 +938,25 @@ HPEXPORT int HPCALL hpcalcs_calc_recv_backup(calc_handle * handle, files_var_ent
     return res;
 }
 
+HPEXPORT int HPCALL hpcalcs_calc_set_entry_callback(calc_handle * handle, calc_entry_callback callback, void * user_data) {
+    int res;
+    if (handle != NULL) {
+        handle->entry_callback = callback;
+        handle->entry_user_data = user_data;
+        res = ERR_SUCCESS;
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
 HPEXPORT int HPCALL hpcalcs_calc_send_key(calc_handle * handle, uint32_t code) {
     int res;
     if (handle != NULL) {
         do {
+            calc_alloc_scope scope;
             int (*send_key) (calc_handle *, uint32_t);
 
             DO_BASIC_HANDLE_CHECKS()
@@ -530,7 +964,9 @@ HPEXPORT int HPCALL hpcalcs_calc_send_key(calc_handle * handle, uint32_t code) {
             send_key = handle->fncts->send_key;
             if (send_key != NULL) {
                 handle->busy = 1;
+                hpcalcs_alloc_scope_enter(handle, &scope);
                 res = (*send_key)(handle, code);
+                hpcalcs_alloc_scope_leave(&scope);
                 if (res == 0) {
                     hpcalcs_info("%s: send_key succeeded", __FUNCTION__);
                 }
@@ -556,6 +992,7 @@ HPEXPORT int HPCALL hpcalcs_calc_send_keys(calc_handle * handle, const uint8_t *
     int res = -1;
     if (handle != NULL) {
         do {
+            calc_alloc_scope scope;
             int (*send_keys) (calc_handle *, const uint8_t *, uint32_t);
 
             DO_BASIC_HANDLE_CHECKS()
@@ -563,7 +1000,9 @@ HPEXPORT int HPCALL hpcalcs_calc_send_keys(calc_handle * handle, const uint8_t *
             send_keys = handle->fncts->send_keys;
             if (send_keys != NULL) {
                 handle->busy = 1;
+                hpcalcs_alloc_scope_enter(handle, &scope);
                 res = (*send_keys)(handle, data, size);
+                hpcalcs_alloc_scope_leave(&scope);
                 if (res == 0) {
                     hpcalcs_info("%s: send_keys succeeded", __FUNCTION__);
                 }
@@ -589,6 +1028,7 @@ HPEXPORT int HPCALL hpcalcs_calc_send_chat(calc_handle * handle, const uint16_t
     int res;
     if (handle != NULL) {
         do {
+            calc_alloc_scope scope;
             int (*send_chat) (calc_handle *, const uint16_t *, uint32_t);
 
             DO_BASIC_HANDLE_CHECKS()
@@ -596,7 +1036,9 @@ HPEXPORT int HPCALL hpcalcs_calc_send_chat(calc_handle * handle, const uint16_t
             send_chat = handle->fncts->send_chat;
             if (send_chat != NULL) {
                 handle->busy = 1;
+                hpcalcs_alloc_scope_enter(handle, &scope);
                 res = (*send_chat)(handle, data, size);
+                hpcalcs_alloc_scope_leave(&scope);
                 if (res == 0) {
                     hpcalcs_info("%s: send_chat succeeded", __FUNCTION__);
                 }
@@ -619,17 +1061,33 @@ HPEXPORT int HPCALL hpcalcs_calc_send_chat(calc_handle * handle, const uint16_t
 }
 
 HPEXPORT int HPCALL hpcalcs_calc_recv_chat(calc_handle * handle, uint16_t ** data, uint32_t *size) {
+    int res;
+    hplibs_buffer_view view;
+
+    memset(&view, 0, sizeof(view));
+    res = hpcalcs_calc_recv_chat_view(handle, (data != NULL && size != NULL) ? &view : NULL);
+    if (view.base != NULL) {
+        *data = (uint16_t *)hplibs_buffer_view_flatten(&view);
+        *size = view.size;
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcalcs_calc_recv_chat_view(calc_handle * handle, hplibs_buffer_view * out_view) {
     int res;
     if (handle != NULL) {
         do {
-            int (*recv_chat) (calc_handle *, uint16_t **, uint32_t *);
+            calc_alloc_scope scope;
+            int (*recv_chat) (calc_handle *, hplibs_buffer_view *);
 
             DO_BASIC_HANDLE_CHECKS()
 
             recv_chat = handle->fncts->recv_chat;
             if (recv_chat != NULL) {
                 handle->busy = 1;
-                res = (*recv_chat)(handle, data, size);
+                hpcalcs_alloc_scope_enter(handle, &scope);
+                res = (*recv_chat)(handle, out_view);
+                hpcalcs_alloc_scope_leave(&scope);
                 if (res == 0) {
                     hpcalcs_info("%s: recv_chat succeeded", __FUNCTION__);
                 }
@@ -651,12 +1109,49 @@ HPEXPORT int HPCALL hpcalcs_calc_recv_chat(calc_handle * handle, uint16_t ** dat
     return res;
 }
 
+HPEXPORT int HPCALL hpcalcs_calc_poll_events(calc_handle * handle, int timeout) {
+    int res;
+    if (handle != NULL) {
+        do {
+            calc_alloc_scope scope;
+            int (*poll_events) (calc_handle *, int);
+
+            DO_BASIC_HANDLE_CHECKS()
+
+            poll_events = handle->fncts->poll_events;
+            if (poll_events != NULL) {
+                handle->busy = 1;
+                hpcalcs_alloc_scope_enter(handle, &scope);
+                res = (*poll_events)(handle, timeout);
+                hpcalcs_alloc_scope_leave(&scope);
+                if (res == 0) {
+                    hpcalcs_info("%s: poll_events succeeded", __FUNCTION__);
+                }
+                else {
+                    hpcalcs_error("%s: poll_events failed", __FUNCTION__);
+                }
+                handle->busy = 0;
+            }
+            else {
+                res = ERR_CALC_INVALID_FNCTS;
+                hpcalcs_error("%s: fncts->poll_events is NULL", __FUNCTION__);
+            }
+        } while (0);
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
 #undef DO_BASIC_HANDLE_CHECKS
 
 HPEXPORT int HPCALL hpcalcs_probe_calc(cable_model cable, calc_model * out_calc) {
     int res;
     if (out_calc != NULL) {
-        if (cable == CABLE_PRIME_HID) {
+        // The enumeration is usually still cached from the cable probe.
+        if (cable == CABLE_PRIME_HID && hpcables_prime_hid_lookup(0, NULL, NULL) == ERR_SUCCESS) {
             res = ERR_SUCCESS;
             *out_calc = CALC_PRIME;
             hpcalcs_info("%s: calc probe succeeded", __FUNCTION__);
@@ -40,6 +40,10 @@
 typedef struct _calc_fncts calc_fncts;
 //! Opaque type for internal _calc_handle.
 typedef struct _calc_handle calc_handle;
+//! Opaque type for internal _calc_screen_stream.
+typedef struct _calc_screen_stream calc_screen_stream;
+//! Opaque type for internal _calc_screen_history.
+typedef struct _calc_screen_history calc_screen_history;
 
 //! Indices of the function pointers in _calc_fncts.
 typedef enum {
@@ -54,6 +58,10 @@ typedef enum {
     CALC_FNCT_SEND_KEYS = 8,
     CALC_FNCT_SEND_CHAT = 9,
     CALC_FNCT_RECV_CHAT = 10,
+    CALC_FNCT_POLL_EVENTS = 11,
+    CALC_FNCT_SEND_FILES = 12,
+    CALC_FNCT_RECV_FILES = 13,
+    CALC_FNCT_RECV_SCREEN_NEXT = 14,
     CALC_FNCT_LAST ///< Keep this one last
 } calc_fncts_idx;
 
@@ -70,13 +78,17 @@ typedef enum {
     CALC_OPS_SEND_KEY = (1 << CALC_FNCT_SEND_KEY),
     CALC_OPS_SEND_KEYS = (1 << CALC_FNCT_SEND_KEYS),
     CALC_OPS_SEND_CHAT = (1 << CALC_FNCT_SEND_CHAT),
-    CALC_OPS_RECV_CHAT = (1 << CALC_FNCT_RECV_CHAT)
+    CALC_OPS_RECV_CHAT = (1 << CALC_FNCT_RECV_CHAT),
+    CALC_OPS_POLL_EVENTS = (1 << CALC_FNCT_POLL_EVENTS),
+    CALC_OPS_SEND_FILES = (1 << CALC_FNCT_SEND_FILES),
+    CALC_OPS_RECV_FILES = (1 << CALC_FNCT_RECV_FILES),
+    CALC_OPS_RECV_SCREEN_NEXT = (1 << CALC_FNCT_RECV_SCREEN_NEXT)
 } calc_features_operations;
 
 //! Screenshot formats supported by the calculators, list is known to be incomplete.
 typedef enum {
-    // 5 is triggered periodically by the official connectivity kit. It returns something with a PNG header, but much smaller.
-    CALC_SCREENSHOT_FORMAT_FIRST = 8,
+    CALC_SCREENSHOT_FORMAT_PRIME_PREVIEW = 5, ///< Triggered periodically by the official connectivity kit: a much smaller PNG, cheap to poll.
+    CALC_SCREENSHOT_FORMAT_FIRST = 8, ///< First of the full-size formats.
     CALC_SCREENSHOT_FORMAT_PRIME_PNG_320x240x16 = 8,
     CALC_SCREENSHOT_FORMAT_PRIME_PNG_320x240x4 = 9,
     CALC_SCREENSHOT_FORMAT_PRIME_PNG_160x120x16 = 10,
@@ -90,6 +102,84 @@ typedef struct {
     uint8_t * data;
 } calc_infos;
 
+//! Kinds of messages received from the calculator, used for routing them to per-type queues.
+typedef enum {
+    CALC_EVENT_REPLY = 0, ///< Reply to a command, received while no operation was waiting for it.
+    CALC_EVENT_CHAT, ///< Unsolicited chat message.
+    CALC_EVENT_STATUS, ///< Out-of-band report starting with 0xFF.
+    CALC_EVENT_LAST ///< Keep this one last
+} calc_event_type;
+
+//! Opaque type for internal _calc_event.
+typedef struct _calc_event calc_event;
+
+//! Structure containing a message routed by the demultiplexer.
+struct _calc_event {
+    calc_event_type type;
+    uint8_t cmd; ///< Command byte of the message (0xFF for status reports).
+    uint32_t size;
+    uint8_t * data; ///< Full message, including the command byte; for status reports, the report without its leading 0xFF.
+    calc_event * next;
+};
+
+/**
+ * \brief Callback type for being notified of incoming messages.
+ * \param handle the calculator handle the message was received from.
+ * \param event the message. It remains owned by the library.
+ * \param user_data the pointer given to \a hpcalcs_events_set_callback.
+ * \return nonzero if the message was handled (it is then deleted), 0 to have it queued for \a hpcalcs_events_pop.
+ * \note the callback is called while an operation is in progress on \a handle, it must not start other operations on it.
+ */
+typedef int (*calc_event_callback)(calc_handle * handle, calc_event * event, void * user_data);
+
+/**
+ * \brief Callback type for being handed each file of a multi-file operation (backup, batch receive) as soon as it is received, in order.
+ * \param handle the calculator handle the file was received from.
+ * \param entry the file.
+ * \param user_data the pointer given to \a hpcalcs_calc_set_entry_callback.
+ * \return nonzero if the callback takes ownership of the entry, 0 to have it stored by the operation as usual.
+ * \note the callback is called while an operation is in progress on \a handle, it must not start other operations on it, and should return quickly.
+ */
+typedef int (*calc_entry_callback)(calc_handle * handle, files_var_entry * entry, void * user_data);
+
+/**
+ * \brief Callback type for being handed the changed frames of a screen stream, see \a hpcalcs_calc_screen_stream_start.
+ * \param handle the calculator handle the frame was received from.
+ * \param data the screenshot, as returned by \a hpcalcs_calc_recv_screen. It remains owned by the library, and is only valid during the call.
+ * \param size the size of the screenshot.
+ * \param user_data the pointer given to \a hpcalcs_calc_screen_stream_start.
+ * \note the callback is called from a thread of the library, it must not call \a hpcalcs_calc_screen_stream_stop. The next frames are received meanwhile, only the latest one is kept.
+ */
+typedef void (*calc_screen_callback)(calc_handle * handle, const uint8_t * data, uint32_t size, void * user_data);
+
+//! Statistics of a screen stream, see \a hpcalcs_calc_screen_stream_get_stats.
+typedef struct {
+    uint32_t frames_received; ///< Frames received correctly.
+    uint32_t frames_delivered; ///< Frames handed to the callback, i.e. those which differed from the previous one.
+    uint32_t frames_dropped; ///< Frames replaced by a newer one before they could be compared.
+    uint32_t errors; ///< Failed or corrupted replies.
+    double fps; ///< Frames received per second, over the last few frames.
+    uint32_t latency_ms; ///< Time between the request and the complete reply, for the last frame.
+    uint32_t average_latency_ms; ///< Same, averaged over the stream.
+    int running; ///< Zero once the stream gave up after repeated errors.
+    int last_error; ///< Last error met by the stream, 0 if none.
+} calc_screen_stream_stats;
+
+//! Statistics of the screen history of a calculator handle, see \a hpcalcs_calc_screen_history_get_stats.
+typedef struct {
+    uint32_t frames; ///< Frames currently kept.
+    uint32_t images; ///< Distinct images among them; identical frames share their image.
+    uint32_t bytes; ///< Memory taken by the images.
+    uint64_t oldest_time_ms; ///< Time of the oldest frame kept, 0 if none.
+    uint64_t newest_time_ms; ///< Time of the newest frame kept, 0 if none.
+    uint32_t frames_recorded; ///< Frames recorded since the history was enabled, evicted ones included.
+    uint32_t frames_rejected; ///< Frames which couldn't be kept within the limits.
+    uint64_t global_bytes; ///< Memory taken by the images of all handles.
+} calc_screen_history_stats;
+
+//! Maximum number of messages kept in each of the per-type queues; the oldest messages are dropped beyond that.
+#define CALC_EVENTS_MAX_QUEUED (64)
+
 //! Internal structure containing information about the calculator, and function pointers.
 struct _calc_fncts {
     calc_model model;
@@ -99,16 +189,29 @@ struct _calc_fncts {
     int (*check_ready) (calc_handle * handle, uint8_t ** out_data, uint32_t * out_size);
     int (*get_infos) (calc_handle * handle, calc_infos * infos);
     int (*set_date_time) (calc_handle * handle, time_t timestamp);
-    int (*recv_screen) (calc_handle * handle, calc_screenshot_format format, uint8_t ** out_data, uint32_t * out_size);
+    int (*recv_screen) (calc_handle * handle, calc_screenshot_format format, hplibs_buffer_view * out_view);
     int (*send_file) (calc_handle * handle, files_var_entry * file);
     int (*recv_file) (calc_handle * handle, files_var_entry * request, files_var_entry ** out_file);
-    int (*recv_backup) (calc_handle * handle, files_var_entry *** out_vars);
+    int (*recv_backup) (calc_handle * handle, files_ve_vector * out_vars);
     int (*send_key) (calc_handle * handle, uint32_t code);
     int (*send_keys) (calc_handle * handle, const uint8_t * data, uint32_t size);
     int (*send_chat) (calc_handle * handle, const uint16_t * data, uint32_t size);
-    int (*recv_chat) (calc_handle * handle, uint16_t ** out_data, uint32_t * out_size);
+    int (*recv_chat) (calc_handle * handle, hplibs_buffer_view * out_view);
+    int (*poll_events) (calc_handle * handle, int timeout);
+    int (*send_files) (calc_handle * handle, files_var_entry ** files, uint32_t count, int * out_results);
+    int (*recv_files) (calc_handle * handle, files_var_entry ** requests, uint32_t count, files_ve_vector * out_vars, int * out_results);
+    // Receives a screenshot, sending a request first unless *inout_pending (the number of requests outstanding) is nonzero. If send_next is set, the next request is sent once a full reply is in; *inout_pending is updated accordingly.
+    int (*recv_screen_next) (calc_handle * handle, calc_screenshot_format format, int send_next, int * inout_pending, hplibs_buffer_view * out_view);
+    // Like recv_file, but the data of the file stays in the buffer it was received into, and is returned as *out_view; *out_file has no data.
+    int (*recv_file_view) (calc_handle * handle, files_var_entry * request, files_var_entry ** out_file, hplibs_buffer_view * out_view);
 };
 
+//! Allocation scope of a thread, saved by \a hpcalcs_alloc_scope_enter and restored by \a hpcalcs_alloc_scope_leave.
+typedef struct {
+    const hplibs_malloc_funcs * funcs;
+    hplibs_arena * arena;
+} calc_alloc_scope;
+
 //! Internal structure containing state about the calculator, returned and passed around by the user.
 struct _calc_handle {
     calc_model model;
@@ -118,6 +221,20 @@ struct _calc_handle {
     int attached; // Should be made explicitly atomic with GCC >= 4.7 or Clang, but int is atomic on most ISAs anyway.
     int open; // Should be made explicitly atomic with GCC >= 4.7 or Clang, but int is atomic on most ISAs anyway.
     int busy; // Should be made explicitly atomic with GCC >= 4.7 or Clang, but int is atomic on most ISAs anyway.
+    calc_event * events_head[CALC_EVENT_LAST];
+    calc_event * events_tail[CALC_EVENT_LAST];
+    uint32_t events_count[CALC_EVENT_LAST];
+    calc_event_callback event_callback;
+    void * event_user_data;
+    calc_entry_callback entry_callback;
+    void * entry_user_data;
+    hplibs_malloc_funcs alloc_funcs; ///< Allocator for the operations on this handle, if has_alloc_funcs is set.
+    int has_alloc_funcs;
+    hplibs_arena * arena; ///< Arena for the operations on this handle, takes precedence over alloc_funcs.
+    int operation_timeout; ///< Overall timeout (in ms) of each operation, 0 for none.
+    uint64_t operation_deadline; ///< Time (from get_monotonic_time_ms) at which the current operation times out, 0 for none.
+    calc_screen_stream * screen_stream; ///< Screen stream in progress, if any; the handle is busy meanwhile.
+    calc_screen_history * screen_history; ///< Recent screenshots, if enabled; only accessed under the lock of screenhistory.c.
 };
 
 
@@ -140,14 +257,32 @@ typedef struct
 } prime_raw_hid_pkt;
 
 
+//! Size of the storage embedded in virtual packets, used instead of a separate memory block by short commands.
+#define PRIME_VTL_PKT_INLINE_SIZE (16)
+
 //! Structure defining a virtual packet for the Prime, used at the middle layer of the protocol implementation (fragmented to / reassembled from raw packets).
 typedef struct
 {
     uint32_t size;
-    uint8_t * data;
+    uint8_t * data; ///< Either a memory block owned by the packet, or inline_data; use prime_vtl_pkt_detach_data to take it over.
     uint8_t cmd;
+    uint8_t inline_data[PRIME_VTL_PKT_INLINE_SIZE];
 } prime_vtl_pkt;
 
+//! Series of virtual packets received back to back, e.g. the files making up a backup.
+typedef struct
+{
+    uint8_t * data; ///< The messages, without the sequence numbers and the trailing padding of the raw packets.
+    uint32_t size;
+    uint32_t capacity;
+    uint32_t * offsets; ///< Offset of each message in \a data.
+    uint32_t count; ///< Number of messages.
+    uint32_t offsets_capacity;
+    //! If set by the caller, called with each message as soon as it is complete (or truncated); returning nonzero means that the callback is done with the message, which is then dropped from the stream.
+    int (*message_callback)(void * user_data, uint8_t * data, uint32_t size);
+    void * user_data;
+} prime_vtl_stream;
+
 
 #ifdef __cplusplus
 extern "C" {
@@ -249,6 +384,54 @@ HPEXPORT int HPCALL hpcalcs_cable_detach(calc_handle * handle);
  **/
 HPEXPORT cable_handle * HPCALL hpcalcs_cable_get(calc_handle * handle);
 
+/**
+ * \brief Sets the allocator used for the operations on the given calculator handle, instead of the one given to \a hpcalcs_init.
+ * Data returned by these operations must be released in an allocation scope of the handle (see \a hpcalcs_alloc_scope_enter).
+ * \param handle the calculator handle.
+ * \param alloc_funcs the allocator, copied; NULL for reverting to the library-wide allocator.
+ * \return 0 if the operation succeeded, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcalcs_handle_set_alloc_funcs(calc_handle * handle, hplibs_malloc_funcs * alloc_funcs);
+/**
+ * \brief Sets an arena from which all allocations made by the operations on the given calculator handle are served.
+ * Data returned by these operations (packets, entries, names, screenshots) remains valid until the arena is reset or deleted,
+ * releasing it with the usual functions is a no-op.
+ * \param handle the calculator handle.
+ * \param arena the arena, NULL for none.
+ * \return 0 if the operation succeeded, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcalcs_handle_set_arena(calc_handle * handle, hplibs_arena * arena);
+/**
+ * \brief Makes the allocations of the calling thread use the allocator or arena of the given calculator handle, until \a hpcalcs_alloc_scope_leave.
+ * The hpcalcs_calc_* functions do this on their own; this is useful e.g. for releasing the data they returned.
+ * \param handle the calculator handle.
+ * \param out_saved storage area for the scope active so far, to be passed to \a hpcalcs_alloc_scope_leave.
+ * \return 0 if the operation succeeded, nonzero otherwise.
+ * \note scopes can be nested, but must be left in reverse order, on the thread which entered them.
+ */
+HPEXPORT int HPCALL hpcalcs_alloc_scope_enter(calc_handle * handle, calc_alloc_scope * out_saved);
+/**
+ * \brief Restores the allocation scope active before \a hpcalcs_alloc_scope_enter.
+ * \param saved the scope stored by \a hpcalcs_alloc_scope_enter.
+ * \return 0 if the operation succeeded, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcalcs_alloc_scope_leave(const calc_alloc_scope * saved);
+
+/**
+ * \brief Gets the overall timeout (in ms) of the operations performed on the given calculator handle.
+ * \param handle the calculator handle.
+ * \return the current timeout, 0 if none or error.
+ */
+HPEXPORT int HPCALL hpcalcs_options_get_operation_timeout(calc_handle * handle);
+/**
+ * \brief Sets the overall timeout (in ms) of the operations performed on the given calculator handle.
+ * The timeouts of the individual reads are derived from the link speed measured by the cable, and capped by this one.
+ * \param handle the calculator handle.
+ * \param timeout the new timeout, 0 for none.
+ * \return 0 if the operation succeeded, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcalcs_options_set_operation_timeout(calc_handle * handle, int timeout);
+
 /**
  * \brief Checks whether the calculator is ready
  * \param handle the calculator handle.
@@ -280,6 +463,88 @@ HPEXPORT int HPCALL hpcalcs_calc_set_date_time(calc_handle * handle, time_t time
  * \return 0 upon success, nonzero otherwise.
  */
 HPEXPORT int HPCALL hpcalcs_calc_recv_screen(calc_handle * handle, calc_screenshot_format format, uint8_t ** out_data, uint32_t * out_size);
+/**
+ * \brief Retrieves a screenshot from the calculator, without copying it out of the buffer it was received into.
+ * \param handle the calculator handle.
+ * \param format the desired screenshot format.
+ * \param out_view storage area for a view of the screenshot contained in the calculator's reply, to be released with \a hplibs_buffer_view_release.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcalcs_calc_recv_screen_view(calc_handle * handle, calc_screenshot_format format, hplibs_buffer_view * out_view);
+/**
+ * \brief Starts receiving screenshots continuously, on a thread of the library.
+ * \param handle the calculator handle.
+ * \param format the desired screenshot format.
+ * \param callback function called with each frame which differs from the previous one.
+ * \param user_data opaque pointer passed to the callback.
+ * \return 0 upon success, nonzero otherwise.
+ * \note Where supported, the request for the next frame is sent as soon as the reply for the current one is in. The handle is busy until \a hpcalcs_calc_screen_stream_stop is called; the per-read timeouts apply to each frame, the operation timeout doesn't.
+ * \note The status reports received during the stream are handed to the event callback and queues when it stops, from the thread stopping it.
+ */
+HPEXPORT int HPCALL hpcalcs_calc_screen_stream_start(calc_handle * handle, calc_screenshot_format format, calc_screen_callback callback, void * user_data);
+/**
+ * \brief Stops a screen stream started by \a hpcalcs_calc_screen_stream_start, waiting for the frame in progress.
+ * \param handle the calculator handle.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcalcs_calc_screen_stream_stop(calc_handle * handle);
+/**
+ * \brief Retrieves the statistics of the screen stream in progress.
+ * \param handle the calculator handle.
+ * \param stats storage area for the statistics.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcalcs_calc_screen_stream_get_stats(calc_handle * handle, calc_screen_stream_stats * stats);
+/**
+ * \brief Starts keeping the recent screenshots received from the calculator, or changes the limits of the history.
+ * \param handle the calculator handle.
+ * \param max_frames maximum number of frames kept; the oldest ones are evicted first.
+ * \param max_bytes maximum memory taken by the images of the frames.
+ * \return 0 upon success, nonzero otherwise.
+ * \note Every screenshot received through \a hpcalcs_calc_recv_screen_view (and the functions built on it) or a screen stream is recorded, with the wall clock time of its reception. Identical images are kept once. The history survives the detaching of the cable; it is deleted with the handle.
+ */
+HPEXPORT int HPCALL hpcalcs_calc_screen_history_enable(calc_handle * handle, uint32_t max_frames, uint32_t max_bytes);
+/**
+ * \brief Stops keeping the recent screenshots, and deletes those kept.
+ * \param handle the calculator handle.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcalcs_calc_screen_history_disable(calc_handle * handle);
+/**
+ * \brief Retrieves the screenshot which was current at a given time, i.e. the last one received at or before it.
+ * \param handle the calculator handle.
+ * \param time_ms the time, in ms since the Epoch.
+ * \param out_time_ms storage area for the time the screenshot was received (may be NULL).
+ * \param out_format storage area for the format of the screenshot (may be NULL).
+ * \param out_view storage area for a copy of the screenshot, as returned by \a hpcalcs_calc_recv_screen_view, to be released with \a hplibs_buffer_view_release.
+ * \return 0 upon success, ERR_CALC_NO_FRAME if no such screenshot is kept, nonzero otherwise.
+ * \note This can be called while screenshots are being received, e.g. by a screen stream.
+ */
+HPEXPORT int HPCALL hpcalcs_calc_screen_history_get_frame(calc_handle * handle, uint64_t time_ms, uint64_t * out_time_ms, calc_screenshot_format * out_format, hplibs_buffer_view * out_view);
+/**
+ * \brief Lists the times of the screenshots kept which were received at or after a given time, oldest first.
+ * \param handle the calculator handle.
+ * \param since_ms the time, in ms since the Epoch; 0 for all the screenshots kept.
+ * \param out_times storage area for up to max_count times (may be NULL if max_count is 0).
+ * \param max_count the size of out_times.
+ * \param out_count storage area for the number of such screenshots, which may exceed max_count.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcalcs_calc_screen_history_get_times(calc_handle * handle, uint64_t since_ms, uint64_t * out_times, uint32_t max_count, uint32_t * out_count);
+/**
+ * \brief Retrieves the statistics of the screen history of a calculator handle.
+ * \param handle the calculator handle.
+ * \param stats storage area for the statistics.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcalcs_calc_screen_history_get_stats(calc_handle * handle, calc_screen_history_stats * stats);
+/**
+ * \brief Sets the maximum memory taken by the screen histories of all calculator handles together.
+ * \param max_bytes the limit, 0 for none (the default).
+ * \return 0 upon success, nonzero otherwise.
+ * \note A handle whose frame would exceed the limit evicts its own oldest frames; if that isn't enough, the frame is rejected. Lowering the limit doesn't evict frames already kept.
+ */
+HPEXPORT int HPCALL hpcalcs_screen_history_set_global_limit(uint64_t max_bytes);
 /**
  * \brief Sends a file to the calculator.
  * \param handle the calculator handle.
@@ -287,6 +552,16 @@ HPEXPORT int HPCALL hpcalcs_calc_recv_screen(calc_handle * handle, calc_screensh
  * \return 0 upon success, nonzero otherwise.
  */
 HPEXPORT int HPCALL hpcalcs_calc_send_file(calc_handle * handle, files_var_entry * file);
+/**
+ * \brief Sends multiple files to the calculator, as a single operation.
+ * \param handle the calculator handle.
+ * \param files the files to be sent, in order.
+ * \param count the number of files.
+ * \param out_results storage area for the result of each file (0 upon success), may be NULL. The files which weren't sent because of an earlier failure get ERR_CALC_SKIPPED.
+ * \return 0 upon success, the result of the first failed file otherwise.
+ * \note Where supported, the packet of the next file is built while the current file is being sent. The operation timeout applies to the whole batch.
+ */
+HPEXPORT int HPCALL hpcalcs_calc_send_files(calc_handle * handle, files_var_entry ** files, uint32_t count, int * out_results);
 /**
  * \brief Receives a file from the calculator.
  * \param handle the calculator handle.
@@ -295,6 +570,26 @@ HPEXPORT int HPCALL hpcalcs_calc_send_file(calc_handle * handle, files_var_entry
  * \return 0 upon success, nonzero otherwise.
  */
 HPEXPORT int HPCALL hpcalcs_calc_recv_file(calc_handle * handle, files_var_entry * request, files_var_entry ** out_file);
+/**
+ * \brief Receives a file from the calculator, without copying its data out of the buffer it was received into.
+ * \param handle the calculator handle.
+ * \param request information about the file to be received.
+ * \param out_file storage area for the name and type of the file received, in an entry without data; set to NULL if no file was received.
+ * \param out_view storage area for a view of the data of the file, to be released with \a hplibs_buffer_view_release.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcalcs_calc_recv_file_view(calc_handle * handle, files_var_entry * request, files_var_entry ** out_file, hplibs_buffer_view * out_view);
+/**
+ * \brief Receives multiple files from the calculator, as a single operation.
+ * \param handle the calculator handle.
+ * \param requests information (name, type) about the files to be received, in order.
+ * \param count the number of requests.
+ * \param out_vars vector the received files are appended to as they arrive, unless the entry callback takes them over (see \a hpcalcs_calc_set_entry_callback); may be NULL.
+ * \param out_results storage area for the result of each request (0 upon success), may be NULL. The requests which weren't made because of an earlier failure get ERR_CALC_SKIPPED.
+ * \return 0 upon success, the result of the first failed request otherwise.
+ * \note A file the calculator doesn't have is reported as a success, without an entry. Where supported, the next request is sent before the reply to the current one is read. The operation timeout applies to the whole batch.
+ */
+HPEXPORT int HPCALL hpcalcs_calc_recv_files(calc_handle * handle, files_var_entry ** requests, uint32_t count, files_ve_vector * out_vars, int * out_results);
 /**
  * \brief Receives a backup (made of multiple files) from the calculator.
  * \param handle the calculator handle.
@@ -302,6 +597,21 @@ HPEXPORT int HPCALL hpcalcs_calc_recv_file(calc_handle * handle, files_var_entry
  * \return 0 upon success, nonzero otherwise.
  */
 HPEXPORT int HPCALL hpcalcs_calc_recv_backup(calc_handle * handle, files_var_entry *** out_vars);
+/**
+ * \brief Receives a backup (made of multiple files) from the calculator, appending the files to the given vector.
+ * \param handle the calculator handle.
+ * \param out_vars the vector receiving the files, created with \a hpfiles_ve_vector_new; it contains the files received so far if an error occurs.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcalcs_calc_recv_backup_vector(calc_handle * handle, files_ve_vector * out_vars);
+/**
+ * \brief Sets the callback function handed each file of a backup as soon as it is received.
+ * \param handle the calculator handle.
+ * \param callback the callback, NULL for storing all files in the vector or array given to the operation.
+ * \param user_data opaque pointer passed to the callback.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcalcs_calc_set_entry_callback(calc_handle * handle, calc_entry_callback callback, void * user_data);
 /**
  * \brief Sends a single keypress to the calculator.
  * \param handle the calculator handle.
@@ -333,6 +643,63 @@ HPEXPORT int HPCALL hpcalcs_calc_send_chat(calc_handle * handle, const uint16_t
  * \return 0 upon success, nonzero otherwise.
  */
 HPEXPORT int HPCALL hpcalcs_calc_recv_chat(calc_handle * handle, uint16_t ** out_data, uint32_t * out_size);
+/**
+ * \brief Receives chat data from the calculator, without copying it out of the buffer it was received into.
+ * \param handle the calculator handle.
+ * \param out_view storage area for a view of the UTF-16LE chat data contained in the calculator's reply, to be released with \a hplibs_buffer_view_release.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcalcs_calc_recv_chat_view(calc_handle * handle, hplibs_buffer_view * out_view);
+/**
+ * \brief Reads the messages the calculator sent on its own initiative (chat, status reports, late replies), without waiting for a given command.
+ * Each message is handed to the callback set by \a hpcalcs_events_set_callback, and queued if the callback did not handle it.
+ * \param handle the calculator handle.
+ * \param timeout how long to wait (in ms) for the first message; 0 returns immediately if nothing is pending.
+ * \return 0 upon success (even if no message was received), nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcalcs_calc_poll_events(calc_handle * handle, int timeout);
+
+
+/**
+ * \brief Sets the callback function notified of every message routed by the demultiplexer.
+ * \param handle the calculator handle.
+ * \param callback the callback, NULL for queueing all messages.
+ * \param user_data opaque pointer passed to the callback.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcalcs_events_set_callback(calc_handle * handle, calc_event_callback callback, void * user_data);
+/**
+ * \brief Routes a message to the callback, or to the queue corresponding to its type.
+ * \param handle the calculator handle.
+ * \param type the type of the message.
+ * \param cmd the command byte of the message.
+ * \param data the message (assumed to be allocated with the same memory allocator as the one given to libhpcalcs).
+ * \param size the size of the message.
+ * \return 0 upon success, nonzero otherwise.
+ * \warning This function takes ownership of \a data, even upon failure.
+ * \note The message is copied into the event, so that it can be freed outside of the calls to libhpcalcs; \a data is freed right away.
+ */
+HPEXPORT int HPCALL hpcalcs_events_push(calc_handle * handle, calc_event_type type, uint8_t cmd, uint8_t * data, uint32_t size);
+/**
+ * \brief Removes the oldest queued message of the given type.
+ * \param handle the calculator handle.
+ * \param type the type of the message.
+ * \param cmd if nonzero, only a message with this command byte is removed.
+ * \param out_event storage area for the message, set to NULL if no message is queued. Use \a hpcalcs_event_del to free it.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcalcs_events_pop(calc_handle * handle, calc_event_type type, uint8_t cmd, calc_event ** out_event);
+/**
+ * \brief Deletes all queued messages of the given calculator handle.
+ * \param handle the calculator handle.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcalcs_events_clear(calc_handle * handle);
+/**
+ * \brief Deletes a message returned by \a hpcalcs_events_pop, along with its data.
+ * \param event the message to be deleted.
+ */
+HPEXPORT void HPCALL hpcalcs_event_del(calc_event * event);
 
 
 /**
@@ -364,6 +731,7 @@ HPEXPORT int HPCALL hpcalcs_probe_calc(cable_model cable, calc_model * out_calc)
  * \brief Creates a virtual packet for the Prime calculator, preallocating the given size.
  * \param size the size to be preallocated.
  * \return NULL if an error occurred, a virtual packet otherwise.
+ * \note Up to PRIME_VTL_PKT_INLINE_SIZE bytes are stored in the packet itself, so that \a data must not be freed or reallocated by the caller.
  */
 HPEXPORT prime_vtl_pkt * HPCALL prime_vtl_pkt_new(uint32_t size);
 /**
@@ -379,6 +747,18 @@ HPEXPORT prime_vtl_pkt * HPCALL prime_vtl_pkt_new_with_data_ptr(uint32_t size, u
  * \param pkt the packet to be deleted.
  */
 HPEXPORT void HPCALL prime_vtl_pkt_del(prime_vtl_pkt * pkt);
+/**
+ * \brief Takes over the data of a virtual packet for the Prime calculator, leaving the packet empty.
+ * \param pkt the packet.
+ * \return NULL if the packet has no data or an error occurred, otherwise a memory block allocated with the memory allocator given to libhpcalcs, which the caller must free.
+ * \note Data stored in the packet itself is copied to a new memory block.
+ */
+HPEXPORT uint8_t * HPCALL prime_vtl_pkt_detach_data(prime_vtl_pkt * pkt);
+/**
+ * \brief Frees the virtual packets kept for reuse by the calling thread.
+ * Called by hpcalcs_exit; threads which exit before that can call it to avoid leaking their packets.
+ */
+HPEXPORT void HPCALL prime_vtl_pkt_pool_trim(void);
 
 /**
  * \brief Sends the given virtual packet to the Prime calculator using given calculator handle.
@@ -394,6 +774,38 @@ HPEXPORT int HPCALL prime_send_data(calc_handle * handle, prime_vtl_pkt * pkt);
  * \return 0 upon success, nonzero otherwise.
  */
 HPEXPORT int HPCALL prime_recv_data(calc_handle * handle, prime_vtl_pkt * pkt);
+/**
+ * \brief Same as \a prime_recv_data, but with a different timeout for the first raw packet.
+ * \param handle the calculator handle.
+ * \param pkt the dest virtual packet.
+ * \param first_timeout the timeout (in ms) for the first raw packet, negative for the cable's timeout.
+ * \return 0 upon success (an empty packet means that nothing was received in time), nonzero otherwise.
+ */
+HPEXPORT int HPCALL prime_recv_data_timeout(calc_handle * handle, prime_vtl_pkt * pkt, int first_timeout);
+/**
+ * \brief Receives a series of messages from the Prime calculator into a single buffer, until an end marker or a timeout.
+ * Raw packets lost in the middle of a message don't stop the reception: the affected messages can be detected afterwards, e.g. through their CRC.
+ * \param handle the calculator handle.
+ * \param cmd the command starting each message, e.g. CMD_PRIME_RECV_FILE.
+ * \param end_cmd the command of the message marking the end of the series, e.g. CMD_PRIME_RECV_BACKUP.
+ * \param stream the dest stream, whose message_callback and user_data fields are set (or NULL) by the caller; to be cleared with \a prime_vtl_stream_clear even upon failure.
+ * \return 0 upon success (including when the end marker is missing, but messages were received), nonzero otherwise.
+ */
+HPEXPORT int HPCALL prime_recv_stream(calc_handle * handle, uint8_t cmd, uint8_t end_cmd, prime_vtl_stream * stream);
+/**
+ * \brief Returns the given message of a stream.
+ * \param stream the stream.
+ * \param index the index of the message.
+ * \param out_data storage area for a pointer to the message, which remains owned by the stream.
+ * \param out_size storage area for the size of the message.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL prime_vtl_stream_get_message(prime_vtl_stream * stream, uint32_t index, uint8_t ** out_data, uint32_t * out_size);
+/**
+ * \brief Frees the memory used by a stream, leaving its message_callback and user_data fields alone.
+ * \param stream the stream.
+ */
+HPEXPORT void HPCALL prime_vtl_stream_clear(prime_vtl_stream * stream);
 /**
  * \brief Returns the packet size corresponding to command \a cmd, possibly corrected by the contents of \a data.
  * \param cmd the command.
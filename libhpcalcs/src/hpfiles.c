@@ -44,13 +44,37 @@
 #include "utils.h"
 #include "gettext.h"
 
-hplibs_malloc_funcs hpfiles_alloc_funcs = {
+hplibs_malloc_funcs hpfiles_base_alloc_funcs = {
     .malloc = malloc,
     .calloc = calloc,
     .realloc = realloc,
     .free = free
 };
 
+// The allocations are routed to the allocator of the calculator handle being operated on, if any.
+static void * hpfiles_malloc(size_t size) {
+    return hplibs_scoped_malloc(&hpfiles_base_alloc_funcs, size);
+}
+
+static void * hpfiles_calloc(size_t nmemb, size_t size) {
+    return hplibs_scoped_calloc(&hpfiles_base_alloc_funcs, nmemb, size);
+}
+
+static void * hpfiles_realloc(void * ptr, size_t size) {
+    return hplibs_scoped_realloc(&hpfiles_base_alloc_funcs, ptr, size);
+}
+
+static void hpfiles_free(void * ptr) {
+    hplibs_scoped_free(&hpfiles_base_alloc_funcs, ptr);
+}
+
+hplibs_malloc_funcs hpfiles_alloc_funcs = {
+    .malloc = hpfiles_malloc,
+    .calloc = hpfiles_calloc,
+    .realloc = hpfiles_realloc,
+    .free = hpfiles_free
+};
+
 
 // not static, must be shared between instances
 int hpfiles_instance_count = 0;
@@ -116,7 +140,7 @@ HPEXPORT int HPCALL hpfiles_init(hpfiles_config * config) {
         if (!hpfiles_instance_count) {
             hpfiles_log_set_callback(log_callback);
             if (alloc_funcs != NULL) {
-                hpfiles_alloc_funcs = *alloc_funcs;
+                hpfiles_base_alloc_funcs = *alloc_funcs;
             }
             hpfiles_info(_("hpfiles library version %s"), hpfiles_version_get());
 
@@ -140,6 +164,7 @@ HPEXPORT int HPCALL hpfiles_exit(void) {
     }
     else {
         hpfiles_instance_count--;
+        hpfiles_ve_pool_trim();
 
         hpfiles_info(_("%s: exit succeeded"), __FUNCTION__);
         res = ERR_SUCCESS;
@@ -153,8 +178,29 @@ HPEXPORT const char* HPCALL hpfiles_version_get (void) {
 }
 
 
+//! Maximum number of deleted entries kept by each thread for reuse.
+#define FILES_VE_POOL_SIZE (32)
+
+// Backups and file transfers create and delete many entries: recycle them instead of going through the allocator.
+// As for Prime virtual packets, only entries allocated with the base allocator are kept, so the pool is bypassed within allocation scopes.
+static HPLIBS_THREAD_LOCAL files_var_entry * ve_pool[FILES_VE_POOL_SIZE];
+static HPLIBS_THREAD_LOCAL uint32_t ve_pool_count;
+
 HPEXPORT files_var_entry * HPCALL hpfiles_ve_create(void) {
-    return (hpfiles_alloc_funcs.calloc)(1, sizeof(files_var_entry));
+    files_var_entry * ve;
+    if (hplibs_alloc_scope_is_default()) {
+        if (ve_pool_count > 0) {
+            ve = ve_pool[--ve_pool_count];
+            memset(ve, 0, sizeof(*ve));
+        }
+        else {
+            ve = (hpfiles_alloc_funcs.calloc)(1, sizeof(files_var_entry));
+        }
+    }
+    else {
+        ve = (hpfiles_alloc_funcs.calloc)(1, sizeof(files_var_entry));
+    }
+    return ve;
 }
 
 HPEXPORT files_var_entry * HPCALL hpfiles_ve_create_with_size(uint32_t size) {
@@ -165,7 +211,7 @@ HPEXPORT files_var_entry * HPCALL hpfiles_ve_create_with_size(uint32_t size) {
             ve->size = size;
         }
         else {
-            (hpfiles_alloc_funcs.free)(ve);
+            hpfiles_ve_delete(ve);
             ve = NULL;
         }
     }
@@ -188,7 +234,7 @@ HPEXPORT files_var_entry * HPCALL hpfiles_ve_create_with_data(uint8_t * data, ui
             ve->size = size;
         }
         else {
-            (hpfiles_alloc_funcs.free)(ve);
+            hpfiles_ve_delete(ve);
             ve = NULL;
         }
     }
@@ -213,6 +259,31 @@ HPEXPORT files_var_entry * HPCALL hpfiles_ve_create_with_data_ptr(uint8_t * data
     return ve;
 }
 
+HPEXPORT files_var_entry * HPCALL hpfiles_ve_create_with_data_view(hplibs_buffer_view * view) {
+    files_var_entry * ve = NULL;
+    if (view != NULL) {
+        if (hplibs_release_func_matches(view->release, &hpfiles_alloc_funcs)) {
+            // The entry's data must be a block of its own: move the data to the start of the block, and hand the block over.
+            ve = hpfiles_ve_create_with_data_ptr(hplibs_buffer_view_flatten(view), view->size);
+            if (ve != NULL) {
+                memset(view, 0, sizeof(*view));
+            }
+        }
+        else {
+            // The block couldn't be freed along with the entry.
+            ve = hpfiles_ve_create_with_data(view->base + view->offset, view->size);
+            if (ve != NULL) {
+                hplibs_buffer_view_release(view);
+            }
+        }
+    }
+    else {
+        hpfiles_error("%s: view is NULL", __FUNCTION__);
+    }
+
+    return ve;
+}
+
 HPEXPORT files_var_entry * HPCALL hpfiles_ve_create_with_data_and_name(uint8_t * data, uint32_t size, const char16_t * name) {
     files_var_entry * ve = hpfiles_ve_create_with_data(data, size);
     if (ve != NULL) {
@@ -271,13 +342,24 @@ HPEXPORT files_var_entry * HPCALL hpfiles_ve_create_from_file(FILE * file, const
 HPEXPORT void HPCALL hpfiles_ve_delete(files_var_entry * ve) {
     if (ve != NULL) {
         (hpfiles_alloc_funcs.free)(ve->data);
-        (hpfiles_alloc_funcs.free)(ve);
+        if (ve_pool_count < FILES_VE_POOL_SIZE && hplibs_block_is_base(ve)) {
+            ve_pool[ve_pool_count++] = ve;
+        }
+        else {
+            (hpfiles_alloc_funcs.free)(ve);
+        }
     }
     else {
         hpfiles_error("%s: ve is NULL", __FUNCTION__);
     }
 }
 
+HPEXPORT void HPCALL hpfiles_ve_pool_trim(void) {
+    while (ve_pool_count > 0) {
+        (hpfiles_base_alloc_funcs.free)(ve_pool[--ve_pool_count]);
+    }
+}
+
 
 HPEXPORT void *hpfiles_ve_alloc_data(uint32_t size) {
     return (hpfiles_alloc_funcs.calloc)(sizeof(uint8_t), size + 1);
@@ -363,6 +445,92 @@ HPEXPORT files_var_entry ** HPCALL hpfiles_ve_resize_array(files_var_entry ** ar
     return (files_var_entry **)(hpfiles_alloc_funcs.realloc)(array, (element_count + 1) * sizeof(files_var_entry *));
 }
 
+//! Capacity of entry vectors created without an explicit capacity.
+#define FILES_VE_VECTOR_DEFAULT_CAPACITY (32)
+
+HPEXPORT files_ve_vector * HPCALL hpfiles_ve_vector_new(uint32_t capacity) {
+    files_ve_vector * vector = (hpfiles_alloc_funcs.malloc)(sizeof(*vector));
+    if (vector != NULL) {
+        if (capacity == 0) {
+            capacity = FILES_VE_VECTOR_DEFAULT_CAPACITY;
+        }
+        vector->entries = hpfiles_ve_create_array(capacity);
+        if (vector->entries != NULL) {
+            vector->count = 0;
+            vector->capacity = capacity + 1;
+        }
+        else {
+            (hpfiles_alloc_funcs.free)(vector);
+            vector = NULL;
+        }
+    }
+    if (vector == NULL) {
+        hpfiles_error("%s: failed to create vector", __FUNCTION__);
+    }
+    return vector;
+}
+
+HPEXPORT int HPCALL hpfiles_ve_vector_append(files_ve_vector * vector, files_var_entry * entry) {
+    int res = ERR_SUCCESS;
+    if (vector != NULL && entry != NULL) {
+        if (vector->count + 1 >= vector->capacity) {
+            uint32_t new_count = (vector->capacity - 1) * 2;
+            files_var_entry ** new_entries = hpfiles_ve_resize_array(vector->entries, new_count);
+            if (new_entries != NULL) {
+                vector->entries = new_entries;
+                vector->capacity = new_count + 1;
+            }
+            else {
+                res = ERR_MALLOC;
+                hpfiles_error("%s: couldn't grow vector", __FUNCTION__);
+            }
+        }
+        if (res == ERR_SUCCESS) {
+            vector->entries[vector->count++] = entry;
+            vector->entries[vector->count] = NULL;
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpfiles_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT uint32_t HPCALL hpfiles_ve_vector_get_count(files_ve_vector * vector) {
+    return (vector != NULL) ? vector->count : 0;
+}
+
+HPEXPORT files_var_entry * HPCALL hpfiles_ve_vector_get(files_ve_vector * vector, uint32_t index) {
+    return (vector != NULL && index < vector->count) ? vector->entries[index] : NULL;
+}
+
+HPEXPORT files_var_entry ** HPCALL hpfiles_ve_vector_detach_array(files_ve_vector * vector) {
+    files_var_entry ** array = NULL;
+    if (vector != NULL) {
+        array = vector->entries;
+        (hpfiles_alloc_funcs.free)(vector);
+    }
+    else {
+        hpfiles_error("%s: vector is NULL", __FUNCTION__);
+    }
+    return array;
+}
+
+HPEXPORT void HPCALL hpfiles_ve_vector_delete(files_ve_vector * vector) {
+    if (vector != NULL) {
+        uint32_t i;
+        for (i = 0; i < vector->count; i++) {
+            hpfiles_ve_delete(vector->entries[i]);
+        }
+        (hpfiles_alloc_funcs.free)(vector->entries);
+        (hpfiles_alloc_funcs.free)(vector);
+    }
+    else {
+        hpfiles_error("%s: vector is NULL", __FUNCTION__);
+    }
+}
+
 HPEXPORT void HPCALL hpfiles_ve_delete_array(files_var_entry ** array) {
 
     if (array != NULL) {
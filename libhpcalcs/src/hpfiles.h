@@ -146,6 +146,14 @@ HPEXPORT files_var_entry * HPCALL hpfiles_ve_create_with_data(uint8_t * data, ui
  * \return Pointer to files_var_entry, NULL if failed.
  */
 HPEXPORT files_var_entry * HPCALL hpfiles_ve_create_with_data_ptr(uint8_t * data, uint32_t size);
+/**
+ * \brief Creates a files_var_entry structure whose data is the data of the given buffer view.
+ * The memory block of the view becomes the data of the entry, the data being moved to its start if needed.
+ * Blocks which couldn't be freed along with the entry (e.g. coming from another allocator) are copied instead.
+ * \param view the buffer view, released or cleared upon success.
+ * \return Pointer to files_var_entry, NULL if failed.
+ */
+HPEXPORT files_var_entry * HPCALL hpfiles_ve_create_with_data_view(hplibs_buffer_view * view);
 /**
  * \brief Creates and fills a files_var_entry structure with the given data.
  * \param data the data to be copied
@@ -166,6 +174,11 @@ HPEXPORT files_var_entry * HPCALL hpfiles_ve_create_from_file(FILE * file, const
  * \param entry the entry
  */
 HPEXPORT void HPCALL hpfiles_ve_delete(files_var_entry * entry);
+/**
+ * \brief Frees the entries kept for reuse by the calling thread.
+ * Called by hpfiles_exit; threads which exit before that can call it to avoid leaking their entries.
+ */
+HPEXPORT void HPCALL hpfiles_ve_pool_trim(void);
 
 /**
  * \brief Allocates data for the \a data field of files_var_entry.
@@ -215,6 +228,128 @@ HPEXPORT files_var_entry ** HPCALL hpfiles_ve_resize_array(files_var_entry ** en
 HPEXPORT void HPCALL hpfiles_ve_delete_array(files_var_entry ** entries);
 
 
+//! Growable collection of files_var_entry pointers, e.g. the contents of a backup.
+typedef struct {
+    files_var_entry ** entries; ///< Always NULL-terminated (entries[count] == NULL), so that it can be passed to functions taking such arrays.
+    uint32_t count;
+    uint32_t capacity; ///< Number of slots of \a entries, including the terminating NULL.
+} files_ve_vector;
+
+/**
+ * \brief Creates an empty entry vector.
+ * \param capacity the number of entries to reserve space for, 0 for a default.
+ * \return the vector, NULL if failed.
+ **/
+HPEXPORT files_ve_vector * HPCALL hpfiles_ve_vector_new(uint32_t capacity);
+/**
+ * \brief Appends an entry to the vector, growing it geometrically if needed.
+ * \param vector the vector.
+ * \param entry the entry, now owned by the vector.
+ * \return 0 upon success, nonzero otherwise (the entry is then still owned by the caller).
+ **/
+HPEXPORT int HPCALL hpfiles_ve_vector_append(files_ve_vector * vector, files_var_entry * entry);
+/**
+ * \brief Returns the number of entries of the vector.
+ * \param vector the vector.
+ * \return the number of entries, 0 if vector is NULL.
+ **/
+HPEXPORT uint32_t HPCALL hpfiles_ve_vector_get_count(files_ve_vector * vector);
+/**
+ * \brief Returns the entry at the given index.
+ * \param vector the vector.
+ * \param index the index.
+ * \return the entry, NULL if index is out of range.
+ **/
+HPEXPORT files_var_entry * HPCALL hpfiles_ve_vector_get(files_ve_vector * vector, uint32_t index);
+/**
+ * \brief Deletes the vector, returning its entries as a NULL-terminated array, to be destroyed by \a hpfiles_ve_delete_array.
+ * \param vector the vector.
+ * \return the array, NULL if vector is NULL.
+ **/
+HPEXPORT files_var_entry ** HPCALL hpfiles_ve_vector_detach_array(files_ve_vector * vector);
+/**
+ * \brief Destroys the vector, including all entries and their data.
+ * \param vector the vector.
+ **/
+HPEXPORT void HPCALL hpfiles_ve_vector_delete(files_ve_vector * vector);
+
+
+//! Opaque type for pools of interned UTF-16LE names, shared by compact entries.
+typedef struct _files_string_pool files_string_pool;
+//! Opaque type for variable entries storing their name in a string pool, a fraction of the size of files_var_entry.
+typedef struct _files_compact_entry files_compact_entry;
+
+/**
+ * \brief Creates an empty string pool.
+ * \return the string pool, NULL if failed.
+ * \note a string pool must not be used by several threads at the same time.
+ **/
+HPEXPORT files_string_pool * HPCALL hpfiles_string_pool_new(void);
+/**
+ * \brief Deletes a string pool, and all strings interned into it.
+ * \param pool the string pool, which must outlive the compact entries created with it.
+ **/
+HPEXPORT void HPCALL hpfiles_string_pool_del(files_string_pool * pool);
+/**
+ * \brief Returns the copy of the given string stored in the pool, storing it if it wasn't there already.
+ * \param pool the string pool.
+ * \param str the UTF-16LE string, which does not need to be NUL-terminated.
+ * \param length the number of characters of the string.
+ * \return the NUL-terminated interned string, NULL if failed.
+ **/
+HPEXPORT const char16_t * HPCALL hpfiles_string_pool_intern(files_string_pool * pool, const char16_t * str, uint32_t length);
+/**
+ * \brief Returns the number of distinct strings stored in the pool.
+ * \param pool the string pool.
+ * \return the number of strings.
+ **/
+HPEXPORT uint32_t HPCALL hpfiles_string_pool_get_count(files_string_pool * pool);
+
+/**
+ * \brief Creates a compact entry.
+ * \param pool the string pool where the name is interned.
+ * \param name the NUL-terminated UTF-16LE name, truncated to FILES_VARNAME_MAXLEN characters.
+ * \param type the file type ID.
+ * \param data the pre-allocated data, can be NULL (assumed to be allocated with the same memory allocator as the one given to libhpfiles, if not using the default one).
+ * \param size the size of the data.
+ * \return the new entry, NULL if failed.
+ * \warning This function takes ownership of \a data.
+ **/
+HPEXPORT files_compact_entry * HPCALL hpfiles_ce_create(files_string_pool * pool, const char16_t * name, uint8_t type, uint8_t * data, uint32_t size);
+/**
+ * \brief Creates a compact entry from a files_var_entry, moving the data without copying it.
+ * \param pool the string pool where the name is interned.
+ * \param ve the entry, left without data upon success; it still needs to be deleted.
+ * \return the new entry, NULL if failed.
+ **/
+HPEXPORT files_compact_entry * HPCALL hpfiles_ce_create_from_ve(files_string_pool * pool, files_var_entry * ve);
+/**
+ * \brief Creates a files_var_entry from a compact entry, for functions which take the former.
+ * \param ce the compact entry, whose data is copied.
+ * \return the new entry, NULL if failed.
+ **/
+HPEXPORT files_var_entry * HPCALL hpfiles_ce_to_ve(files_compact_entry * ce);
+/**
+ * \brief Destroys the given compact entry, and its data.
+ * \param ce the compact entry.
+ **/
+HPEXPORT void HPCALL hpfiles_ce_delete(files_compact_entry * ce);
+//! Returns the interned, NUL-terminated name of the compact entry.
+HPEXPORT const char16_t * HPCALL hpfiles_ce_get_name(files_compact_entry * ce);
+//! Returns the number of characters of the name of the compact entry.
+HPEXPORT uint32_t HPCALL hpfiles_ce_get_name_length(files_compact_entry * ce);
+//! Returns the file type ID of the compact entry.
+HPEXPORT uint8_t HPCALL hpfiles_ce_get_type(files_compact_entry * ce);
+//! Returns the calculator model of the compact entry.
+HPEXPORT uint8_t HPCALL hpfiles_ce_get_model(files_compact_entry * ce);
+//! Returns nonzero if a packet loss was detected while receiving the compact entry.
+HPEXPORT int HPCALL hpfiles_ce_is_invalid(files_compact_entry * ce);
+//! Returns the size of the data of the compact entry.
+HPEXPORT uint32_t HPCALL hpfiles_ce_get_size(files_compact_entry * ce);
+//! Returns the data of the compact entry.
+HPEXPORT const uint8_t * HPCALL hpfiles_ce_get_data(files_compact_entry * ce);
+
+
 /**
  * \brief Converts a calculator model to a printable string.
  * \param model the calculator model.
@@ -29,6 +29,7 @@
 #define __HPLIBS_H__
 
 #include <stddef.h>
+#include <stdint.h>
 
 #include "export.h"
 
@@ -63,6 +64,20 @@ typedef struct {
    void (*free) (void *ptr); ///< A free()-compatible function
 } hplibs_malloc_funcs;
 
+//! Function releasing a memory block, e.g. the free function of the allocator the block was obtained from.
+typedef void (*hplibs_release_func)(void * block);
+
+//! View of data stored inside a larger memory block, e.g. the payload of a reply reassembled from raw packets, handed over without copying.
+typedef struct {
+    uint8_t * base; ///< The memory block, owned by the view.
+    uint32_t offset; ///< Offset of the data from \a base.
+    uint32_t size; ///< Size of the data.
+    hplibs_release_func release; ///< Function releasing \a base.
+} hplibs_buffer_view;
+
+//! Returns a pointer to the data of the given buffer view.
+#define HPLIBS_BUFFER_VIEW_DATA(view) ((view)->base + (view)->offset)
+
 //! USB Vendor ID of Hewlett-Packard.
 #define USB_VID_HP (0x03F0)
 //! USB Product ID of the Prime calculator in firmware revisions < 8151.
@@ -86,6 +101,44 @@ extern "C" {
  **/
 HPEXPORT int HPCALL hplibs_error_get(int number, char **message);
 
+//! Opaque type for bump-pointer arenas, from which all allocations are released at once.
+typedef struct _hplibs_arena hplibs_arena;
+
+//! Default size of the blocks of an arena, large enough for a screenshot.
+#define HPLIBS_ARENA_DEFAULT_BLOCK_SIZE (256 * 1024)
+
+/**
+ * \brief Creates an arena, to be set on calculator handles with \a hpcalcs_handle_set_arena.
+ * \param block_size the size of the blocks allocated by the arena, 0 for the default. It is rounded up to a multiple of 64 KiB.
+ * \return the arena, NULL if an error occurred.
+ * \note an arena must not be used by several threads at the same time.
+ **/
+HPEXPORT hplibs_arena * HPCALL hplibs_arena_new(size_t block_size);
+/**
+ * \brief Releases all blocks allocated from the arena, which can then be reused.
+ * \param arena the arena.
+ **/
+HPEXPORT void HPCALL hplibs_arena_reset(hplibs_arena * arena);
+/**
+ * \brief Deletes the arena, releasing all blocks allocated from it.
+ * \param arena the arena.
+ **/
+HPEXPORT void HPCALL hplibs_arena_del(hplibs_arena * arena);
+
+/**
+ * \brief Releases the memory block of a buffer view, and clears the view.
+ * \param view the buffer view.
+ * \note views of data allocated from an arena remain valid until the arena is reset, and releasing them does nothing.
+ **/
+HPEXPORT void HPCALL hplibs_buffer_view_release(hplibs_buffer_view * view);
+/**
+ * \brief Moves the data of a buffer view to the start of its memory block, so that the block can be handed over as a plain pointer.
+ * \param view the buffer view.
+ * \return the memory block, now starting with the data, which must be released with view->release; NULL if view is NULL.
+ * \note this is the only copy of the data left in the legacy pointer + size APIs, such as \a hpcalcs_calc_recv_screen.
+ **/
+HPEXPORT uint8_t * HPCALL hplibs_buffer_view_flatten(hplibs_buffer_view * view);
+
 #ifdef __cplusplus
 }
 #endif
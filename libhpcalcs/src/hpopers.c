@@ -111,6 +111,7 @@ HPEXPORT int HPCALL hpopers_exit(void) {
     }
     else {
         hpopers_instance_count--;
+        hpopers_screen_buffers_trim();
 
         hpopers_info(_("%s: exit succeeded"), __FUNCTION__);
         res = ERR_SUCCESS;
@@ -48,6 +48,84 @@ typedef struct {
 //! Latest revision of the \a hpopers_config struct layout supported by this version of the library.
 #define HPOPERS_CONFIG_VERSION (1)
 
+//! Structure passed to \a hpopers_calc_recv_backup_ex and \a hpopers_calc_send_backup_ex, contains options for backups to and from folders.
+typedef struct {
+    unsigned int version; ///< Options version number.
+    int use_journal; ///< Whether to record completed files in a journal kept in the folder, and skip the files already recorded there.
+    // Version 2.
+    int use_store; ///< For receiving: whether the folder is a content-addressed store, see \a hpopers_calc_recv_backup_ex. The journal isn't used then.
+    const char * device_name; ///< For receiving to a store: name of the device, used as the folder of its manifests; required, and unique to the device, e.g. its serial number.
+    // Version 3.
+    int incremental; ///< For receiving to a store: whether to compare the files with the previous manifest of the device, only store new or changed files, and write a change list.
+} hpopers_backup_options;
+
+//! Latest revision of the \a hpopers_backup_options struct layout supported by this version of the library.
+#define HPOPERS_BACKUP_OPTIONS_VERSION (3)
+
+//! Structure passed to \a hpopers_preview_scheduler_new, contains the polling parameters.
+typedef struct {
+    unsigned int version; ///< Options version number.
+    uint32_t interval_ms; ///< Time between two previews of each calculator; 1000 if 0.
+    uint32_t full_min_interval_ms; ///< Minimum time between two full screenshots of each calculator, however often its preview changes.
+    calc_screenshot_format full_format; ///< Format of the full screenshots, e.g. CALC_SCREENSHOT_FORMAT_PRIME_PNG_320x240x16.
+    uint32_t threads; ///< Number of calculators polled at the same time; 1 polls them in turn on the calling thread.
+} hpopers_preview_options;
+
+//! Latest revision of the \a hpopers_preview_options struct layout supported by this version of the library.
+#define HPOPERS_PREVIEW_OPTIONS_VERSION (1)
+
+//! Opaque type of the schedulers created by \a hpopers_preview_scheduler_new.
+typedef struct _hpopers_preview_scheduler hpopers_preview_scheduler;
+
+//! Structure passed to \a hpopers_key_macro_play, contains the playback parameters.
+typedef struct {
+    unsigned int version; ///< Options version number.
+    uint32_t chunk_size; ///< Maximum number of keys sent at once, so as not to overflow the input handling of the calculator; 16 if 0.
+    uint32_t chunk_interval_ms; ///< Pause between the chunks of a run of keys.
+    uint32_t change_timeout_ms; ///< How long wait:change waits for the screen to change; 5000 if 0.
+    calc_screenshot_format change_format; ///< Screenshot format compared by wait:change; CALC_SCREENSHOT_FORMAT_PRIME_PREVIEW if 0.
+} hpopers_key_macro_options;
+
+//! Latest revision of the \a hpopers_key_macro_options struct layout supported by this version of the library.
+#define HPOPERS_KEY_MACRO_OPTIONS_VERSION (1)
+
+//! Opaque type of the key scripts compiled by \a hpopers_key_macro_compile.
+typedef struct _hpopers_key_macro hpopers_key_macro;
+
+//! Structure passed to \a hpopers_test_run and \a hpopers_test_run_parallel, contains the parameters of the test runs.
+typedef struct {
+    unsigned int version; ///< Options version number.
+    calc_screenshot_format format; ///< Format of the screenshots watched by wait_stable and compared by expect; CALC_SCREENSHOT_FORMAT_PRIME_PNG_320x240x16 if 0.
+    uint32_t stable_ms; ///< How long the screen must stay unchanged for wait_stable without a duration; 300 if 0.
+    uint32_t stable_timeout_ms; ///< How long wait_stable waits at most; 10000 if 0.
+    uint32_t tolerance; ///< Largest difference of a color component between the screen and the golden image for a pixel to match.
+    uint32_t max_differing_pixels; ///< Number of pixels of a region allowed not to match.
+    const char * failure_folder; ///< If not NULL, folder receiving the screenshots which failed an expect step, as device<index>-line<line>.png.
+    const hpopers_key_macro_options * key_options; ///< Options of the keys steps, NULL for the defaults.
+} hpopers_test_options;
+
+//! Latest revision of the \a hpopers_test_options struct layout supported by this version of the library.
+#define HPOPERS_TEST_OPTIONS_VERSION (1)
+
+//! Outcome of a test run on a calculator.
+typedef struct {
+    int res; ///< 0 if the test passed, else the error of the failing step, e.g. ERR_OPER_MISMATCH for an expect step.
+    uint32_t line; ///< Line of the failing step, 0 if the test passed.
+    uint32_t differing_pixels; ///< Pixels which didn't match in the last expect step run.
+    uint32_t duration_ms; ///< Duration of the run.
+} hpopers_test_result;
+
+//! Opaque type of the test scripts compiled by \a hpopers_test_compile.
+typedef struct _hpopers_test hpopers_test;
+
+//! Opaque type of the recorders created by \a hpopers_recorder_new.
+typedef struct _hpopers_recorder hpopers_recorder;
+
+//! Name of the journal of the files received to a folder.
+#define HPOPERS_BACKUP_JOURNAL_NAME ".hpbackup.journal"
+//! Name of the journal of the files sent from a folder.
+#define HPOPERS_BACKUP_SENT_JOURNAL_NAME ".hpbackup.sent.journal"
+
 
 #ifdef __cplusplus
 extern "C" {
@@ -134,8 +212,159 @@ HPEXPORT int HPCALL hpopers_oper_recv_screen_png_r8g8b8_to_file(calc_handle * ha
  * \param out_data storage area for R8G8B8 screenshot.
  * \param out_size storage area for size of the R8G8B8 screenshot.
  * \return 0 upon success, nonzero otherwise.
+ * \note the PNG image is allocated with the allocator given to \a hpopers_init (malloc() by default). The decoding and encoding buffers are kept by the calling thread for the next conversions, see \a hpopers_screen_buffers_trim.
  */
 HPEXPORT int HPCALL hpopers_oper_convert_raw_screen_to_png_r8g8b8(uint8_t * in_data, uint32_t in_size, calc_screenshot_format format, uint8_t ** out_data, uint32_t * out_size);
+/**
+ * \brief Releases the buffers kept by the calling thread for converting screenshots.
+ */
+HPEXPORT void HPCALL hpopers_screen_buffers_trim(void);
+/**
+ * \brief Creates a scheduler watching the screens of several calculators through cheap previews (CALC_SCREENSHOT_FORMAT_PRIME_PREVIEW).
+ * \param options pointer to the options; full_format is required.
+ * \param callback function receiving the full screenshots, called from \a hpopers_preview_scheduler_poll.
+ * \param user_data opaque data passed to the callback.
+ * \return the scheduler, NULL upon failure.
+ * \note A full screenshot of a calculator is only taken when its preview changed, and at most once every full_min_interval_ms; a change seen in the meantime is caught up with afterwards.
+ */
+HPEXPORT hpopers_preview_scheduler * HPCALL hpopers_preview_scheduler_new(const hpopers_preview_options * options, calc_screen_callback callback, void * user_data);
+/**
+ * \brief Adds a calculator to the ones watched by a scheduler; its first preview is due immediately.
+ * \param scheduler the scheduler.
+ * \param handle the calculator handle, which must remain valid until it is removed or the scheduler is deleted.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpopers_preview_scheduler_add(hpopers_preview_scheduler * scheduler, calc_handle * handle);
+/**
+ * \brief Removes a calculator from the ones watched by a scheduler.
+ * \param scheduler the scheduler.
+ * \param handle the calculator handle.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpopers_preview_scheduler_remove(hpopers_preview_scheduler * scheduler, calc_handle * handle);
+/**
+ * \brief Polls the calculators whose preview is due, and hands the full screenshots taken over to the callback.
+ * \param scheduler the scheduler.
+ * \param out_wait_ms storage area for the time until the next preview is due (may be NULL).
+ * \return 0 upon success, nonzero otherwise. Failures of individual calculators are only counted, see \a hpopers_preview_scheduler_get_counts.
+ * \note The calls to the functions of a scheduler must not overlap; the callback runs on the calling thread.
+ */
+HPEXPORT int HPCALL hpopers_preview_scheduler_poll(hpopers_preview_scheduler * scheduler, uint32_t * out_wait_ms);
+/**
+ * \brief Retrieves the number of previews, full screenshots and failures of a scheduler so far.
+ * \param scheduler the scheduler.
+ * \param out_previews storage area for the number of previews received (may be NULL).
+ * \param out_full storage area for the number of full screenshots received (may be NULL).
+ * \param out_errors storage area for the number of failed polls (may be NULL).
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpopers_preview_scheduler_get_counts(hpopers_preview_scheduler * scheduler, uint32_t * out_previews, uint32_t * out_full, uint32_t * out_errors);
+/**
+ * \brief Deletes a scheduler; the calculator handles are left alone.
+ * \param scheduler the scheduler.
+ */
+HPEXPORT void HPCALL hpopers_preview_scheduler_del(hpopers_preview_scheduler * scheduler);
+/**
+ * \brief Creates a recorder writing screenshots to an animated PNG (APNG) file, as they come.
+ * \param out_file struct FILE pointer for storing the output; it must be seekable, and is left open by \a hpopers_recorder_close.
+ * \return the recorder, NULL upon failure.
+ * \note The image data of the PNG screenshots is copied without being decoded, so all frames must have the size and pixel format of the first one, e.g. come from the same screenshot format. Only the digest of the last frame is kept in memory.
+ */
+HPEXPORT hpopers_recorder * HPCALL hpopers_recorder_new(FILE * out_file);
+/**
+ * \brief Appends a screenshot to a recording.
+ * \param recorder the recorder.
+ * \param data the screenshot, as returned by e.g. \a hpcalcs_calc_recv_screen: a PNG image.
+ * \param size the size of the screenshot.
+ * \param time_ms the time the screenshot was taken at, in ms, from any clock as long as all the calls use the same; 0 for the monotonic clock of the library.
+ * \return 0 upon success, nonzero otherwise. After a write error, the recording is unusable and the next calls fail.
+ * \note A screenshot identical to the previous one only extends its display time.
+ */
+HPEXPORT int HPCALL hpopers_recorder_add_frame(hpopers_recorder * recorder, const uint8_t * data, uint32_t size, uint64_t time_ms);
+/**
+ * \brief Screen stream callback appending the frames to the recorder given as user_data, see \a hpcalcs_calc_screen_stream_start.
+ * \param handle the calculator handle.
+ * \param data the screenshot.
+ * \param size the size of the screenshot.
+ * \param user_data the recorder.
+ */
+HPEXPORT void HPCALL hpopers_recorder_screen_callback(calc_handle * handle, const uint8_t * data, uint32_t size, void * user_data);
+/**
+ * \brief Retrieves the number of frames written and of identical frames collapsed into them so far.
+ * \param recorder the recorder.
+ * \param out_frames storage area for the number of frames written (may be NULL).
+ * \param out_collapsed storage area for the number of identical frames collapsed (may be NULL).
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpopers_recorder_get_counts(hpopers_recorder * recorder, uint32_t * out_frames, uint32_t * out_collapsed);
+/**
+ * \brief Completes a recording, and deletes the recorder.
+ * \param recorder the recorder.
+ * \param end_time_ms the time the last frame stopped being displayed, on the clock of \a hpopers_recorder_add_frame; 0 for the monotonic clock of the library.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpopers_recorder_close(hpopers_recorder * recorder, uint64_t end_time_ms);
+/**
+ * \brief Compiles a key script into the key codes and waits to be played by \a hpopers_key_macro_play.
+ * \param script the script: tokens separated by spaces, commas or newlines, '#' starting a comment until the end of the line.
+ * \param out_macro storage area for the compiled script, to be deleted with \a hpopers_key_macro_del.
+ * \return 0 upon success, ERR_OPER_SCRIPT if a token is invalid (the line is logged), nonzero otherwise.
+ * \note A token is a key name (case-insensitive: apps, symb, up, help, esc, home, plot, left, right, view, cas, num, down, menu, vars, toolbox, template, xttn, abc, backspace or del, pow, sin, cos, tan, ln, log, sq, neg, paren, comma, enter, eex, alpha, shift, on, 0 to 9, div or /, mul or *, sub or -, add or +, dot or ., space) or a key code (code:<number>), optionally repeated (e.g. down*5); wait:<ms> to pause; or wait:change to wait for the screen to differ from the one before the previous keys.
+ */
+HPEXPORT int HPCALL hpopers_key_macro_compile(const char * script, hpopers_key_macro ** out_macro);
+/**
+ * \brief Retrieves the number of keys of a compiled script.
+ * \param macro the compiled script.
+ * \return the number of keys, 0 if macro is NULL.
+ */
+HPEXPORT uint32_t HPCALL hpopers_key_macro_get_key_count(const hpopers_key_macro * macro);
+/**
+ * \brief Plays a compiled script on a calculator.
+ * \param handle the calculator handle.
+ * \param macro the compiled script.
+ * \param options pointer to the options, NULL for the defaults.
+ * \return 0 upon success, ERR_CALC_OPERATION_TIMEOUT if the screen didn't change in time, nonzero otherwise.
+ * \note The keys between two waits are sent in chunks through \a hpcalcs_calc_send_keys, or one by one if the calculator doesn't support it.
+ */
+HPEXPORT int HPCALL hpopers_key_macro_play(calc_handle * handle, const hpopers_key_macro * macro, const hpopers_key_macro_options * options);
+/**
+ * \brief Deletes a compiled script.
+ * \param macro the compiled script.
+ */
+HPEXPORT void HPCALL hpopers_key_macro_del(hpopers_key_macro * macro);
+/**
+ * \brief Compiles a UI test script, loading its golden images.
+ * \param script the script, one step per line, '#' starting a comment: "keys <key script>" (see \a hpopers_key_macro_compile), "sleep <ms>", "wait_stable [<ms>]" to wait for the screen to stay unchanged that long, "expect <golden PNG> [<x> <y> <width> <height>]" to compare the screen, or a region of it, with a golden image.
+ * \param folder folder of the golden images given with relative paths, NULL for the current folder.
+ * \param out_test storage area for the compiled test, to be deleted with \a hpopers_test_del.
+ * \return 0 upon success, ERR_OPER_SCRIPT if a step is invalid (the line is logged), nonzero otherwise.
+ * \note Golden images can be made with \a hpopers_oper_recv_screen_png_r8g8b8_to_file; paths can't contain spaces.
+ */
+HPEXPORT int HPCALL hpopers_test_compile(const char * script, const char * folder, hpopers_test ** out_test);
+/**
+ * \brief Runs a compiled test on a calculator, stopping at the first failing step.
+ * \param handle the calculator handle.
+ * \param test the compiled test.
+ * \param options pointer to the options, NULL for the defaults.
+ * \param out_result storage area for the outcome of the run.
+ * \return 0 if the test passed, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpopers_test_run(calc_handle * handle, const hpopers_test * test, const hpopers_test_options * options, hpopers_test_result * out_result);
+/**
+ * \brief Runs a compiled test on several calculators at the same time, one thread per calculator (up to 8).
+ * \param handles the calculator handles.
+ * \param count the number of handles.
+ * \param test the compiled test.
+ * \param options pointer to the options, NULL for the defaults.
+ * \param out_results storage area for the outcomes of the runs, one per handle.
+ * \return 0 if the test passed on all calculators, else the error of the first one which failed.
+ */
+HPEXPORT int HPCALL hpopers_test_run_parallel(calc_handle ** handles, uint32_t count, const hpopers_test * test, const hpopers_test_options * options, hpopers_test_result * out_results);
+/**
+ * \brief Deletes a compiled test.
+ * \param test the compiled test.
+ */
+HPEXPORT void HPCALL hpopers_test_del(hpopers_test * test);
 /**
  * \brief Sends a file to the calculator.
  * \param handle the calculator handle.
@@ -162,6 +391,18 @@ HPEXPORT int HPCALL hpopers_calc_recv_file(calc_handle * handle, const char16_t
  * \note This shall be a wrapper over \a hpcalcs_calc_recv_backup .
  */
 HPEXPORT int HPCALL hpopers_calc_recv_backup(calc_handle * handle, const char * out_path);
+/**
+ * \brief Receives a backup (made of multiple files) from the calculator to a folder, with options.
+ * \param handle the calculator handle.
+ * \param out_path name of the folder receiving the files, created if needed.
+ * \param options pointer to the options, NULL for the defaults (no journal).
+ * \return 0 upon success, nonzero otherwise.
+ * \note The files received before an error are written nevertheless. With a journal, each file is recorded with its type, size and CRC once it is completely written; the files which are recorded, and still present with the same size, are not written again. Corrupted files are written, but not recorded.
+ * \note Receiving to a store fails with ERR_INVALID_PARAMETER if the options have no device name.
+ * \note In a store, the contents of each file are written once, as objects/ab/abcdef... where abcdef... is their SHA-256 in hex, and each backup is described by a manifest, manifests/<device>/<UTC date and time, to the millisecond>.manifest, listing the type, size, SHA-256, corruption flag ('C' or '-') and name of each file. Identical files, within a backup or across backups and devices, share their object.
+ * \note In incremental mode, the files listed with the same name, type, size and SHA-256 in the previous manifest of the device are considered unchanged, and not stored again. The other files are stored, and the differences are written to <UTC date and time>.changes.tsv next to the manifest: a header line, then one tab-separated line per file with the change ('A' added, 'M' modified, 'D' deleted), type, size, SHA-256 and name.
+ */
+HPEXPORT int HPCALL hpopers_calc_recv_backup_ex(calc_handle * handle, const char * out_path, const hpopers_backup_options * options);
 /**
  * \brief Sends a backup (made of multiple files) from a folder to the calculator.
  * \param handle the calculator handle.
@@ -170,6 +411,15 @@ HPEXPORT int HPCALL hpopers_calc_recv_backup(calc_handle * handle, const char *
  * \note This shall be a wrapper over \a hpcalcs_calc_send_file (called in a loop) .
  */
 HPEXPORT int HPCALL hpopers_calc_send_backup(calc_handle * handle, const char * in_path);
+/**
+ * \brief Sends a backup (made of multiple files) from a folder to the calculator, with options.
+ * \param handle the calculator handle.
+ * \param in_path name of the folder containing the files; hidden files and files of unknown type are skipped.
+ * \param options pointer to the options, NULL for the defaults (no journal).
+ * \return 0 upon success, nonzero otherwise.
+ * \note With a journal, each file is recorded with its type, size and CRC once it is sent; the files which are recorded, and weren't modified since, are not sent again.
+ */
+HPEXPORT int HPCALL hpopers_calc_send_backup_ex(calc_handle * handle, const char * in_path, const hpopers_backup_options * options);
 
 
 #ifdef __cplusplus
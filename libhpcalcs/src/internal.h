@@ -29,4 +29,100 @@ extern hplibs_malloc_funcs hpcables_alloc_funcs;
 extern hplibs_malloc_funcs hpcalcs_alloc_funcs;
 extern hplibs_malloc_funcs hpopers_alloc_funcs;
 
+//! Allocators given to hpfiles_init / hpcalcs_init, used outside of the operations on calculator handles with their own allocator.
+extern hplibs_malloc_funcs hpfiles_base_alloc_funcs;
+extern hplibs_malloc_funcs hpcalcs_base_alloc_funcs;
+
+#if defined(_MSC_VER)
+#define HPLIBS_THREAD_LOCAL __declspec(thread)
+#else
+#define HPLIBS_THREAD_LOCAL __thread
+#endif
+
+//! Allocates from the arena or allocator of the current allocation scope (see \a hpcalcs_alloc_scope_enter), or from \a base.
+void * hplibs_scoped_malloc(const hplibs_malloc_funcs * base, size_t size);
+//! calloc counterpart of \a hplibs_scoped_malloc.
+void * hplibs_scoped_calloc(const hplibs_malloc_funcs * base, size_t nmemb, size_t size);
+//! realloc counterpart of \a hplibs_scoped_malloc.
+void * hplibs_scoped_realloc(const hplibs_malloc_funcs * base, void * ptr, size_t size);
+//! free counterpart of \a hplibs_scoped_malloc. Blocks allocated from arenas are left alone.
+void hplibs_scoped_free(const hplibs_malloc_funcs * base, void * ptr);
+//! Returns nonzero if no calculator handle allocator or arena is in effect on the calling thread, i.e. allocations go to the base allocators.
+int hplibs_alloc_scope_is_default(void);
+//! Returns the function to be stored in buffer views for releasing blocks allocated now through the given dispatcher (e.g. &hpcalcs_alloc_funcs).
+hplibs_release_func hplibs_scoped_release_func(const hplibs_malloc_funcs * funcs);
+//! Returns nonzero if blocks released by \a release can instead be released now through the given dispatcher (e.g. &hpfiles_alloc_funcs).
+int hplibs_release_func_matches(hplibs_release_func release, const hplibs_malloc_funcs * funcs);
+//! Returns nonzero if freeing the given block now through a dispatcher would hand it to the base allocator, i.e. it doesn't come from an arena and no calculator handle allocator is in effect.
+int hplibs_block_is_base(const void * ptr);
+
+//! Pool of worker threads, see workers.c.
+typedef struct _hplibs_workers hplibs_workers;
+//! Function processing a job, called by the threads of a pool.
+typedef void (*hplibs_work_func)(void * job);
+//! Maximum number of jobs submitted to a pool and not taken back yet.
+#define HPLIBS_WORKERS_MAX_PENDING (64)
+//! Creates a pool of threads calling func on the submitted jobs; returns NULL if threads are unavailable, in which case the caller processes its jobs itself.
+hplibs_workers * hplibs_workers_new(uint32_t threads_count, hplibs_work_func func);
+//! Submits a job; fails if HPLIBS_WORKERS_MAX_PENDING jobs are already pending.
+int hplibs_workers_submit(hplibs_workers * workers, void * job);
+//! Returns the number of jobs submitted and not taken back yet.
+uint32_t hplibs_workers_get_pending(hplibs_workers * workers);
+//! Takes back the oldest submitted job once it was processed, waiting for it if wait is nonzero; returns NULL if it isn't ready or no job is pending.
+void * hplibs_workers_take(hplibs_workers * workers, int wait);
+//! Stops the threads of the pool and deletes it. Pending jobs are processed, but not handed back.
+void hplibs_workers_del(hplibs_workers * workers);
+
+//! Looks up the \a index-th Prime among the connected HID devices, reusing a recent enumeration if possible. \a out_path is allocated with hpcables_alloc_funcs.
+int hpcables_prime_hid_lookup(uint32_t index, uint16_t * out_pid, char ** out_path);
+//! Forces the next \a hpcables_prime_hid_lookup to enumerate the devices again.
+void hpcables_enumeration_invalidate(void);
+
+#ifdef __HPLIBS_CALCS_H__
+//! Hands an entry received from a calculator over to the handle's entry callback, or else appends it to \a out_vars (may be NULL). The entry is deleted if neither keeps it; returns ERR_MALLOC if \a out_vars couldn't grow.
+int hpcalcs_deliver_entry(calc_handle * handle, files_var_entry * entry, files_ve_vector * out_vars);
+//! Events held back from the callback and queues of their handle, up to CALC_EVENTS_MAX_QUEUED (the oldest are dropped beyond that).
+typedef struct {
+    calc_event * head;
+    calc_event * tail;
+    uint32_t count;
+} calc_event_list;
+//! Makes the events pushed by the calling thread go to \a list (NULL to stop) instead of the callback and queues of their handle, which only the thread running the handle's operations may touch; see events.c.
+void hpcalcs_events_hold(calc_event_list * list);
+//! Same as hpcalcs_events_push, but copies \a data, which stays owned by the caller.
+int hpcalcs_events_push_copy(calc_handle * handle, calc_event_type type, uint8_t cmd, const uint8_t * data, uint32_t size);
+//! Same as hpcalcs_events_pop, but leaves \a out_event NULL on the threads whose events are held, as the queues belong to the thread running the handle's operations.
+void hpcalcs_events_take(calc_handle * handle, calc_event_type type, uint8_t cmd, calc_event ** out_event);
+//! Deletes the queued replies to command \a cmd, which can't be replies to a request being sent now (no-op on the threads whose events are held).
+void hpcalcs_events_discard_replies(calc_handle * handle, uint8_t cmd);
+//! Hands the events held in \a list to the callback and queues of the handle, in order, and empties the list.
+void hpcalcs_events_release(calc_handle * handle, calc_event_list * list);
+//! Timeout (in ms) for the first packet of the replies which the calculator sends right away, e.g. to a standalone check_ready, derived from the speed of the link; see prime_vpkt.c.
+int prime_quick_reply_timeout(calc_handle * handle);
+//! Returns nonzero if the handle has neither its own allocator nor an arena, so that its operations may run on another thread than the caller's; see alloc.c.
+int hpcalcs_handle_uses_base_alloc(calc_handle * handle);
+//! Starts the threads of a screen stream on a busy handle, see screenstream.c.
+int hpcalcs_screen_stream_new(calc_handle * handle, calc_screenshot_format format, calc_screen_callback callback, void * user_data, calc_screen_stream ** out_stream);
+//! Stops the threads of a screen stream, waiting for the frame in progress, and deletes it.
+void hpcalcs_screen_stream_del(calc_screen_stream * stream);
+//! Copies the statistics of a screen stream.
+void hpcalcs_screen_stream_get_stats(calc_screen_stream * stream, calc_screen_stream_stats * stats);
+//! Records a screenshot received from the calculator in the handle's screen history, if enabled; see screenhistory.c.
+void hpcalcs_screen_history_record(calc_handle * handle, calc_screenshot_format format, const uint8_t * data, uint32_t size);
+#endif
+
+#ifdef __HPLIBS_OPERS_H__
+//! Decodes a PNG screenshot to R8G8B8 pixels, into a buffer of the calling thread which stays valid until its next decoding; see screen.c.
+int hpopers_screen_decode_r8g8b8(const uint8_t * data, uint32_t size, const uint8_t ** out_pixels, uint32_t * out_width, uint32_t * out_height);
+#endif
+
+#ifdef __HPLIBS_CABLES_H__
+//! Registers an open cable handle, so that it can be invalidated when its device is unplugged.
+void hpcables_hotplug_register(cable_handle * handle);
+//! Unregisters a cable handle registered by \a hpcables_hotplug_register.
+void hpcables_hotplug_unregister(cable_handle * handle);
+//! Lists the connected Primes as \a hpcables_enumerate_devices does, reusing a recent enumeration if possible.
+int hpcables_prime_hid_enumerate(cable_device_info ** out_devices, uint32_t * out_count);
+#endif
+
 #endif
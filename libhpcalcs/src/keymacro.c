@@ -0,0 +1,383 @@
+/*
+ * libhpcalcs: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+/**
+ * \file keymacro.c Higher-level operations: compiling and playing key scripts.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <hpopers.h>
+#include "internal.h"
+#include "logging.h"
+#include "error.h"
+#include "utils.h"
+
+//! Keys sent per packet if the options don't say.
+#define DEFAULT_CHUNK_SIZE (16)
+//! How long wait:change waits if the options don't say.
+#define DEFAULT_CHANGE_TIMEOUT_MS (5000)
+//! Longest token of a script.
+#define MAX_TOKEN_LENGTH (31)
+//! Highest repeat count of a key.
+#define MAX_REPEAT (10000)
+
+typedef enum {
+    STEP_KEYS, ///< Sends count key codes, from offset value of the codes.
+    STEP_DELAY, ///< Waits for value ms.
+    STEP_WAIT_CHANGE ///< Waits for the screen to differ from the one before the previous keys.
+} step_type;
+
+typedef struct {
+    step_type type;
+    uint32_t value;
+    uint32_t count;
+} macro_step;
+
+struct _hpopers_key_macro {
+    uint8_t * codes;
+    uint32_t codes_count;
+    uint32_t codes_capacity;
+    macro_step * steps;
+    uint32_t steps_count;
+    uint32_t steps_capacity;
+};
+
+typedef struct {
+    const char * name;
+    uint8_t code;
+} key_name;
+
+// Key numbers of the Prime, as returned by GETKEY.
+static const key_name prime_keys[] = {
+    { "apps", 0 }, { "symb", 1 }, { "up", 2 }, { "help", 3 }, { "esc", 4 }, { "home", 5 }, { "plot", 6 },
+    { "left", 7 }, { "right", 8 }, { "view", 9 }, { "cas", 10 }, { "num", 11 }, { "down", 12 }, { "menu", 13 },
+    { "vars", 14 }, { "toolbox", 15 }, { "template", 16 }, { "xttn", 17 }, { "abc", 18 }, { "backspace", 19 }, { "del", 19 },
+    { "pow", 20 }, { "sin", 21 }, { "cos", 22 }, { "tan", 23 }, { "ln", 24 }, { "log", 25 },
+    { "sq", 26 }, { "neg", 27 }, { "paren", 28 }, { "comma", 29 }, { "enter", 30 },
+    { "eex", 31 }, { "7", 32 }, { "8", 33 }, { "9", 34 }, { "div", 35 }, { "/", 35 },
+    { "alpha", 36 }, { "4", 37 }, { "5", 38 }, { "6", 39 }, { "mul", 40 }, { "*", 40 },
+    { "shift", 41 }, { "1", 42 }, { "2", 43 }, { "3", 44 }, { "sub", 45 }, { "-", 45 },
+    { "on", 46 }, { "0", 47 }, { "dot", 48 }, { ".", 48 }, { "space", 49 }, { "add", 50 }, { "+", 50 }
+};
+
+static int name_equals(const char * name, const char * token, uint32_t length) {
+    uint32_t i;
+    for (i = 0; i < length; i++) {
+        if (name[i] != (char)tolower((unsigned char)token[i])) {
+            return 0;
+        }
+    }
+    return name[length] == 0;
+}
+
+// Parses a decimal or hexadecimal number making up the whole of [token, token + length).
+static int parse_number(const char * token, uint32_t length, uint32_t max, uint32_t * out_value) {
+    char buffer[MAX_TOKEN_LENGTH + 1];
+    char * end;
+    unsigned long value;
+    memcpy(buffer, token, length);
+    buffer[length] = 0;
+    value = strtoul(buffer, &end, 0);
+    *out_value = (uint32_t)value;
+    return length > 0 && isdigit((unsigned char)buffer[0]) && *end == 0 && value <= max;
+}
+
+static int add_step(hpopers_key_macro * macro, step_type type, uint32_t value) {
+    int res = ERR_SUCCESS;
+    if (macro->steps_count == macro->steps_capacity) {
+        uint32_t new_capacity = macro->steps_capacity != 0 ? macro->steps_capacity * 2 : 16;
+        macro_step * new_steps = (macro_step *)(hpopers_alloc_funcs.realloc)(macro->steps, new_capacity * sizeof(*new_steps));
+        if (new_steps != NULL) {
+            macro->steps = new_steps;
+            macro->steps_capacity = new_capacity;
+        }
+        else {
+            res = ERR_MALLOC;
+        }
+    }
+    if (res == ERR_SUCCESS) {
+        macro_step * step = &macro->steps[macro->steps_count++];
+        step->type = type;
+        step->value = value;
+        step->count = 0;
+    }
+    return res;
+}
+
+// Appends a key, repeat times, to the run of keys ending the macro.
+static int add_keys(hpopers_key_macro * macro, uint8_t code, uint32_t repeat) {
+    int res = ERR_SUCCESS;
+    if (macro->steps_count == 0 || macro->steps[macro->steps_count - 1].type != STEP_KEYS) {
+        res = add_step(macro, STEP_KEYS, macro->codes_count);
+    }
+    if (res == ERR_SUCCESS && macro->codes_count + repeat > macro->codes_capacity) {
+        uint32_t new_capacity = macro->codes_capacity != 0 ? macro->codes_capacity : 64;
+        uint8_t * new_codes;
+        while (new_capacity < macro->codes_count + repeat) {
+            new_capacity *= 2;
+        }
+        new_codes = (uint8_t *)(hpopers_alloc_funcs.realloc)(macro->codes, new_capacity);
+        if (new_codes != NULL) {
+            macro->codes = new_codes;
+            macro->codes_capacity = new_capacity;
+        }
+        else {
+            res = ERR_MALLOC;
+        }
+    }
+    if (res == ERR_SUCCESS) {
+        memset(macro->codes + macro->codes_count, code, repeat);
+        macro->codes_count += repeat;
+        macro->steps[macro->steps_count - 1].count += repeat;
+    }
+    return res;
+}
+
+// Compiles a token: wait:<ms>, wait:change, or a key, as a name or code:<number>, optionally followed by *<repeat>.
+static int compile_token(hpopers_key_macro * macro, const char * token, uint32_t length) {
+    int res = ERR_OPER_SCRIPT;
+    uint32_t value;
+    if (length > 5 && name_equals("wait:", token, 5)) {
+        if (name_equals("change", token + 5, length - 5)) {
+            res = add_step(macro, STEP_WAIT_CHANGE, 0);
+        }
+        else if (parse_number(token + 5, length - 5, UINT32_MAX, &value)) {
+            res = add_step(macro, STEP_DELAY, value);
+        }
+    }
+    else {
+        uint32_t name_length = 1; // A lone '*' is the multiplication key.
+        uint32_t repeat = 1;
+        while (name_length < length && token[name_length] != '*') {
+            name_length++;
+        }
+        if (name_length == length || parse_number(token + name_length + 1, length - name_length - 1, MAX_REPEAT, &repeat)) {
+            if (name_length > 5 && name_equals("code:", token, 5)) {
+                if (parse_number(token + 5, name_length - 5, 0xFF, &value)) {
+                    res = add_keys(macro, (uint8_t)value, repeat);
+                }
+            }
+            else {
+                uint32_t i;
+                for (i = 0; i < sizeof(prime_keys) / sizeof(prime_keys[0]); i++) {
+                    if (name_equals(prime_keys[i].name, token, name_length)) {
+                        res = add_keys(macro, prime_keys[i].code, repeat);
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpopers_key_macro_compile(const char * script, hpopers_key_macro ** out_macro) {
+    int res;
+    if (script != NULL && out_macro != NULL) {
+        hpopers_key_macro * macro = (hpopers_key_macro *)(hpopers_alloc_funcs.calloc)(1, sizeof(*macro));
+        *out_macro = NULL;
+        if (macro != NULL) {
+            const char * ptr = script;
+            uint32_t line = 1;
+            res = ERR_SUCCESS;
+            while (res == ERR_SUCCESS && *ptr != 0) {
+                if (*ptr == '#') {
+                    while (*ptr != 0 && *ptr != '\n') {
+                        ptr++;
+                    }
+                }
+                else if (isspace((unsigned char)*ptr) || *ptr == ',') {
+                    if (*ptr == '\n') {
+                        line++;
+                    }
+                    ptr++;
+                }
+                else {
+                    uint32_t length = 0;
+                    while (ptr[length] != 0 && ptr[length] != ',' && ptr[length] != '#' && !isspace((unsigned char)ptr[length])) {
+                        length++;
+                    }
+                    res = (length <= MAX_TOKEN_LENGTH) ? compile_token(macro, ptr, length) : ERR_OPER_SCRIPT;
+                    if (res == ERR_OPER_SCRIPT) {
+                        hpopers_error("%s: line %" PRIu32 ": invalid token \"%.*s\"", __FUNCTION__, line, (int)length, ptr);
+                    }
+                    ptr += length;
+                }
+            }
+            if (res == ERR_SUCCESS) {
+                *out_macro = macro;
+                hpopers_info("%s: %" PRIu32 " keys in %" PRIu32 " steps", __FUNCTION__, macro->codes_count, macro->steps_count);
+            }
+            else {
+                hpopers_key_macro_del(macro);
+            }
+        }
+        else {
+            res = ERR_MALLOC;
+            hpopers_error("%s: couldn't allocate memory", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpopers_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT uint32_t HPCALL hpopers_key_macro_get_key_count(const hpopers_key_macro * macro) {
+    return macro != NULL ? macro->codes_count : 0;
+}
+
+// Fills in the default chunk size, change timeout and change detection format where the caller left them at 0.
+static int get_key_macro_options(const hpopers_key_macro_options * options, hpopers_key_macro_options * out_options) {
+    int res = ERR_SUCCESS;
+    memset(out_options, 0, sizeof(*out_options));
+    out_options->version = HPOPERS_KEY_MACRO_OPTIONS_VERSION;
+    if (options != NULL) {
+        if (options->version >= 1 && options->version <= HPOPERS_KEY_MACRO_OPTIONS_VERSION) {
+            out_options->chunk_size = options->chunk_size;
+            out_options->chunk_interval_ms = options->chunk_interval_ms;
+            out_options->change_timeout_ms = options->change_timeout_ms;
+            out_options->change_format = options->change_format;
+        }
+        else {
+            res = ERR_LIBRARY_CONFIG_VERSION;
+            hpopers_error("%s: unsupported options version %u", __FUNCTION__, options->version);
+        }
+    }
+    if (out_options->chunk_size == 0) {
+        out_options->chunk_size = DEFAULT_CHUNK_SIZE;
+    }
+    if (out_options->change_timeout_ms == 0) {
+        out_options->change_timeout_ms = DEFAULT_CHANGE_TIMEOUT_MS;
+    }
+    if (out_options->change_format == 0) {
+        // The preview is much cheaper to poll than a full screenshot.
+        out_options->change_format = CALC_SCREENSHOT_FORMAT_PRIME_PREVIEW;
+    }
+    return res;
+}
+
+static int get_screen_hash(calc_handle * handle, calc_screenshot_format format, uint64_t * out_hash) {
+    hplibs_buffer_view view;
+    int res;
+    memset(&view, 0, sizeof(view));
+    res = hpcalcs_calc_recv_screen_view(handle, format, &view);
+    if (res == ERR_SUCCESS && view.base != NULL) {
+        *out_hash = fnv1a_64_block(FNV1A_64_INIT, view.base + view.offset, view.size);
+    }
+    else if (res == ERR_SUCCESS) {
+        res = ERR_CALC_PACKET_FORMAT;
+    }
+    hplibs_buffer_view_release(&view);
+    return res;
+}
+
+static int send_chunk(calc_handle * handle, const uint8_t * codes, uint32_t count) {
+    int res = hpcalcs_calc_send_keys(handle, codes, count);
+    if (res == ERR_CALC_INVALID_FNCTS) {
+        uint32_t i;
+        res = ERR_SUCCESS;
+        for (i = 0; i < count && res == ERR_SUCCESS; i++) {
+            res = hpcalcs_calc_send_key(handle, codes[i]);
+        }
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpopers_key_macro_play(calc_handle * handle, const hpopers_key_macro * macro, const hpopers_key_macro_options * options) {
+    int res;
+    if (handle != NULL && macro != NULL) {
+        hpopers_key_macro_options macro_options;
+        res = get_key_macro_options(options, &macro_options);
+        if (res == ERR_SUCCESS) {
+            uint64_t reference = 0;
+            int has_reference = 0;
+            uint32_t i;
+            for (i = 0; i < macro->steps_count && res == ERR_SUCCESS; i++) {
+                const macro_step * step = &macro->steps[i];
+                if (step->type == STEP_KEYS) {
+                    uint32_t sent = 0;
+                    has_reference = 0;
+                    if (i + 1 < macro->steps_count && macro->steps[i + 1].type == STEP_WAIT_CHANGE) {
+                        res = get_screen_hash(handle, macro_options.change_format, &reference);
+                        has_reference = (res == ERR_SUCCESS);
+                    }
+                    while (res == ERR_SUCCESS && sent < step->count) {
+                        uint32_t count = step->count - sent;
+                        if (count > macro_options.chunk_size) {
+                            count = macro_options.chunk_size;
+                        }
+                        if (sent > 0 && macro_options.chunk_interval_ms > 0) {
+                            sleep_ms(macro_options.chunk_interval_ms);
+                        }
+                        res = send_chunk(handle, macro->codes + step->value + sent, count);
+                        sent += count;
+                    }
+                }
+                else if (step->type == STEP_DELAY) {
+                    sleep_ms(step->value);
+                }
+                else {
+                    uint64_t deadline = get_monotonic_time_ms() + macro_options.change_timeout_ms;
+                    uint64_t hash;
+                    if (!has_reference) {
+                        res = get_screen_hash(handle, macro_options.change_format, &reference);
+                    }
+                    while (res == ERR_SUCCESS) {
+                        res = get_screen_hash(handle, macro_options.change_format, &hash);
+                        if (res == ERR_SUCCESS && hash != reference) {
+                            break;
+                        }
+                        if (res == ERR_SUCCESS && get_monotonic_time_ms() >= deadline) {
+                            res = ERR_CALC_OPERATION_TIMEOUT;
+                            hpopers_error("%s: the screen didn't change within %" PRIu32 " ms", __FUNCTION__, macro_options.change_timeout_ms);
+                        }
+                    }
+                    has_reference = 0;
+                }
+            }
+            if (res != ERR_SUCCESS) {
+                hpopers_error("%s: failed at step %" PRIu32 ": %d", __FUNCTION__, i - 1, res);
+            }
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpopers_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT void HPCALL hpopers_key_macro_del(hpopers_key_macro * macro) {
+    if (macro != NULL) {
+        (hpopers_alloc_funcs.free)(macro->codes);
+        (hpopers_alloc_funcs.free)(macro->steps);
+        (hpopers_alloc_funcs.free)(macro);
+    }
+}
@@ -30,38 +30,237 @@
 #endif
 
 #include <inttypes.h>
+#include <string.h>
 
 #include <hidapi.h>
 
 #include <hplibs.h>
 #include <hpcalcs.h>
+#include "internal.h"
 #include "logging.h"
 #include "error.h"
+#include "utils.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 extern const cable_fncts cable_prime_hid_fncts;
 
+// How long (in ms) the result of an enumeration is reused, so that e.g. probing then opening walks the bus only once.
+#define PRIME_HID_ENUMERATION_TTL (1000)
+
+//! A device found by the enumeration.
+typedef struct {
+    uint16_t pid;
+    char * path;
+    char * serial; ///< Empty if unknown.
+} prime_hid_device;
+
+static struct {
+    int valid;
+    uint64_t time;
+    uint32_t count;
+    prime_hid_device * devices; // The devices with the first PID come first, as it used to be preferred.
+} enumeration_cache;
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t enumeration_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK_ENUMERATION() pthread_mutex_lock(&enumeration_mutex)
+#define UNLOCK_ENUMERATION() pthread_mutex_unlock(&enumeration_mutex)
+#else
+#define LOCK_ENUMERATION()
+#define UNLOCK_ENUMERATION()
+#endif
+
+static char * copy_path(const char * path) {
+    size_t len = strlen(path) + 1;
+    char * copy = (char *)(hpcables_alloc_funcs.malloc)(len);
+    if (copy != NULL) {
+        memcpy(copy, path, len);
+    }
+    return copy;
+}
+
+// hidapi reports serial numbers as wide strings; they are plain ASCII in practice.
+static char * copy_serial(const wchar_t * serial) {
+    size_t len = 0;
+    char * copy;
+    if (serial != NULL) {
+        while (serial[len] != 0) {
+            len++;
+        }
+    }
+    copy = (char *)(hpcables_alloc_funcs.malloc)(len + 1);
+    if (copy != NULL) {
+        size_t i;
+        for (i = 0; i < len; i++) {
+            copy[i] = (serial[i] >= 0x20 && serial[i] < 0x7F) ? (char)serial[i] : '?';
+        }
+        copy[len] = 0;
+    }
+    return copy;
+}
+
+// Must be called with the enumeration lock held.
+static void enumeration_clear(void) {
+    uint32_t i;
+    for (i = 0; i < enumeration_cache.count; i++) {
+        (hpcables_alloc_funcs.free)(enumeration_cache.devices[i].path);
+        (hpcables_alloc_funcs.free)(enumeration_cache.devices[i].serial);
+    }
+    (hpcables_alloc_funcs.free)(enumeration_cache.devices);
+    enumeration_cache.devices = NULL;
+    enumeration_cache.count = 0;
+    enumeration_cache.valid = 0;
+}
+
+// Must be called with the enumeration lock held.
+static void enumeration_refresh(uint64_t now) {
+    static const uint16_t pids[] = { USB_PID_PRIME1, USB_PID_PRIME2 };
+    // A single pass over the HP devices, for both PIDs.
+    struct hid_device_info * infos = hid_enumerate(USB_VID_HP, 0);
+    struct hid_device_info * info;
+    uint32_t count = 0;
+
+    enumeration_clear();
+    for (info = infos; info != NULL; info = info->next) {
+        if ((info->product_id == USB_PID_PRIME1 || info->product_id == USB_PID_PRIME2) && info->path != NULL) {
+            count++;
+        }
+    }
+    if (count != 0) {
+        enumeration_cache.devices = (prime_hid_device *)(hpcables_alloc_funcs.calloc)(count, sizeof(*enumeration_cache.devices));
+        if (enumeration_cache.devices != NULL) {
+            uint32_t i;
+            for (i = 0; i < sizeof(pids) / sizeof(pids[0]); i++) {
+                for (info = infos; info != NULL; info = info->next) {
+                    if (info->product_id == pids[i] && info->path != NULL) {
+                        prime_hid_device * device = &enumeration_cache.devices[enumeration_cache.count];
+                        device->path = copy_path(info->path);
+                        device->serial = copy_serial(info->serial_number);
+                        if (device->path != NULL && device->serial != NULL) {
+                            device->pid = info->product_id;
+                            enumeration_cache.count++;
+                        }
+                        else {
+                            (hpcables_alloc_funcs.free)(device->path);
+                            (hpcables_alloc_funcs.free)(device->serial);
+                            device->path = NULL;
+                            device->serial = NULL;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    enumeration_cache.time = now;
+    enumeration_cache.valid = 1;
+    hid_free_enumeration(infos);
+    hpcables_info("%s: enumerated %" PRIu32 " devices", __FUNCTION__, enumeration_cache.count);
+}
+
+void hpcables_enumeration_invalidate(void) {
+    LOCK_ENUMERATION();
+    enumeration_clear();
+    UNLOCK_ENUMERATION();
+}
+
+// Must be called with the enumeration lock held.
+static void enumeration_update(void) {
+    uint64_t now = get_monotonic_time_ms();
+    if (!enumeration_cache.valid || now - enumeration_cache.time > PRIME_HID_ENUMERATION_TTL) {
+        enumeration_refresh(now);
+    }
+    else {
+        hpcables_debug("%s: using cached enumeration", __FUNCTION__);
+    }
+}
+
+int hpcables_prime_hid_lookup(uint32_t index, uint16_t * out_pid, char ** out_path) {
+    int res;
+
+    LOCK_ENUMERATION();
+    enumeration_update();
+
+    if (index < enumeration_cache.count) {
+        const prime_hid_device * device = &enumeration_cache.devices[index];
+        res = ERR_SUCCESS;
+        if (out_pid != NULL) {
+            *out_pid = device->pid;
+        }
+        if (out_path != NULL) {
+            *out_path = copy_path(device->path);
+            if (*out_path == NULL) {
+                res = ERR_MALLOC;
+            }
+        }
+    }
+    else {
+        res = ERR_CABLE_PROBE_FAILED;
+    }
+    UNLOCK_ENUMERATION();
+    return res;
+}
+
+int hpcables_prime_hid_enumerate(cable_device_info ** out_devices, uint32_t * out_count) {
+    int res = ERR_SUCCESS;
+    cable_device_info * devices = NULL;
+    uint32_t count;
+
+    LOCK_ENUMERATION();
+    enumeration_update();
+    count = enumeration_cache.count;
+    if (count != 0) {
+        // A single block, holding the strings after the array, so that the caller frees it at once.
+        size_t size = count * sizeof(*devices);
+        uint32_t i;
+        for (i = 0; i < count; i++) {
+            size += strlen(enumeration_cache.devices[i].path) + 1 + strlen(enumeration_cache.devices[i].serial) + 1;
+        }
+        devices = (cable_device_info *)(hpcables_alloc_funcs.malloc)(size);
+        if (devices != NULL) {
+            char * strings = (char *)(devices + count);
+            for (i = 0; i < count; i++) {
+                const prime_hid_device * device = &enumeration_cache.devices[i];
+                size_t len;
+                devices[i].model = CABLE_PRIME_HID;
+                devices[i].vid = USB_VID_HP;
+                devices[i].pid = device->pid;
+                len = strlen(device->path) + 1;
+                memcpy(strings, device->path, len);
+                devices[i].path = strings;
+                strings += len;
+                len = strlen(device->serial) + 1;
+                memcpy(strings, device->serial, len);
+                devices[i].serial = strings;
+                strings += len;
+            }
+        }
+        else {
+            count = 0;
+            res = ERR_MALLOC;
+        }
+    }
+    UNLOCK_ENUMERATION();
+    *out_devices = devices;
+    *out_count = count;
+    return res;
+}
+
 static int cable_prime_hid_probe(cable_handle * handle) {
     int res;
     // In fact, we're not using handle here, but let's nevertheless flag misuse of the API.
     if (handle != NULL) {
         // Enumerating the device seems to do the job.
-        struct hid_device_info * info = hid_enumerate(USB_VID_HP, USB_PID_PRIME1);
-        if (info != NULL) {
-            hid_free_enumeration(info);
-            res = ERR_SUCCESS;
-            hpcables_info("%s: cable probe succeeded, PID=%04X", __FUNCTION__, USB_PID_PRIME1);
+        uint16_t pid;
+        res = hpcables_prime_hid_lookup(0, &pid, NULL);
+        if (res == ERR_SUCCESS) {
+            hpcables_info("%s: cable probe succeeded, PID=%04X", __FUNCTION__, pid);
         }
         else {
-            info = hid_enumerate(USB_VID_HP, USB_PID_PRIME2);
-            if (info != NULL) {
-                hid_free_enumeration(info);
-                res = ERR_SUCCESS;
-                hpcables_info("%s: cable probe succeeded, PID=%04X", __FUNCTION__, USB_PID_PRIME2);
-            }
-            else {
-                res = ERR_CABLE_PROBE_FAILED;
-                hpcables_error("%s: cable probe failed", __FUNCTION__);
-            }
+            res = ERR_CABLE_PROBE_FAILED;
+            hpcables_error("%s: cable probe failed", __FUNCTION__);
         }
     }
     else {
@@ -74,31 +273,52 @@ static int cable_prime_hid_probe(cable_handle * handle) {
 static int cable_prime_hid_open(cable_handle * handle) {
     int res;
     if (handle != NULL) {
-        hid_device * device_handle = hid_open(USB_VID_HP, USB_PID_PRIME1, NULL);
-        unsigned int pid = USB_PID_PRIME1;
+        // Open by path, so that the hotplug monitor can tell which handles are affected when a device vanishes.
+        hid_device * device_handle = NULL;
+        uint16_t pid = 0;
+        char * path = NULL;
+        int attempt;
+        if (handle->requested_path != NULL) {
+            // A given device, e.g. one of several calculators, and no other.
+            path = copy_path(handle->requested_path);
+            if (path != NULL) {
+                device_handle = hid_open_path(path);
+            }
+        }
+        for (attempt = 0; attempt < 2 && device_handle == NULL && handle->requested_path == NULL; attempt++) {
+            uint32_t index;
+            if (attempt != 0) {
+                // The cached enumeration may be stale.
+                hpcables_enumeration_invalidate();
+            }
+            // As hid_open used to, fall back to the next device (e.g. the second PID) when one can't be opened.
+            for (index = 0; device_handle == NULL && hpcables_prime_hid_lookup(index, &pid, &path) == ERR_SUCCESS; index++) {
+                device_handle = hid_open_path(path);
+                if (device_handle == NULL) {
+                    (hpcables_alloc_funcs.free)(path);
+                    path = NULL;
+                }
+            }
+        }
         if (device_handle) {
-device_handle_ok:
+            handle->path = path;
+            path = NULL;
             handle->model = CABLE_PRIME_HID;
             handle->handle = (void *)device_handle;
             handle->fncts = &cable_prime_hid_fncts;
             // Especially screenshots can take a while before beginning to send data.
+            // This is an upper bound: libhpcalcs lowers it for replies expected to come quickly, based on the measured link speed.
             handle->read_timeout = 8000;
             handle->open = 1;
             handle->busy = 0;
             res = ERR_SUCCESS;
-            hpcables_info("%s: cable open succeeded, PID=%04X", __FUNCTION__, pid);
+            hpcables_info("%s: cable open succeeded, path %s", __FUNCTION__, handle->path);
         }
         else {
-            device_handle = hid_open(USB_VID_HP, USB_PID_PRIME2, NULL);
-            pid = USB_PID_PRIME2;
-            if (device_handle) {
-                goto device_handle_ok;
-            }
-            else {
-                res = ERR_CABLE_NOT_OPEN;
-                hpcables_error("%s: cable open failed", __FUNCTION__);
-            }
+            res = ERR_CABLE_NOT_OPEN;
+            hpcables_error("%s: cable open failed", __FUNCTION__);
         }
+        (hpcables_alloc_funcs.free)(path);
     }
     else {
         res = ERR_INVALID_HANDLE;
@@ -114,6 +334,8 @@ static int cable_prime_hid_close(cable_handle * handle) {
         if (device_handle != NULL) {
             if (handle->open) {
                 hid_close(device_handle);
+                (hpcables_alloc_funcs.free)(handle->path);
+                handle->path = NULL;
                 handle->model = CABLE_NUL;
                 handle->handle = NULL;
                 handle->fncts = NULL;
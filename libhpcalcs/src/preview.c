@@ -0,0 +1,272 @@
+/*
+ * libhpcalcs: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+/**
+ * \file preview.c Higher-level operations: watching the screens of several calculators through previews.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <hpopers.h>
+#include "internal.h"
+#include "logging.h"
+#include "error.h"
+#include "utils.h"
+
+//! Time between two previews of a calculator if the options don't say.
+#define DEFAULT_INTERVAL_MS (1000)
+
+//! A calculator watched by a scheduler, also the job handed to the worker threads.
+typedef struct {
+    calc_handle * handle;
+    const hpopers_preview_options * options;
+    uint64_t next_preview; ///< Monotonic time at which the next preview is due.
+    uint64_t last_full; ///< Monotonic time of the last full screenshot, 0 if none.
+    uint64_t hash; ///< Hash of the preview the last full screenshot was taken for.
+    int has_hash;
+    // Outcome of the current poll.
+    int res;
+    int previewed;
+    hplibs_buffer_view full;
+} preview_device;
+
+struct _hpopers_preview_scheduler {
+    hpopers_preview_options options;
+    calc_screen_callback callback;
+    void * user_data;
+    preview_device * devices;
+    uint32_t count;
+    uint32_t capacity;
+    hplibs_workers * workers;
+    uint32_t previews;
+    uint32_t fulls;
+    uint32_t errors;
+};
+
+// Takes a preview, and a full screenshot if the preview changed since the last one and the rate allows it.
+static void poll_device(void * job) {
+    preview_device * device = (preview_device *)job;
+    hplibs_buffer_view preview;
+
+    memset(&preview, 0, sizeof(preview));
+    memset(&device->full, 0, sizeof(device->full));
+    device->previewed = 0;
+    device->res = hpcalcs_calc_recv_screen_view(device->handle, CALC_SCREENSHOT_FORMAT_PRIME_PREVIEW, &preview);
+    if (device->res == ERR_SUCCESS && preview.base != NULL) {
+        uint64_t hash = fnv1a_64_block(FNV1A_64_INIT, preview.base + preview.offset, preview.size);
+        uint64_t now = get_monotonic_time_ms();
+        device->previewed = 1;
+        if (   (!device->has_hash || hash != device->hash)
+            && (device->last_full == 0 || now - device->last_full >= device->options->full_min_interval_ms)) {
+            device->res = hpcalcs_calc_recv_screen_view(device->handle, device->options->full_format, &device->full);
+            if (device->res == ERR_SUCCESS && device->full.base != NULL) {
+                // The hash is only recorded once the full screenshot is in, so that a failed one is taken again.
+                device->hash = hash;
+                device->has_hash = 1;
+                device->last_full = now;
+            }
+            else {
+                hplibs_buffer_view_release(&device->full);
+            }
+        }
+    }
+    hplibs_buffer_view_release(&preview);
+}
+
+static void collect_device(hpopers_preview_scheduler * scheduler, preview_device * device) {
+    if (device->previewed) {
+        scheduler->previews++;
+    }
+    if (device->res != ERR_SUCCESS) {
+        scheduler->errors++;
+        hpopers_warning("%s: polling calculator %p failed: %d", __FUNCTION__, (void *)device->handle, device->res);
+    }
+    else if (device->full.base != NULL) {
+        scheduler->fulls++;
+        if (scheduler->callback != NULL) {
+            (*scheduler->callback)(device->handle, device->full.base + device->full.offset, device->full.size, scheduler->user_data);
+        }
+    }
+    hplibs_buffer_view_release(&device->full);
+}
+
+HPEXPORT hpopers_preview_scheduler * HPCALL hpopers_preview_scheduler_new(const hpopers_preview_options * options, calc_screen_callback callback, void * user_data) {
+    hpopers_preview_scheduler * scheduler = NULL;
+    if (options != NULL) {
+        if (options->version >= 1 && options->version <= HPOPERS_PREVIEW_OPTIONS_VERSION) {
+            scheduler = (hpopers_preview_scheduler *)(hpopers_alloc_funcs.calloc)(1, sizeof(*scheduler));
+            if (scheduler != NULL) {
+                scheduler->options = *options;
+                scheduler->options.version = HPOPERS_PREVIEW_OPTIONS_VERSION;
+                if (scheduler->options.interval_ms == 0) {
+                    scheduler->options.interval_ms = DEFAULT_INTERVAL_MS;
+                }
+                scheduler->callback = callback;
+                scheduler->user_data = user_data;
+                if (scheduler->options.threads > 1) {
+                    // Without threads, the calculators are polled in turn.
+                    scheduler->workers = hplibs_workers_new(scheduler->options.threads, poll_device);
+                }
+            }
+            else {
+                hpopers_error("%s: couldn't allocate memory", __FUNCTION__);
+            }
+        }
+        else {
+            hpopers_error("%s: unsupported options version %u", __FUNCTION__, options->version);
+        }
+    }
+    else {
+        hpopers_error("%s: options is NULL", __FUNCTION__);
+    }
+    return scheduler;
+}
+
+HPEXPORT int HPCALL hpopers_preview_scheduler_add(hpopers_preview_scheduler * scheduler, calc_handle * handle) {
+    int res = ERR_SUCCESS;
+    if (scheduler != NULL && handle != NULL) {
+        if (scheduler->count == scheduler->capacity) {
+            uint32_t new_capacity = scheduler->capacity != 0 ? scheduler->capacity * 2 : 8;
+            preview_device * new_devices = (preview_device *)(hpopers_alloc_funcs.realloc)(scheduler->devices, new_capacity * sizeof(*new_devices));
+            if (new_devices != NULL) {
+                scheduler->devices = new_devices;
+                scheduler->capacity = new_capacity;
+            }
+            else {
+                res = ERR_MALLOC;
+                hpopers_error("%s: couldn't allocate memory", __FUNCTION__);
+            }
+        }
+        if (res == ERR_SUCCESS) {
+            preview_device * device = &scheduler->devices[scheduler->count++];
+            memset(device, 0, sizeof(*device));
+            device->handle = handle;
+            device->options = &scheduler->options;
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpopers_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpopers_preview_scheduler_remove(hpopers_preview_scheduler * scheduler, calc_handle * handle) {
+    int res = ERR_INVALID_PARAMETER;
+    if (scheduler != NULL && handle != NULL) {
+        uint32_t i;
+        for (i = 0; i < scheduler->count; i++) {
+            if (scheduler->devices[i].handle == handle) {
+                memmove(&scheduler->devices[i], &scheduler->devices[i + 1], (scheduler->count - i - 1) * sizeof(*scheduler->devices));
+                scheduler->count--;
+                res = ERR_SUCCESS;
+                break;
+            }
+        }
+        if (res != ERR_SUCCESS) {
+            hpopers_error("%s: calculator not watched by the scheduler", __FUNCTION__);
+        }
+    }
+    else {
+        hpopers_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpopers_preview_scheduler_poll(hpopers_preview_scheduler * scheduler, uint32_t * out_wait_ms) {
+    int res;
+    if (scheduler != NULL) {
+        uint64_t now = get_monotonic_time_ms();
+        uint64_t next;
+        preview_device * device;
+        uint32_t i;
+
+        for (i = 0; i < scheduler->count; i++) {
+            device = &scheduler->devices[i];
+            if (device->next_preview <= now) {
+                device->next_preview = now + scheduler->options.interval_ms;
+                if (scheduler->workers != NULL && hpcalcs_handle_uses_base_alloc(device->handle)) {
+                    while (hplibs_workers_submit(scheduler->workers, device) != ERR_SUCCESS) {
+                        collect_device(scheduler, (preview_device *)hplibs_workers_take(scheduler->workers, 1));
+                    }
+                }
+                else {
+                    poll_device(device);
+                    collect_device(scheduler, device);
+                }
+            }
+        }
+        while ((device = (preview_device *)hplibs_workers_take(scheduler->workers, 1)) != NULL) {
+            collect_device(scheduler, device);
+        }
+
+        if (out_wait_ms != NULL) {
+            now = get_monotonic_time_ms();
+            next = now + scheduler->options.interval_ms;
+            for (i = 0; i < scheduler->count; i++) {
+                if (scheduler->devices[i].next_preview < next) {
+                    next = scheduler->devices[i].next_preview;
+                }
+            }
+            *out_wait_ms = (next > now) ? (uint32_t)(next - now) : 0;
+        }
+        res = ERR_SUCCESS;
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpopers_error("%s: scheduler is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpopers_preview_scheduler_get_counts(hpopers_preview_scheduler * scheduler, uint32_t * out_previews, uint32_t * out_full, uint32_t * out_errors) {
+    int res;
+    if (scheduler != NULL) {
+        if (out_previews != NULL) {
+            *out_previews = scheduler->previews;
+        }
+        if (out_full != NULL) {
+            *out_full = scheduler->fulls;
+        }
+        if (out_errors != NULL) {
+            *out_errors = scheduler->errors;
+        }
+        res = ERR_SUCCESS;
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpopers_error("%s: scheduler is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT void HPCALL hpopers_preview_scheduler_del(hpopers_preview_scheduler * scheduler) {
+    if (scheduler != NULL) {
+        hplibs_workers_del(scheduler->workers);
+        (hpopers_alloc_funcs.free)(scheduler->devices);
+        (hpopers_alloc_funcs.free)(scheduler);
+    }
+}
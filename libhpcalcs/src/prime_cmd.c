@@ -31,6 +31,7 @@
 
 #include <hpcalcs.h>
 #include "prime_cmd.h"
+#include "internal.h"
 #include "logging.h"
 #include "error.h"
 #include "utils.h"
@@ -40,7 +41,8 @@
 #include <string.h>
 #include <wchar.h>
 
-static inline uint16_t crc16_block(const uint8_t * buffer, uint32_t len) {
+// Continues the CRC of data split into several blocks.
+static inline uint16_t crc16_update(uint16_t crc, const uint8_t * buffer, uint32_t len) {
     static const uint16_t ccitt_crc16_table[256] = {
         0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
         0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
@@ -75,44 +77,91 @@ static inline uint16_t crc16_block(const uint8_t * buffer, uint32_t len) {
         0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
         0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0
     };
-    uint16_t crc = 0;
-
     while (len--) {
        crc = ccitt_crc16_table[(crc >> 8) ^ *buffer++] ^ (crc << 8);
     }
     return crc;
 }
 
-static int read_vtl_pkt(calc_handle * handle, uint8_t cmd, prime_vtl_pkt ** pkt, int packet_contains_header) {
+static inline uint16_t crc16_block(const uint8_t * buffer, uint32_t len) {
+    return crc16_update(0, buffer, len);
+}
+
+// Hands the reply data starting at offset over to the caller, without copying it: received replies never use the inline storage.
+static void detach_view(prime_vtl_pkt * pkt, uint32_t offset, hplibs_buffer_view * view) {
+    view->size = pkt->size - offset;
+    view->base = prime_vtl_pkt_detach_data(pkt);
+    view->offset = offset;
+    view->release = hplibs_scoped_release_func(&hpcalcs_alloc_funcs);
+}
+
+// first_timeout is as for prime_recv_data_timeout.
+static int read_vtl_pkt(calc_handle * handle, uint8_t cmd, prime_vtl_pkt ** pkt, int first_timeout) {
     int res;
-    (void)packet_contains_header;
-    *pkt = prime_vtl_pkt_new(0);
-    if (*pkt != NULL) {
-        (*pkt)->cmd = cmd;
-        res = prime_recv_data(handle, *pkt);
-        if (res == ERR_SUCCESS) {
-            if ((*pkt)->size > 0) {
-                if ((*pkt)->data[0] == (*pkt)->cmd) {
-                    hpcalcs_debug("%s: command matches returned data", __FUNCTION__);
+    calc_event * event = NULL;
+
+    // The message may already have been received by an earlier read, or by hpcalcs_calc_poll_events.
+    // Stale replies were discarded when the request was sent.
+    hpcalcs_events_take(handle, (cmd == CMD_PRIME_RECV_CHAT) ? CALC_EVENT_CHAT : CALC_EVENT_REPLY, cmd, &event);
+    if (event != NULL) {
+        hpcalcs_info("%s: using queued message", __FUNCTION__);
+        *pkt = prime_vtl_pkt_new(event->size);
+        if (*pkt != NULL) {
+            (*pkt)->cmd = cmd;
+            if (event->size != 0) {
+                memcpy((*pkt)->data, event->data, event->size);
+            }
+            res = ERR_SUCCESS;
+        }
+        else {
+            res = ERR_MALLOC;
+            hpcalcs_error("%s: couldn't create packet", __FUNCTION__);
+        }
+        hpcalcs_event_del(event);
+    }
+    else {
+        for (;;) {
+            *pkt = prime_vtl_pkt_new(0);
+            if (*pkt != NULL) {
+                (*pkt)->cmd = cmd;
+                res = prime_recv_data_timeout(handle, *pkt, first_timeout);
+                if (res == ERR_SUCCESS) {
+                    if ((*pkt)->size > 0) {
+                        if ((*pkt)->data[0] == (*pkt)->cmd) {
+                            hpcalcs_debug("%s: command matches returned data", __FUNCTION__);
+                        }
+                        else if (   (*pkt)->data[0] == CMD_PRIME_RECV_CHAT && (*pkt)->size >= 2 && (*pkt)->data[1] == 0x01
+                                 && (*pkt)->cmd != CMD_PRIME_RECV_CHAT) {
+                            // Unsolicited chat message: queue it, and keep waiting for the reply.
+                            hpcalcs_info("%s: routing chat message to the chat queue", __FUNCTION__);
+                            res = hpcalcs_events_push_copy(handle, CALC_EVENT_CHAT, (*pkt)->data[0], (*pkt)->data, (*pkt)->size);
+                            prime_vtl_pkt_del(*pkt);
+                            *pkt = NULL;
+                            if (res == ERR_SUCCESS) {
+                                continue;
+                            }
+                        }
+                        else {
+                            hpcalcs_debug("%s: command does not match returned data", __FUNCTION__);
+                            // It's not necessarily an error.
+                        }
+                    }
+                    else {
+                        hpcalcs_info("%s: empty packet", __FUNCTION__);
+                    }
                 }
                 else {
-                    hpcalcs_debug("%s: command does not match returned data", __FUNCTION__);
-                    // It's not necessarily an error.
+                    prime_vtl_pkt_del(*pkt);
+                    *pkt = NULL;
                 }
             }
             else {
-                hpcalcs_info("%s: empty packet", __FUNCTION__);
+                res = ERR_MALLOC;
+                hpcalcs_error("%s: couldn't create packet", __FUNCTION__);
             }
-        }
-        else {
-            prime_vtl_pkt_del(*pkt);
-            *pkt = NULL;
+            break;
         }
     }
-    else {
-        res = ERR_MALLOC;
-        hpcalcs_error("%s: couldn't create packet", __FUNCTION__);
-    }
     return res;
 }
 
@@ -145,23 +194,35 @@ HPEXPORT int HPCALL calc_prime_s_check_ready(calc_handle * handle) {
     return res;
 }
 
-HPEXPORT int HPCALL calc_prime_r_check_ready(calc_handle * handle, uint8_t ** out_data, uint32_t * out_size) {
+// An empty reply means that nothing came within the timeout; it is only an error if required.
+static int read_check_ready(calc_handle * handle, uint8_t ** out_data, uint32_t * out_size, int first_timeout, int require_reply) {
     int res;
-    if (handle != NULL) {
-        prime_vtl_pkt * pkt;
-        res = read_vtl_pkt(handle, CMD_PRIME_CHECK_READY, &pkt, 0);
-        if (res == ERR_SUCCESS && pkt != NULL) {
-            if (out_data != NULL && out_size != NULL) {
-                *out_size = pkt->size;
-                *out_data = pkt->data; // Transfer ownership of the memory block to the caller.
-                pkt->data = NULL; // Detach it from virtual packet.
-            }
-            // else do nothing. res is already ERR_SUCCESS.
-            prime_vtl_pkt_del(pkt);
+    prime_vtl_pkt * pkt;
+    res = read_vtl_pkt(handle, CMD_PRIME_CHECK_READY, &pkt, first_timeout);
+    if (res == ERR_SUCCESS && pkt != NULL && (pkt->size > 0 || !require_reply)) {
+        if (out_data != NULL && out_size != NULL) {
+            *out_size = pkt->size;
+            *out_data = prime_vtl_pkt_detach_data(pkt); // Transfer ownership of the memory block to the caller.
         }
-        else {
-            hpcalcs_error("%s: failed to read packet", __FUNCTION__);
+        // else do nothing. res is already ERR_SUCCESS.
+    }
+    else {
+        if (res == ERR_SUCCESS) {
+            res = ERR_CALC_OPERATION_TIMEOUT;
         }
+        hpcalcs_error("%s: failed to read packet", __FUNCTION__);
+    }
+    if (pkt != NULL) {
+        prime_vtl_pkt_del(pkt);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL calc_prime_r_check_ready(calc_handle * handle, uint8_t ** out_data, uint32_t * out_size) {
+    int res;
+    if (handle != NULL) {
+        // A standalone check_ready is answered right away, so a dead or wedged calculator can be detected quickly.
+        res = read_check_ready(handle, out_data, out_size, prime_quick_reply_timeout(handle), 0);
     }
     else {
         res = ERR_INVALID_HANDLE;
@@ -199,12 +260,11 @@ HPEXPORT int HPCALL calc_prime_r_get_infos (calc_handle * handle, calc_infos * i
     int res;
     if (handle != NULL) {
         prime_vtl_pkt * pkt;
-        res = read_vtl_pkt(handle, CMD_PRIME_GET_INFOS, &pkt, 1);
+        res = read_vtl_pkt(handle, CMD_PRIME_GET_INFOS, &pkt, prime_quick_reply_timeout(handle));
         if (res == ERR_SUCCESS && pkt != NULL) {
             if (infos != NULL) {
                 infos->size = pkt->size;
-                infos->data = pkt->data; // Transfer ownership of the memory block to the caller.
-                pkt->data = NULL; // Detach it from virtual packet.
+                infos->data = prime_vtl_pkt_detach_data(pkt); // Transfer ownership of the memory block to the caller.
             }
             // else do nothing. res is already ERR_SUCCESS.
             prime_vtl_pkt_del(pkt);
@@ -306,47 +366,111 @@ HPEXPORT int HPCALL calc_prime_s_recv_screen(calc_handle * handle, calc_screensh
     return res;
 }
 
-HPEXPORT int HPCALL calc_prime_r_recv_screen(calc_handle * handle, calc_screenshot_format format, uint8_t ** out_data, uint32_t * out_size) {
+//! How far into a preview reply the PNG signature is looked for.
+#define PREVIEW_MAX_HEADER (32)
+
+static const uint8_t png_signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+// Returns the size of the PNG image at the beginning of data, up to and including its IEND chunk, or 0 if a chunk is truncated or fails its CRC.
+static uint32_t png_image_size(const uint8_t * data, uint32_t size) {
+    uint32_t offset = sizeof(png_signature);
+    uint32_t image_size = 0;
+    while (image_size == 0 && offset + 12 <= size) {
+        uint32_t chunk_size = read_be32(data + offset);
+        const uint8_t * type = data + offset + 4;
+        if (chunk_size > size - offset - 12) {
+            hpcalcs_info("%s: truncated chunk", __FUNCTION__);
+            break;
+        }
+        if (crc32_block(0, type, chunk_size + 4) != read_be32(type + 4 + chunk_size)) {
+            hpcalcs_error("%s: chunk CRC mismatch", __FUNCTION__);
+            break;
+        }
+        offset += chunk_size + 12;
+        if (memcmp(type, "IEND", 4) == 0) {
+            image_size = offset;
+        }
+    }
+    return image_size;
+}
+
+// The header of format 5 replies isn't as well known, but they carry a whole PNG image, whose chunk CRCs protect it.
+static int parse_preview_pkt(prime_vtl_pkt * pkt, hplibs_buffer_view * out_view) {
+    int res = ERR_CALC_PACKET_FORMAT;
+    uint32_t offset;
+    for (offset = 6; offset < PREVIEW_MAX_HEADER && offset + sizeof(png_signature) <= pkt->size; offset++) {
+        if (memcmp(pkt->data + offset, png_signature, sizeof(png_signature)) == 0) {
+            break;
+        }
+    }
+    if (offset < PREVIEW_MAX_HEADER && offset + sizeof(png_signature) <= pkt->size) {
+        uint32_t image_size = png_image_size(pkt->data + offset, pkt->size - offset);
+        if (image_size != 0) {
+            hpcalcs_info("%s: %" PRIu32 " bytes PNG at offset %" PRIu32 " of %" PRIu32, __FUNCTION__, image_size, offset, pkt->size);
+            if (out_view != NULL) {
+                detach_view(pkt, offset, out_view); // Transfer ownership of the memory block to the caller.
+                out_view->size = image_size;
+            }
+            res = ERR_SUCCESS;
+        }
+        else {
+            hpcalcs_error("%s: corrupted preview", __FUNCTION__);
+        }
+    }
+    else {
+        hpcalcs_error("%s: no PNG signature in preview", __FUNCTION__);
+    }
+    return res;
+}
+
+// Checks a screenshot reply, and hands the image over to out_view (if non-NULL).
+static int parse_screen_pkt(prime_vtl_pkt * pkt, calc_screenshot_format format, hplibs_buffer_view * out_view) {
+    int res = ERR_SUCCESS;
+    if (format == CALC_SCREENSHOT_FORMAT_PRIME_PREVIEW) {
+        res = parse_preview_pkt(pkt, out_view);
+    }
+    else if (pkt->size > 13) {
+        // Packet has CRC
+        uint16_t computed_crc; // 0x0000 ?
+        uint8_t * ptr = pkt->data;
+        // For whatever reason the CRC seems to be encoded the other way around compared to receiving files
+        uint16_t embedded_crc = (((uint16_t)(ptr[6])) << 8) | ((uint16_t)(ptr[7]));
+        // Reset CRC before computing
+        ptr[6] = 0x00;
+        ptr[7] = 0x00;
+        computed_crc = crc16_block(ptr + 6, pkt->size - 6); // The CRC for *screenshots* skips the header, and includes all data.
+        hpcalcs_info("%s: embedded=%" PRIX16 " computed=%" PRIX16, __FUNCTION__, embedded_crc, computed_crc);
+        if (computed_crc != embedded_crc) {
+            res = ERR_CALC_PACKET_FORMAT;
+            hpcalcs_error("%s: CRC mismatch", __FUNCTION__);
+        }
+
+        // Skip marker.
+        if (pkt->data[8] == (uint8_t)format && pkt->data[9] == 0xFF && pkt->data[10] == 0xFF && pkt->data[11] == 0xFF && pkt->data[12] == 0xFF) {
+            if (out_view != NULL) {
+                detach_view(pkt, 13, out_view); // Transfer ownership of the memory block to the caller.
+            }
+            // else do nothing. res is already ERR_SUCCESS.
+        }
+        else {
+            res = ERR_CALC_PACKET_FORMAT;
+            hpcalcs_warning("%s: unknown marker at beginning of image", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_CALC_PACKET_FORMAT;
+        hpcalcs_info("%s: packet is too short: %" PRIu32 "bytes", __FUNCTION__, pkt->size);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL calc_prime_r_recv_screen(calc_handle * handle, calc_screenshot_format format, hplibs_buffer_view * out_view) {
     int res;
     if (handle != NULL) {
         prime_vtl_pkt * pkt;
-        res = read_vtl_pkt(handle, CMD_PRIME_RECV_SCREEN, &pkt, 1);
+        res = read_vtl_pkt(handle, CMD_PRIME_RECV_SCREEN, &pkt, -1);
         if (res == ERR_SUCCESS && pkt != NULL) {
-            if (pkt->size > 13) {
-                // Packet has CRC
-                uint16_t computed_crc; // 0x0000 ?
-                uint8_t * ptr = pkt->data;
-                // For whatever reason the CRC seems to be encoded the other way around compared to receiving files
-                uint16_t embedded_crc = (((uint16_t)(ptr[6])) << 8) | ((uint16_t)(ptr[7]));
-                // Reset CRC before computing
-                ptr[6] = 0x00;
-                ptr[7] = 0x00;
-                computed_crc = crc16_block(ptr + 6, pkt->size - 6); // The CRC for *screenshots* skips the header, and includes all data.
-                hpcalcs_info("%s: embedded=%" PRIX16 " computed=%" PRIX16, __FUNCTION__, embedded_crc, computed_crc);
-                if (computed_crc != embedded_crc) {
-                    res = ERR_CALC_PACKET_FORMAT;
-                    hpcalcs_error("%s: CRC mismatch", __FUNCTION__);
-                }
-
-                // Skip marker.
-                if (pkt->data[8] == (uint8_t)format && pkt->data[9] == 0xFF && pkt->data[10] == 0xFF && pkt->data[11] == 0xFF && pkt->data[12] == 0xFF) {
-                    if (out_data != NULL && out_size != NULL) {
-                        *out_size = pkt->size - 13;
-                        memmove(pkt->data, pkt->data + 13, pkt->size - 13);
-                        *out_data = pkt->data; // Transfer ownership of the memory block to the caller.
-                        pkt->data = NULL; // Detach it from virtual packet.
-                    }
-                    // else do nothing. res is already ERR_SUCCESS.
-                }
-                else {
-                    res = ERR_CALC_PACKET_FORMAT;
-                    hpcalcs_warning("%s: unknown marker at beginning of image", __FUNCTION__);
-                }
-            }
-            else {
-                res = ERR_CALC_PACKET_FORMAT;
-                hpcalcs_info("%s: packet is too short: %" PRIu32 "bytes", __FUNCTION__, pkt->size);
-            }
+            res = parse_screen_pkt(pkt, format, out_view);
             prime_vtl_pkt_del(pkt);
         }
         else {
@@ -360,10 +484,43 @@ HPEXPORT int HPCALL calc_prime_r_recv_screen(calc_handle * handle, calc_screensh
     return res;
 }
 
+HPEXPORT int HPCALL calc_prime_r_recv_screen_next(calc_handle * handle, calc_screenshot_format format, int send_next, int * inout_pending, hplibs_buffer_view * out_view) {
+    int res;
+    if (handle != NULL && inout_pending != NULL) {
+        prime_vtl_pkt * pkt;
+        res = read_vtl_pkt(handle, CMD_PRIME_RECV_SCREEN, &pkt, -1);
+        if (res == ERR_SUCCESS && pkt != NULL && pkt->size > 0) {
+            // The reply answers the oldest request. The calculator can start working on the next screenshot while this one is being checked.
+            if (*inout_pending > 0) {
+                (*inout_pending)--;
+            }
+            if (send_next && calc_prime_s_recv_screen(handle, format) == ERR_SUCCESS) {
+                (*inout_pending)++;
+            }
+            res = parse_screen_pkt(pkt, format, out_view);
+        }
+        else {
+            // Nothing came in time: the request is still outstanding, so no other one is sent, lest the replies pile up.
+            if (res == ERR_SUCCESS) {
+                res = ERR_CALC_PACKET_FORMAT;
+            }
+            hpcalcs_error("%s: failed to read packet", __FUNCTION__);
+        }
+        if (pkt != NULL) {
+            prime_vtl_pkt_del(pkt);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcalcs_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
 // Seems to be made of a series of CMD_PRIME_RECV_FILE.
-HPEXPORT int HPCALL calc_prime_s_send_file(calc_handle * handle, files_var_entry * file) {
+HPEXPORT int HPCALL calc_prime_build_file_pkt(files_var_entry * file, prime_vtl_pkt ** out_pkt) {
     int res;
-    if (handle != NULL && file != NULL) {
+    if (file != NULL && out_pkt != NULL) {
         uint8_t namelen = (uint8_t)char16_strlen(file->name) * 2;
         uint32_t size = 10 - 6 + namelen + file->size; // Size of the data after the header.
         prime_vtl_pkt * pkt = prime_vtl_pkt_new(size + 6); // Add size of the header.
@@ -400,9 +557,8 @@ HPEXPORT int HPCALL calc_prime_s_send_file(calc_handle * handle, files_var_entry
             crc16 = crc16_block(pkt->data, size); // Yup, the last 6 bytes of the packet are excluded from the CRC.
             pkt->data[8] = crc16 & 0xFF;
             pkt->data[9] = (crc16 >> 8) & 0xFF;
-            res = write_vtl_pkt(handle, pkt);
-
-            prime_vtl_pkt_del(pkt);
+            *out_pkt = pkt;
+            res = ERR_SUCCESS;
         }
         else {
             res = ERR_MALLOC;
@@ -416,11 +572,42 @@ HPEXPORT int HPCALL calc_prime_s_send_file(calc_handle * handle, files_var_entry
     return res;
 }
 
+HPEXPORT int HPCALL calc_prime_s_send_file_pkt(calc_handle * handle, prime_vtl_pkt * pkt) {
+    int res;
+    if (handle != NULL && pkt != NULL) {
+        res = write_vtl_pkt(handle, pkt);
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcalcs_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL calc_prime_s_send_file(calc_handle * handle, files_var_entry * file) {
+    int res;
+    if (handle != NULL && file != NULL) {
+        prime_vtl_pkt * pkt;
+        res = calc_prime_build_file_pkt(file, &pkt);
+        if (res == ERR_SUCCESS) {
+            res = write_vtl_pkt(handle, pkt);
+            prime_vtl_pkt_del(pkt);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcalcs_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
 HPEXPORT int HPCALL calc_prime_r_send_file(calc_handle * handle) {
     int res;
     if (handle != NULL) {
         // There doesn't seem to be anything to do, beyond eliminating packets starting with 0xFF.
-        res = calc_prime_r_check_ready(handle, NULL, NULL);
+        // Storing a large file can take a while: wait as long as the cable allows, and don't take the lack of an acknowledgement
+        // for success, lest it be read later as the reply to another command.
+        res = read_check_ready(handle, NULL, NULL, -1, 1);
     }
     else {
         res = ERR_INVALID_HANDLE;
@@ -472,74 +659,159 @@ HPEXPORT int HPCALL calc_prime_s_recv_file(calc_handle * handle, files_var_entry
     return res;
 }
 
-HPEXPORT int HPCALL calc_prime_r_recv_file(calc_handle * handle, files_var_entry ** out_file) {
+//! Parts of a CMD_PRIME_RECV_FILE message, as located by parse_file_message.
+typedef struct {
+    uint8_t type;
+    uint8_t namelen;
+    const uint8_t * name;
+    uint32_t data_offset;
+    uint32_t data_size;
+    int crc_ok;
+} file_message;
+
+// Same as parse_file_message, for a message of the given size whose first header_size bytes are in ptr, and the others in rest.
+// The header must contain at least 11 bytes and the whole name of the file.
+static int parse_file_message_parts(uint8_t * ptr, uint32_t header_size, const uint8_t * rest, uint32_t size, file_message * msg) {
+    int res = ERR_SUCCESS;
+    // Packet has CRC
+    uint16_t computed_crc; // 0x0000 ?
+    uint16_t embedded_crc = (((uint16_t)(ptr[9])) << 8) | ((uint16_t)(ptr[8]));
+    uint32_t crc_size = size - 6; // The CRC contains the initial 0x00, but not the final 6 bytes (...).
+    // Reset CRC before computing
+    ptr[8] = 0x00;
+    ptr[9] = 0x00;
+    if (crc_size <= header_size) {
+        computed_crc = crc16_block(ptr, crc_size);
+    }
+    else {
+        computed_crc = crc16_update(crc16_block(ptr, header_size), rest, crc_size - header_size);
+    }
+    hpcalcs_info("%s: embedded=%" PRIX16 " computed=%" PRIX16, __FUNCTION__, embedded_crc, computed_crc);
+    msg->crc_ok = (computed_crc == embedded_crc);
+    if (!msg->crc_ok) {
+        hpcalcs_error("%s: CRC mismatch", __FUNCTION__);
+    }
+
+    msg->type = ptr[6];
+    msg->namelen = ptr[7];
+    msg->name = &ptr[10];
+    msg->data_offset = 10 + msg->namelen;
+    msg->data_size = size - 10 - msg->namelen;
+    if (msg->data_size & UINT32_C(0x80000000)) {
+        res = ERR_CALC_PACKET_FORMAT;
+        hpcalcs_error("%s: weird size (packet too short ?)", __FUNCTION__);
+    }
+    return res;
+}
+
+// Checks the CRC of a CMD_PRIME_RECV_FILE message (at least 11 bytes long), and locates the file's name and data.
+// The bytes of the CRC are reset in the process.
+static int parse_file_message(uint8_t * ptr, uint32_t size, file_message * msg) {
+    return parse_file_message_parts(ptr, size, NULL, size, msg);
+}
+
+static void fill_entry(files_var_entry * entry, const file_message * msg) {
+    entry->type = msg->type;
+    memcpy(entry->name, msg->name, msg->namelen);
+    entry->invalid = !msg->crc_ok;
+    hpcalcs_info("%s: created entry for %ls with size %" PRIu32 " and type %02X", __FUNCTION__, entry->name, msg->data_size, msg->type);
+}
+
+// Reads the reply to a file request. *out_pkt is set to NULL if the reply doesn't contain a file.
+static int read_file_reply(calc_handle * handle, prime_vtl_pkt ** out_pkt, file_message * msg) {
     int res;
     prime_vtl_pkt * pkt;
+    *out_pkt = NULL;
+    res = read_vtl_pkt(handle, CMD_PRIME_RECV_FILE, &pkt, -1);
+    if (res == ERR_SUCCESS && pkt != NULL) {
+        if (pkt->size >= 11) {
+            res = parse_file_message(pkt->data, pkt->size, msg);
+            if (res == ERR_SUCCESS) {
+                *out_pkt = pkt;
+                pkt = NULL;
+            }
+        }
+        else {
+            // Nothing at all comes back if the calculator didn't reply in time.
+            if (pkt->size == 0 || pkt->data[0] != 0xF9) {
+                res = ERR_CALC_PACKET_FORMAT;
+                hpcalcs_info("%s: packet is too short: %" PRIu32 "bytes", __FUNCTION__, pkt->size);
+            }
+            else {
+                hpcalcs_info("%s: skipping F9 packet", __FUNCTION__);
+            }
+        }
+        if (pkt != NULL) {
+            prime_vtl_pkt_del(pkt);
+        }
+    }
+    else {
+        hpcalcs_error("%s: failed to read packet", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL calc_prime_r_recv_file(calc_handle * handle, files_var_entry ** out_file) {
+    int res;
     // TODO: if no file was received, have *out_file = NULL, but res = 0.
     if (handle != NULL) {
-        res = read_vtl_pkt(handle, CMD_PRIME_RECV_FILE, &pkt, 1);
-        if (res == ERR_SUCCESS && pkt != NULL) {
-            if (pkt->size >= 11) {
-                // Packet has CRC
-                uint16_t computed_crc; // 0x0000 ?
-                uint8_t * ptr = pkt->data;
-                uint16_t embedded_crc = (((uint16_t)(ptr[9])) << 8) | ((uint16_t)(ptr[8]));
-                // Reset CRC before computing
-                ptr[8] = 0x00;
-                ptr[9] = 0x00;
-                computed_crc = crc16_block(ptr, pkt->size - 6); // The CRC contains the initial 0x00, but not the final 6 bytes (...).
-                hpcalcs_info("%s: embedded=%" PRIX16 " computed=%" PRIX16, __FUNCTION__, embedded_crc, computed_crc);
-                if (computed_crc != embedded_crc) {
-                    hpcalcs_error("%s: CRC mismatch", __FUNCTION__);
+        prime_vtl_pkt * pkt;
+        file_message msg;
+        if (out_file != NULL) {
+            *out_file = NULL;
+        }
+        res = read_file_reply(handle, &pkt, &msg);
+        if (pkt != NULL) {
+            if (out_file != NULL) {
+                hplibs_buffer_view view;
+                detach_view(pkt, msg.data_offset, &view); // The entry takes ownership of the memory block.
+                *out_file = hpfiles_ve_create_with_data_view(&view);
+                if (*out_file != NULL) {
+                    fill_entry(*out_file, &msg);
                 }
-
-                if (out_file != NULL) {
-                    uint8_t namelen;
-                    uint32_t size;
-                    uint8_t filetype;
-
-                    *out_file = NULL;
-                    filetype = pkt->data[6];
-                    namelen = pkt->data[7];
-                    size = pkt->size - 10 - namelen;
-
-                    if (!(size & UINT32_C(0x80000000))) {
-                        *out_file = hpfiles_ve_create_with_data(&pkt->data[10 + namelen], size);
-                        if (*out_file != NULL) {
-                            (*out_file)->type = filetype;
-                            memcpy((*out_file)->name, &pkt->data[10], namelen);
-                            (*out_file)->invalid = (computed_crc != embedded_crc);
-                            hpcalcs_info("%s: created entry for %ls with size %" PRIu32 " and type %02X", __FUNCTION__, (*out_file)->name, (*out_file)->size, filetype);
-                        }
-                        else {
-                            res = ERR_MALLOC;
-                            hpcalcs_error("%s: couldn't create entry", __FUNCTION__);
-                        }
-                    }
-                    else {
-                        res = ERR_CALC_PACKET_FORMAT;
-                        hpcalcs_error("%s: weird size (packet too short ?)", __FUNCTION__);
-                        // TODO: change res.
-                    }
+                else {
+                    hplibs_buffer_view_release(&view);
+                    res = ERR_MALLOC;
+                    hpcalcs_error("%s: couldn't create entry", __FUNCTION__);
                 }
             }
-            else {
-                if (pkt->data[0] != 0xF9) {
-                    res = ERR_CALC_PACKET_FORMAT;
-                    hpcalcs_info("%s: packet is too short: %" PRIu32 "bytes", __FUNCTION__, pkt->size);
+            prime_vtl_pkt_del(pkt);
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL calc_prime_r_recv_file_view(calc_handle * handle, files_var_entry ** out_file, hplibs_buffer_view * out_view) {
+    int res;
+    if (handle != NULL) {
+        prime_vtl_pkt * pkt;
+        file_message msg;
+        if (out_file != NULL) {
+            *out_file = NULL;
+        }
+        if (out_view != NULL) {
+            memset(out_view, 0, sizeof(*out_view));
+        }
+        res = read_file_reply(handle, &pkt, &msg);
+        if (pkt != NULL) {
+            if (out_file != NULL && out_view != NULL) {
+                // The data stays in the reply, where it was reassembled: the entry only gets the name and type.
+                *out_file = hpfiles_ve_create();
+                if (*out_file != NULL) {
+                    detach_view(pkt, msg.data_offset, out_view); // Transfer ownership of the memory block to the caller.
+                    fill_entry(*out_file, &msg);
                 }
                 else {
-                    hpcalcs_info("%s: skipping F9 packet", __FUNCTION__);
-                }
-                if (out_file != NULL) {
-                    *out_file = NULL;
+                    res = ERR_MALLOC;
+                    hpcalcs_error("%s: couldn't create entry", __FUNCTION__);
                 }
             }
             prime_vtl_pkt_del(pkt);
         }
-        else {
-            hpcalcs_error("%s: failed to read packet", __FUNCTION__);
-        }
     }
     else {
         res = ERR_INVALID_HANDLE;
@@ -573,51 +845,194 @@ HPEXPORT int HPCALL calc_prime_s_recv_backup(calc_handle * handle) {
     return res;
 }
 
-HPEXPORT int HPCALL calc_prime_r_recv_backup(calc_handle * handle, files_var_entry *** out_vars) {
+// Builds the entry for a message of a backup: a copy of the file, or the whole message flagged as invalid if it's truncated.
+static files_var_entry * backup_message_to_entry(uint8_t * data, uint32_t size, uint32_t index) {
+    files_var_entry * entry = NULL;
+    file_message msg;
+    if (size >= 11 && parse_file_message(data, size, &msg) == ERR_SUCCESS) {
+        entry = hpfiles_ve_create_with_data(data + msg.data_offset, msg.data_size);
+        if (entry != NULL) {
+            fill_entry(entry, &msg);
+        }
+    }
+    else {
+        // Salvage the whole message as an invalid entry, rather than dropping it.
+        hpcalcs_warning("%s: message %" PRIu32 " is truncated", __FUNCTION__, index);
+        entry = hpfiles_ve_create_with_data(data, size);
+        if (entry != NULL) {
+            entry->invalid = 1;
+        }
+    }
+    return entry;
+}
+
+//! A message of a backup handed to the worker threads. The header of the message follows the structure; the rest of the message
+//! is copied to a block of its own, which becomes the data of the entry. A message without a valid header is copied whole to that block.
+typedef struct {
+    uint32_t size;
+    uint32_t index;
+    uint32_t header_size; ///< 0 if the message has no valid header.
+    uint8_t * data; ///< Allocated with hpfiles_alloc_funcs.
+    files_var_entry * entry;
+} backup_job;
+
+static void parse_backup_job(void * arg) {
+    backup_job * job = (backup_job *)arg;
+    file_message msg;
+    if (job->header_size != 0 && parse_file_message_parts((uint8_t *)(job + 1), job->header_size, job->data, job->size, &msg) == ERR_SUCCESS) {
+        job->entry = hpfiles_ve_create_with_data_ptr(job->data, msg.data_size);
+        if (job->entry != NULL) {
+            fill_entry(job->entry, &msg);
+        }
+    }
+    else {
+        // Salvage the whole message as an invalid entry, rather than dropping it.
+        hpcalcs_warning("%s: message %" PRIu32 " is truncated", __FUNCTION__, job->index);
+        job->entry = hpfiles_ve_create_with_data_ptr(job->data, job->size);
+        if (job->entry != NULL) {
+            job->entry->invalid = 1;
+        }
+    }
+    if (job->entry != NULL) {
+        job->data = NULL; // Transfer ownership of the memory block to the entry.
+    }
+}
+
+//! State of calc_prime_r_recv_backup, shared with the stream callback.
+typedef struct {
+    hplibs_workers * workers;
+    calc_handle * handle;
+    files_ve_vector * out_vars;
+    uint32_t count; // Messages handled so far.
+    uint32_t invalid_count;
+    int synchronous; // Set once a message was left in the stream, so that the order of the entries is kept.
+    int res;
+} backup_receiver;
+
+static void store_backup_entry(backup_receiver * receiver, files_var_entry * entry) {
+    if (entry != NULL) {
+        if (entry->invalid) {
+            receiver->invalid_count++;
+        }
+        if (receiver->res != ERR_SUCCESS) {
+            hpfiles_ve_delete(entry);
+        }
+        else {
+            receiver->res = hpcalcs_deliver_entry(receiver->handle, entry, receiver->out_vars);
+        }
+    }
+    else if (receiver->res == ERR_SUCCESS) {
+        receiver->res = ERR_MALLOC;
+        hpcalcs_error("%s: couldn't create entry", __FUNCTION__);
+    }
+}
+
+static void collect_backup_job(backup_receiver * receiver, backup_job * job) {
+    store_backup_entry(receiver, job->entry);
+    (hpfiles_alloc_funcs.free)(job->data);
+    (hpcalcs_base_alloc_funcs.free)(job);
+}
+
+// Called by prime_recv_stream for each message: hands a copy of the message to the worker threads, so that CRC checking and parsing overlap with receiving the next messages.
+// The file's data is copied straight to the block which the entry takes over.
+static int backup_message_callback(void * user_data, uint8_t * data, uint32_t size) {
+    backup_receiver * receiver = (backup_receiver *)user_data;
+    backup_job * job;
+    uint32_t header_size = 0;
+
+    if (receiver->synchronous) {
+        return 0;
+    }
+    while (hplibs_workers_get_pending(receiver->workers) >= HPLIBS_WORKERS_MAX_PENDING) {
+        collect_backup_job(receiver, (backup_job *)hplibs_workers_take(receiver->workers, 1));
+    }
+    if (size >= 11 && 10 + (uint32_t)data[7] <= size) {
+        header_size = 10 + data[7];
+    }
+    job = (hpcalcs_base_alloc_funcs.malloc)(sizeof(*job) + header_size);
+    if (job != NULL) {
+        job->size = size;
+        job->index = receiver->count;
+        job->header_size = header_size;
+        job->entry = NULL;
+        job->data = NULL;
+        if (size > header_size) {
+            job->data = (uint8_t *)(hpfiles_alloc_funcs.malloc)(size - header_size);
+        }
+        if (job->data != NULL || size == header_size) {
+            memcpy((uint8_t *)(job + 1), data, header_size);
+            if (size > header_size) {
+                memcpy(job->data, data + header_size, size - header_size);
+            }
+            if (hplibs_workers_submit(receiver->workers, job) != ERR_SUCCESS) {
+                (hpfiles_alloc_funcs.free)(job->data);
+                (hpcalcs_base_alloc_funcs.free)(job);
+                job = NULL;
+            }
+        }
+        else {
+            (hpcalcs_base_alloc_funcs.free)(job);
+            job = NULL;
+        }
+    }
+    if (job == NULL) {
+        // Leave this message, and the next ones, in the stream: they'll be processed afterwards.
+        receiver->synchronous = 1;
+        return 0;
+    }
+    receiver->count++;
+    while ((job = (backup_job *)hplibs_workers_take(receiver->workers, 0)) != NULL) {
+        collect_backup_job(receiver, job);
+    }
+    return 1;
+}
+
+HPEXPORT int HPCALL calc_prime_r_recv_backup(calc_handle * handle, files_ve_vector * out_vars) {
     int res;
     if (handle != NULL) {
-        // TODO: in order to be more robust against packet losses,
-        // rewrite this code to read as much as possible, then attempt to split data according to file headers.
-        uint32_t count = 0;
-        files_var_entry ** entries = hpfiles_ve_create_array(count);
-        if (entries != NULL) {
-            for (;;) {
-                if (out_vars != NULL) {
-                    *out_vars = entries;
-                }
-                res = calc_prime_r_recv_file(handle, &entries[count]);
-                if (res == ERR_SUCCESS) {
-                    if (entries[count] != NULL) {
-                        files_var_entry ** new_entries;
-                        hpcalcs_info("%s: continuing due to non-empty entry", __FUNCTION__);
-                        count++;
-                        new_entries = hpfiles_ve_resize_array(entries, count);
-                        if (new_entries != NULL) {
-                            entries = new_entries;
-                            entries[count] = NULL;
-                        }
-                        else {
-                            res = ERR_MALLOC;
-                            hpcalcs_error("%s: couldn't resize entries", __FUNCTION__);
-                            break;
-                        }
-                    }
-                    else {
-                        hpcalcs_info("%s: breaking due to empty file", __FUNCTION__);
-                        res = ERR_SUCCESS;
-                        break;
-                    }
-                }
-                else {
-                    hpcalcs_error("%s: breaking due to reception failure", __FUNCTION__);
-                    break;
-                }
+        prime_vtl_stream stream;
+        backup_receiver receiver;
+        backup_job * job;
+
+        memset(&stream, 0, sizeof(stream));
+        memset(&receiver, 0, sizeof(receiver));
+        receiver.handle = handle;
+        receiver.out_vars = out_vars;
+        receiver.res = ERR_SUCCESS;
+        // Worker threads don't see the handle's allocators, so they can only be used with the default ones.
+        if (hplibs_alloc_scope_is_default()) {
+            receiver.workers = hplibs_workers_new(2, parse_backup_job);
+        }
+        if (receiver.workers != NULL) {
+            stream.message_callback = backup_message_callback;
+            stream.user_data = &receiver;
+        }
+
+        // Read as much as possible, then split data according to file headers, so that a packet loss only affects one file.
+        res = prime_recv_stream(handle, CMD_PRIME_RECV_FILE, CMD_PRIME_RECV_BACKUP, &stream);
+        while ((job = (backup_job *)hplibs_workers_take(receiver.workers, 1)) != NULL) {
+            collect_backup_job(&receiver, job);
+        }
+        hplibs_workers_del(receiver.workers);
+
+        if (res == ERR_SUCCESS) {
+            uint32_t i;
+            // Messages which weren't handed to the worker threads.
+            for (i = 0; i < stream.count && receiver.res == ERR_SUCCESS; i++) {
+                uint8_t * data;
+                uint32_t size;
+                prime_vtl_stream_get_message(&stream, i, &data, &size);
+                store_backup_entry(&receiver, backup_message_to_entry(data, size, receiver.count++));
+            }
+            res = receiver.res;
+            if (receiver.invalid_count != 0) {
+                hpcalcs_warning("%s: %" PRIu32 " of %" PRIu32 " files are corrupted", __FUNCTION__, receiver.invalid_count, receiver.count);
             }
         }
         else {
-            res = ERR_MALLOC;
-            hpcalcs_error("%s: couldn't create entries", __FUNCTION__);
+            hpcalcs_error("%s: failed to receive backup", __FUNCTION__);
         }
+        prime_vtl_stream_clear(&stream);
     }
     else {
         res = ERR_INVALID_PARAMETER;
@@ -755,18 +1170,15 @@ HPEXPORT int HPCALL calc_prime_r_send_chat(calc_handle * handle) {
     return res;
 }
 
-HPEXPORT int HPCALL calc_prime_r_recv_chat(calc_handle * handle, uint16_t ** out_data, uint32_t * out_size) {
+HPEXPORT int HPCALL calc_prime_r_recv_chat(calc_handle * handle, hplibs_buffer_view * out_view) {
     int res;
     if (handle != NULL) {
         prime_vtl_pkt * pkt;
-        res = read_vtl_pkt(handle, CMD_PRIME_RECV_CHAT, &pkt, 0);
+        res = read_vtl_pkt(handle, CMD_PRIME_RECV_CHAT, &pkt, -1);
         if (res == ERR_SUCCESS && pkt != NULL) {
             if (pkt->size >= 8) {
-                if (out_data != NULL && out_size != NULL) {
-                    *out_size = pkt->size - 6;
-                    memmove(pkt->data, pkt->data + 6, pkt->size - 6);
-                    *out_data = (uint16_t *)pkt->data; // Transfer ownership of the memory block to the caller.
-                    pkt->data = NULL; // Detach it from virtual packet.
+                if (out_view != NULL) {
+                    detach_view(pkt, 6, out_view); // Transfer ownership of the memory block to the caller.
                 }
             }
             else {
@@ -785,3 +1197,41 @@ HPEXPORT int HPCALL calc_prime_r_recv_chat(calc_handle * handle, uint16_t ** out
     }
     return res;
 }
+
+HPEXPORT int HPCALL calc_prime_r_poll_events(calc_handle * handle, int timeout) {
+    int res;
+    if (handle != NULL) {
+        for (;;) {
+            prime_vtl_pkt * pkt = prime_vtl_pkt_new(0);
+            if (pkt != NULL) {
+                pkt->cmd = CMD_PRIME_ANY;
+                res = prime_recv_data_timeout(handle, pkt, timeout);
+                if (res == ERR_SUCCESS && pkt->size > 0) {
+                    // Same classification as in read_vtl_pkt.
+                    calc_event_type type = (pkt->data[0] == CMD_PRIME_RECV_CHAT && pkt->size >= 2 && pkt->data[1] == 0x01) ? CALC_EVENT_CHAT : CALC_EVENT_REPLY;
+                    res = hpcalcs_events_push_copy(handle, type, pkt->data[0], pkt->data, pkt->size);
+                    prime_vtl_pkt_del(pkt);
+                    if (res != ERR_SUCCESS) {
+                        break;
+                    }
+                    // Drain whatever else is pending, without waiting.
+                    timeout = 0;
+                }
+                else {
+                    prime_vtl_pkt_del(pkt);
+                    break;
+                }
+            }
+            else {
+                res = ERR_MALLOC;
+                hpcalcs_error("%s: couldn't create packet", __FUNCTION__);
+                break;
+            }
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
@@ -38,6 +38,8 @@
 #define CMD_PRIME_RECV_CHAT (0xF2)
 #define CMD_PRIME_SEND_KEY (0xEC)
 #define CMD_PRIME_SET_DATE_TIME (0xE7)
+// Not a real command: used for receiving whatever the calculator sends.
+#define CMD_PRIME_ANY (0x00)
 
 HPEXPORT int HPCALL calc_prime_s_check_ready(calc_handle * handle);
 HPEXPORT int HPCALL calc_prime_r_check_ready(calc_handle * handle, uint8_t ** out_data, uint32_t * out_size);
@@ -49,16 +51,23 @@ HPEXPORT int HPCALL calc_prime_s_set_date_time(calc_handle * handle, time_t time
 HPEXPORT int HPCALL calc_prime_r_set_date_time(calc_handle * handle);
 
 HPEXPORT int HPCALL calc_prime_s_recv_screen(calc_handle * handle, calc_screenshot_format format);
-HPEXPORT int HPCALL calc_prime_r_recv_screen(calc_handle * handle, calc_screenshot_format format, uint8_t ** out_data, uint32_t * out_size);
+HPEXPORT int HPCALL calc_prime_r_recv_screen(calc_handle * handle, calc_screenshot_format format, hplibs_buffer_view * out_view);
+//! Like \a calc_prime_r_recv_screen, but sends the next request (if \a send_next) as soon as a full reply is in, before checking it. \a inout_pending is the number of requests outstanding, updated accordingly.
+HPEXPORT int HPCALL calc_prime_r_recv_screen_next(calc_handle * handle, calc_screenshot_format format, int send_next, int * inout_pending, hplibs_buffer_view * out_view);
 
 HPEXPORT int HPCALL calc_prime_s_send_file(calc_handle * handle, files_var_entry * file);
+//! Builds the packet for sending a file, so that it can be done ahead of \a calc_prime_s_send_file_pkt.
+HPEXPORT int HPCALL calc_prime_build_file_pkt(files_var_entry * file, prime_vtl_pkt ** out_pkt);
+HPEXPORT int HPCALL calc_prime_s_send_file_pkt(calc_handle * handle, prime_vtl_pkt * pkt);
 HPEXPORT int HPCALL calc_prime_r_send_file(calc_handle * handle);
 
 HPEXPORT int HPCALL calc_prime_s_recv_file(calc_handle * handle, files_var_entry * file);
 HPEXPORT int HPCALL calc_prime_r_recv_file(calc_handle * handle, files_var_entry ** out_file);
+//! Like \a calc_prime_r_recv_file, but leaves the data of the file in the reply: \a out_view gets a view of it, and \a out_file has none.
+HPEXPORT int HPCALL calc_prime_r_recv_file_view(calc_handle * handle, files_var_entry ** out_file, hplibs_buffer_view * out_view);
 
 HPEXPORT int HPCALL calc_prime_s_recv_backup(calc_handle * handle);
-HPEXPORT int HPCALL calc_prime_r_recv_backup(calc_handle * handle, files_var_entry *** out_vars);
+HPEXPORT int HPCALL calc_prime_r_recv_backup(calc_handle * handle, files_ve_vector * out_vars);
 
 HPEXPORT int HPCALL calc_prime_s_send_key(calc_handle * handle, uint32_t code);
 HPEXPORT int HPCALL calc_prime_r_send_key(calc_handle * handle);
@@ -68,6 +77,8 @@ HPEXPORT int HPCALL calc_prime_r_send_keys(calc_handle * handle);
 HPEXPORT int HPCALL calc_prime_s_send_chat(calc_handle * handle, const uint16_t * data, uint32_t size);
 HPEXPORT int HPCALL calc_prime_r_send_chat(calc_handle * handle);
 
-HPEXPORT int HPCALL calc_prime_r_recv_chat(calc_handle * handle, uint16_t ** out_data, uint32_t * out_size);
+HPEXPORT int HPCALL calc_prime_r_recv_chat(calc_handle * handle, hplibs_buffer_view * out_view);
+
+HPEXPORT int HPCALL calc_prime_r_poll_events(calc_handle * handle, int timeout);
 
 #endif
@@ -71,23 +71,15 @@ HPEXPORT int HPCALL prime_recv(calc_handle * handle, prime_raw_hid_pkt * pkt) {
     if (handle != NULL && pkt != NULL) {
         cable_handle * cable = handle->cable;
         if (cable != NULL) {
-            uint8_t * data;
-            data = (hpcalcs_alloc_funcs.malloc)(sizeof(pkt->data));
-            if (data != NULL) {
-                res = hpcables_cable_recv(cable, &data, &pkt->size);
-                hexdump("IN", data, pkt->size, 2);
-                if (res == ERR_SUCCESS) {
-                    //hpcalcs_info("%s: recv succeeded", __FUNCTION__);
-                    memcpy(pkt->data, data, sizeof(pkt->data));
-                }
-                else {
-                    hpcalcs_warning("%s: recv failed", __FUNCTION__);
-                }
-                (hpcalcs_alloc_funcs.free)(data);
+            // Read straight into the raw packet, which is large enough for a full HID report.
+            uint8_t * data = pkt->data;
+            res = hpcables_cable_recv(cable, &data, &pkt->size);
+            hexdump("IN", data, pkt->size, 2);
+            if (res == ERR_SUCCESS) {
+                //hpcalcs_info("%s: recv succeeded", __FUNCTION__);
             }
             else {
-                res = ERR_MALLOC;
-                hpcalcs_error("%s: failed to allocate buffer", __FUNCTION__);
+                hpcalcs_warning("%s: recv failed", __FUNCTION__);
             }
         }
         else {
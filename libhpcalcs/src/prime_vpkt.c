@@ -32,6 +32,7 @@
 #include "internal.h"
 #include "logging.h"
 #include "error.h"
+#include "utils.h"
 
 #include "prime_cmd.h"
 
@@ -43,18 +44,59 @@
 // Calcs - HP Prime virtual packets
 // -----------------------------------------------
 
+//! Maximum number of deleted virtual packets kept by each thread for reuse.
+#define PRIME_VTL_PKT_POOL_SIZE (16)
+
+// Every command and every polling iteration creates and deletes at least one packet: recycle them instead of going through the allocator.
+// The pool only serves and keeps packets allocated with the base allocator, never those from a calculator handle allocator or arena.
+// Short commands keep their data in the packet itself, so that e.g. polling allocates nothing once warm; prime_vtl_pkt_detach_data
+// is the only way for the callers to take the data over.
+static HPLIBS_THREAD_LOCAL prime_vtl_pkt * pkt_pool[PRIME_VTL_PKT_POOL_SIZE];
+static HPLIBS_THREAD_LOCAL uint32_t pkt_pool_count;
+
+static prime_vtl_pkt * vtl_pkt_alloc(void) {
+    prime_vtl_pkt * pkt;
+    if (hplibs_alloc_scope_is_default()) {
+        if (pkt_pool_count > 0) {
+            pkt = pkt_pool[--pkt_pool_count];
+        }
+        else {
+            pkt = (prime_vtl_pkt *)(hpcalcs_alloc_funcs.malloc)(sizeof(*pkt));
+        }
+    }
+    else {
+        pkt = (prime_vtl_pkt *)(hpcalcs_alloc_funcs.malloc)(sizeof(*pkt));
+    }
+    return pkt;
+}
+
+static void vtl_pkt_release(prime_vtl_pkt * pkt) {
+    if (pkt_pool_count < PRIME_VTL_PKT_POOL_SIZE && hplibs_block_is_base(pkt)) {
+        pkt_pool[pkt_pool_count++] = pkt;
+    }
+    else {
+        (hpcalcs_alloc_funcs.free)(pkt);
+    }
+}
 
 HPEXPORT prime_vtl_pkt * HPCALL prime_vtl_pkt_new(uint32_t size) {
-    prime_vtl_pkt * pkt = (prime_vtl_pkt *)(hpcalcs_alloc_funcs.malloc)(sizeof(*pkt));
+    prime_vtl_pkt * pkt = vtl_pkt_alloc();
 
     if (pkt != NULL) {
         pkt->size = size;
+        pkt->data = NULL;
         if (size != 0) {
-            pkt->data = (uint8_t *)(hpcalcs_alloc_funcs.calloc)(size, sizeof(*pkt->data));
+            if (size <= PRIME_VTL_PKT_INLINE_SIZE) {
+                memset(pkt->inline_data, 0, sizeof(pkt->inline_data));
+                pkt->data = pkt->inline_data;
+            }
+            else {
+                pkt->data = (uint8_t *)(hpcalcs_alloc_funcs.calloc)(size, sizeof(*pkt->data));
 
-            if (pkt->data == NULL) {
-                (hpcalcs_alloc_funcs.free)(pkt);
-                pkt = NULL;
+                if (pkt->data == NULL) {
+                    vtl_pkt_release(pkt);
+                    pkt = NULL;
+                }
             }
         }
     }
@@ -63,7 +105,7 @@ HPEXPORT prime_vtl_pkt * HPCALL prime_vtl_pkt_new(uint32_t size) {
 }
 
 HPEXPORT prime_vtl_pkt * HPCALL prime_vtl_pkt_new_with_data_ptr(uint32_t size, uint8_t * data) {
-    prime_vtl_pkt * pkt = (prime_vtl_pkt *)(hpcalcs_alloc_funcs.malloc)(sizeof(*pkt));
+    prime_vtl_pkt * pkt = vtl_pkt_alloc();
 
     if (pkt != NULL) {
         pkt->size = size;
@@ -75,14 +117,47 @@ HPEXPORT prime_vtl_pkt * HPCALL prime_vtl_pkt_new_with_data_ptr(uint32_t size, u
 
 HPEXPORT void HPCALL prime_vtl_pkt_del(prime_vtl_pkt * pkt) {
     if (pkt != NULL) {
-        (hpcalcs_alloc_funcs.free)(pkt->data);
-        (hpcalcs_alloc_funcs.free)(pkt);
+        if (pkt->data != pkt->inline_data) {
+            (hpcalcs_alloc_funcs.free)(pkt->data);
+        }
+        vtl_pkt_release(pkt);
     }
     else {
         hpcalcs_error("%s: pkt is NULL", __FUNCTION__);
     }
 }
 
+HPEXPORT uint8_t * HPCALL prime_vtl_pkt_detach_data(prime_vtl_pkt * pkt) {
+    uint8_t * data = NULL;
+    if (pkt != NULL) {
+        if (pkt->data == pkt->inline_data) {
+            data = (uint8_t *)(hpcalcs_alloc_funcs.malloc)(pkt->size);
+            if (data != NULL) {
+                memcpy(data, pkt->inline_data, pkt->size);
+            }
+            else {
+                hpcalcs_error("%s: couldn't allocate memory", __FUNCTION__);
+            }
+        }
+        else {
+            data = pkt->data;
+        }
+        if (data != NULL) {
+            pkt->data = NULL; // Detach it from virtual packet.
+        }
+    }
+    else {
+        hpcalcs_error("%s: pkt is NULL", __FUNCTION__);
+    }
+    return data;
+}
+
+HPEXPORT void HPCALL prime_vtl_pkt_pool_trim(void) {
+    while (pkt_pool_count > 0) {
+        (hpcalcs_base_alloc_funcs.free)(pkt_pool[--pkt_pool_count]);
+    }
+}
+
 HPEXPORT int HPCALL prime_send_data(calc_handle * handle, prime_vtl_pkt * pkt) {
     int res;
     if (handle != NULL && pkt != NULL) {
@@ -91,6 +166,9 @@ HPEXPORT int HPCALL prime_send_data(calc_handle * handle, prime_vtl_pkt * pkt) {
         uint32_t offset = 0;
         uint8_t pkt_id = 0;
 
+        // E.g. a screenshot picked up by a poll after its request timed out mustn't be taken for the reply to this request.
+        hpcalcs_events_discard_replies(handle, pkt->cmd);
+
         memset((void *)&raw, 0, sizeof(raw));
         q = (pkt->size) / (PRIME_RAW_HID_DATA_SIZE - 1);
         r = (pkt->size) % (PRIME_RAW_HID_DATA_SIZE - 1);
@@ -142,19 +220,105 @@ HPEXPORT int HPCALL prime_send_data(calc_handle * handle, prime_vtl_pkt * pkt) {
 }
 
 HPEXPORT int HPCALL prime_recv_data(calc_handle * handle, prime_vtl_pkt * pkt) {
+    return prime_recv_data_timeout(handle, pkt, -1);
+}
+
+// Lower bound (in ms) of the read timeouts derived from the link statistics.
+#define PRIME_MIN_READ_TIMEOUT (250)
+// Upper bound (in ms) of the timeout for the first packet of the replies sent right away by the calculator.
+#define PRIME_MAX_QUICK_REPLY_TIMEOUT (1500)
+
+static void set_read_timeout(cable_handle * cable, int timeout) {
+    // Changing the timeout is cheap, but logged.
+    if (hpcables_options_get_read_timeout(cable) != timeout) {
+        hpcables_options_set_read_timeout(cable, timeout);
+    }
+}
+
+int prime_quick_reply_timeout(calc_handle * handle) {
+    int timeout = PRIME_MAX_QUICK_REPLY_TIMEOUT;
+    cable_handle * cable = handle->cable;
+    if (cable != NULL) {
+        int cable_timeout = hpcables_options_get_read_timeout(cable);
+        if (cable->stats.latency_samples != 0 && cable->stats.latency * 8 + PRIME_MIN_READ_TIMEOUT < (uint32_t)timeout) {
+            timeout = (int)(cable->stats.latency * 8 + PRIME_MIN_READ_TIMEOUT);
+        }
+        if (timeout > cable_timeout) {
+            timeout = cable_timeout;
+        }
+    }
+    return timeout;
+}
+
+static int next_read_timeout(cable_handle * cable, int cable_timeout) {
+    int timeout = cable_timeout;
+    if (cable->stats.bandwidth_samples != 0 && cable->stats.bandwidth != 0) {
+        // Leave room for the calculator sending packets in irregular bursts.
+        uint32_t t = (PRIME_RAW_HID_DATA_SIZE * 1000 * 16) / cable->stats.bandwidth + cable->stats.latency * 2 + PRIME_MIN_READ_TIMEOUT;
+        if (t < (uint32_t)timeout) {
+            timeout = (int)t;
+        }
+    }
+    return timeout;
+}
+
+static void route_status_report(calc_handle * handle, prime_raw_hid_pkt * raw) {
+    // TODO: investigate whether the second byte could indicate an error code ?
+    hpcalcs_info("%s: routing packet starting with 0xFF to the status queue", __FUNCTION__);
+    if (hpcalcs_events_push_copy(handle, CALC_EVENT_STATUS, 0xFF, &(raw->data[1]), raw->size - 1) != ERR_SUCCESS) {
+        hpcalcs_error("%s: skipping packet starting with 0xFF", __FUNCTION__);
+    }
+}
+
+HPEXPORT int HPCALL prime_recv_data_timeout(calc_handle * handle, prime_vtl_pkt * pkt, int first_timeout) {
     int res;
     if (handle != NULL && pkt != NULL) {
         prime_raw_hid_pkt raw;
         uint32_t expected_size = 0;
         uint32_t offset = 0;
+        uint32_t capacity = 0;
         uint32_t read_pkts_count = 0;
+        cable_handle * cable = handle->cable;
+        int cable_timeout = 0;
+        int read_timeout = 0;
+        uint64_t deadline = 0;
+        int deadline_bound = 0;
+        int retried = 0;
         // WIP: reassembly.
 
         //size = pkt->size;
         pkt->size = 0;
         pkt->data = NULL;
 
+        if (cable != NULL) {
+            cable_timeout = hpcables_options_get_read_timeout(cable);
+            // Screenshots, files and backups can take seconds to be prepared: only the callers know which replies come quicker.
+            read_timeout = (first_timeout >= 0) ? first_timeout : cable_timeout;
+            // The deadline is only meaningful within an operation started by one of the hpcalcs_calc_* functions.
+            if (handle->busy) {
+                deadline = handle->operation_deadline;
+            }
+        }
+
         for(;;) {
+            if (cable != NULL) {
+                int timeout = read_timeout;
+                deadline_bound = 0;
+                if (deadline != 0) {
+                    uint64_t now = get_monotonic_time_ms();
+                    if (now >= deadline) {
+                        res = ERR_CALC_OPERATION_TIMEOUT;
+                        hpcalcs_error("%s: operation timed out", __FUNCTION__);
+                        break;
+                    }
+                    if (deadline - now < (uint64_t)timeout) {
+                        timeout = (int)(deadline - now);
+                        deadline_bound = 1;
+                    }
+                }
+                set_read_timeout(cable, timeout);
+            }
+
             memset(&raw, 0, sizeof(raw));
             res = prime_recv(handle, &raw);
             if (res) {
@@ -164,14 +328,28 @@ HPEXPORT int HPCALL prime_recv_data(calc_handle * handle, prime_vtl_pkt * pkt) {
             else {
                 //hpcalcs_info("%s: recv succeeded", __FUNCTION__);
             }
+            if (raw.size == 0) {
+                if (deadline_bound) {
+                    res = ERR_CALC_OPERATION_TIMEOUT;
+                    hpcalcs_error("%s: operation timed out", __FUNCTION__);
+                    break;
+                }
+                if (read_pkts_count != 0 && read_timeout < cable_timeout && !retried) {
+                    // The estimate may have been too optimistic: give the calculator one more chance before truncating the reply.
+                    hpcalcs_warning("%s: no data within %d ms, retrying with %d ms", __FUNCTION__, read_timeout, cable_timeout);
+                    read_timeout = cable_timeout;
+                    retried = 1;
+                    continue;
+                }
+            }
             //hpcalcs_info("%s: raw.size=%" PRIu32, __FUNCTION__, raw.size);
             if (raw.size > 0) {
                 uint8_t * new_data;
 
-                // Exclude those packets from reassembly (at least for screenshotting purposes, they seem to be spurious).
+                // Exclude those packets from reassembly (at least for screenshotting purposes, they seem to be spurious),
+                // but hand them to the demultiplexer instead of dropping them.
                 if (raw.data[0] == 0xFF) {
-                    // TODO: investigate whether the second byte could indicate an error code ?
-                    hpcalcs_error("%s: skipping packet starting with 0xFF", __FUNCTION__);
+                    route_status_report(handle, &raw);
                     continue;
                 }
                 // Sanity check. The first byte is the sequence number. After reaching 0xFE. it wraps back to 0 (skipping 0xFF).
@@ -185,32 +363,58 @@ HPEXPORT int HPCALL prime_recv_data(calc_handle * handle, prime_vtl_pkt * pkt) {
 
                 // Over-read prevention (hopefully ^^) code: pre-set the expected size of the reply to the given command.
                 if (read_pkts_count == 1) {
-                    res = prime_data_size(pkt->cmd, raw.data + 1, &expected_size); // +1: skip leading byte.
+                    uint8_t size_cmd = pkt->cmd;
+                    if (cable != NULL) {
+                        read_timeout = next_read_timeout(cable, cable_timeout);
+                    }
+                    if (pkt->cmd == CMD_PRIME_ANY) {
+                        // Take the command from the packet itself.
+                        pkt->cmd = raw.data[1];
+                        size_cmd = raw.data[1];
+                    }
+                    else if (raw.data[1] == CMD_PRIME_RECV_CHAT && raw.data[2] == 0x01) {
+                        // Unsolicited chat message, received while waiting for another reply.
+                        size_cmd = CMD_PRIME_RECV_CHAT;
+                    }
+                    res = prime_data_size(size_cmd, raw.data + 1, &expected_size); // +1: skip leading byte.
                     if (res != ERR_SUCCESS) {
                         break;
                     }
                 }
 
                 pkt->size += raw.size - 1;
-                new_data = (hpcalcs_alloc_funcs.realloc)(pkt->data, pkt->size);
-                if (new_data != NULL) {
-                    pkt->data = new_data;
-                    // Skip first byte, which is usually 0x00.
-                    memcpy(pkt->data + offset, &(raw.data[1]), raw.size - 1);
-                    offset += raw.size - 1;
-                }
-                else {
-                    res = ERR_MALLOC;
-                    hpcalcs_error("%s: cannot reallocate memory", __FUNCTION__);
-                    break;
+                if (pkt->size > capacity) {
+                    // Reserve the whole reply at once when its size is known, otherwise grow geometrically,
+                    // instead of reallocating for every raw packet.
+                    uint32_t new_capacity = (expected_size > pkt->size) ? expected_size : pkt->size;
+                    if (expected_size == 0 && new_capacity < capacity * 2) {
+                        new_capacity = capacity * 2;
+                    }
+                    new_data = (hpcalcs_alloc_funcs.realloc)(pkt->data, new_capacity);
+                    if (new_data != NULL) {
+                        pkt->data = new_data;
+                        capacity = new_capacity;
+                    }
+                    else {
+                        res = ERR_MALLOC;
+                        hpcalcs_error("%s: cannot reallocate memory", __FUNCTION__);
+                        break;
+                    }
                 }
+                // Skip first byte, which is usually 0x00.
+                memcpy(pkt->data + offset, &(raw.data[1]), raw.size - 1);
+                offset += raw.size - 1;
             }
 
             if (raw.size < PRIME_RAW_HID_DATA_SIZE) {
                 hpcalcs_info("%s: breaking due to short packet (1)", __FUNCTION__);
+                if (expected_size == 0 && read_pkts_count != 0) {
+                    // Size undetermined: keep everything.
+                    break;
+                }
                 goto shorten_packet;
             }
-            if (offset >= expected_size) {
+            if (expected_size != 0 && offset >= expected_size) {
                 hpcalcs_info("%s: breaking because the expected size was reached (2)", __FUNCTION__);
 shorten_packet:
                 // Shorten packet.
@@ -220,11 +424,17 @@ shorten_packet:
                 else {
                     hpcalcs_warning("%s: expected %" PRIu32 " bytes but only got %" PRIu32 " bytes, output corrupted", __FUNCTION__, expected_size, pkt->size);
                 }
-                pkt->data = (hpcalcs_alloc_funcs.realloc)(pkt->data, expected_size);
+                if (expected_size != capacity) {
+                    pkt->data = (hpcalcs_alloc_funcs.realloc)(pkt->data, expected_size);
+                }
                 pkt->size = expected_size;
                 break;
             }
         }
+
+        if (cable != NULL) {
+            set_read_timeout(cable, cable_timeout);
+        }
     }
     else {
         res = ERR_INVALID_PARAMETER;
@@ -233,6 +443,268 @@ shorten_packet:
     return res;
 }
 
+static int stream_reserve(prime_vtl_stream * stream, uint32_t size) {
+    int res = ERR_SUCCESS;
+    if (stream->size + size > stream->capacity) {
+        // Grow geometrically: a backup easily spans tens of thousands of raw packets.
+        uint32_t new_capacity = (stream->capacity != 0) ? stream->capacity * 2 : 65536;
+        uint8_t * new_data;
+        if (new_capacity < stream->size + size) {
+            new_capacity = stream->size + size;
+        }
+        new_data = (hpcalcs_alloc_funcs.realloc)(stream->data, new_capacity);
+        if (new_data != NULL) {
+            stream->data = new_data;
+            stream->capacity = new_capacity;
+        }
+        else {
+            res = ERR_MALLOC;
+            hpcalcs_error("%s: cannot reallocate memory", __FUNCTION__);
+        }
+    }
+    return res;
+}
+
+static int stream_start_message(prime_vtl_stream * stream) {
+    int res = ERR_SUCCESS;
+    if (stream->count == stream->offsets_capacity) {
+        uint32_t new_capacity = (stream->offsets_capacity != 0) ? stream->offsets_capacity * 2 : 64;
+        uint32_t * new_offsets = (hpcalcs_alloc_funcs.realloc)(stream->offsets, new_capacity * sizeof(*new_offsets));
+        if (new_offsets != NULL) {
+            stream->offsets = new_offsets;
+            stream->offsets_capacity = new_capacity;
+        }
+        else {
+            res = ERR_MALLOC;
+            hpcalcs_error("%s: cannot reallocate memory", __FUNCTION__);
+        }
+    }
+    if (res == ERR_SUCCESS) {
+        stream->offsets[stream->count++] = stream->size;
+    }
+    return res;
+}
+
+// Offers the last message to the callback, if any.
+static void stream_deliver(prime_vtl_stream * stream) {
+    if (stream->message_callback != NULL && stream->count != 0) {
+        uint32_t offset = stream->offsets[stream->count - 1];
+        if ((*stream->message_callback)(stream->user_data, stream->data + offset, stream->size - offset)) {
+            // Reuse the space for the next message.
+            stream->size = offset;
+            stream->count--;
+        }
+    }
+}
+
+// A raw packet starting a message: sequence number 0, then the command and 0x01 followed by the size.
+static int is_message_start(prime_raw_hid_pkt * raw, uint8_t cmd) {
+    return raw->size >= 7 && raw->data[0] == 0x00 && raw->data[1] == cmd && raw->data[2] == 0x01;
+}
+
+HPEXPORT int HPCALL prime_recv_stream(calc_handle * handle, uint8_t cmd, uint8_t end_cmd, prime_vtl_stream * stream) {
+    int res;
+    if (handle != NULL && stream != NULL) {
+        prime_raw_hid_pkt raw;
+        cable_handle * cable = handle->cable;
+        uint32_t expected_size = 0; // Of the current message, 0 between messages.
+        uint32_t received_size = 0;
+        uint32_t read_pkts_count = 0; // In the current message.
+        uint32_t skipped_pkts_count = 0;
+        uint32_t messages_count = 0;
+        int cable_timeout = 0;
+        int read_timeout = 0;
+        uint64_t deadline = 0;
+        int deadline_bound = 0;
+        int retried = 0;
+
+        stream->data = NULL;
+        stream->size = 0;
+        stream->capacity = 0;
+        stream->offsets = NULL;
+        stream->count = 0;
+        stream->offsets_capacity = 0;
+        res = ERR_SUCCESS;
+
+        if (cable != NULL) {
+            cable_timeout = hpcables_options_get_read_timeout(cable);
+            read_timeout = cable_timeout;
+            if (handle->busy) {
+                deadline = handle->operation_deadline;
+            }
+        }
+
+        for (;;) {
+            if (cable != NULL) {
+                int timeout = read_timeout;
+                deadline_bound = 0;
+                if (deadline != 0) {
+                    uint64_t now = get_monotonic_time_ms();
+                    if (now >= deadline) {
+                        res = ERR_CALC_OPERATION_TIMEOUT;
+                        hpcalcs_error("%s: operation timed out", __FUNCTION__);
+                        break;
+                    }
+                    if (deadline - now < (uint64_t)timeout) {
+                        timeout = (int)(deadline - now);
+                        deadline_bound = 1;
+                    }
+                }
+                set_read_timeout(cable, timeout);
+            }
+
+            memset(&raw, 0, sizeof(raw));
+            res = prime_recv(handle, &raw);
+            if (res) {
+                hpcalcs_warning("%s: recv failed", __FUNCTION__);
+                break;
+            }
+            if (raw.size == 0) {
+                if (deadline_bound) {
+                    res = ERR_CALC_OPERATION_TIMEOUT;
+                    hpcalcs_error("%s: operation timed out", __FUNCTION__);
+                }
+                else if (expected_size != 0 && read_timeout < cable_timeout && !retried) {
+                    hpcalcs_warning("%s: no data within %d ms, retrying with %d ms", __FUNCTION__, read_timeout, cable_timeout);
+                    read_timeout = cable_timeout;
+                    retried = 1;
+                    continue;
+                }
+                else if (messages_count == 0) {
+                    res = ERR_CALC_PACKET_FORMAT;
+                    hpcalcs_error("%s: nothing received", __FUNCTION__);
+                }
+                else {
+                    // Keep what was received: each message is validated separately afterwards.
+                    hpcalcs_warning("%s: stream ended without end marker, after %" PRIu32 " messages", __FUNCTION__, messages_count);
+                }
+                break;
+            }
+
+            if (raw.data[0] == 0xFF) {
+                route_status_report(handle, &raw);
+                continue;
+            }
+
+            if (expected_size != 0 && raw.data[0] != ((read_pkts_count + (read_pkts_count / 0xFF)) & 0xFF)) {
+                if (is_message_start(&raw, cmd) || (raw.data[0] == 0x00 && raw.data[1] == end_cmd)) {
+                    // Raw packets were lost at the end of the current message: it will fail validation, but the next one is fine.
+                    hpcalcs_warning("%s: message %" PRIu32 " truncated at %" PRIu32 " of %" PRIu32 " bytes", __FUNCTION__, messages_count - 1, received_size, expected_size);
+                    expected_size = 0;
+                    stream_deliver(stream);
+                }
+                else {
+                    // Raw packets were lost in the middle of the message: keep going, its CRC won't match.
+                    hpcalcs_warning("%s: packet out of sequence, got %d, expected %" PRIu32, __FUNCTION__, (int)raw.data[0], read_pkts_count);
+                    read_pkts_count = raw.data[0];
+                }
+            }
+
+            if (expected_size == 0) {
+                // Between messages.
+                if (raw.data[0] == 0x00 && raw.data[1] == end_cmd) {
+                    hpcalcs_info("%s: end marker received after %" PRIu32 " messages", __FUNCTION__, messages_count);
+                    break;
+                }
+                else if (is_message_start(&raw, cmd)) {
+                    res = prime_data_size(cmd, raw.data + 1, &expected_size); // +1: skip leading byte.
+                    if (res == ERR_SUCCESS) {
+                        res = stream_start_message(stream);
+                    }
+                    if (res != ERR_SUCCESS) {
+                        break;
+                    }
+                    messages_count++;
+                    received_size = 0;
+                    read_pkts_count = 0;
+                    retried = 0;
+                    if (cable != NULL) {
+                        read_timeout = next_read_timeout(cable, cable_timeout);
+                    }
+                }
+                else {
+                    // Resynchronize on the next message.
+                    skipped_pkts_count++;
+                    hpcalcs_warning("%s: skipping raw packet which doesn't start a message", __FUNCTION__);
+                    continue;
+                }
+            }
+
+            read_pkts_count++;
+            {
+                // Skip first byte (sequence number), and the padding after the end of the message.
+                uint32_t size = raw.size - 1;
+                if (size > expected_size - received_size) {
+                    size = expected_size - received_size;
+                }
+                res = stream_reserve(stream, size);
+                if (res != ERR_SUCCESS) {
+                    break;
+                }
+                memcpy(stream->data + stream->size, &(raw.data[1]), size);
+                stream->size += size;
+                received_size += size;
+            }
+
+            if (received_size >= expected_size) {
+                expected_size = 0;
+                stream_deliver(stream);
+                if (cable != NULL) {
+                    // The calculator may need some time for preparing the next file.
+                    read_timeout = cable_timeout;
+                }
+            }
+        }
+
+        if (expected_size != 0) {
+            // Hand over the truncated message too.
+            stream_deliver(stream);
+        }
+        if (skipped_pkts_count != 0) {
+            hpcalcs_warning("%s: skipped %" PRIu32 " raw packets", __FUNCTION__, skipped_pkts_count);
+        }
+        if (cable != NULL) {
+            set_read_timeout(cable, cable_timeout);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcalcs_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL prime_vtl_stream_get_message(prime_vtl_stream * stream, uint32_t index, uint8_t ** out_data, uint32_t * out_size) {
+    int res;
+    if (stream != NULL && out_data != NULL && out_size != NULL && index < stream->count) {
+        uint32_t end = (index + 1 < stream->count) ? stream->offsets[index + 1] : stream->size;
+        *out_data = stream->data + stream->offsets[index];
+        *out_size = end - stream->offsets[index];
+        res = ERR_SUCCESS;
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcalcs_error("%s: an argument is NULL or out of range", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT void HPCALL prime_vtl_stream_clear(prime_vtl_stream * stream) {
+    if (stream != NULL) {
+        (hpcalcs_alloc_funcs.free)(stream->data);
+        (hpcalcs_alloc_funcs.free)(stream->offsets);
+        stream->data = NULL;
+        stream->size = 0;
+        stream->capacity = 0;
+        stream->offsets = NULL;
+        stream->count = 0;
+        stream->offsets_capacity = 0;
+    }
+    else {
+        hpcalcs_error("%s: stream is NULL", __FUNCTION__);
+    }
+}
+
 HPEXPORT int HPCALL prime_data_size(uint8_t cmd, uint8_t * data, uint32_t * out_size) {
     int res = ERR_SUCCESS;
     if (data != NULL && out_size != NULL) {
@@ -0,0 +1,359 @@
+/*
+ * libhpcalcs: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+/**
+ * \file recorder.c Higher-level operations: recording screenshots to an animated PNG.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <hpopers.h>
+#include "internal.h"
+#include "logging.h"
+#include "error.h"
+#include "utils.h"
+
+//! Size of the data of the fcTL chunk, which describes a frame.
+#define FCTL_SIZE (26)
+//! Size of the data of the acTL chunk, which holds the number of frames.
+#define ACTL_SIZE (8)
+
+static const uint8_t png_signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+struct _hpopers_recorder {
+    FILE * file;
+    int res; ///< First error met, returned by the next calls.
+    uint32_t frames;
+    uint32_t collapsed;
+    uint32_t sequence; ///< Sequence number of the next fcTL or fdAT chunk.
+    uint32_t width;
+    uint32_t height;
+    uint64_t layout_hash; ///< Hash of the chunks before the image data of the first frame, which all frames must share.
+    long actl_offset;
+    long fctl_offset; ///< Offset of the fcTL chunk of the last frame, whose delay is only known once the next frame comes.
+    uint8_t fctl[FCTL_SIZE];
+    uint64_t frame_time; ///< Time the last frame was added at.
+    uint8_t digest[32]; ///< SHA-256 of the last frame, for collapsing identical frames.
+};
+
+// Writes a chunk; prefix (may be NULL) is written between the type and the data, e.g. the sequence number of fdAT chunks.
+static int write_chunk(hpopers_recorder * recorder, const char * type, const uint8_t * prefix, uint32_t prefix_size, const uint8_t * data, uint32_t size) {
+    int res = ERR_SUCCESS;
+    uint8_t header[8];
+    uint8_t trailer[4];
+    uint32_t crc = crc32_block(0, (const uint8_t *)type, 4);
+    crc = crc32_block(crc, prefix, prefix_size);
+    crc = crc32_block(crc, data, size);
+    write_be32(header, prefix_size + size);
+    memcpy(header + 4, type, 4);
+    write_be32(trailer, crc);
+    if (   fwrite(header, 1, sizeof(header), recorder->file) != sizeof(header)
+        || (prefix_size != 0 && fwrite(prefix, 1, prefix_size, recorder->file) != prefix_size)
+        || (size != 0 && fwrite(data, 1, size, recorder->file) != size)
+        || fwrite(trailer, 1, sizeof(trailer), recorder->file) != sizeof(trailer)) {
+        res = ERR_OPER_IO;
+        hpopers_error("%s: couldn't write %.4s chunk", __FUNCTION__, type);
+    }
+    return res;
+}
+
+// Rewrites a chunk written earlier at offset, then goes back to the end of the file.
+static int rewrite_chunk(hpopers_recorder * recorder, long offset, const char * type, const uint8_t * data, uint32_t size) {
+    int res;
+    if (fseek(recorder->file, offset, SEEK_SET) == 0) {
+        res = write_chunk(recorder, type, NULL, 0, data, size);
+        if (res == ERR_SUCCESS && fseek(recorder->file, 0, SEEK_END) != 0) {
+            res = ERR_OPER_IO;
+        }
+    }
+    else {
+        res = ERR_OPER_IO;
+        hpopers_error("%s: the file isn't seekable", __FUNCTION__);
+    }
+    return res;
+}
+
+// The delay of a frame is a 16-bit fraction of a second: coarser units are used for long delays, up to about 18 hours.
+static void set_delay(uint8_t * fctl, uint64_t delay_ms) {
+    uint16_t numerator;
+    uint16_t denominator;
+    if (delay_ms <= 0xFFFF) {
+        numerator = (uint16_t)delay_ms;
+        denominator = 1000;
+    }
+    else if (delay_ms / 10 <= 0xFFFF) {
+        numerator = (uint16_t)(delay_ms / 10);
+        denominator = 100;
+    }
+    else if (delay_ms / 100 <= 0xFFFF) {
+        numerator = (uint16_t)(delay_ms / 100);
+        denominator = 10;
+    }
+    else {
+        numerator = (uint16_t)((delay_ms / 1000 <= 0xFFFF) ? delay_ms / 1000 : 0xFFFF);
+        denominator = 1;
+    }
+    fctl[20] = (uint8_t)(numerator >> 8);
+    fctl[21] = (uint8_t)numerator;
+    fctl[22] = (uint8_t)(denominator >> 8);
+    fctl[23] = (uint8_t)denominator;
+}
+
+// Sets the delay of the last frame written, now that the time of the next one is known.
+static int finish_frame(hpopers_recorder * recorder, uint64_t time_ms) {
+    int res = ERR_SUCCESS;
+    if (recorder->frames > 0) {
+        set_delay(recorder->fctl, time_ms > recorder->frame_time ? time_ms - recorder->frame_time : 0);
+        res = rewrite_chunk(recorder, recorder->fctl_offset, "fcTL", recorder->fctl, FCTL_SIZE);
+    }
+    return res;
+}
+
+// Starts a frame with its fcTL chunk: the whole image, replacing the previous one.
+static int start_frame(hpopers_recorder * recorder) {
+    int res;
+    memset(recorder->fctl, 0, sizeof(recorder->fctl));
+    write_be32(recorder->fctl, recorder->sequence++);
+    write_be32(recorder->fctl + 4, recorder->width);
+    write_be32(recorder->fctl + 8, recorder->height);
+    set_delay(recorder->fctl, 0);
+    recorder->fctl_offset = ftell(recorder->file);
+    if (recorder->fctl_offset >= 0) {
+        res = write_chunk(recorder, "fcTL", NULL, 0, recorder->fctl, FCTL_SIZE);
+    }
+    else {
+        res = ERR_OPER_IO;
+        hpopers_error("%s: the file isn't seekable", __FUNCTION__);
+    }
+    return res;
+}
+
+// Checks that a PNG image is made of whole chunks, and has image data, before anything is written for it.
+static int check_image(const uint8_t * data, uint32_t size) {
+    int res = ERR_OPER_IMAGE;
+    if (size >= sizeof(png_signature) && memcmp(data, png_signature, sizeof(png_signature)) == 0) {
+        uint32_t offset = sizeof(png_signature);
+        while (offset + 12 <= size) {
+            uint32_t chunk_size = read_be32(data + offset);
+            if (chunk_size > size - offset - 12) {
+                res = ERR_OPER_IMAGE;
+                break;
+            }
+            if (memcmp(data + offset + 4, "IDAT", 4) == 0) {
+                res = ERR_SUCCESS;
+            }
+            offset += chunk_size + 12;
+        }
+    }
+    if (res != ERR_SUCCESS) {
+        hpopers_error("%s: not a complete PNG image", __FUNCTION__);
+    }
+    return res;
+}
+
+// Copies the chunks of a PNG image to the file: all of them for the first frame, which is also the default image, and only the image data, as fdAT chunks, for the next ones.
+static int write_frame(hpopers_recorder * recorder, const uint8_t * data, uint32_t size, uint64_t time_ms) {
+    int res = ERR_SUCCESS;
+    uint64_t layout_hash = FNV1A_64_INIT;
+    int in_data = 0;
+    uint32_t offset = sizeof(png_signature);
+
+    if (recorder->frames == 0 && fwrite(png_signature, 1, sizeof(png_signature), recorder->file) != sizeof(png_signature)) {
+        res = ERR_OPER_IO;
+    }
+    while (res == ERR_SUCCESS && offset + 12 <= size) {
+        uint32_t chunk_size = read_be32(data + offset);
+        const uint8_t * type = data + offset + 4;
+        if (memcmp(type, "IDAT", 4) == 0) {
+            if (!in_data) {
+                in_data = 1;
+                if (recorder->frames == 0) {
+                    recorder->layout_hash = layout_hash;
+                }
+                else if (layout_hash != recorder->layout_hash) {
+                    // The frames would have to be decoded and converted; see hpopers_oper_convert_raw_screen_to_png_r8g8b8.
+                    res = ERR_OPER_IMAGE;
+                    hpopers_error("%s: the size or pixel format differs from the first frame", __FUNCTION__);
+                    break;
+                }
+                res = finish_frame(recorder, time_ms);
+                if (res == ERR_SUCCESS) {
+                    res = start_frame(recorder);
+                }
+            }
+            if (res == ERR_SUCCESS) {
+                if (recorder->frames == 0) {
+                    res = write_chunk(recorder, "IDAT", NULL, 0, type + 4, chunk_size);
+                }
+                else {
+                    uint8_t sequence[4];
+                    write_be32(sequence, recorder->sequence++);
+                    res = write_chunk(recorder, "fdAT", sequence, sizeof(sequence), type + 4, chunk_size);
+                }
+            }
+        }
+        else if (in_data || memcmp(type, "IEND", 4) == 0) {
+            // The chunks after the image data, e.g. text, only belong to the default image.
+            break;
+        }
+        else {
+            layout_hash = fnv1a_64_block(layout_hash, data + offset, chunk_size + 12);
+            if (recorder->frames == 0) {
+                if (fwrite(data + offset, 1, chunk_size + 12, recorder->file) != chunk_size + 12) {
+                    res = ERR_OPER_IO;
+                }
+                else if (memcmp(type, "IHDR", 4) == 0 && chunk_size >= 8) {
+                    uint8_t actl[ACTL_SIZE];
+                    recorder->width = read_be32(type + 4);
+                    recorder->height = read_be32(type + 8);
+                    memset(actl, 0, sizeof(actl));
+                    recorder->actl_offset = ftell(recorder->file);
+                    res = write_chunk(recorder, "acTL", NULL, 0, actl, sizeof(actl));
+                }
+            }
+        }
+        offset += chunk_size + 12;
+    }
+    if (res == ERR_OPER_IO) {
+        hpopers_error("%s: couldn't write frame", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT hpopers_recorder * HPCALL hpopers_recorder_new(FILE * out_file) {
+    hpopers_recorder * recorder = NULL;
+    if (out_file != NULL) {
+        recorder = (hpopers_recorder *)(hpopers_alloc_funcs.calloc)(1, sizeof(*recorder));
+        if (recorder != NULL) {
+            recorder->file = out_file;
+        }
+        else {
+            hpopers_error("%s: couldn't allocate memory", __FUNCTION__);
+        }
+    }
+    else {
+        hpopers_error("%s: out_file is NULL", __FUNCTION__);
+    }
+    return recorder;
+}
+
+HPEXPORT int HPCALL hpopers_recorder_add_frame(hpopers_recorder * recorder, const uint8_t * data, uint32_t size, uint64_t time_ms) {
+    int res;
+    if (recorder != NULL && data != NULL) {
+        res = recorder->res;
+        if (res == ERR_SUCCESS) {
+            uint8_t digest[32];
+            if (time_ms == 0) {
+                time_ms = get_monotonic_time_ms();
+            }
+            sha256_block(data, size, digest);
+            if (recorder->frames > 0 && !memcmp(digest, recorder->digest, sizeof(digest))) {
+                // The frame only extends the display time of the previous one.
+                recorder->collapsed++;
+            }
+            else {
+                res = check_image(data, size);
+                if (res == ERR_SUCCESS) {
+                    res = write_frame(recorder, data, size, time_ms);
+                }
+                if (res == ERR_SUCCESS) {
+                    memcpy(recorder->digest, digest, sizeof(digest));
+                    recorder->frame_time = time_ms;
+                    recorder->frames++;
+                }
+                else if (res == ERR_OPER_IO) {
+                    // The file may hold part of the frame.
+                    recorder->res = res;
+                }
+            }
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpopers_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT void HPCALL hpopers_recorder_screen_callback(calc_handle * handle, const uint8_t * data, uint32_t size, void * user_data) {
+    (void)handle;
+    hpopers_recorder_add_frame((hpopers_recorder *)user_data, data, size, 0);
+}
+
+HPEXPORT int HPCALL hpopers_recorder_get_counts(hpopers_recorder * recorder, uint32_t * out_frames, uint32_t * out_collapsed) {
+    int res;
+    if (recorder != NULL) {
+        if (out_frames != NULL) {
+            *out_frames = recorder->frames;
+        }
+        if (out_collapsed != NULL) {
+            *out_collapsed = recorder->collapsed;
+        }
+        res = ERR_SUCCESS;
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpopers_error("%s: recorder is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpopers_recorder_close(hpopers_recorder * recorder, uint64_t end_time_ms) {
+    int res;
+    if (recorder != NULL) {
+        res = recorder->res;
+        if (res == ERR_SUCCESS) {
+            if (recorder->frames > 0) {
+                uint8_t actl[ACTL_SIZE];
+                if (end_time_ms == 0) {
+                    end_time_ms = get_monotonic_time_ms();
+                }
+                write_be32(actl, recorder->frames);
+                write_be32(actl + 4, 0); // Loop forever.
+                res = finish_frame(recorder, end_time_ms);
+                if (res == ERR_SUCCESS) {
+                    res = rewrite_chunk(recorder, recorder->actl_offset, "acTL", actl, sizeof(actl));
+                }
+                if (res == ERR_SUCCESS) {
+                    res = write_chunk(recorder, "IEND", NULL, 0, NULL, 0);
+                }
+                if (res == ERR_SUCCESS && fflush(recorder->file) != 0) {
+                    res = ERR_OPER_IO;
+                }
+                hpopers_info("%s: %" PRIu32 " frames written, %" PRIu32 " identical frames collapsed", __FUNCTION__, recorder->frames, recorder->collapsed);
+            }
+            else {
+                hpopers_warning("%s: no frames recorded", __FUNCTION__);
+            }
+        }
+        (hpopers_alloc_funcs.free)(recorder);
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpopers_error("%s: recorder is NULL", __FUNCTION__);
+    }
+    return res;
+}
@@ -0,0 +1,441 @@
+/*
+ * libhpcalcs: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+/**
+ * \file screen.c Higher-level operations: screenshot conversion.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <png.h>
+#include <zlib.h>
+
+#include <hpopers.h>
+#include "internal.h"
+#include "logging.h"
+#include "error.h"
+
+//! Bytes per pixel of the converted images.
+#define RGB_BYTES (3)
+//! Room for the pixels of a byte of a packed (1, 2 or 4 bits per pixel) row, once expanded.
+#define LUT_STRIDE_MAX (8 * RGB_BYTES)
+
+//! Growable memory block.
+typedef struct {
+    uint8_t * data;
+    uint32_t size;
+    uint32_t capacity;
+} screen_buffer;
+
+// Reused by the next conversion on the same thread, which then neither reallocates nor rebuilds the expansion table; per thread, so that concurrent conversions don't need a lock.
+static HPLIBS_THREAD_LOCAL screen_buffer pixels_buffer; // Converted pixels.
+static HPLIBS_THREAD_LOCAL screen_buffer row_buffer; // A decoded row, before expansion.
+static HPLIBS_THREAD_LOCAL screen_buffer rows_buffer; // Row pointers, for images decoded in one go.
+static HPLIBS_THREAD_LOCAL screen_buffer encoded_buffer; // Re-encoded PNG.
+
+// Expansion of every possible byte of a packed row to R8G8B8, and what it was built for.
+static HPLIBS_THREAD_LOCAL uint8_t lut[256 * LUT_STRIDE_MAX];
+static HPLIBS_THREAD_LOCAL int lut_valid;
+static HPLIBS_THREAD_LOCAL int lut_color_type;
+static HPLIBS_THREAD_LOCAL int lut_bit_depth;
+static HPLIBS_THREAD_LOCAL int lut_palette_count;
+static HPLIBS_THREAD_LOCAL png_color lut_palette[256];
+
+static int buffer_reserve(screen_buffer * buffer, uint32_t capacity) {
+    int res = ERR_SUCCESS;
+    if (buffer->capacity < capacity) {
+        uint8_t * data = (uint8_t *)(hpopers_alloc_funcs.realloc)(buffer->data, capacity);
+        if (data != NULL) {
+            buffer->data = data;
+            buffer->capacity = capacity;
+        }
+        else {
+            res = ERR_MALLOC;
+        }
+    }
+    return res;
+}
+
+static void buffer_free(screen_buffer * buffer) {
+    (hpopers_alloc_funcs.free)(buffer->data);
+    buffer->data = NULL;
+    buffer->size = 0;
+    buffer->capacity = 0;
+}
+
+HPEXPORT void HPCALL hpopers_screen_buffers_trim(void) {
+    buffer_free(&pixels_buffer);
+    buffer_free(&row_buffer);
+    buffer_free(&rows_buffer);
+    buffer_free(&encoded_buffer);
+    lut_valid = 0;
+}
+
+static void screen_png_error(png_structp png_ptr, png_const_charp message) {
+    hpopers_error("%s: %s", __FUNCTION__, message);
+    longjmp(png_jmpbuf(png_ptr), 1);
+}
+
+static void screen_png_warning(png_structp png_ptr, png_const_charp message) {
+    hpopers_warning("%s: %s", __FUNCTION__, message);
+}
+
+//! Position in the raw screenshot being decoded.
+typedef struct {
+    const uint8_t * data;
+    uint32_t size;
+    uint32_t offset;
+} screen_reader;
+
+static void screen_png_read(png_structp png_ptr, png_bytep out, png_size_t length) {
+    screen_reader * reader = (screen_reader *)png_get_io_ptr(png_ptr);
+    if (length > reader->size - reader->offset) {
+        png_error(png_ptr, "truncated image");
+    }
+    memcpy(out, reader->data + reader->offset, length);
+    reader->offset += (uint32_t)length;
+}
+
+static void screen_png_write(png_structp png_ptr, png_bytep data, png_size_t length) {
+    screen_buffer * buffer = (screen_buffer *)png_get_io_ptr(png_ptr);
+    if ((uint64_t)buffer->size + length > buffer->capacity) {
+        uint64_t capacity = (uint64_t)buffer->capacity * 2 + length;
+        if (capacity > UINT32_MAX || buffer_reserve(buffer, (uint32_t)capacity) != ERR_SUCCESS) {
+            png_error(png_ptr, "out of memory");
+        }
+    }
+    memcpy(buffer->data + buffer->size, data, length);
+    buffer->size += (uint32_t)length;
+}
+
+static void screen_png_flush(png_structp png_ptr) {
+}
+
+// Builds, unless the previous image had the same format and palette, the R8G8B8 expansion of each possible byte of a palette or grayscale row with the given bit depth.
+static void update_lut(png_structp png_ptr, png_infop info_ptr, int color_type, int bit_depth) {
+    png_colorp palette = NULL;
+    int palette_count = 0;
+
+    if (color_type == PNG_COLOR_TYPE_PALETTE) {
+        png_get_PLTE(png_ptr, info_ptr, &palette, &palette_count);
+    }
+    if (   !lut_valid || lut_color_type != color_type || lut_bit_depth != bit_depth || lut_palette_count != palette_count
+        || (palette_count > 0 && memcmp(lut_palette, palette, palette_count * sizeof(*palette)) != 0)
+       ) {
+        uint32_t pixels_per_byte = 8 / bit_depth;
+        uint32_t mask = (1U << bit_depth) - 1;
+        uint32_t value;
+
+        for (value = 0; value < 256; value++) {
+            uint8_t * out = &lut[value * pixels_per_byte * RGB_BYTES];
+            uint32_t i;
+            for (i = 0; i < pixels_per_byte; i++) {
+                // The leftmost pixel is in the high-order bits.
+                uint32_t index = (value >> (8 - bit_depth * (i + 1))) & mask;
+                if (color_type == PNG_COLOR_TYPE_PALETTE) {
+                    if (index < (uint32_t)palette_count) {
+                        *out++ = palette[index].red;
+                        *out++ = palette[index].green;
+                        *out++ = palette[index].blue;
+                    }
+                    else {
+                        *out++ = 0;
+                        *out++ = 0;
+                        *out++ = 0;
+                    }
+                }
+                else {
+                    uint8_t gray = (uint8_t)(index * 255 / mask);
+                    *out++ = gray;
+                    *out++ = gray;
+                    *out++ = gray;
+                }
+            }
+        }
+        if (palette_count > 0) {
+            memcpy(lut_palette, palette, palette_count * sizeof(*palette));
+        }
+        lut_color_type = color_type;
+        lut_bit_depth = bit_depth;
+        lut_palette_count = palette_count;
+        lut_valid = 1;
+    }
+}
+
+// Expands a palette or grayscale row a byte (i.e. up to 8 pixels) at a time.
+static void expand_packed_row(const uint8_t * in, uint8_t * out, uint32_t width, int bit_depth) {
+    uint32_t pixels_per_byte = 8 / bit_depth;
+    uint32_t stride = pixels_per_byte * RGB_BYTES;
+    uint32_t full_bytes = width / pixels_per_byte;
+    uint32_t remainder = width % pixels_per_byte;
+    uint32_t i;
+
+    if (stride == 6) {
+        // The 4-bit formats of the Prime: a fixed-size copy per byte.
+        for (i = 0; i < full_bytes; i++) {
+            memcpy(out, &lut[in[i] * 6], 6);
+            out += 6;
+        }
+    }
+    else {
+        for (i = 0; i < full_bytes; i++) {
+            memcpy(out, &lut[in[i] * stride], stride);
+            out += stride;
+        }
+    }
+    if (remainder != 0) {
+        memcpy(out, &lut[in[full_bytes] * stride], remainder * RGB_BYTES);
+    }
+}
+
+// Keeps the most significant byte of each 16-bit big-endian sample.
+static void expand_rgb16_row(const uint8_t * in, uint8_t * out, uint32_t width) {
+    uint32_t i;
+    for (i = 0; i < width * RGB_BYTES; i++) {
+        out[i] = in[i * 2];
+    }
+}
+
+// Decodes a PNG image to R8G8B8 pixels, into pixels_buffer.
+static int decode_png(const uint8_t * data, uint32_t size, uint32_t * out_width, uint32_t * out_height) {
+    int res;
+    png_structp png_ptr;
+    png_infop info_ptr = NULL;
+    screen_reader reader;
+
+    reader.data = data;
+    reader.size = size;
+    reader.offset = 0;
+
+    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, screen_png_error, screen_png_warning);
+    if (png_ptr != NULL) {
+        info_ptr = png_create_info_struct(png_ptr);
+    }
+    if (png_ptr == NULL || info_ptr == NULL) {
+        res = ERR_MALLOC;
+        hpopers_error("%s: couldn't create decoder", __FUNCTION__);
+    }
+    else if (setjmp(png_jmpbuf(png_ptr))) {
+        res = ERR_OPER_IMAGE;
+    }
+    else {
+        png_uint_32 width;
+        png_uint_32 height;
+        int bit_depth;
+        int color_type;
+        int interlace_type;
+        uint32_t out_row_size;
+        uint32_t y;
+
+        png_set_read_fn(png_ptr, &reader, screen_png_read);
+        png_read_info(png_ptr, info_ptr);
+        png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth, &color_type, &interlace_type, NULL, NULL);
+        hpopers_info("%s: %" PRIu32 "x%" PRIu32 ", color type %d, bit depth %d", __FUNCTION__, (uint32_t)width, (uint32_t)height, color_type, bit_depth);
+        if (width == 0 || height == 0 || width > 4096 || height > 4096) {
+            png_error(png_ptr, "unsupported image size");
+        }
+        out_row_size = (uint32_t)width * RGB_BYTES;
+        if (   buffer_reserve(&pixels_buffer, out_row_size * (uint32_t)height) != ERR_SUCCESS
+            || buffer_reserve(&row_buffer, (uint32_t)png_get_rowbytes(png_ptr, info_ptr)) != ERR_SUCCESS
+           ) {
+            png_error(png_ptr, "out of memory");
+        }
+
+        if (   interlace_type == PNG_INTERLACE_NONE
+            && (color_type == PNG_COLOR_TYPE_PALETTE || color_type == PNG_COLOR_TYPE_GRAY)
+            && bit_depth <= 8
+           ) {
+            update_lut(png_ptr, info_ptr, color_type, bit_depth);
+            for (y = 0; y < height; y++) {
+                png_read_row(png_ptr, row_buffer.data, NULL);
+                expand_packed_row(row_buffer.data, pixels_buffer.data + y * out_row_size, (uint32_t)width, bit_depth);
+            }
+        }
+        else if (interlace_type == PNG_INTERLACE_NONE && color_type == PNG_COLOR_TYPE_RGB && bit_depth == 16) {
+            for (y = 0; y < height; y++) {
+                png_read_row(png_ptr, row_buffer.data, NULL);
+                expand_rgb16_row(row_buffer.data, pixels_buffer.data + y * out_row_size, (uint32_t)width);
+            }
+        }
+        else {
+            // Anything else, e.g. alpha channels: let libpng do the conversion.
+            png_bytepp rows;
+            if (bit_depth == 16) {
+                png_set_strip_16(png_ptr);
+            }
+            if (color_type == PNG_COLOR_TYPE_PALETTE || (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)) {
+                png_set_expand(png_ptr);
+            }
+            if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA) {
+                png_set_gray_to_rgb(png_ptr);
+            }
+            png_set_strip_alpha(png_ptr);
+            png_set_interlace_handling(png_ptr);
+            png_read_update_info(png_ptr, info_ptr);
+            if (png_get_rowbytes(png_ptr, info_ptr) != out_row_size) {
+                png_error(png_ptr, "unexpected row size after conversion");
+            }
+            if (buffer_reserve(&rows_buffer, (uint32_t)height * sizeof(*rows)) != ERR_SUCCESS) {
+                png_error(png_ptr, "out of memory");
+            }
+            rows = (png_bytepp)rows_buffer.data;
+            for (y = 0; y < height; y++) {
+                rows[y] = pixels_buffer.data + y * out_row_size;
+            }
+            png_read_image(png_ptr, rows);
+        }
+        png_read_end(png_ptr, NULL);
+
+        pixels_buffer.size = out_row_size * (uint32_t)height;
+        *out_width = (uint32_t)width;
+        *out_height = (uint32_t)height;
+        res = ERR_SUCCESS;
+    }
+
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    return res;
+}
+
+// Encodes the R8G8B8 pixels of pixels_buffer as PNG, into encoded_buffer.
+static int encode_png(uint32_t width, uint32_t height) {
+    int res;
+    png_structp png_ptr;
+    png_infop info_ptr = NULL;
+
+    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, screen_png_error, screen_png_warning);
+    if (png_ptr != NULL) {
+        info_ptr = png_create_info_struct(png_ptr);
+    }
+    encoded_buffer.size = 0;
+    if (png_ptr == NULL || info_ptr == NULL) {
+        res = ERR_MALLOC;
+        hpopers_error("%s: couldn't create encoder", __FUNCTION__);
+    }
+    else if (setjmp(png_jmpbuf(png_ptr))) {
+        res = ERR_OPER_IMAGE;
+    }
+    else {
+        uint32_t y;
+
+        png_set_write_fn(png_ptr, &encoded_buffer, screen_png_write, screen_png_flush);
+        // Screenshots are mostly flat areas, which compress well enough with the fastest settings.
+        png_set_compression_level(png_ptr, Z_BEST_SPEED);
+        png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, PNG_FILTER_SUB);
+        png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+        png_write_info(png_ptr, info_ptr);
+        for (y = 0; y < height; y++) {
+            png_write_row(png_ptr, pixels_buffer.data + y * width * RGB_BYTES);
+        }
+        png_write_end(png_ptr, NULL);
+        res = ERR_SUCCESS;
+    }
+
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    return res;
+}
+
+int hpopers_screen_decode_r8g8b8(const uint8_t * data, uint32_t size, const uint8_t ** out_pixels, uint32_t * out_width, uint32_t * out_height) {
+    int res = decode_png(data, size, out_width, out_height);
+    *out_pixels = (res == ERR_SUCCESS) ? pixels_buffer.data : NULL;
+    return res;
+}
+
+HPEXPORT int HPCALL hpopers_oper_convert_raw_screen_to_png_r8g8b8(uint8_t * in_data, uint32_t in_size, calc_screenshot_format format, uint8_t ** out_data, uint32_t * out_size) {
+    int res;
+    if (in_data != NULL && out_data != NULL && out_size != NULL) {
+        if (format == CALC_SCREENSHOT_FORMAT_PRIME_PREVIEW || (format >= CALC_SCREENSHOT_FORMAT_FIRST && format < CALC_SCREENSHOT_FORMAT_LAST)) {
+            uint32_t width = 0;
+            uint32_t height = 0;
+
+            res = decode_png(in_data, in_size, &width, &height);
+            if (res == ERR_SUCCESS) {
+                res = encode_png(width, height);
+            }
+            if (res == ERR_SUCCESS) {
+                // The encoding buffer stays with this thread, hand over an exactly-sized copy.
+                *out_data = (uint8_t *)(hpopers_alloc_funcs.malloc)(encoded_buffer.size);
+                if (*out_data != NULL) {
+                    memcpy(*out_data, encoded_buffer.data, encoded_buffer.size);
+                    *out_size = encoded_buffer.size;
+                }
+                else {
+                    res = ERR_MALLOC;
+                    hpopers_error("%s: couldn't allocate output", __FUNCTION__);
+                }
+            }
+            else {
+                hpopers_error("%s: conversion failed", __FUNCTION__);
+            }
+        }
+        else {
+            res = ERR_INVALID_PARAMETER;
+            hpopers_error("%s: unsupported format", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpopers_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpopers_oper_recv_screen_png_r8g8b8(calc_handle * handle, calc_screenshot_format format, uint8_t ** out_data, uint32_t * out_size) {
+    int res;
+    if (handle != NULL && out_data != NULL && out_size != NULL) {
+        hplibs_buffer_view view;
+        res = hpcalcs_calc_recv_screen_view(handle, format, &view);
+        if (res == ERR_SUCCESS) {
+            res = hpopers_oper_convert_raw_screen_to_png_r8g8b8(HPLIBS_BUFFER_VIEW_DATA(&view), view.size, format, out_data, out_size);
+            hplibs_buffer_view_release(&view);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpopers_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpopers_oper_recv_screen_png_r8g8b8_to_file(calc_handle * handle, calc_screenshot_format format, FILE * out_file) {
+    int res;
+    if (handle != NULL && out_file != NULL) {
+        uint8_t * data;
+        uint32_t size;
+        res = hpopers_oper_recv_screen_png_r8g8b8(handle, format, &data, &size);
+        if (res == ERR_SUCCESS) {
+            if (fwrite(data, 1, size, out_file) != size) {
+                res = ERR_OPER_IO;
+                hpopers_error("%s: couldn't write file", __FUNCTION__);
+            }
+            (hpopers_alloc_funcs.free)(data);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpopers_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
@@ -0,0 +1,370 @@
+/*
+ * libhpcalcs: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+/**
+ * \file screenhistory.c Calcs: history of the recent screenshots of a calculator.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <hpcalcs.h>
+#include "internal.h"
+#include "logging.h"
+#include "error.h"
+#include "utils.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+//! An image kept by a history, shared by the identical frames; the image follows the structure.
+typedef struct _screen_image screen_image;
+struct _screen_image {
+    screen_image * next;
+    uint64_t hash;
+    uint32_t size;
+    uint32_t refs;
+};
+
+typedef struct {
+    uint64_t time_ms;
+    calc_screenshot_format format;
+    screen_image * image;
+} screen_frame;
+
+struct _calc_screen_history {
+    screen_frame * frames; // Ring of max_frames slots: the count frames from head on are in use, oldest first.
+    uint32_t max_frames;
+    uint32_t head;
+    uint32_t count;
+    uint32_t max_bytes;
+    uint32_t bytes;
+    screen_image * images; // Most recent first.
+    uint32_t images_count;
+    uint32_t frames_recorded;
+    uint32_t frames_rejected;
+};
+
+// The histories are fed by e.g. the capture thread of a screen stream while the caller looks them up, and share the global limit.
+static uint64_t global_bytes;
+static uint64_t global_limit;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t history_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK_HISTORY() pthread_mutex_lock(&history_mutex)
+#define UNLOCK_HISTORY() pthread_mutex_unlock(&history_mutex)
+#else
+#define LOCK_HISTORY()
+#define UNLOCK_HISTORY()
+#endif
+
+static screen_image * find_image(calc_screen_history * history, uint64_t hash, const uint8_t * data, uint32_t size) {
+    screen_image * image;
+    for (image = history->images; image != NULL; image = image->next) {
+        if (image->hash == hash && image->size == size && !memcmp((uint8_t *)(image + 1), data, size)) {
+            break;
+        }
+    }
+    return image;
+}
+
+static void release_image(calc_screen_history * history, screen_image * image) {
+    if (--image->refs == 0) {
+        screen_image ** link = &history->images;
+        while (*link != image) {
+            link = &(*link)->next;
+        }
+        *link = image->next;
+        history->images_count--;
+        history->bytes -= image->size;
+        global_bytes -= image->size;
+        (hpcalcs_base_alloc_funcs.free)(image);
+    }
+}
+
+static void evict_oldest(calc_screen_history * history) {
+    release_image(history, history->frames[history->head].image);
+    history->head = (history->head + 1) % history->max_frames;
+    history->count--;
+}
+
+static int image_fits(const calc_screen_history * history, uint32_t size) {
+    return    (uint64_t)history->bytes + size <= history->max_bytes
+           && (global_limit == 0 || global_bytes + size <= global_limit);
+}
+
+// Whether the image would fit once all the frames of the history are evicted.
+static int image_can_fit(const calc_screen_history * history, uint32_t size) {
+    return    size <= history->max_bytes
+           && (global_limit == 0 || global_bytes - history->bytes + size <= global_limit);
+}
+
+void hpcalcs_screen_history_record(calc_handle * handle, calc_screenshot_format format, const uint8_t * data, uint32_t size) {
+    calc_screen_history * history;
+    if (handle == NULL || data == NULL || size == 0) {
+        return;
+    }
+    LOCK_HISTORY();
+    history = handle->screen_history;
+    if (history != NULL) {
+        uint64_t hash = fnv1a_64_block(FNV1A_64_INIT, data, size);
+        screen_image * image = find_image(history, hash, data, size);
+
+        history->frames_recorded++;
+        if (image != NULL) {
+            image->refs++; // Before evicting, so that the image survives its older frames.
+        }
+        if (image != NULL || image_can_fit(history, size)) {
+            while (history->count > 0 && (history->count == history->max_frames || (image == NULL && !image_fits(history, size)))) {
+                evict_oldest(history);
+            }
+        }
+        // Otherwise, the frames are kept rather than evicted in vain.
+        if (image == NULL && image_fits(history, size)) {
+            image = (hpcalcs_base_alloc_funcs.malloc)(sizeof(*image) + size);
+            if (image != NULL) {
+                image->hash = hash;
+                image->size = size;
+                image->refs = 1;
+                memcpy((uint8_t *)(image + 1), data, size);
+                image->next = history->images;
+                history->images = image;
+                history->images_count++;
+                history->bytes += size;
+                global_bytes += size;
+            }
+        }
+        if (image != NULL) {
+            screen_frame * frame = &history->frames[(history->head + history->count) % history->max_frames];
+            frame->time_ms = get_wall_time_ms();
+            frame->format = format;
+            frame->image = image;
+            history->count++;
+        }
+        else {
+            history->frames_rejected++;
+            hpcalcs_warning("%s: no room for a %" PRIu32 " bytes screenshot", __FUNCTION__, size);
+        }
+    }
+    UNLOCK_HISTORY();
+}
+
+HPEXPORT int HPCALL hpcalcs_calc_screen_history_enable(calc_handle * handle, uint32_t max_frames, uint32_t max_bytes) {
+    int res;
+    if (handle != NULL) {
+        if (max_frames != 0 && max_bytes != 0) {
+            screen_frame * frames = (hpcalcs_base_alloc_funcs.calloc)(max_frames, sizeof(*frames));
+            if (frames != NULL) {
+                calc_screen_history * history;
+                res = ERR_SUCCESS;
+                LOCK_HISTORY();
+                history = handle->screen_history;
+                if (history == NULL) {
+                    history = (hpcalcs_base_alloc_funcs.calloc)(1, sizeof(*history));
+                    handle->screen_history = history;
+                    if (history == NULL) {
+                        res = ERR_MALLOC;
+                    }
+                }
+                if (history != NULL) {
+                    uint32_t i;
+                    // Move the frames kept to the new ring, without the oldest ones if they don't fit.
+                    while (history->count > max_frames) {
+                        evict_oldest(history);
+                    }
+                    for (i = 0; i < history->count; i++) {
+                        frames[i] = history->frames[(history->head + i) % history->max_frames];
+                    }
+                    (hpcalcs_base_alloc_funcs.free)(history->frames);
+                    history->frames = frames;
+                    history->max_frames = max_frames;
+                    history->head = 0;
+                    history->max_bytes = max_bytes;
+                    while (history->count > 0 && history->bytes > max_bytes) {
+                        evict_oldest(history);
+                    }
+                    frames = NULL;
+                }
+                UNLOCK_HISTORY();
+                (hpcalcs_base_alloc_funcs.free)(frames);
+            }
+            else {
+                res = ERR_MALLOC;
+            }
+            if (res == ERR_SUCCESS) {
+                hpcalcs_info("%s: keeping up to %" PRIu32 " frames in %" PRIu32 " bytes", __FUNCTION__, max_frames, max_bytes);
+            }
+            else {
+                hpcalcs_error("%s: couldn't allocate memory", __FUNCTION__);
+            }
+        }
+        else {
+            res = ERR_INVALID_PARAMETER;
+            hpcalcs_error("%s: limits must not be 0", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcalcs_calc_screen_history_disable(calc_handle * handle) {
+    int res;
+    if (handle != NULL) {
+        calc_screen_history * history;
+        LOCK_HISTORY();
+        history = handle->screen_history;
+        handle->screen_history = NULL;
+        if (history != NULL) {
+            while (history->count > 0) {
+                evict_oldest(history);
+            }
+            (hpcalcs_base_alloc_funcs.free)(history->frames);
+            (hpcalcs_base_alloc_funcs.free)(history);
+        }
+        UNLOCK_HISTORY();
+        res = ERR_SUCCESS;
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcalcs_calc_screen_history_get_frame(calc_handle * handle, uint64_t time_ms, uint64_t * out_time_ms, calc_screenshot_format * out_format, hplibs_buffer_view * out_view) {
+    int res;
+    if (handle != NULL && out_view != NULL) {
+        calc_screen_history * history;
+        memset(out_view, 0, sizeof(*out_view));
+        res = ERR_CALC_NO_FRAME;
+        LOCK_HISTORY();
+        history = handle->screen_history;
+        if (history != NULL) {
+            uint32_t i;
+            // Newest first: the wall clock may have been set back meanwhile.
+            for (i = history->count; i > 0; i--) {
+                const screen_frame * frame = &history->frames[(history->head + i - 1) % history->max_frames];
+                if (frame->time_ms <= time_ms) {
+                    out_view->base = (hpcalcs_alloc_funcs.malloc)(frame->image->size);
+                    if (out_view->base != NULL) {
+                        memcpy(out_view->base, (uint8_t *)(frame->image + 1), frame->image->size);
+                        out_view->size = frame->image->size;
+                        out_view->release = hplibs_scoped_release_func(&hpcalcs_alloc_funcs);
+                        if (out_time_ms != NULL) {
+                            *out_time_ms = frame->time_ms;
+                        }
+                        if (out_format != NULL) {
+                            *out_format = frame->format;
+                        }
+                        res = ERR_SUCCESS;
+                    }
+                    else {
+                        res = ERR_MALLOC;
+                    }
+                    break;
+                }
+            }
+        }
+        UNLOCK_HISTORY();
+        if (res != ERR_SUCCESS) {
+            hpcalcs_info("%s: no screenshot for time %" PRIu64 ": %d", __FUNCTION__, time_ms, res);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcalcs_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcalcs_calc_screen_history_get_times(calc_handle * handle, uint64_t since_ms, uint64_t * out_times, uint32_t max_count, uint32_t * out_count) {
+    int res;
+    if (handle != NULL && out_count != NULL && (out_times != NULL || max_count == 0)) {
+        calc_screen_history * history;
+        uint32_t count = 0;
+        LOCK_HISTORY();
+        history = handle->screen_history;
+        if (history != NULL) {
+            uint32_t i;
+            for (i = 0; i < history->count; i++) {
+                uint64_t time_ms = history->frames[(history->head + i) % history->max_frames].time_ms;
+                if (time_ms >= since_ms) {
+                    if (count < max_count) {
+                        out_times[count] = time_ms;
+                    }
+                    count++;
+                }
+            }
+        }
+        UNLOCK_HISTORY();
+        *out_count = count;
+        res = ERR_SUCCESS;
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcalcs_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcalcs_calc_screen_history_get_stats(calc_handle * handle, calc_screen_history_stats * stats) {
+    int res;
+    if (handle != NULL && stats != NULL) {
+        calc_screen_history * history;
+        memset(stats, 0, sizeof(*stats));
+        LOCK_HISTORY();
+        history = handle->screen_history;
+        if (history != NULL) {
+            stats->frames = history->count;
+            stats->images = history->images_count;
+            stats->bytes = history->bytes;
+            if (history->count > 0) {
+                stats->oldest_time_ms = history->frames[history->head].time_ms;
+                stats->newest_time_ms = history->frames[(history->head + history->count - 1) % history->max_frames].time_ms;
+            }
+            stats->frames_recorded = history->frames_recorded;
+            stats->frames_rejected = history->frames_rejected;
+        }
+        stats->global_bytes = global_bytes;
+        UNLOCK_HISTORY();
+        res = ERR_SUCCESS;
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcalcs_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcalcs_screen_history_set_global_limit(uint64_t max_bytes) {
+    LOCK_HISTORY();
+    global_limit = max_bytes;
+    UNLOCK_HISTORY();
+    hpcalcs_info("%s: global limit set to %" PRIu64 " bytes", __FUNCTION__, max_bytes);
+    return ERR_SUCCESS;
+}
@@ -0,0 +1,281 @@
+/*
+ * libhpcalcs: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+/**
+ * \file screenstream.c Calcs: continuous screenshot streaming, with a thread receiving the frames and another one delivering the changed ones.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <hpcalcs.h>
+#include "internal.h"
+#include "logging.h"
+#include "error.h"
+#include "utils.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_PTHREAD
+
+#include <pthread.h>
+
+//! Number of frames the frame rate is measured over.
+#define SCREEN_STREAM_FPS_WINDOW (16)
+//! Number of consecutive errors after which the stream gives up, e.g. when the calculator was unplugged.
+#define SCREEN_STREAM_MAX_ERRORS (8)
+
+struct _calc_screen_stream {
+    calc_handle * handle;
+    calc_screenshot_format format;
+    calc_screen_callback callback;
+    void * user_data;
+    pthread_t capture_thread;
+    pthread_t delivery_thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t frame_available;
+    // Latest frame received and not handed to the delivery thread yet.
+    hplibs_buffer_view frame;
+    int has_frame;
+    int stopping;
+    int capture_done;
+    // Statistics.
+    calc_screen_stream_stats stats;
+    uint64_t total_latency_ms;
+    uint64_t frame_times[SCREEN_STREAM_FPS_WINDOW];
+    uint32_t frame_times_count;
+    // Status reports received by the capture thread, handed to the handle once it stopped.
+    calc_event_list held_events;
+};
+
+// Records a received frame and its latency; called with the mutex held.
+static void record_frame(calc_screen_stream * stream, uint64_t now, uint32_t latency) {
+    // Intervals between the last SCREEN_STREAM_FPS_WINDOW frames, the oldest of which is about to be replaced.
+    uint32_t count = stream->frame_times_count < SCREEN_STREAM_FPS_WINDOW - 1 ? stream->frame_times_count : SCREEN_STREAM_FPS_WINDOW - 1;
+    stream->frame_times[stream->frame_times_count++ % SCREEN_STREAM_FPS_WINDOW] = now;
+    if (count > 0) {
+        uint64_t oldest = stream->frame_times[(stream->frame_times_count - 1 - count) % SCREEN_STREAM_FPS_WINDOW];
+        if (now > oldest) {
+            stream->stats.fps = (double)count * 1000.0 / (double)(now - oldest);
+        }
+    }
+    stream->stats.frames_received++;
+    stream->stats.latency_ms = latency;
+    stream->total_latency_ms += latency;
+    stream->stats.average_latency_ms = (uint32_t)(stream->total_latency_ms / stream->stats.frames_received);
+}
+
+static void * capture_thread_main(void * arg) {
+    calc_screen_stream * stream = (calc_screen_stream *)arg;
+    calc_handle * handle = stream->handle;
+    int (*recv_screen_next) (calc_handle *, calc_screenshot_format, int, int *, hplibs_buffer_view *) = handle->fncts->recv_screen_next;
+    int pending = 0;
+    uint32_t consecutive_errors = 0;
+
+    hpcalcs_events_hold(&stream->held_events);
+    for (;;) {
+        hplibs_buffer_view view;
+        uint64_t start;
+        uint64_t end;
+        int stopping;
+        int res;
+
+        pthread_mutex_lock(&stream->mutex);
+        stopping = stream->stopping;
+        pthread_mutex_unlock(&stream->mutex);
+        // The replies to the requests still outstanding must be read, so that they don't get in the way of the next operations.
+        if (stopping && !pending) {
+            break;
+        }
+
+        memset(&view, 0, sizeof(view));
+        start = get_monotonic_time_ms();
+        if (recv_screen_next != NULL) {
+            res = (*recv_screen_next)(handle, stream->format, !stopping, &pending, &view);
+        }
+        else {
+            res = (*handle->fncts->recv_screen)(handle, stream->format, &view);
+        }
+        end = get_monotonic_time_ms();
+        if (res == ERR_SUCCESS && view.base != NULL) {
+            hpcalcs_screen_history_record(handle, stream->format, view.base + view.offset, view.size);
+        }
+
+        pthread_mutex_lock(&stream->mutex);
+        if (res == ERR_SUCCESS && view.base != NULL) {
+            consecutive_errors = 0;
+            // With the request sent ahead, the time spent in the call is the time the calculator took to reply.
+            record_frame(stream, end, (uint32_t)(end - start));
+            if (stream->has_frame) {
+                hplibs_buffer_view_release(&stream->frame);
+                stream->stats.frames_dropped++;
+            }
+            stream->frame = view;
+            stream->has_frame = 1;
+            pthread_cond_signal(&stream->frame_available);
+        }
+        else {
+            // The image may have been handed over even though an error was reported (e.g. CRC mismatch).
+            hplibs_buffer_view_release(&view);
+            stream->stats.errors++;
+            stream->stats.last_error = (res != ERR_SUCCESS) ? res : ERR_CALC_PACKET_FORMAT;
+            consecutive_errors++;
+            if (consecutive_errors >= SCREEN_STREAM_MAX_ERRORS || (res >= ERR_CABLE_FIRST && res <= ERR_CABLE_LAST)) {
+                hpcalcs_error("%s: giving up after error %d", __FUNCTION__, res);
+                stream->stats.running = 0;
+                pthread_mutex_unlock(&stream->mutex);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&stream->mutex);
+    }
+    hpcalcs_events_hold(NULL);
+    // The packets recycled by this thread would be lost with it.
+    prime_vtl_pkt_pool_trim();
+
+    pthread_mutex_lock(&stream->mutex);
+    stream->capture_done = 1;
+    pthread_cond_signal(&stream->frame_available);
+    pthread_mutex_unlock(&stream->mutex);
+    return NULL;
+}
+
+static void * delivery_thread_main(void * arg) {
+    calc_screen_stream * stream = (calc_screen_stream *)arg;
+    uint64_t last_hash = 0;
+    int has_last_hash = 0;
+
+    pthread_mutex_lock(&stream->mutex);
+    for (;;) {
+        hplibs_buffer_view view;
+        uint64_t hash;
+        while (!stream->has_frame && !stream->capture_done) {
+            pthread_cond_wait(&stream->frame_available, &stream->mutex);
+        }
+        if (!stream->has_frame) {
+            break;
+        }
+        view = stream->frame;
+        stream->has_frame = 0;
+        pthread_mutex_unlock(&stream->mutex);
+
+        // Only the frames which differ from the previous one are worth the callback's time.
+        hash = fnv1a_64_block(FNV1A_64_INIT, HPLIBS_BUFFER_VIEW_DATA(&view), view.size);
+        if (!has_last_hash || hash != last_hash) {
+            (*stream->callback)(stream->handle, HPLIBS_BUFFER_VIEW_DATA(&view), view.size, stream->user_data);
+            last_hash = hash;
+            has_last_hash = 1;
+            pthread_mutex_lock(&stream->mutex);
+            stream->stats.frames_delivered++;
+            pthread_mutex_unlock(&stream->mutex);
+        }
+        hplibs_buffer_view_release(&view);
+
+        pthread_mutex_lock(&stream->mutex);
+    }
+    pthread_mutex_unlock(&stream->mutex);
+    return NULL;
+}
+
+int hpcalcs_screen_stream_new(calc_handle * handle, calc_screenshot_format format, calc_screen_callback callback, void * user_data, calc_screen_stream ** out_stream) {
+    int res;
+    // The threads allocate the frames with the base allocators, as they aren't in the handle's allocation scope.
+    calc_screen_stream * stream = (hpcalcs_base_alloc_funcs.calloc)(1, sizeof(*stream));
+    *out_stream = NULL;
+    if (stream != NULL) {
+        stream->handle = handle;
+        stream->format = format;
+        stream->callback = callback;
+        stream->user_data = user_data;
+        stream->stats.running = 1;
+        pthread_mutex_init(&stream->mutex, NULL);
+        pthread_cond_init(&stream->frame_available, NULL);
+        if (pthread_create(&stream->delivery_thread, NULL, delivery_thread_main, stream) == 0) {
+            if (pthread_create(&stream->capture_thread, NULL, capture_thread_main, stream) == 0) {
+                *out_stream = stream;
+                res = ERR_SUCCESS;
+            }
+            else {
+                pthread_mutex_lock(&stream->mutex);
+                stream->capture_done = 1;
+                pthread_cond_signal(&stream->frame_available);
+                pthread_mutex_unlock(&stream->mutex);
+                pthread_join(stream->delivery_thread, NULL);
+                res = ERR_CALC_NO_THREADS;
+            }
+        }
+        else {
+            res = ERR_CALC_NO_THREADS;
+        }
+        if (res != ERR_SUCCESS) {
+            hpcalcs_error("%s: couldn't create threads", __FUNCTION__);
+            pthread_cond_destroy(&stream->frame_available);
+            pthread_mutex_destroy(&stream->mutex);
+            (hpcalcs_base_alloc_funcs.free)(stream);
+        }
+    }
+    else {
+        res = ERR_MALLOC;
+        hpcalcs_error("%s: couldn't allocate stream", __FUNCTION__);
+    }
+    return res;
+}
+
+void hpcalcs_screen_stream_del(calc_screen_stream * stream) {
+    if (stream != NULL) {
+        pthread_mutex_lock(&stream->mutex);
+        stream->stopping = 1;
+        pthread_mutex_unlock(&stream->mutex);
+        pthread_join(stream->capture_thread, NULL);
+        pthread_join(stream->delivery_thread, NULL);
+        hpcalcs_events_release(stream->handle, &stream->held_events);
+        pthread_cond_destroy(&stream->frame_available);
+        pthread_mutex_destroy(&stream->mutex);
+        (hpcalcs_base_alloc_funcs.free)(stream);
+    }
+}
+
+void hpcalcs_screen_stream_get_stats(calc_screen_stream * stream, calc_screen_stream_stats * stats) {
+    pthread_mutex_lock(&stream->mutex);
+    *stats = stream->stats;
+    pthread_mutex_unlock(&stream->mutex);
+}
+
+#else
+
+// Without threads, there is no streaming.
+
+int hpcalcs_screen_stream_new(calc_handle * handle, calc_screenshot_format format, calc_screen_callback callback, void * user_data, calc_screen_stream ** out_stream) {
+    *out_stream = NULL;
+    hpcalcs_error("%s: threads are not available", __FUNCTION__);
+    return ERR_CALC_NO_THREADS;
+}
+
+void hpcalcs_screen_stream_del(calc_screen_stream * stream) {
+}
+
+void hpcalcs_screen_stream_get_stats(calc_screen_stream * stream, calc_screen_stream_stats * stats) {
+    memset(stats, 0, sizeof(*stats));
+}
+
+#endif
@@ -0,0 +1,495 @@
+/*
+ * libhpcalcs: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+/**
+ * \file testrunner.c Higher-level operations: running scripted UI tests on calculators.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <hpopers.h>
+#include "internal.h"
+#include "logging.h"
+#include "error.h"
+#include "utils.h"
+
+//! How long the screen must stay unchanged for wait_stable if neither the step nor the options say.
+#define DEFAULT_STABLE_MS (300)
+//! How long wait_stable waits at most if the options don't say.
+#define DEFAULT_STABLE_TIMEOUT_MS (10000)
+//! Room for a command or a path of a test script.
+#define TOKEN_MAX (1024)
+
+typedef enum {
+    STEP_KEYS,
+    STEP_SLEEP,
+    STEP_WAIT_STABLE,
+    STEP_EXPECT
+} step_type;
+
+typedef struct {
+    step_type type;
+    uint32_t line;
+    uint32_t value; ///< Time, in ms, for STEP_SLEEP and STEP_WAIT_STABLE (0 for the default).
+    hpopers_key_macro * macro; ///< For STEP_KEYS.
+    // For STEP_EXPECT: the golden image, as R8G8B8 pixels, and the region compared.
+    uint8_t * pixels;
+    uint32_t width;
+    uint32_t height;
+    uint32_t x;
+    uint32_t y;
+    uint32_t w;
+    uint32_t h;
+} test_step;
+
+struct _hpopers_test {
+    test_step * steps;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+//! A test run on one calculator, handed to the worker threads by hpopers_test_run_parallel.
+typedef struct {
+    calc_handle * handle;
+    uint32_t index;
+    const hpopers_test * test;
+    const hpopers_test_options * options;
+    hpopers_test_result * result;
+    int on_worker;
+} test_job;
+
+// Loads a golden image, and checks that the region compared lies within it.
+static int load_golden(test_step * step, const char * folder, const char * name, int has_region) {
+    int res = ERR_OPER_IO;
+    char * path = (folder != NULL && name[0] != '/') ? join_path(folder, name) : NULL;
+    FILE * f = fopen(path != NULL ? path : name, "rb");
+    if (f != NULL) {
+        long size;
+        if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) > 0 && (uint64_t)size <= UINT32_MAX && fseek(f, 0, SEEK_SET) == 0) {
+            uint8_t * data = (uint8_t *)(hpopers_alloc_funcs.malloc)((size_t)size);
+            if (data != NULL) {
+                if (fread(data, 1, (size_t)size, f) == (size_t)size) {
+                    const uint8_t * pixels;
+                    res = hpopers_screen_decode_r8g8b8(data, (uint32_t)size, &pixels, &step->width, &step->height);
+                    if (res == ERR_SUCCESS) {
+                        uint32_t pixels_size = step->width * step->height * 3;
+                        step->pixels = (uint8_t *)(hpopers_alloc_funcs.malloc)(pixels_size);
+                        if (step->pixels != NULL) {
+                            memcpy(step->pixels, pixels, pixels_size);
+                        }
+                        else {
+                            res = ERR_MALLOC;
+                        }
+                    }
+                }
+                (hpopers_alloc_funcs.free)(data);
+            }
+            else {
+                res = ERR_MALLOC;
+            }
+        }
+        fclose(f);
+    }
+    if (res == ERR_SUCCESS) {
+        if (!has_region) {
+            step->w = step->width;
+            step->h = step->height;
+        }
+        else if (   step->w == 0 || step->h == 0
+                 || step->x > step->width || step->w > step->width - step->x
+                 || step->y > step->height || step->h > step->height - step->y) {
+            res = ERR_OPER_SCRIPT;
+            hpopers_error("%s: line %" PRIu32 ": region outside of the %" PRIu32 "x%" PRIu32 " image", __FUNCTION__, step->line, step->width, step->height);
+        }
+    }
+    else {
+        hpopers_error("%s: line %" PRIu32 ": couldn't load %s", __FUNCTION__, step->line, name);
+    }
+    (hpopers_alloc_funcs.free)(path);
+    return res;
+}
+
+// Compiles a line of a test script into a step (if not empty); the line is modified.
+static int compile_line(hpopers_test * test, char * line, uint32_t line_number, const char * folder) {
+    int res = ERR_SUCCESS;
+    char command[16];
+    int length = 0;
+    char * comment;
+    if (sscanf(line, "%15s%n", command, &length) < 1 || command[0] == '#') {
+        // Empty line or comment.
+    }
+    else if (test->count == test->capacity) {
+        uint32_t new_capacity = test->capacity != 0 ? test->capacity * 2 : 16;
+        test_step * new_steps = (test_step *)(hpopers_alloc_funcs.realloc)(test->steps, new_capacity * sizeof(*new_steps));
+        if (new_steps != NULL) {
+            test->steps = new_steps;
+            test->capacity = new_capacity;
+        }
+        else {
+            res = ERR_MALLOC;
+        }
+    }
+    if (res == ERR_SUCCESS && length > 0 && command[0] != '#') {
+        test_step * step = &test->steps[test->count];
+        char * rest = line + length;
+        char extra[2];
+        memset(step, 0, sizeof(*step));
+        step->line = line_number;
+        if (!strcmp(command, "keys")) {
+            step->type = STEP_KEYS;
+            res = hpopers_key_macro_compile(rest, &step->macro);
+        }
+        else {
+            // The other commands end at a comment.
+            comment = strchr(rest, '#');
+            if (comment != NULL) {
+                *comment = 0;
+            }
+            if (!strcmp(command, "sleep")) {
+                step->type = STEP_SLEEP;
+                res = (sscanf(rest, "%" SCNu32 " %1s", &step->value, extra) == 1) ? ERR_SUCCESS : ERR_OPER_SCRIPT;
+            }
+            else if (!strcmp(command, "wait_stable")) {
+                step->type = STEP_WAIT_STABLE;
+                res = (sscanf(rest, " %1s", extra) < 1 || sscanf(rest, "%" SCNu32 " %1s", &step->value, extra) == 1) ? ERR_SUCCESS : ERR_OPER_SCRIPT;
+            }
+            else if (!strcmp(command, "expect")) {
+                char * name = (char *)(hpopers_alloc_funcs.malloc)(TOKEN_MAX);
+                step->type = STEP_EXPECT;
+                if (name != NULL) {
+                    int count = sscanf(rest, "%1023s %" SCNu32 " %" SCNu32 " %" SCNu32 " %" SCNu32 " %1s", name, &step->x, &step->y, &step->w, &step->h, extra);
+                    if (count == 1 || count == 5) {
+                        res = load_golden(step, folder, name, count == 5);
+                    }
+                    else {
+                        res = ERR_OPER_SCRIPT;
+                    }
+                    (hpopers_alloc_funcs.free)(name);
+                }
+                else {
+                    res = ERR_MALLOC;
+                }
+            }
+            else {
+                res = ERR_OPER_SCRIPT;
+            }
+        }
+        if (res == ERR_SUCCESS || step->pixels != NULL || step->macro != NULL) {
+            // Counted even upon failure, so that what it holds is deleted with the test.
+            test->count++;
+        }
+        if (res == ERR_OPER_SCRIPT) {
+            hpopers_error("%s: line %" PRIu32 ": invalid %s step", __FUNCTION__, line_number, command);
+        }
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpopers_test_compile(const char * script, const char * folder, hpopers_test ** out_test) {
+    int res;
+    if (script != NULL && out_test != NULL) {
+        size_t length = strlen(script);
+        char * copy = (char *)(hpopers_alloc_funcs.malloc)(length + 1);
+        hpopers_test * test = (hpopers_test *)(hpopers_alloc_funcs.calloc)(1, sizeof(*test));
+        *out_test = NULL;
+        if (copy != NULL && test != NULL) {
+            char * line = copy;
+            uint32_t line_number = 1;
+            memcpy(copy, script, length + 1);
+            res = ERR_SUCCESS;
+            while (res == ERR_SUCCESS && line != NULL) {
+                char * end = strchr(line, '\n');
+                if (end != NULL) {
+                    *end++ = 0;
+                }
+                res = compile_line(test, line, line_number++, folder);
+                line = end;
+            }
+            if (res == ERR_SUCCESS) {
+                *out_test = test;
+                test = NULL;
+            }
+        }
+        else {
+            res = ERR_MALLOC;
+            hpopers_error("%s: couldn't allocate memory", __FUNCTION__);
+        }
+        hpopers_test_del(test);
+        (hpopers_alloc_funcs.free)(copy);
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpopers_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT void HPCALL hpopers_test_del(hpopers_test * test) {
+    if (test != NULL) {
+        uint32_t i;
+        for (i = 0; i < test->count; i++) {
+            hpopers_key_macro_del(test->steps[i].macro);
+            (hpopers_alloc_funcs.free)(test->steps[i].pixels);
+        }
+        (hpopers_alloc_funcs.free)(test->steps);
+        (hpopers_alloc_funcs.free)(test);
+    }
+}
+
+// Fills in the default screenshot format and stability delays where the caller left them at 0.
+static int get_test_options(const hpopers_test_options * options, hpopers_test_options * out_options) {
+    int res = ERR_SUCCESS;
+    memset(out_options, 0, sizeof(*out_options));
+    out_options->version = HPOPERS_TEST_OPTIONS_VERSION;
+    if (options != NULL) {
+        if (options->version >= 1 && options->version <= HPOPERS_TEST_OPTIONS_VERSION) {
+            out_options->format = options->format;
+            out_options->stable_ms = options->stable_ms;
+            out_options->stable_timeout_ms = options->stable_timeout_ms;
+            out_options->tolerance = options->tolerance;
+            out_options->max_differing_pixels = options->max_differing_pixels;
+            out_options->failure_folder = options->failure_folder;
+            out_options->key_options = options->key_options;
+        }
+        else {
+            res = ERR_LIBRARY_CONFIG_VERSION;
+            hpopers_error("%s: unsupported options version %u", __FUNCTION__, options->version);
+        }
+    }
+    if (out_options->format == 0) {
+        out_options->format = CALC_SCREENSHOT_FORMAT_PRIME_PNG_320x240x16;
+    }
+    if (out_options->stable_ms == 0) {
+        out_options->stable_ms = DEFAULT_STABLE_MS;
+    }
+    if (out_options->stable_timeout_ms == 0) {
+        out_options->stable_timeout_ms = DEFAULT_STABLE_TIMEOUT_MS;
+    }
+    return res;
+}
+
+// Waits until successive screenshots stay identical for stable_ms, comparing their hashes.
+static int wait_stable(calc_handle * handle, const hpopers_test_options * options, uint32_t stable_ms) {
+    int res;
+    uint64_t start = get_monotonic_time_ms();
+    uint64_t stable_since = start;
+    uint64_t reference = 0;
+    int has_reference = 0;
+    for (;;) {
+        hplibs_buffer_view view;
+        uint64_t now;
+        memset(&view, 0, sizeof(view));
+        res = hpcalcs_calc_recv_screen_view(handle, options->format, &view);
+        now = get_monotonic_time_ms();
+        if (res == ERR_SUCCESS && view.base != NULL) {
+            uint64_t hash = fnv1a_64_block(FNV1A_64_INIT, view.base + view.offset, view.size);
+            if (!has_reference || hash != reference) {
+                reference = hash;
+                has_reference = 1;
+                stable_since = now;
+            }
+            else if (now - stable_since >= stable_ms) {
+                hplibs_buffer_view_release(&view);
+                break;
+            }
+        }
+        else if (res == ERR_SUCCESS) {
+            res = ERR_CALC_PACKET_FORMAT;
+        }
+        hplibs_buffer_view_release(&view);
+        if (res != ERR_SUCCESS) {
+            break;
+        }
+        if (now - start >= options->stable_timeout_ms) {
+            res = ERR_CALC_OPERATION_TIMEOUT;
+            hpopers_error("%s: the screen didn't settle within %" PRIu32 " ms", __FUNCTION__, options->stable_timeout_ms);
+            break;
+        }
+    }
+    return res;
+}
+
+static void save_failure(const hpopers_test_options * options, uint32_t index, uint32_t line, const hplibs_buffer_view * view) {
+    char name[48];
+    char * path;
+    snprintf(name, sizeof(name), "device%" PRIu32 "-line%" PRIu32 ".png", index, line);
+    path = join_path(options->failure_folder, name);
+    if (path != NULL) {
+        FILE * f = fopen(path, "wb");
+        if (f == NULL || fwrite(view->base + view->offset, 1, view->size, f) != view->size) {
+            hpopers_warning("%s: couldn't write %s", __FUNCTION__, path);
+        }
+        if (f != NULL) {
+            fclose(f);
+        }
+        (hpopers_alloc_funcs.free)(path);
+    }
+}
+
+// Compares the region of a step with the current screen; out_differing receives the number of pixels differing beyond the tolerance.
+static int expect_screen(calc_handle * handle, const test_step * step, const hpopers_test_options * options, uint32_t index, uint32_t * out_differing) {
+    int res;
+    hplibs_buffer_view view;
+    memset(&view, 0, sizeof(view));
+    *out_differing = 0;
+    res = hpcalcs_calc_recv_screen_view(handle, options->format, &view);
+    if (res == ERR_SUCCESS && view.base != NULL) {
+        const uint8_t * pixels;
+        uint32_t width;
+        uint32_t height;
+        res = hpopers_screen_decode_r8g8b8(view.base + view.offset, view.size, &pixels, &width, &height);
+        if (res == ERR_SUCCESS) {
+            if (width == step->width && height == step->height) {
+                uint32_t x;
+                uint32_t y;
+                for (y = step->y; y < step->y + step->h; y++) {
+                    const uint8_t * actual = pixels + (y * width + step->x) * 3;
+                    const uint8_t * expected = step->pixels + (y * width + step->x) * 3;
+                    for (x = 0; x < step->w * 3; x += 3) {
+                        if (   (uint32_t)abs(actual[x] - expected[x]) > options->tolerance
+                            || (uint32_t)abs(actual[x + 1] - expected[x + 1]) > options->tolerance
+                            || (uint32_t)abs(actual[x + 2] - expected[x + 2]) > options->tolerance) {
+                            (*out_differing)++;
+                        }
+                    }
+                }
+            }
+            else {
+                *out_differing = step->w * step->h;
+                hpopers_warning("%s: screenshot is %" PRIu32 "x%" PRIu32 ", expected %" PRIu32 "x%" PRIu32, __FUNCTION__, width, height, step->width, step->height);
+            }
+            if (*out_differing > options->max_differing_pixels) {
+                res = ERR_OPER_MISMATCH;
+                hpopers_info("%s: line %" PRIu32 ": %" PRIu32 " pixels differ", __FUNCTION__, step->line, *out_differing);
+                if (options->failure_folder != NULL) {
+                    save_failure(options, index, step->line, &view);
+                }
+            }
+        }
+    }
+    else if (res == ERR_SUCCESS) {
+        res = ERR_CALC_PACKET_FORMAT;
+    }
+    hplibs_buffer_view_release(&view);
+    return res;
+}
+
+static void run_test(void * arg) {
+    test_job * job = (test_job *)arg;
+    const hpopers_test_options * options = job->options;
+    hpopers_test_result * result = job->result;
+    uint64_t start = get_monotonic_time_ms();
+    uint32_t i;
+
+    memset(result, 0, sizeof(*result));
+    for (i = 0; i < job->test->count && result->res == ERR_SUCCESS; i++) {
+        const test_step * step = &job->test->steps[i];
+        switch (step->type) {
+            case STEP_KEYS:
+                result->res = hpopers_key_macro_play(job->handle, step->macro, options->key_options);
+                break;
+            case STEP_SLEEP:
+                sleep_ms(step->value);
+                break;
+            case STEP_WAIT_STABLE:
+                result->res = wait_stable(job->handle, options, step->value != 0 ? step->value : options->stable_ms);
+                break;
+            default:
+                result->res = expect_screen(job->handle, step, options, job->index, &result->differing_pixels);
+                break;
+        }
+        if (result->res != ERR_SUCCESS) {
+            result->line = step->line;
+            hpopers_warning("%s: device %" PRIu32 " failed at line %" PRIu32 ": %d", __FUNCTION__, job->index, step->line, result->res);
+        }
+    }
+    result->duration_ms = (uint32_t)(get_monotonic_time_ms() - start);
+    if (job->on_worker) {
+        // The decoding buffers would be lost with the thread.
+        hpopers_screen_buffers_trim();
+    }
+}
+
+HPEXPORT int HPCALL hpopers_test_run(calc_handle * handle, const hpopers_test * test, const hpopers_test_options * options, hpopers_test_result * out_result) {
+    return hpopers_test_run_parallel(&handle, 1, test, options, out_result);
+}
+
+HPEXPORT int HPCALL hpopers_test_run_parallel(calc_handle ** handles, uint32_t count, const hpopers_test * test, const hpopers_test_options * options, hpopers_test_result * out_results) {
+    int res;
+    if (handles != NULL && count != 0 && test != NULL && out_results != NULL) {
+        hpopers_test_options test_options;
+        res = get_test_options(options, &test_options);
+        if (res == ERR_SUCCESS) {
+            test_job * jobs = (test_job *)(hpopers_alloc_funcs.calloc)(count, sizeof(*jobs));
+            if (jobs != NULL) {
+                hplibs_workers * workers = (count > 1) ? hplibs_workers_new(count, run_test) : NULL;
+                uint32_t i;
+                for (i = 0; i < count; i++) {
+                    jobs[i].handle = handles[i];
+                    jobs[i].index = i;
+                    jobs[i].test = test;
+                    jobs[i].options = &test_options;
+                    jobs[i].result = &out_results[i];
+                    memset(&out_results[i], 0, sizeof(out_results[i]));
+                    if (handles[i] == NULL) {
+                        out_results[i].res = ERR_INVALID_HANDLE;
+                        continue;
+                    }
+                    jobs[i].on_worker = (workers != NULL && hpcalcs_handle_uses_base_alloc(handles[i]));
+                    if (jobs[i].on_worker) {
+                        while (hplibs_workers_submit(workers, &jobs[i]) != ERR_SUCCESS) {
+                            hplibs_workers_take(workers, 1);
+                        }
+                    }
+                }
+                for (i = 0; i < count; i++) {
+                    if (handles[i] != NULL && !jobs[i].on_worker) {
+                        run_test(&jobs[i]);
+                    }
+                }
+                while (hplibs_workers_take(workers, 1) != NULL) {
+                }
+                hplibs_workers_del(workers);
+                (hpopers_alloc_funcs.free)(jobs);
+
+                for (i = 0; i < count && res == ERR_SUCCESS; i++) {
+                    res = out_results[i].res;
+                }
+                hpopers_info("%s: %" PRIu32 " devices, result %d", __FUNCTION__, count, res);
+            }
+            else {
+                res = ERR_MALLOC;
+                hpopers_error("%s: couldn't allocate memory", __FUNCTION__);
+            }
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpopers_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
@@ -34,8 +34,15 @@
 #include "utils.h"
 #include "logging.h"
 
+#include <errno.h>
 #include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
 
 uint32_t char16_strlen(char16_t * str) {
     uint32_t i = 0;
@@ -61,6 +68,14 @@ char16_t * char16_strncpy(char16_t * dst, const char16_t * src, uint32_t n) {
     return dst;
 }
 
+int char16_strcmp(const char16_t * str1, const char16_t * str2) {
+    while (*str1 != 0 && *str1 == *str2) {
+        str1++;
+        str2++;
+    }
+    return (int)*str1 - (int)*str2;
+}
+
 void hexdump(const char * direction, uint8_t *data, uint32_t size, uint32_t level)
 {
     if (size > 0) {
@@ -112,3 +127,150 @@ void hexdump(const char * direction, uint8_t *data, uint32_t size, uint32_t leve
         }
     }
 }
+
+uint64_t get_monotonic_time_ms(void) {
+#ifdef _WIN32
+    return (uint64_t)GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec) * 1000 + ((uint64_t)ts.tv_nsec) / 1000000;
+#endif
+}
+
+uint64_t get_wall_time_ms(void) {
+#ifdef _WIN32
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    // 100 ns units since 1601.
+    return ((((uint64_t)ft.dwHighDateTime) << 32) | ((uint64_t)ft.dwLowDateTime)) / 10000 - UINT64_C(11644473600000);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ((uint64_t)ts.tv_sec) * 1000 + ((uint64_t)ts.tv_nsec) / 1000000;
+#endif
+}
+
+void sleep_ms(uint32_t ms) {
+#ifdef _WIN32
+    Sleep(ms);
+#else
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+        // Interrupted by a signal: sleep for the remaining time.
+    }
+#endif
+}
+
+uint32_t crc32_block(uint32_t crc, const uint8_t * buffer, uint32_t len) {
+    // Reflected polynomial 0xEDB88320, one nibble at a time.
+    static const uint32_t crc32_table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+    };
+    crc = ~crc;
+    while (len--) {
+        crc ^= *buffer++;
+        crc = (crc >> 4) ^ crc32_table[crc & 0x0F];
+        crc = (crc >> 4) ^ crc32_table[crc & 0x0F];
+    }
+    return ~crc;
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+#define SHA256_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_transform(uint32_t state[8], const uint8_t * block) {
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h;
+    uint32_t i;
+    for (i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)block[4 * i] << 24) | ((uint32_t)block[4 * i + 1] << 16) | ((uint32_t)block[4 * i + 2] << 8) | block[4 * i + 3];
+    }
+    for (i = 16; i < 64; i++) {
+        uint32_t s0 = SHA256_ROTR(w[i - 15], 7) ^ SHA256_ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = SHA256_ROTR(w[i - 2], 17) ^ SHA256_ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+    for (i = 0; i < 64; i++) {
+        uint32_t t1 = h + (SHA256_ROTR(e, 6) ^ SHA256_ROTR(e, 11) ^ SHA256_ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (SHA256_ROTR(a, 2) ^ SHA256_ROTR(a, 13) ^ SHA256_ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void sha256_block(const uint8_t * buffer, uint32_t len, uint8_t digest[32]) {
+    uint32_t state[8] = {
+        0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+    };
+    uint8_t last[128];
+    uint64_t bits = (uint64_t)len * 8;
+    uint32_t remaining;
+    uint32_t last_size;
+    uint32_t i;
+
+    while (len >= 64) {
+        sha256_transform(state, buffer);
+        buffer += 64;
+        len -= 64;
+    }
+    // Padding: 0x80, zeroes, then the length in bits, big-endian, in one or two blocks.
+    remaining = len;
+    memset(last, 0, sizeof(last));
+    memcpy(last, buffer, remaining);
+    last[remaining] = 0x80;
+    last_size = (remaining < 56) ? 64 : 128;
+    for (i = 0; i < 8; i++) {
+        last[last_size - 1 - i] = (uint8_t)(bits >> (8 * i));
+    }
+    sha256_transform(state, last);
+    if (last_size == 128) {
+        sha256_transform(state, last + 64);
+    }
+    for (i = 0; i < 8; i++) {
+        digest[4 * i] = (uint8_t)(state[i] >> 24);
+        digest[4 * i + 1] = (uint8_t)(state[i] >> 16);
+        digest[4 * i + 2] = (uint8_t)(state[i] >> 8);
+        digest[4 * i + 3] = (uint8_t)state[i];
+    }
+}
+
+uint64_t fnv1a_64_block(uint64_t hash, const uint8_t * buffer, uint32_t len) {
+    while (len-- > 0) {
+        hash ^= *buffer++;
+        hash *= UINT64_C(0x100000001B3);
+    }
+    return hash;
+}
+
+char * join_path(const char * folder, const char * name) {
+    size_t folder_length = strlen(folder);
+    size_t name_length = strlen(name);
+    char * path = (char *)(hpopers_alloc_funcs.malloc)(folder_length + name_length + 2);
+    if (path != NULL) {
+        memcpy(path, folder, folder_length);
+        path[folder_length] = '/';
+        memcpy(path + folder_length + 1, name, name_length + 1);
+    }
+    else {
+        hpopers_error("%s: couldn't allocate path", __FUNCTION__);
+    }
+    return path;
+}
@@ -28,11 +28,42 @@
 #ifndef __HPLIBS_UTILS_H__
 #define __HPLIBS_UTILS_H__
 
+#include <hpfiles.h>
+
 //! Plain C equivalent of char_traits<char16_t>::length.
 uint32_t char16_strlen(char16_t * str);
 //! strncpy applied to char16_t.
 char16_t * char16_strncpy(char16_t * dst, const char16_t * src, uint32_t n);
+//! strcmp applied to char16_t.
+int char16_strcmp(const char16_t * str1, const char16_t * str2);
 //! Hex dumping function.
 void hexdump(const char * direction, uint8_t *data, uint32_t size, uint32_t level);
+//! Monotonic clock, in ms, for measuring durations.
+uint64_t get_monotonic_time_ms(void);
+//! Wall clock, in ms since the Epoch, for timestamps meant to be compared with other clocks.
+uint64_t get_wall_time_ms(void);
+//! Suspends the calling thread for the given time, in ms.
+void sleep_ms(uint32_t ms);
+//! CRC-32 (as used by zip and PNG) of a block, continuing from \a crc (0 for the first block).
+uint32_t crc32_block(uint32_t crc, const uint8_t * buffer, uint32_t len);
+//! SHA-256 digest of a block.
+void sha256_block(const uint8_t * buffer, uint32_t len, uint8_t digest[32]);
+//! Initial value of a 64-bit FNV-1a hash.
+#define FNV1A_64_INIT UINT64_C(0xCBF29CE484222325)
+//! 64-bit FNV-1a hash of a block, continuing from \a hash (FNV1A_64_INIT for the first block).
+uint64_t fnv1a_64_block(uint64_t hash, const uint8_t * buffer, uint32_t len);
+//! Reads a big-endian 32-bit value, e.g. the length of a PNG chunk.
+static inline uint32_t read_be32(const uint8_t * ptr) {
+    return (((uint32_t)(ptr[0])) << 24) | (((uint32_t)(ptr[1])) << 16) | (((uint32_t)(ptr[2])) << 8) | ((uint32_t)(ptr[3]));
+}
+//! Writes a big-endian 32-bit value.
+static inline void write_be32(uint8_t * ptr, uint32_t value) {
+    ptr[0] = (uint8_t)(value >> 24);
+    ptr[1] = (uint8_t)(value >> 16);
+    ptr[2] = (uint8_t)(value >> 8);
+    ptr[3] = (uint8_t)value;
+}
+//! Joins a folder and a name with a '/'; the result is allocated with hpopers_alloc_funcs.
+char * join_path(const char * folder, const char * name);
 
 #endif
@@ -0,0 +1,212 @@
+/*
+ * libhpcalcs: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+/**
+ * \file workers.c Files / Calcs: small pools of worker threads, processing jobs in parallel and handing them back in submission order.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <hpcalcs.h>
+#include "internal.h"
+#include "logging.h"
+#include "error.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_PTHREAD
+
+#include <pthread.h>
+
+//! Maximum number of threads of a pool.
+#define WORKERS_MAX_THREADS (8)
+
+struct _hplibs_workers {
+    hplibs_work_func func;
+    pthread_t threads[WORKERS_MAX_THREADS];
+    uint32_t threads_count;
+    pthread_mutex_t mutex;
+    pthread_cond_t work_available;
+    pthread_cond_t work_done;
+    // Ring of jobs, in submission order: [head, next) are being processed, [next, tail) are waiting for a thread.
+    void * jobs[HPLIBS_WORKERS_MAX_PENDING];
+    uint8_t done[HPLIBS_WORKERS_MAX_PENDING];
+    uint32_t head;
+    uint32_t next;
+    uint32_t tail;
+    int stopping;
+};
+
+static void * workers_thread_main(void * arg) {
+    hplibs_workers * workers = (hplibs_workers *)arg;
+    pthread_mutex_lock(&workers->mutex);
+    for (;;) {
+        uint32_t index;
+        void * job;
+        while (workers->next == workers->tail && !workers->stopping) {
+            pthread_cond_wait(&workers->work_available, &workers->mutex);
+        }
+        if (workers->next == workers->tail) {
+            break;
+        }
+        index = workers->next++ % HPLIBS_WORKERS_MAX_PENDING;
+        job = workers->jobs[index];
+        pthread_mutex_unlock(&workers->mutex);
+
+        (*workers->func)(job);
+
+        pthread_mutex_lock(&workers->mutex);
+        workers->done[index] = 1;
+        pthread_cond_broadcast(&workers->work_done);
+    }
+    pthread_mutex_unlock(&workers->mutex);
+    // The packets and entries recycled by this thread, e.g. while receiving on its behalf, would be lost with it.
+    prime_vtl_pkt_pool_trim();
+    hpfiles_ve_pool_trim();
+    return NULL;
+}
+
+hplibs_workers * hplibs_workers_new(uint32_t threads_count, hplibs_work_func func) {
+    hplibs_workers * workers = NULL;
+    if (func != NULL && threads_count != 0) {
+        // Threads don't inherit the allocation scope of their creator, and pooled memory must come from the base allocators.
+        workers = (hpcalcs_base_alloc_funcs.calloc)(1, sizeof(*workers));
+        if (workers != NULL) {
+            uint32_t i;
+            workers->func = func;
+            pthread_mutex_init(&workers->mutex, NULL);
+            pthread_cond_init(&workers->work_available, NULL);
+            pthread_cond_init(&workers->work_done, NULL);
+            if (threads_count > WORKERS_MAX_THREADS) {
+                threads_count = WORKERS_MAX_THREADS;
+            }
+            for (i = 0; i < threads_count; i++) {
+                if (pthread_create(&workers->threads[workers->threads_count], NULL, workers_thread_main, workers) == 0) {
+                    workers->threads_count++;
+                }
+            }
+            if (workers->threads_count == 0) {
+                hpcalcs_error("%s: couldn't create threads", __FUNCTION__);
+                hplibs_workers_del(workers);
+                workers = NULL;
+            }
+        }
+        else {
+            hpcalcs_error("%s: couldn't allocate pool", __FUNCTION__);
+        }
+    }
+    return workers;
+}
+
+int hplibs_workers_submit(hplibs_workers * workers, void * job) {
+    int res;
+    if (workers != NULL) {
+        pthread_mutex_lock(&workers->mutex);
+        if (workers->tail - workers->head < HPLIBS_WORKERS_MAX_PENDING) {
+            uint32_t index = workers->tail++ % HPLIBS_WORKERS_MAX_PENDING;
+            workers->jobs[index] = job;
+            workers->done[index] = 0;
+            pthread_cond_signal(&workers->work_available);
+            res = ERR_SUCCESS;
+        }
+        else {
+            res = ERR_CALC_BUSY;
+        }
+        pthread_mutex_unlock(&workers->mutex);
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+    }
+    return res;
+}
+
+uint32_t hplibs_workers_get_pending(hplibs_workers * workers) {
+    uint32_t pending = 0;
+    if (workers != NULL) {
+        pthread_mutex_lock(&workers->mutex);
+        pending = workers->tail - workers->head;
+        pthread_mutex_unlock(&workers->mutex);
+    }
+    return pending;
+}
+
+void * hplibs_workers_take(hplibs_workers * workers, int wait) {
+    void * job = NULL;
+    if (workers != NULL) {
+        pthread_mutex_lock(&workers->mutex);
+        if (wait) {
+            while (workers->head != workers->tail && !workers->done[workers->head % HPLIBS_WORKERS_MAX_PENDING]) {
+                pthread_cond_wait(&workers->work_done, &workers->mutex);
+            }
+        }
+        if (workers->head != workers->tail && workers->done[workers->head % HPLIBS_WORKERS_MAX_PENDING]) {
+            job = workers->jobs[workers->head++ % HPLIBS_WORKERS_MAX_PENDING];
+        }
+        pthread_mutex_unlock(&workers->mutex);
+    }
+    return job;
+}
+
+void hplibs_workers_del(hplibs_workers * workers) {
+    if (workers != NULL) {
+        uint32_t i;
+        pthread_mutex_lock(&workers->mutex);
+        workers->stopping = 1;
+        pthread_cond_broadcast(&workers->work_available);
+        pthread_mutex_unlock(&workers->mutex);
+        // Jobs submitted but not taken yet are processed, but not freed.
+        for (i = 0; i < workers->threads_count; i++) {
+            pthread_join(workers->threads[i], NULL);
+        }
+        pthread_cond_destroy(&workers->work_done);
+        pthread_cond_destroy(&workers->work_available);
+        pthread_mutex_destroy(&workers->mutex);
+        (hpcalcs_base_alloc_funcs.free)(workers);
+    }
+}
+
+#else
+
+// Without threads, callers process their jobs synchronously.
+
+hplibs_workers * hplibs_workers_new(uint32_t threads_count, hplibs_work_func func) {
+    return NULL;
+}
+
+int hplibs_workers_submit(hplibs_workers * workers, void * job) {
+    return ERR_INVALID_PARAMETER;
+}
+
+uint32_t hplibs_workers_get_pending(hplibs_workers * workers) {
+    return 0;
+}
+
+void * hplibs_workers_take(hplibs_workers * workers, int wait) {
+    return NULL;
+}
+
+void hplibs_workers_del(hplibs_workers * workers) {
+}
+
+#endif
@@ -550,6 +550,28 @@ static int recv_chat(calc_handle * handle) {
     return res;
 }
 
+static int poll_events(calc_handle * handle) {
+    int res = 0;
+
+    res = hpcalcs_calc_poll_events(handle, 1000);
+    if (res == 0) {
+        calc_event_type type;
+        output_log(stdout, "hpcalcs_calc_poll_events succeeded\n");
+        for (type = CALC_EVENT_REPLY; type < CALC_EVENT_LAST; type++) {
+            calc_event * event;
+            while (hpcalcs_events_pop(handle, type, 0, &event) == 0 && event != NULL) {
+                output_log(stdout, "Event type %d, command %02X, %" PRIu32 " bytes\n", (int)event->type, event->cmd, event->size);
+                hpcalcs_event_del(event);
+            }
+        }
+    }
+    else {
+        output_log(stdout, "hpcalcs_calc_poll_events failed\n");
+    }
+
+    return res;
+}
+
 static int vpkt_send_experiments(calc_handle * handle) {
     int res = 0;
     int err;
@@ -588,7 +610,7 @@ static int vpkt_send_experiments(calc_handle * handle) {
     return res;
 }
 
-#define NITEMS	13
+#define NITEMS	14
 
 static const char *str_menu[NITEMS] = {
     "Exit",
@@ -603,6 +625,7 @@ static const char *str_menu[NITEMS] = {
     "Send keys (multiple keys)",
     "Send chat",
     "Receive chat",
+    "Poll events (chat, status reports)",
     "Virtual packet send experiments"
 };
 
@@ -621,6 +644,7 @@ static const FNCT_MENU fnct_menu[NITEMS] = {
     send_keys,
     send_chat,
     recv_chat,
+    poll_events,
     vpkt_send_experiments
 };
 
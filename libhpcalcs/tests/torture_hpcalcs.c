@@ -1,10 +1,16 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 #include <hpfiles.h>
 #include <hpcables.h>
 #include <hpcalcs.h>
 #include <hpopers.h>
 #include <filetypes.h>
 #include <prime_cmd.h>
+#include "error.h"
 
 #define PRINTF(FUNCTION, TYPE, args...) \
 fprintf(stderr, "%d\t" TYPE "\n", i, FUNCTION(args)); i++
@@ -17,25 +23,351 @@ fprintf(stderr, "%d\n", i); FUNCTION(args); i++
 #define STR "\"%s\""
 #define VOID ""
 
+// Behaviour checks, as opposed to the calls with invalid arguments above: failures make the test fail.
+#define CHECK(CONDITION) \
+if (!(CONDITION)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #CONDITION); failures++; }
+
+static int failures;
+
 static void output_log_callback(const char *format, va_list args) {
     vprintf(format, args);
     fflush(stdout);
 }
 
+// Compiles a key script, and checks the result and the number of keys.
+static void check_key_script(const char * script, int expected_res, uint32_t expected_keys) {
+    hpopers_key_macro * macro = NULL;
+    int res = hpopers_key_macro_compile(script, &macro);
+    CHECK(res == expected_res);
+    CHECK(hpopers_key_macro_get_key_count(macro) == expected_keys);
+    CHECK((macro != NULL) == (expected_res == ERR_SUCCESS));
+    hpopers_key_macro_del(macro);
+}
+
+static void test_key_macro_compile(void) {
+    check_key_script("", ERR_SUCCESS, 0);
+    check_key_script("home enter", ERR_SUCCESS, 2);
+    check_key_script("HOME,Enter,backspace,del", ERR_SUCCESS, 4);
+    check_key_script("1 + 2 * 3 / 4 - 5 . 6", ERR_SUCCESS, 11);
+    check_key_script("down*5, up", ERR_SUCCESS, 6);
+    check_key_script("*", ERR_SUCCESS, 1);
+    check_key_script("**3", ERR_SUCCESS, 3);
+    check_key_script("code:30 code:0x1E*2", ERR_SUCCESS, 3);
+    check_key_script("home wait:100 wait:change enter", ERR_SUCCESS, 2);
+    check_key_script("# Comment only", ERR_SUCCESS, 0);
+    check_key_script("home # enter, comma\n  # esc\nenter#plot", ERR_SUCCESS, 2);
+    // Unknown names, out of range numbers and incomplete tokens are rejected, wherever they are in the script.
+    check_key_script("home\nbogus", ERR_OPER_SCRIPT, 0);
+    check_key_script("enterx", ERR_OPER_SCRIPT, 0);
+    check_key_script("down*0x", ERR_OPER_SCRIPT, 0);
+    check_key_script("down*10001", ERR_OPER_SCRIPT, 0);
+    check_key_script("down*", ERR_OPER_SCRIPT, 0);
+    check_key_script("code:256", ERR_OPER_SCRIPT, 0);
+    check_key_script("code:", ERR_OPER_SCRIPT, 0);
+    check_key_script("code:-1", ERR_OPER_SCRIPT, 0);
+    check_key_script("wait:", ERR_OPER_SCRIPT, 0);
+    check_key_script("wait:soon", ERR_OPER_SCRIPT, 0);
+    check_key_script("wait:100*2", ERR_OPER_SCRIPT, 0);
+    check_key_script("downdowndowndowndowndowndowndown", ERR_OPER_SCRIPT, 0);
+}
+
+static void test_string_pool(void) {
+    static const char16_t name1[] = { 'P', 'r', 'o', 'g', 0 };
+    static const char16_t name2[] = { 'P', 'r', 'o', 'g', '2', 0 };
+    files_string_pool * pool = hpfiles_string_pool_new();
+    CHECK(pool != NULL);
+    if (pool != NULL) {
+        const char16_t * interned1 = hpfiles_string_pool_intern(pool, name1, 4);
+        const char16_t * interned2 = hpfiles_string_pool_intern(pool, name2, 5);
+        files_compact_entry * ce1;
+        files_compact_entry * ce2;
+        files_var_entry * ve;
+        uint8_t * data;
+
+        // Equal strings are stored once, and prefixes are distinct strings.
+        CHECK(interned1 != NULL && interned2 != NULL && interned1 != interned2);
+        CHECK(hpfiles_string_pool_intern(pool, name2, 4) == interned1);
+        CHECK(hpfiles_string_pool_get_count(pool) == 2);
+        CHECK(interned1 != NULL && interned1[4] == 0 && memcmp(interned1, name1, sizeof(name1)) == 0);
+
+        data = (uint8_t *)malloc(3);
+        if (data != NULL) {
+            memcpy(data, "abc", 3);
+        }
+        ce1 = hpfiles_ce_create(pool, name1, 2, data, 3);
+        CHECK(ce1 != NULL);
+        if (ce1 != NULL) {
+            CHECK(hpfiles_ce_get_name(ce1) == interned1);
+            CHECK(hpfiles_ce_get_name_length(ce1) == 4);
+            CHECK(hpfiles_ce_get_type(ce1) == 2);
+            CHECK(hpfiles_ce_get_size(ce1) == 3 && hpfiles_ce_get_data(ce1) == data);
+
+            // Converting to a files_var_entry copies the data, converting back moves it.
+            ve = hpfiles_ce_to_ve(ce1);
+            CHECK(ve != NULL);
+            if (ve != NULL) {
+                CHECK(ve->size == 3 && ve->data != data && memcmp(ve->data, "abc", 3) == 0);
+                CHECK(ve->type == 2 && memcmp(ve->name, name1, sizeof(name1)) == 0);
+                data = ve->data;
+                ve->invalid = 1;
+                ce2 = hpfiles_ce_create_from_ve(pool, ve);
+                CHECK(ce2 != NULL);
+                if (ce2 != NULL) {
+                    CHECK(ve->data == NULL && ve->size == 0);
+                    CHECK(hpfiles_ce_get_data(ce2) == data && hpfiles_ce_get_size(ce2) == 3);
+                    CHECK(hpfiles_ce_get_name(ce2) == interned1 && hpfiles_ce_is_invalid(ce2));
+                    hpfiles_ce_delete(ce2);
+                }
+                hpfiles_ve_delete(ve);
+            }
+            hpfiles_ce_delete(ce1);
+        }
+        CHECK(hpfiles_string_pool_get_count(pool) == 2);
+        hpfiles_string_pool_del(pool);
+    }
+}
+
+#ifndef _WIN32
+// Cable acknowledging everything sent to it, as a Prime acknowledges the files it receives.
+static int ack_cable_open(cable_handle * handle) {
+    return 0;
+}
+
+static int ack_cable_close(cable_handle * handle) {
+    return 0;
+}
+
+static int ack_cable_set_read_timeout(cable_handle * handle, int read_timeout) {
+    return 0;
+}
+
+static int ack_cable_send(cable_handle * handle, uint8_t * data, uint32_t len) {
+    return 0;
+}
+
+static int ack_cable_recv(cable_handle * handle, uint8_t ** data, uint32_t * len) {
+    memset(*data, 0, PRIME_RAW_HID_DATA_SIZE);
+    (*data)[1] = CMD_PRIME_CHECK_READY;
+    *len = PRIME_RAW_HID_DATA_SIZE;
+    return 0;
+}
+
+static const cable_fncts ack_cable_fncts =
+{
+    CABLE_NUL,
+    "Acknowledging cable",
+    "Dummy cable acknowledging everything sent to it",
+    NULL,
+    &ack_cable_open,
+    &ack_cable_close,
+    &ack_cable_set_read_timeout,
+    &ack_cable_send,
+    &ack_cable_recv
+};
+
+static void write_file(const char * folder, const char * name, const char * contents, const char * mode) {
+    char path[256];
+    FILE * f;
+    snprintf(path, sizeof(path), "%s/%s", folder, name);
+    f = fopen(path, mode);
+    CHECK(f != NULL);
+    if (f != NULL) {
+        fputs(contents, f);
+        fclose(f);
+    }
+}
+
+// Counts the records of the sent journal of the folder for the given file, as well as the other lines.
+static uint32_t count_journal_records(const char * folder, const char * name, uint32_t * out_others) {
+    char path[256];
+    char line[512];
+    uint32_t count = 0;
+    FILE * f;
+    *out_others = 0;
+    snprintf(path, sizeof(path), "%s/%s", folder, HPOPERS_BACKUP_SENT_JOURNAL_NAME);
+    f = fopen(path, "r");
+    if (f != NULL) {
+        while (fgets(line, sizeof(line), f) != NULL) {
+            const char * last = strrchr(line, ' ');
+            line[strcspn(line, "\n")] = 0;
+            if (line[0] != '#' && last != NULL && strcmp(last + 1, name) == 0) {
+                count++;
+            }
+            else {
+                (*out_others)++;
+            }
+        }
+        fclose(f);
+    }
+    return count;
+}
+
+static void test_backup_journal(void) {
+    char folder[] = "/tmp/torture_hpcalcs.XXXXXX";
+    if (mkdtemp(folder) != NULL) {
+        calc_handle * calc = hpcalcs_handle_new(CALC_PRIME);
+        cable_handle * cable = hpcables_handle_new(CABLE_NUL);
+        hpopers_backup_options options;
+        uint32_t others;
+        char path[256];
+
+        memset(&options, 0, sizeof(options));
+        options.version = 1;
+        options.use_journal = 1;
+        CHECK(calc != NULL && cable != NULL);
+        if (calc != NULL && cable != NULL) {
+            cable->fncts = &ack_cable_fncts;
+            CHECK(hpcalcs_cable_attach(calc, cable) == ERR_SUCCESS);
+
+            write_file(folder, "A.hpprgm", "aaaa", "wb");
+            write_file(folder, "B.hpprgm", "bbbb", "wb");
+            CHECK(hpopers_calc_send_backup_ex(calc, folder, &options) == ERR_SUCCESS);
+            CHECK(count_journal_records(folder, "A.hpprgm", &others) == 1);
+            CHECK(count_journal_records(folder, "B.hpprgm", &others) == 1 && others == 2); // The header, and the record of A.
+
+            // Recorded files are skipped, and lines which aren't records are ignored.
+            write_file(folder, HPOPERS_BACKUP_SENT_JOURNAL_NAME, "# comment\nnot a record\n12\n02 4 0000000G C.hpprgm\n", "ab");
+            CHECK(hpopers_calc_send_backup_ex(calc, folder, &options) == ERR_SUCCESS);
+            CHECK(count_journal_records(folder, "A.hpprgm", &others) == 1);
+            CHECK(count_journal_records(folder, "B.hpprgm", &others) == 1);
+
+            // Files whose size or contents changed are sent again.
+            write_file(folder, "A.hpprgm", "aaab", "wb");
+            write_file(folder, "B.hpprgm", "bbbbb", "wb");
+            CHECK(hpopers_calc_send_backup_ex(calc, folder, &options) == ERR_SUCCESS);
+            CHECK(count_journal_records(folder, "A.hpprgm", &others) == 2);
+            CHECK(count_journal_records(folder, "B.hpprgm", &others) == 2);
+
+            // Without the journal, everything is sent, and nothing is recorded.
+            options.use_journal = 0;
+            CHECK(hpopers_calc_send_backup_ex(calc, folder, &options) == ERR_SUCCESS);
+            CHECK(count_journal_records(folder, "A.hpprgm", &others) == 2);
+
+            hpcalcs_cable_detach(calc);
+        }
+        hpcables_handle_del(cable);
+        hpcalcs_handle_del(calc);
+
+        snprintf(path, sizeof(path), "%s/A.hpprgm", folder);
+        remove(path);
+        snprintf(path, sizeof(path), "%s/B.hpprgm", folder);
+        remove(path);
+        snprintf(path, sizeof(path), "%s/%s", folder, HPOPERS_BACKUP_SENT_JOURNAL_NAME);
+        remove(path);
+        rmdir(folder);
+    }
+    else {
+        fprintf(stderr, "couldn't create a temporary folder, skipping the journal checks\n");
+    }
+}
+#endif
+
 int main(int argc, char **argv) {
     int i = 1;
 
     hpfiles_init(NULL);
+    PRINTF(hpfiles_ve_create_with_data_view, PTR, NULL);
+    PRINTF(hpfiles_ve_vector_append, INT, NULL, NULL);
+    PRINTF(hpfiles_ve_vector_get_count, INT, NULL);
+    PRINTF(hpfiles_ve_vector_get, PTR, NULL, 0);
+    PRINTF(hpfiles_ve_vector_detach_array, PTR, NULL);
+    PRINTFVOID(hpfiles_ve_vector_delete, NULL);
+    PRINTFVOID(hpfiles_string_pool_del, NULL);
+    PRINTF(hpfiles_string_pool_intern, PTR, NULL, NULL, 0);
+    PRINTF(hpfiles_string_pool_get_count, INT, NULL);
+    PRINTF(hpfiles_ce_create, PTR, NULL, NULL, 0, NULL, 0);
+    PRINTF(hpfiles_ce_create_from_ve, PTR, NULL, NULL);
+    PRINTF(hpfiles_ce_to_ve, PTR, NULL);
+    PRINTFVOID(hpfiles_ce_delete, NULL);
+    PRINTF(hpfiles_ce_get_name, PTR, NULL);
+    PRINTF(hpfiles_ce_get_size, INT, NULL);
+    test_string_pool();
     hpfiles_exit();
 
     hpcables_init(NULL);
+    PRINTF(hpcables_get_link_stats, INT, NULL, NULL);
+    PRINTF(hpcables_options_set_device_path, INT, NULL, NULL);
+    PRINTF(hpcables_enumerate_devices, INT, CABLE_MAX, NULL, NULL);
+    PRINTF(hpcables_enumerate_devices, INT, CABLE_PRIME_HID, NULL, NULL);
+    PRINTF(hpcables_enumerate_free, INT, NULL);
+    PRINTF(hpcables_hotplug_start, INT, NULL, NULL);
+    PRINTF(hpcables_hotplug_stop, INT);
     hpcables_exit();
 
     hpcalcs_init(NULL);
+    PRINTF(hpcalcs_options_get_operation_timeout, INT, NULL);
+    PRINTF(hpcalcs_options_set_operation_timeout, INT, NULL, 0);
+    PRINTF(hpcalcs_handle_set_alloc_funcs, INT, NULL, NULL);
+    PRINTF(hpcalcs_handle_set_arena, INT, NULL, NULL);
+    PRINTF(hpcalcs_alloc_scope_enter, INT, NULL, NULL);
+    PRINTF(hpcalcs_alloc_scope_leave, INT, NULL);
+    PRINTFVOID(hplibs_arena_reset, NULL);
+    PRINTFVOID(hplibs_arena_del, NULL);
+    PRINTFVOID(hplibs_buffer_view_release, NULL);
+    PRINTF(hplibs_buffer_view_flatten, PTR, NULL);
+    PRINTF(hpcalcs_calc_recv_screen_view, INT, NULL, CALC_SCREENSHOT_FORMAT_FIRST, NULL);
+    PRINTF(hpcalcs_calc_recv_chat_view, INT, NULL, NULL);
+    PRINTF(hpcalcs_calc_recv_file_view, INT, NULL, NULL, NULL, NULL);
+    PRINTF(hpcalcs_calc_recv_backup_vector, INT, NULL, NULL);
+    PRINTF(hpcalcs_calc_set_entry_callback, INT, NULL, NULL, NULL);
+    PRINTF(hpcalcs_calc_send_files, INT, NULL, NULL, 0, NULL);
+    PRINTF(hpcalcs_calc_recv_files, INT, NULL, NULL, 0, NULL, NULL);
+    PRINTF(hpcalcs_calc_screen_stream_start, INT, NULL, CALC_SCREENSHOT_FORMAT_FIRST, NULL, NULL);
+    PRINTF(hpcalcs_calc_screen_stream_stop, INT, NULL);
+    PRINTF(hpcalcs_calc_screen_stream_get_stats, INT, NULL, NULL);
+    PRINTF(hpcalcs_calc_screen_history_enable, INT, NULL, 0, 0);
+    PRINTF(hpcalcs_calc_screen_history_disable, INT, NULL);
+    PRINTF(hpcalcs_calc_screen_history_get_frame, INT, NULL, 0, NULL, NULL, NULL);
+    PRINTF(hpcalcs_calc_screen_history_get_times, INT, NULL, 0, NULL, 0, NULL);
+    PRINTF(hpcalcs_calc_screen_history_get_stats, INT, NULL, NULL);
+    PRINTF(hpcalcs_screen_history_set_global_limit, INT, 0);
+    PRINTF(prime_recv_stream, INT, NULL, 0, 0, NULL);
+    PRINTF(prime_vtl_stream_get_message, INT, NULL, 0, NULL, NULL);
+    PRINTFVOID(prime_vtl_stream_clear, NULL);
     hpcalcs_exit();
 
     hpopers_init(NULL);
+    PRINTF(hpopers_calc_recv_backup, INT, NULL, NULL);
+    PRINTF(hpopers_calc_recv_backup_ex, INT, NULL, NULL, NULL);
+    PRINTF(hpopers_calc_send_backup, INT, NULL, NULL);
+    PRINTF(hpopers_calc_send_backup_ex, INT, NULL, NULL, NULL);
+    PRINTF(hpopers_oper_recv_screen_png_r8g8b8, INT, NULL, CALC_SCREENSHOT_FORMAT_FIRST, NULL, NULL);
+    PRINTF(hpopers_oper_recv_screen_png_r8g8b8_to_file, INT, NULL, CALC_SCREENSHOT_FORMAT_FIRST, NULL);
+    PRINTF(hpopers_oper_convert_raw_screen_to_png_r8g8b8, INT, NULL, 0, CALC_SCREENSHOT_FORMAT_FIRST, NULL, NULL);
+    PRINTFVOID(hpopers_screen_buffers_trim);
+    PRINTF(hpopers_preview_scheduler_new, PTR, NULL, NULL, NULL);
+    PRINTF(hpopers_preview_scheduler_add, INT, NULL, NULL);
+    PRINTF(hpopers_preview_scheduler_remove, INT, NULL, NULL);
+    PRINTF(hpopers_preview_scheduler_poll, INT, NULL, NULL);
+    PRINTF(hpopers_preview_scheduler_get_counts, INT, NULL, NULL, NULL, NULL);
+    PRINTFVOID(hpopers_preview_scheduler_del, NULL);
+    PRINTF(hpopers_recorder_new, PTR, NULL);
+    PRINTF(hpopers_recorder_add_frame, INT, NULL, NULL, 0, 0);
+    PRINTFVOID(hpopers_recorder_screen_callback, NULL, NULL, 0, NULL);
+    PRINTF(hpopers_recorder_get_counts, INT, NULL, NULL, NULL);
+    PRINTF(hpopers_recorder_close, INT, NULL, 0);
+    PRINTF(hpopers_key_macro_compile, INT, NULL, NULL);
+    PRINTF(hpopers_key_macro_get_key_count, INT, NULL);
+    PRINTF(hpopers_key_macro_play, INT, NULL, NULL, NULL);
+    PRINTFVOID(hpopers_key_macro_del, NULL);
+    PRINTF(hpopers_test_compile, INT, NULL, NULL, NULL);
+    PRINTF(hpopers_test_run, INT, NULL, NULL, NULL, NULL);
+    PRINTF(hpopers_test_run_parallel, INT, NULL, 0, NULL, NULL, NULL);
+    PRINTFVOID(hpopers_test_del, NULL);
+    test_key_macro_compile();
     hpopers_exit();
 
-    return 0;
+#ifndef _WIN32
+    hpfiles_init(NULL);
+    hpcables_init(NULL);
+    hpcalcs_init(NULL);
+    hpopers_init(NULL);
+    test_backup_journal();
+    hpopers_exit();
+    hpcalcs_exit();
+    hpcables_exit();
+    hpfiles_exit();
+#endif
+
+    return failures != 0;
 }